@@ -0,0 +1,116 @@
+/*
+ * Per-subsystem allocation accounting. See alloc_stats.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "alloc_stats.h"
+
+static const char* SUBSYSTEM_NAMES[ALLOC_SUBSYSTEMS] = {
+	"context", "tracker", "snapshot", "hasher", "worker"
+};
+
+/* Updated with atomic operations: the hashing threads allocate concurrently */
+static struct alloc_counters counters[ALLOC_SUBSYSTEMS];
+
+static void count_alloc(enum alloc_subsystem s, void *ptr) {
+	struct alloc_counters *c = &counters[s];
+	uint64_t live, peak;
+
+	__sync_fetch_and_add(&c->allocs, 1);
+	live = __sync_add_and_fetch(&c->live_bytes, (uint64_t) malloc_usable_size(ptr));
+	peak = c->peak_bytes;
+	while (live > peak && !__sync_bool_compare_and_swap(&c->peak_bytes, peak, live))
+		peak = c->peak_bytes;
+}
+
+static void count_free(enum alloc_subsystem s, void *ptr) {
+	__sync_fetch_and_add(&counters[s].frees, 1);
+	__sync_fetch_and_sub(&counters[s].live_bytes, (uint64_t) malloc_usable_size(ptr));
+}
+
+void* alloc_stats_malloc(enum alloc_subsystem s, size_t size) {
+	void *ptr = malloc(size);
+	if (ptr != NULL)
+		count_alloc(s, ptr);
+	return ptr;
+}
+
+void* alloc_stats_calloc(enum alloc_subsystem s, size_t count, size_t size) {
+	void *ptr = calloc(count, size);
+	if (ptr != NULL)
+		count_alloc(s, ptr);
+	return ptr;
+}
+
+void* alloc_stats_realloc(enum alloc_subsystem s, void *ptr, size_t size) {
+	size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+	void *grown = realloc(ptr, size);
+
+	if (grown == NULL)
+		return NULL;
+	if (ptr == NULL) {
+		count_alloc(s, grown);
+		return grown;
+	}
+	/* Same allocation, different size */
+	__sync_fetch_and_sub(&counters[s].live_bytes, (uint64_t) old_size);
+	__sync_fetch_and_sub(&counters[s].allocs, 1);
+	count_alloc(s, grown);
+	return grown;
+}
+
+char* alloc_stats_strdup(enum alloc_subsystem s, const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy = (char *) alloc_stats_malloc(s, len);
+	if (copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+void alloc_stats_free(enum alloc_subsystem s, void *ptr) {
+	if (ptr == NULL)
+		return;
+	count_free(s, ptr);
+	free(ptr);
+}
+
+void alloc_stats_get(enum alloc_subsystem s, struct alloc_counters *out) {
+	out->allocs = __sync_fetch_and_add(&counters[s].allocs, 0);
+	out->frees = __sync_fetch_and_add(&counters[s].frees, 0);
+	out->live_bytes = __sync_fetch_and_add(&counters[s].live_bytes, 0);
+	out->peak_bytes = __sync_fetch_and_add(&counters[s].peak_bytes, 0);
+}
+
+const char* alloc_stats_name(enum alloc_subsystem s) {
+	return s < ALLOC_SUBSYSTEMS ? SUBSYSTEM_NAMES[s] : "unknown";
+}
+
+long alloc_stats_rss_kb(void) {
+	long pages_total, pages_resident;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	int found;
+
+	if (statm == NULL)
+		return -1;
+	found = fscanf(statm, "%ld %ld", &pages_total, &pages_resident) == 2;
+	fclose(statm);
+	return found ? pages_resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+void alloc_stats_print(FILE *out) {
+	struct alloc_counters c;
+	int s;
+
+	fprintf(out, "%-10s %12s %12s %10s %12s %12s\n", "subsystem", "allocs", "frees", "live", "live bytes", "peak bytes");
+	for (s = 0; s < ALLOC_SUBSYSTEMS; s++) {
+		alloc_stats_get((enum alloc_subsystem) s, &c);
+		fprintf(out, "%-10s %12llu %12llu %10llu %12llu %12llu\n", alloc_stats_name((enum alloc_subsystem) s),
+			(unsigned long long) c.allocs, (unsigned long long) c.frees,
+			(unsigned long long) (c.allocs - c.frees),
+			(unsigned long long) c.live_bytes, (unsigned long long) c.peak_bytes);
+	}
+	fprintf(out, "resident set: %ld kB\n", alloc_stats_rss_kb());
+}
@@ -0,0 +1,57 @@
+/*
+ * Per-subsystem allocation accounting.
+ *
+ * The analyzer lives as long as the shell it watches, so a few bytes lost per
+ * error add up over weeks. The subsystems that allocate on every snapshot
+ * allocate through the wrappers below, which count allocations and live bytes
+ * per subsystem; a leak shows up as a subsystem whose live count keeps
+ * climbing. Memory allocated inside libgit2 and PCRE isn't counted; the
+ * process's resident set size covers it.
+ */
+
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum alloc_subsystem {
+	ALLOC_CONTEXT,    /* repository contexts */
+	ALLOC_TRACKER,    /* change trackers and their dirty path sets */
+	ALLOC_SNAPSHOT,   /* path lists, hashing jobs and messages of a snapshot */
+	ALLOC_HASHER,     /* file contents being hashed */
+	ALLOC_WORKER,     /* the commit worker's queue and journals */
+	ALLOC_SUBSYSTEMS
+};
+
+struct alloc_counters {
+	uint64_t allocs;      /* allocations made */
+	uint64_t frees;       /* allocations freed */
+	uint64_t live_bytes;  /* bytes currently allocated */
+	uint64_t peak_bytes;  /* most bytes ever allocated at once */
+};
+
+/* Drop-in replacements for the standard allocation functions, counting
+ * against subsystem <s>. Memory must be freed with alloc_stats_free and the
+ * same subsystem it was allocated under.
+ */
+void* alloc_stats_malloc(enum alloc_subsystem s, size_t size);
+void* alloc_stats_calloc(enum alloc_subsystem s, size_t count, size_t size);
+void* alloc_stats_realloc(enum alloc_subsystem s, void *ptr, size_t size);
+char* alloc_stats_strdup(enum alloc_subsystem s, const char *str);
+void alloc_stats_free(enum alloc_subsystem s, void *ptr);
+
+/* Copies the current counters of subsystem <s> to <out> */
+void alloc_stats_get(enum alloc_subsystem s, struct alloc_counters *out);
+
+/* The subsystem's name as printed in the stats */
+const char* alloc_stats_name(enum alloc_subsystem s);
+
+/* The process's resident set size in kilobytes, or -1 if unknown */
+long alloc_stats_rss_kb(void);
+
+/* Prints the counters of every subsystem and the resident set size */
+void alloc_stats_print(FILE *out);
+
+#endif
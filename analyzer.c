@@ -1,112 +1,318 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <pcre.h>
-#include "create_error_commit.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "alloc_stats.h"
+#include "bench.h"
+#include "commit_worker.h"
+#include "error_detect.h"
+#include "error_event.h"
+#include "governor.h"
+#include "output_tail.h"
+#include "probes.h"
+#include "repo_context.h"
+#include "shell_proc.h"
+#include "trace.h"
 const int MAX_BUF_SIZE = 255;
 const int STDIN = 0;
 
+static int analyze(int input_fd);
+static int soak(long events);
+static int bench(int argc, char **argv);
+
+/* Growth of the resident set a soak run tolerates once warmed up: a tenth of
+ * it, or this much, whichever is more
+ */
+static const long SOAK_RSS_SLACK_KB = 8 * 1024;
+
+/* The current command's output, stored with its errors (see output_tail.h) */
+static struct output_tail command_output;
+/* How much of it is scanned when load shedding only looks at the end of each
+ * command's output, and whether there is output it hasn't looked at yet
+ */
+#define SAMPLED_TAIL_BYTES 4096
+static int sample_pending = 0;
+/* Whether this is a benchmark run, which times every error (see bench.h) */
+static int benchmarking = 0;
+
+static int shell_git_dir(const struct shell_proc *shell, char *out, size_t size) {
+  /* Finds the git directory of the repository the shell's foreground job is
+   * working in, falling back to the one we were started in if the shell can't
+   * be inspected. Returns 0 if there is one.
+   */
+  char cwd[4096];
+  if (shell_proc_cwd(shell, cwd, sizeof(cwd)) != 0)
+    return repo_context_discover(".", out, size);
+  return repo_context_discover(cwd, out, size);
+}
+
+static void record_error(struct shell_proc *shell, const char *output, size_t len, int match_offset) {
+  /* Journals an error found in <output> for whichever repository the shell is
+   * in right now
+   */
+  static char tail[OUTPUT_TAIL_BYTES];
+  struct error_event event;
+  struct trace_span span;
+  char git_dir[4096];
+  size_t tail_len;
+
+  if (shell_git_dir(shell, git_dir, sizeof(git_dir)) != 0) {
+    printf("Error detected outside of a git repository\n");
+    return;
+  }
+  error_event_init(&event, output, len, (size_t) match_offset, 0, shell->last_command);
+  tail_len = output_tail_copy(&command_output, OUTPUT_TAIL_BYTES, tail);
+  if (benchmarking)
+    bench_detected();
+  TRACE_BEGIN(&span, "journal_append");
+  if (commit_worker_record(git_dir, &event, tail, tail_len) != 0) {
+    printf("Could not journal the error\n");
+    if (benchmarking)
+      bench_committed(0);
+  }
+  TRACE_END(&span);
+  printf("Error detected\n");
+}
+
+static void scan_tail(struct shell_proc *shell) {
+  /* Looks for an error in the last SAMPLED_TAIL_BYTES of a command's output */
+  char tail[SAMPLED_TAIL_BYTES];
+  size_t len = output_tail_copy(&command_output, SAMPLED_TAIL_BYTES, tail);
+  int match_offset;
+
+  if (len > 0 && prefilter_error(tail, len, &match_offset))
+    record_error(shell, tail, len, match_offset);
+  sample_pending = 0;
+}
+
 int main(int argc, char** argv) {
   srand(time(0));
+  trace_init("analyzer");
+  /* analyzer --soak <events>: see soak() */
+  if (argc == 3 && strcmp(argv[1], "--soak") == 0)
+    return soak(strtol(argv[2], NULL, 10));
+  /* analyzer --bench <workload> [options]: see bench.h */
+  if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    return bench(argc - 2, argv + 2);
+  return analyze(STDIN);
+}
+
+/* Reads output from <input_fd> until it is closed, journaling the errors in it
+ * and committing them in the background. Returns 0 once everything is
+ * committed.
+ */
+static int analyze(int input_fd) {
   char *buf = (char *) calloc(MAX_BUF_SIZE, sizeof(char));
-  int error;
+  int error, num_read, match_offset, new_job;
+  enum governor_level level;
+  struct shell_proc shell;
+  char git_dir[4096];
+
+  /* Snapshots are taken by the commit worker, so reading output never waits
+   * for git. Have it open the shell's repository up front so its change
+   * tracker sees every edit made between now and the first error.
+   */
+  if (commit_worker_start() != 0) {
+    perror("commit worker");
+    return 1;
+  }
+  shell_proc_init(&shell);
+  if (shell_git_dir(&shell, git_dir, sizeof(git_dir)) == 0)
+    commit_worker_hint(git_dir);
+  governor_init(input_fd);
+  /* Edits to the rules file take effect in the sessions already running */
+  if (watch_error_rules() != 0)
+    perror("rules watcher");
+
+  while(1) {
+    num_read = read(input_fd, buf, MAX_BUF_SIZE - 1);
+    if (num_read <= 0)
+      break;
+    buf[num_read] = '\0';
+    /* Note the job in the foreground while its output is still arriving. A
+     * new job is a good moment to open (and start tracking) the repository it
+     * runs in, as the shell may have changed directory since
+     */
+    new_job = shell_proc_update(&shell);
+    if (new_job && shell_git_dir(&shell, git_dir, sizeof(git_dir)) == 0)
+      commit_worker_hint(git_dir);
 
-  while(read(STDIN, buf, MAX_BUF_SIZE)) {
-    error = detect_error(buf);
+    /* Under load, scan less of the output (see governor.h). A sampled
+     * command's tail is scanned once it finishes, or once scanning resumes
+     */
+    level = governor_update((size_t) num_read);
+    PROBE2(chunk, num_read, level);
+    if (sample_pending && (new_job || level != GOVERNOR_SAMPLED))
+      scan_tail(&shell);
+    if (level == GOVERNOR_PAUSED)
+      continue;
+
+    /* Each command's output starts a new tail */
+    if (new_job && shell.foreground != shell.shell_pid)
+      output_tail_reset(&command_output);
+    output_tail_append(&command_output, buf, (size_t) num_read);
+    if (level == GOVERNOR_SAMPLED) {
+      sample_pending = 1;
+      continue;
+    }
+
+    if (level == GOVERNOR_PREFILTER)
+      error = prefilter_error(buf, (size_t) num_read, &match_offset);
+    else
+      error = detect_error(buf, &match_offset);
     if(error) {
-      create_error(buf);
-      printf("Error detected\n");
+      record_error(&shell, buf, (size_t) num_read, match_offset);
     }
     else {
       printf("No error\n");
     }
   }
 
+  /* The shell is gone; commit what is left and fold this session's commits
+   * onto _error
+   */
+  if (benchmarking)
+    bench_input_done();
+  if (sample_pending)
+    scan_tail(&shell);
+  governor_print(stdout);
+  commit_worker_stop();
+  free_error_pattern();
+  free(buf);
   return 0;
 }
 
 
-/* Uses the PCRE match function to look for 'error' or 'exception'
- * in the provided input; returns 1 if the input describes an error
- * and 0 otherwise
+/* Pushes <events> lines of synthetic output, every other one an error, through
+ * detection, the journal and the commit worker into the repository in the
+ * current directory, rewriting a file in it before every error so each
+ * snapshot has something to hash. Checks the resident set stays flat once
+ * warmed up and that every counted allocation is freed at the end. Returns 0
+ * if so, 1 otherwise; run it in a scratch repository.
  */
-int parse_stdin(char **input) {
-  return rand() % 2 == 0;
+static int soak(long events) {
+  char git_dir[4096], line[256], file_name[64];
+  struct error_event event;
+  struct alloc_counters counters;
+  long i, rss, warm_rss = -1, peak_rss = 0, allowed;
+  int match_offset, len, s, failed = 0;
+  FILE *file;
+
+  if (events <= 0 || repo_context_discover(".", git_dir, sizeof(git_dir)) != 0) {
+    printf("Usage: analyzer --soak <events>, from inside a scratch git repository\n");
+    return 1;
+  }
+  if (commit_worker_start() != 0) {
+    perror("commit worker");
+    return 1;
+  }
+  commit_worker_hint(git_dir);
+  snprintf(file_name, sizeof(file_name), "soak-%d.txt", (int) getpid());
+
+  for (i = 0; i < events; i++) {
+    len = snprintf(line, sizeof(line), "src/module%ld.c:%ld: %s %ld\n", i % 97, i % 1000 + 1,
+      i % 2 ? "error: synthetic failure" : "note: all good", i);
+    if (detect_error(line, &match_offset)) {
+      file = fopen(file_name, "w");
+      if (file != NULL) {
+        fprintf(file, "%ld\n", i);
+        fclose(file);
+      }
+      error_event_init(&event, line, (size_t) len, (size_t) match_offset, 0, "soak");
+      if (commit_worker_record(git_dir, &event, line, (size_t) len) != 0)
+        failed = 1;
+    }
+    /* Sample the resident set ten times; the first sample, a tenth of the
+     * way in, is the baseline, by which point the caches have filled
+     */
+    if ((i + 1) % (events / 10 ? events / 10 : 1) == 0) {
+      rss = alloc_stats_rss_kb();
+      if (warm_rss < 0)
+        warm_rss = rss;
+      if (rss > peak_rss)
+        peak_rss = rss;
+      printf("soak: %ld/%ld events, resident set %ld kB\n", i + 1, events, rss);
+    }
+  }
+
+  commit_worker_stop();
+  free_error_pattern();
+  unlink(file_name);
+  alloc_stats_print(stdout);
+
+  allowed = warm_rss / 10 > SOAK_RSS_SLACK_KB ? warm_rss / 10 : SOAK_RSS_SLACK_KB;
+  if (peak_rss - warm_rss > allowed) {
+    printf("soak: FAILED: resident set grew from %ld kB to %ld kB\n", warm_rss, peak_rss);
+    failed = 1;
+  }
+  for (s = 0; s < ALLOC_SUBSYSTEMS; s++) {
+    alloc_stats_get((enum alloc_subsystem) s, &counters);
+    if (counters.allocs != counters.frees) {
+      printf("soak: FAILED: %llu allocations leaked in %s\n",
+        (unsigned long long) (counters.allocs - counters.frees), alloc_stats_name((enum alloc_subsystem) s));
+      failed = 1;
+    }
+  }
+  if (!failed)
+    printf("soak: passed\n");
+  return failed;
 }
 
 
-/* Returns 1 if an error was present in the output and 0 otherwise */
-int detect_error(char* terminal_output) {
-  pcre *reCompiled;
-  pcre_extra *pcreExtra;
-  int pcreExecRet;
-  int subStrVec[30];
-  const char *pcreErrorStr;
-  int pcreErrorOffset;
-  char *aStrRegex;
-  const char *psubStrMatchStr;
-  int j;
-  char *testStrings[] = { "This should match... hello",
-                          "This could match... hello!",
-                          "More than one hello.. hello",
-                          "No chance of a match...",
-                          NULL};
-
-
-  // aStrRegex = "(.*)(hello)+";  
-  aStrRegex = "exception|error";                         
-
-  // First, the regex string must be compiled.
-  reCompiled = pcre_compile(aStrRegex, PCRE_CASELESS, &pcreErrorStr, &pcreErrorOffset, NULL);
-
-  // pcre_compile returns NULL on error, and sets pcreErrorOffset & pcreErrorStr
-  if(reCompiled == NULL) {
-    printf("ERROR: Could not compile '%s': %s\n", aStrRegex, pcreErrorStr);
-    exit(1);
-  } /* end if */
-
-  // Optimize the regex
-  pcreExtra = pcre_study(reCompiled, 0, &pcreErrorStr);
-
-  /* pcre_study() returns NULL for both errors and when it can not optimize the regex.  The last argument is how one checks for
-     errors (it is NULL if everything works, and points to an error string otherwise. */
-  if(pcreErrorStr != NULL) {
-    printf("ERROR: Could not study '%s': %s\n", aStrRegex, pcreErrorStr);
-    exit(1);
-  } /* end if */
-
-
-  /* Try to find the regex in terminal_output, and report results. */
-  pcreExecRet = pcre_exec(reCompiled,
-                          pcreExtra,
-                          terminal_output, 
-                          strlen(terminal_output),  // length of string
-                          0,                      // Start looking at this point
-                          0,                      // OPTIONS
-                          subStrVec,
-                          30);                    // Length of subStrVec
-
-  // Report what happened in the pcre_exec call..
-  if(pcreExecRet < 0) { // Something bad happened..
-    switch(pcreExecRet) {
-    case PCRE_ERROR_NOMATCH      :                                                      return 0;
-    case PCRE_ERROR_NULL         : printf("Something was null\n");                      break;
-    case PCRE_ERROR_BADOPTION    : printf("A bad option was passed\n");                 break;
-    case PCRE_ERROR_BADMAGIC     : printf("Magic number bad (compiled re corrupt?)\n"); break;
-    case PCRE_ERROR_UNKNOWN_NODE : printf("Something kooky in the compiled re\n");      break;
-    case PCRE_ERROR_NOMEMORY     : printf("Ran out of memory\n");                       break;
-    default                      : printf("Unknown error\n");                           break;
-    } /* end switch */
-  } 
-
-  /* We have a match */
-  else {
-    // Free up the substring
-    pcre_free_substring(psubStrMatchStr);
-    pcre_free(reCompiled);
-    return 1;
+/* Runs a benchmark workload (see bench.h) through analyze(), as if monitor
+ * were feeding it a shell's output. What the analyzer prints while it runs is
+ * thrown away, as writing it to a terminal would be most of the cost. Returns
+ * 0 if the workload was fed in full, 1 otherwise.
+ */
+static int bench(int argc, char **argv) {
+  struct bench_options options;
+  char git_dir[4096];
+  int input_fd, saved_stdout, devnull, result;
 
-  } 
+  if (bench_parse(argc, argv, &options) != 0)
+    return 1;
+  if (repo_context_discover(".", git_dir, sizeof(git_dir)) != 0) {
+    printf("analyzer --bench has to be run from inside a scratch git repository\n");
+    return 1;
+  }
+  /* Errors go to the repository we are in, not the one of a shell we may
+   * have been started from
+   */
+  unsetenv(SHELL_PID_ENV);
+  if (bench_start(&options, &input_fd) != 0) {
+    perror("bench");
+    return 1;
+  }
+  commit_worker_observe(bench_committed);
+  benchmarking = 1;
 
+  fflush(stdout);
+  saved_stdout = dup(STDOUT_FILENO);
+  devnull = open("/dev/null", O_WRONLY);
+  if (devnull >= 0) {
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+  }
+  analyze(input_fd);
+  fflush(stdout);
+  if (saved_stdout >= 0) {
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+  }
+  close(input_fd);
 
+  result = bench_finish(&options, stdout);
+  governor_print(stdout);
+  return result;
 }
 
+
+/* Uses the PCRE match function to look for 'error' or 'exception'
+ * in the provided input; returns 1 if the input describes an error
+ * and 0 otherwise
+ */
+int parse_stdin(char **input) {
+  return rand() % 2 == 0;
+}
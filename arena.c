@@ -0,0 +1,158 @@
+/*
+ * Arenas and fixed-size pools. See arena.h.
+ */
+
+#include <string.h>
+#include "arena.h"
+
+/* Alignment of everything handed out, enough for any type */
+#define ARENA_ALIGN 16
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	/* Keeps data aligned */
+	long double align;
+	char data[];
+};
+
+struct pool_slab {
+	struct pool_slab *next;
+	long double align;
+	char data[];
+};
+
+static size_t round_up(size_t n) {
+	return (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena *a, enum alloc_subsystem subsystem, size_t block_size) {
+	memset(a, 0, sizeof(*a));
+	a->subsystem = subsystem;
+	a->block_size = block_size;
+}
+
+static struct arena_block* new_block(struct arena *a, size_t size) {
+	/* A spare block if one is big enough, a new one otherwise */
+	struct arena_block *b, **link;
+	size_t data_size = size > a->block_size ? size : a->block_size;
+
+	for (link = &a->spare; *link != NULL; link = &(*link)->next) {
+		if ((*link)->size >= size) {
+			b = *link;
+			*link = b->next;
+			return b;
+		}
+	}
+	b = (struct arena_block *) alloc_stats_malloc(a->subsystem, sizeof(struct arena_block) + data_size);
+	if (b != NULL)
+		b->size = data_size;
+	return b;
+}
+
+void* arena_alloc(struct arena *a, size_t size) {
+	struct arena_block *b = a->blocks;
+	void *out;
+
+	size = round_up(size ? size : 1);
+	if (b == NULL || b->size - b->used < size) {
+		b = new_block(a, size);
+		if (b == NULL)
+			return NULL;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+	out = b->data + b->used;
+	b->used += size;
+	return out;
+}
+
+char* arena_strdup(struct arena *a, const char *s) {
+	size_t len = strlen(s);
+	char *out = (char *) arena_alloc(a, len + 1);
+
+	if (out != NULL)
+		memcpy(out, s, len + 1);
+	return out;
+}
+
+void arena_reset(struct arena *a) {
+	struct arena_block *b;
+
+	while ((b = a->blocks) != NULL) {
+		a->blocks = b->next;
+		b->next = a->spare;
+		a->spare = b;
+	}
+}
+
+void arena_free(struct arena *a) {
+	struct arena_block *b;
+
+	arena_reset(a);
+	while ((b = a->spare) != NULL) {
+		a->spare = b->next;
+		alloc_stats_free(a->subsystem, b);
+	}
+}
+
+void pool_init(struct pool *p, enum alloc_subsystem subsystem, size_t object_size, size_t slab_objects) {
+	memset(p, 0, sizeof(*p));
+	p->subsystem = subsystem;
+	/* Free objects hold the free list's links */
+	p->object_size = round_up(object_size > sizeof(void *) ? object_size : sizeof(void *));
+	p->slab_objects = slab_objects > 0 ? slab_objects : 1;
+	pthread_mutex_init(&p->lock, NULL);
+}
+
+void* pool_get(struct pool *p) {
+	struct pool_slab *slab;
+	void *object;
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->free_list == NULL) {
+		slab = (struct pool_slab *) alloc_stats_malloc(p->subsystem,
+			sizeof(struct pool_slab) + p->object_size * p->slab_objects);
+		if (slab == NULL) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		slab->next = p->slabs;
+		p->slabs = slab;
+		for (i = p->slab_objects; i > 0; i--) {
+			object = slab->data + (i - 1) * p->object_size;
+			*(void **) object = p->free_list;
+			p->free_list = object;
+		}
+	}
+	object = p->free_list;
+	p->free_list = *(void **) object;
+	pthread_mutex_unlock(&p->lock);
+	memset(object, 0, p->object_size);
+	return object;
+}
+
+void pool_put(struct pool *p, void *object) {
+	if (object == NULL)
+		return;
+	pthread_mutex_lock(&p->lock);
+	*(void **) object = p->free_list;
+	p->free_list = object;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(struct pool *p) {
+	struct pool_slab *slab;
+
+	pthread_mutex_lock(&p->lock);
+	while ((slab = p->slabs) != NULL) {
+		p->slabs = slab->next;
+		alloc_stats_free(p->subsystem, slab);
+	}
+	p->free_list = NULL;
+	pthread_mutex_unlock(&p->lock);
+	pthread_mutex_destroy(&p->lock);
+}
@@ -0,0 +1,74 @@
+/*
+ * Arenas and fixed-size pools for the detection-to-commit path.
+ *
+ * An arena hands out memory from large blocks by bumping an offset and takes
+ * it all back at once with arena_reset(). The blocks are kept, so once an
+ * arena has grown to what a snapshot needs, later snapshots allocate nothing
+ * from the heap. A repository context owns one for the messages and path
+ * lists of its snapshots and resets it after each.
+ *
+ * A pool recycles objects of one size through a free list, carving new ones
+ * out of slabs only when the list is empty; objects are never given back to
+ * the heap before the pool is freed. Pools are locked, so objects can be got
+ * on one thread and put back on another, as the commit worker's queue does.
+ *
+ * Blocks and slabs are counted against an alloc_stats subsystem; the objects
+ * in them are not.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "alloc_stats.h"
+
+struct arena_block;
+struct pool_slab;
+
+struct arena {
+	enum alloc_subsystem subsystem;
+	size_t block_size;
+	struct arena_block *blocks;    /* the first is the one allocated from */
+	struct arena_block *spare;     /* blocks emptied by arena_reset() */
+};
+
+struct pool {
+	enum alloc_subsystem subsystem;
+	size_t object_size;
+	size_t slab_objects;
+	pthread_mutex_t lock;
+	void *free_list;
+	struct pool_slab *slabs;
+};
+
+/* Sets up an empty arena whose blocks hold <block_size> bytes at least */
+void arena_init(struct arena *a, enum alloc_subsystem subsystem, size_t block_size);
+
+/* Returns <size> bytes aligned for any type, or NULL if a block couldn't be
+ * allocated. Valid until the next arena_reset().
+ */
+void* arena_alloc(struct arena *a, size_t size);
+
+/* Copies <s> into the arena */
+char* arena_strdup(struct arena *a, const char *s);
+
+/* Takes back everything allocated from <a>, keeping its blocks */
+void arena_reset(struct arena *a);
+
+/* Frees the blocks */
+void arena_free(struct arena *a);
+
+/* Sets up a pool of <object_size> byte objects, carved <slab_objects> at a time */
+void pool_init(struct pool *p, enum alloc_subsystem subsystem, size_t object_size, size_t slab_objects);
+
+/* Returns a zeroed object, or NULL if a slab couldn't be allocated */
+void* pool_get(struct pool *p);
+
+/* Puts an object from pool_get() back; NULL is ignored */
+void pool_put(struct pool *p, void *object);
+
+/* Frees the slabs. Every object has to have been put back. */
+void pool_free(struct pool *p);
+
+#endif
@@ -0,0 +1,457 @@
+/*
+ * End-to-end benchmark of the analyzer. See bench.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "alloc_stats.h"
+#include "governor.h"
+
+static const char* WORKLOAD_NAMES[] = { "replay", "storm", "clean", "dirty-tree" };
+/* Where the dirty-tree workload keeps its files, and how many go in a directory */
+static const char* TREE_DIR = "bench-tree";
+static const long FILES_PER_DIR = 100;
+/* Most output the feeder writes to the terminal at once */
+#define FEED_CHUNK_BYTES (64 * 1024)
+/* How long the analyzer's input has to stay empty before it is closed */
+static const int DRAINED_MS = 50;
+
+static pid_t feeder = 0;
+static double started = 0, input_done = 0;
+/* When each error was journaled, and how long its commit took. An error's
+ * commit is matched to it by order, which is exact unless a commit is retried
+ */
+static double *detected_at = NULL, *latency = NULL;
+static size_t detected = 0, resolved = 0, given_up = 0;
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void pause_ms(long ms) {
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+static void usage(void) {
+	printf("Usage: analyzer --bench <replay|storm|clean|dirty-tree> [options] [typescript]\n"
+		"  --timing <file>     replay at the pace recorded by script -t\n"
+		"  --speed <n>         replay that many times faster (default 1)\n"
+		"  --repeat <n>        replay the recording n times (default 1)\n"
+		"  --events <n>        errors written by storm and dirty-tree (default 10000, 1000)\n"
+		"  --megabytes <n>     output written by clean (default 1024)\n"
+		"  --files <n>         files created by dirty-tree (default 2000)\n"
+		"  --dirty <n>         files dirty-tree rewrites before each error (default 20)\n"
+		"  --interval <ms>     pause between synthetic errors (default 0)\n"
+		"Run it from inside a scratch git repository.\n");
+}
+
+int bench_parse(int argc, char **argv, struct bench_options *options) {
+	static const struct option long_options[] = {
+		{ "timing", required_argument, NULL, 't' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "repeat", required_argument, NULL, 'r' },
+		{ "events", required_argument, NULL, 'e' },
+		{ "megabytes", required_argument, NULL, 'm' },
+		{ "files", required_argument, NULL, 'f' },
+		{ "dirty", required_argument, NULL, 'd' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int c, w, found = 0;
+
+	memset(options, 0, sizeof(*options));
+	options->speed = 1;
+	options->repeat = 1;
+	options->events = -1;
+	options->megabytes = 1024;
+	options->files = 2000;
+	options->dirty = 20;
+	if (argc < 1) {
+		usage();
+		return -1;
+	}
+	for (w = BENCH_REPLAY; w <= BENCH_DIRTY_TREE; w++) {
+		if (strcmp(argv[0], WORKLOAD_NAMES[w]) == 0) {
+			options->workload = (enum bench_workload) w;
+			found = 1;
+		}
+	}
+
+	optind = 1;
+	while (found && (c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (c) {
+		case 't': options->timing = optarg; break;
+		case 's': options->speed = strtod(optarg, NULL); break;
+		case 'r': options->repeat = strtol(optarg, NULL, 10); break;
+		case 'e': options->events = strtol(optarg, NULL, 10); break;
+		case 'm': options->megabytes = strtol(optarg, NULL, 10); break;
+		case 'f': options->files = strtol(optarg, NULL, 10); break;
+		case 'd': options->dirty = strtol(optarg, NULL, 10); break;
+		case 'i': options->interval_ms = strtol(optarg, NULL, 10); break;
+		default: found = 0; break;
+		}
+	}
+	if (found && options->workload == BENCH_REPLAY && optind == argc - 1)
+		options->recording = argv[optind];
+	else if (optind != argc)
+		found = 0;
+	if (options->events < 0)
+		options->events = options->workload == BENCH_DIRTY_TREE ? 1000 : 10000;
+	if (options->dirty > options->files)
+		options->dirty = options->files;
+
+	if (!found || (options->workload == BENCH_REPLAY && options->recording == NULL) ||
+		options->speed <= 0 || options->repeat < 1 || options->megabytes < 0 || options->files < 1) {
+		usage();
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ **
+ **
+ ** Feeding the workload
+ **
+ **
+ */
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(fd, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		buf += w;
+		len -= (size_t) w;
+	}
+	return 0;
+}
+
+static void tree_file(long n, char *out, size_t size) {
+	snprintf(out, size, "%s/d%03ld/f%05ld.c", TREE_DIR, n / FILES_PER_DIR, n);
+}
+
+static int write_tree_file(long n, long version) {
+	char path[256];
+	FILE *f;
+
+	tree_file(n, path, sizeof(path));
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "/* file %ld, version %ld */\nint f%ld(void) { return %ld; }\n", n, version, n, version);
+	return fclose(f);
+}
+
+static int make_tree(const struct bench_options *options) {
+	char dir[256];
+	long n;
+
+	mkdir(TREE_DIR, 0755);
+	for (n = 0; n < options->files; n++) {
+		if (n % FILES_PER_DIR == 0) {
+			snprintf(dir, sizeof(dir), "%s/d%03ld", TREE_DIR, n / FILES_PER_DIR);
+			mkdir(dir, 0755);
+		}
+		if (write_tree_file(n, 0) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void remove_tree(const struct bench_options *options) {
+	char path[256];
+	long n;
+
+	for (n = 0; n < options->files; n++) {
+		tree_file(n, path, sizeof(path));
+		unlink(path);
+		if (n % FILES_PER_DIR == FILES_PER_DIR - 1 || n == options->files - 1) {
+			snprintf(path, sizeof(path), "%s/d%03ld", TREE_DIR, n / FILES_PER_DIR);
+			rmdir(path);
+		}
+	}
+	rmdir(TREE_DIR);
+}
+
+static char* read_file(const char *path, size_t *len) {
+	FILE *f = fopen(path, "rb");
+	char *data = NULL;
+	long size;
+
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0 &&
+		(data = (char *) malloc((size_t) size + 1)) != NULL && fread(data, 1, (size_t) size, f) != (size_t) size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*len = data != NULL ? (size_t) size : 0;
+	return data;
+}
+
+static int feed_replay(const struct bench_options *options, int fd) {
+	/* script's timing file has a "<delay> <bytes>" line for each write,
+	 * starting after the "Script started" line of the typescript
+	 */
+	size_t len, offset;
+	char *data = read_file(options->recording, &len);
+	double delay;
+	long bytes, r;
+	FILE *timing;
+	int result = 0;
+
+	if (data == NULL)
+		return -1;
+	for (r = 0; r < options->repeat && result == 0; r++) {
+		if (options->timing == NULL) {
+			result = write_all(fd, data, len);
+			continue;
+		}
+		timing = fopen(options->timing, "r");
+		if (timing == NULL) {
+			result = -1;
+			break;
+		}
+		offset = 0;
+		while (offset < len && data[offset++] != '\n')
+			;
+		while (result == 0 && offset < len && fscanf(timing, "%lf %ld", &delay, &bytes) == 2 && bytes >= 0) {
+			pause_ms((long) (delay * 1000 / options->speed));
+			if ((size_t) bytes > len - offset)
+				bytes = (long) (len - offset);
+			result = write_all(fd, data + offset, (size_t) bytes);
+			offset += (size_t) bytes;
+		}
+		fclose(timing);
+	}
+	free(data);
+	return result;
+}
+
+static int feed_storm(const struct bench_options *options, int fd) {
+	char line[256];
+	long i;
+	int len;
+
+	for (i = 0; i < options->events; i++) {
+		len = snprintf(line, sizeof(line), "src/storm%ld.c:%ld: error: storm %ld\n", i % 97, i % 1000 + 1, i);
+		if (write_all(fd, line, (size_t) len) != 0)
+			return -1;
+		pause_ms(options->interval_ms);
+	}
+	return 0;
+}
+
+static int feed_clean(const struct bench_options *options, int fd) {
+	/* Build progress lines, which mention neither of the pattern's words */
+	static char buf[FEED_CHUNK_BYTES];
+	long long total = (long long) options->megabytes * 1024 * 1024, written = 0;
+	size_t used = 0;
+	long i = 0;
+
+	while (written < total) {
+		used += (size_t) snprintf(buf + used, sizeof(buf) - used, "[%3ld%%] Building C object CMakeFiles/bench.dir/src/unit%ld.c.o\n",
+			(long) (written * 100 / total), i++ % 5000);
+		if (sizeof(buf) - used < 128 || written + (long long) used >= total) {
+			if (write_all(fd, buf, used) != 0)
+				return -1;
+			written += (long long) used;
+			used = 0;
+		}
+	}
+	return 0;
+}
+
+static int feed_dirty_tree(const struct bench_options *options, int fd) {
+	/* Spreads the rewritten files across the tree, a different set each time */
+	char line[512], path[256];
+	long i, k, n = 0;
+	int len;
+
+	for (i = 0; i < options->events; i++) {
+		for (k = 0; k < options->dirty; k++) {
+			n = (n + 7919) % options->files;
+			write_tree_file(n, i + 1);
+		}
+		tree_file(n, path, sizeof(path));
+		len = snprintf(line, sizeof(line), "Compiling %s\n%s:2: error: dirty tree %ld\n", path, path, i);
+		if (write_all(fd, line, (size_t) len) != 0)
+			return -1;
+		pause_ms(options->interval_ms);
+	}
+	return 0;
+}
+
+static int feed(const struct bench_options *options, int master, int slave) {
+	/* Once everything is written, waits for the analyzer to read it all, as
+	 * closing the terminal throws away what it hasn't read. Written output
+	 * only shows up in the terminal's input queue once the kernel has moved it
+	 * there, so the queue has to stay empty for a while
+	 */
+	int result = 0, queued, empty_ms = 0;
+
+	switch (options->workload) {
+	case BENCH_REPLAY: result = feed_replay(options, master); break;
+	case BENCH_STORM: result = feed_storm(options, master); break;
+	case BENCH_CLEAN: result = feed_clean(options, master); break;
+	case BENCH_DIRTY_TREE: result = feed_dirty_tree(options, master); break;
+	}
+	while (empty_ms < DRAINED_MS && ioctl(slave, FIONREAD, &queued) == 0) {
+		empty_ms = queued > 0 ? 0 : empty_ms + 1;
+		pause_ms(1);
+	}
+	return result;
+}
+
+int bench_start(const struct bench_options *options, int *input_fd) {
+	struct termios raw;
+	int master, slave;
+
+	detected_at = (double *) calloc(BENCH_MAX_TIMED, sizeof(double));
+	latency = (double *) calloc(BENCH_MAX_TIMED, sizeof(double));
+	if (detected_at == NULL || latency == NULL)
+		return -1;
+	if (options->workload == BENCH_DIRTY_TREE && make_tree(options) != 0)
+		return -1;
+
+	/* Raw, so the analyzer sees the bytes as written, without echo */
+	if (openpty(&master, &slave, NULL, NULL, NULL) != 0)
+		return -1;
+	if (tcgetattr(slave, &raw) == 0) {
+		cfmakeraw(&raw);
+		tcsetattr(slave, TCSANOW, &raw);
+	}
+	fflush(stdout);
+	feeder = fork();
+	if (feeder < 0)
+		return -1;
+	if (feeder == 0)
+		_exit(feed(options, master, slave) == 0 ? 0 : 1);
+	close(master);
+	*input_fd = slave;
+	started = now_seconds();
+	return 0;
+}
+
+
+/*
+ **
+ **
+ ** Measuring
+ **
+ **
+ */
+
+void bench_detected(void) {
+	if (detected < BENCH_MAX_TIMED)
+		detected_at[detected] = now_seconds();
+	/* A full barrier: the worker reads the time once it sees the count */
+	__sync_fetch_and_add(&detected, 1);
+}
+
+void bench_committed(int committed) {
+	/* Entries adopted from a dead analyzer's journal weren't detected by us */
+	size_t i;
+
+	if (resolved >= __sync_fetch_and_add(&detected, 0))
+		return;
+	i = __sync_fetch_and_add(&resolved, 1);
+	if (i < BENCH_MAX_TIMED)
+		latency[i] = now_seconds() - detected_at[i];
+	if (!committed)
+		__sync_fetch_and_add(&given_up, 1);
+}
+
+void bench_input_done(void) {
+	input_done = now_seconds();
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+	size_t i = (size_t) (p * (double) n + 0.999999);
+	return n == 0 ? 0 : sorted[i > 0 ? i - 1 : 0];
+}
+
+int bench_finish(const struct bench_options *options, FILE *out) {
+	double finished = now_seconds(), elapsed = finished - started, reading, cpu;
+	struct governor_stats g;
+	struct rusage usage;
+	uint64_t bytes = 0;
+	size_t timed;
+	int status = 0, l;
+
+	if (feeder > 0)
+		while (waitpid(feeder, &status, 0) < 0 && errno == EINTR)
+			;
+	if (options->workload == BENCH_DIRTY_TREE)
+		remove_tree(options);
+	governor_get(&g);
+	for (l = 0; l < GOVERNOR_LEVELS; l++)
+		bytes += g.bytes[l];
+	getrusage(RUSAGE_SELF, &usage);
+	/* Not counting the feeder's wait for the input to stay empty */
+	reading = (input_done > 0 ? input_done : finished) - started - (double) DRAINED_MS / 1000;
+	if (reading < 0)
+		reading = 0;
+	cpu = (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6 +
+		(double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6;
+	timed = resolved < BENCH_MAX_TIMED ? resolved : BENCH_MAX_TIMED;
+	qsort(latency, timed, sizeof(double), compare_doubles);
+
+	fprintf(out, "bench: %s\n", WORKLOAD_NAMES[options->workload]);
+	fprintf(out, "input:      %llu bytes read in %.3f s, %.1f MB/s\n", (unsigned long long) bytes, reading,
+		reading > 0 ? (double) bytes / reading / (1024 * 1024) : 0);
+	fprintf(out, "errors:     %lu detected, %lu committed, %lu given up in %.3f s, %.1f commits/s\n",
+		(unsigned long) detected, (unsigned long) (resolved - given_up), (unsigned long) given_up, elapsed,
+		elapsed > 0 ? (double) (resolved - given_up) / elapsed : 0);
+	fprintf(out, "latency:    p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms (%lu errors)\n",
+		percentile(latency, timed, 0.5) * 1000, percentile(latency, timed, 0.9) * 1000,
+		percentile(latency, timed, 0.99) * 1000, timed > 0 ? latency[timed - 1] * 1000 : 0, (unsigned long) timed);
+	fprintf(out, "cpu:        %.3f s user, %.3f s system, %.0f%% of one CPU\n",
+		(double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6,
+		(double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6,
+		elapsed > 0 ? cpu * 100 / elapsed : 0);
+	fprintf(out, "memory:     peak resident set %ld kB, %ld kB at the end\n", usage.ru_maxrss, alloc_stats_rss_kb());
+	alloc_stats_print(out);
+
+	free(detected_at);
+	free(latency);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(out, "bench: the workload could not be fed in full\n");
+		return 1;
+	}
+	return 0;
+}
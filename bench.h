@@ -0,0 +1,83 @@
+/*
+ * End-to-end benchmark of the analyzer.
+ *
+ * analyzer --bench feeds a workload to the analyzer's real input loop through
+ * a pseudo-terminal, the way monitor feeds it a shell's output, and lets it
+ * detect, journal and commit errors into the repository in the current
+ * directory. Run it from inside a scratch repository. The workloads are:
+ *
+ *   replay <typescript>  a session recorded with script(1), at maximum speed,
+ *                        or with --timing <file> (script -t) as it was
+ *                        recorded, sped up --speed times
+ *   storm                --events error lines in a row
+ *   clean                --megabytes of build output without a single error
+ *   dirty-tree           --files files created under bench-tree/, of which
+ *                        --dirty are rewritten before each of --events errors
+ *
+ * --interval spaces the synthetic errors out by that many milliseconds and
+ * --repeat replays a recording that many times. The report gives the input
+ * throughput, the time from detecting each error to its commit (percentiles
+ * over the first BENCH_MAX_TIMED errors), the CPU time and the resident set.
+ * The feeding process's own CPU time isn't counted.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Errors whose detection-to-commit latency is recorded */
+#define BENCH_MAX_TIMED 65536
+
+enum bench_workload {
+	BENCH_REPLAY,
+	BENCH_STORM,
+	BENCH_CLEAN,
+	BENCH_DIRTY_TREE
+};
+
+struct bench_options {
+	enum bench_workload workload;
+	const char *recording;       /* replay: the typescript */
+	const char *timing;          /* replay: script's timing file, or NULL */
+	double speed;
+	long repeat;
+	long events;
+	long megabytes;
+	long files;
+	long dirty;
+	long interval_ms;
+};
+
+/* Parses the arguments following --bench. Returns 0 on success, -1 after
+ * printing the usage.
+ */
+int bench_parse(int argc, char **argv, struct bench_options *options);
+
+/* Sets the workload up and starts feeding it to a pseudo-terminal from a
+ * child process. Stores the terminal end the analyzer should read in
+ * <input_fd>; reading it fails with EIO once the workload is exhausted.
+ * Returns 0 on success and -1 on failure.
+ */
+int bench_start(const struct bench_options *options, int *input_fd);
+
+/* Notes that an error was journaled. Called from the main thread only. */
+void bench_detected(void);
+
+/* Notes that the oldest journaled error not yet accounted for was committed
+ * (<committed> 1) or given up on (0). Called from the commit worker, as its
+ * observer (see commit_worker_observe()).
+ */
+void bench_committed(int committed);
+
+/* Notes that the analyzer read the last of its input */
+void bench_input_done(void);
+
+/* Waits for the feeding process, cleans the workload up and prints the report
+ * to <out>. Called once the commit worker has stopped. Returns 0, or 1 if the
+ * workload couldn't be fed in full.
+ */
+int bench_finish(const struct bench_options *options, FILE *out);
+
+#endif
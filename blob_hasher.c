@@ -0,0 +1,233 @@
+/*
+ * Thread pool for reading, hashing and writing snapshot blobs. See blob_hasher.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "blob_hasher.h"
+#include "alloc_stats.h"
+
+struct hash_pool {
+	git_odb *odb;
+	git_odb_backend *staging;
+	pthread_mutex_t staging_lock;
+	size_t staged;        /* bytes given to <staging>, up to max_bytes */
+	const char *workdir;
+	struct blob_job *jobs;
+	size_t count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t budget_freed;
+	size_t next_job;      /* index of the next job to hand out */
+	size_t bytes_held;    /* file contents currently held by workers */
+	size_t max_bytes;
+	size_t failed;
+};
+
+static int read_contents(const char *abs, const struct stat *st, char *buf, size_t size) {
+	/* Reads the blob contents for a file (or a symlink's target) into <buf> */
+	ssize_t n;
+	size_t done = 0;
+	int fd;
+
+	if (S_ISLNK(st->st_mode))
+		return readlink(abs, buf, size) == (ssize_t) size ? 0 : -1;
+
+	fd = open(abs, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while (done < size) {
+		n = read(fd, buf + done, size - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	close(fd);
+	/* A file that changed size under us is picked up by the next snapshot */
+	return done == size ? 0 : -1;
+}
+
+static int store_blob(struct hash_pool *pool, git_oid *id, const void *data, size_t len) {
+	int result = 0, stage = 0;
+
+	if (pool->staging != NULL) {
+		pthread_mutex_lock(&pool->staging_lock);
+		stage = pool->staged + len <= pool->max_bytes;
+		if (stage)
+			pool->staged += len;
+		pthread_mutex_unlock(&pool->staging_lock);
+	}
+	if (!stage)
+		return git_odb_write(id, pool->odb, data, len, GIT_OBJECT_BLOB);
+
+	if (git_odb_hash(id, data, len, GIT_OBJECT_BLOB) != 0)
+		return -1;
+	pthread_mutex_lock(&pool->staging_lock);
+	if (!git_odb_exists(pool->odb, id))
+		result = pool->staging->write(pool->staging, id, data, len, GIT_OBJECT_BLOB);
+	pthread_mutex_unlock(&pool->staging_lock);
+	return result;
+}
+
+static size_t bytes_needed(const struct blob_job *job) {
+	/* Bytes of the file that hashing the job reads into memory */
+	size_t size = (size_t) job->st.st_size;
+	if (job->stub && size > BLOB_STUB_HEAD_BYTES)
+		return BLOB_STUB_HEAD_BYTES;
+	return size;
+}
+
+static int write_stub(struct hash_pool *pool, struct blob_job *job, const char *abs) {
+	/* Writes the stub blob standing in for a file too large to snapshot */
+	char head[BLOB_STUB_HEAD_BYTES];
+	char head_hex[GIT_OID_HEXSZ + 1];
+	char stub[4096 + 256];
+	size_t head_len = bytes_needed(job);
+	git_oid head_id;
+	int fd, len;
+	ssize_t n;
+
+	fd = open(abs, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, head, head_len);
+	close(fd);
+	if (n < 0 || git_odb_hash(&head_id, head, (size_t) n, GIT_OBJECT_BLOB) != 0)
+		return -1;
+	git_oid_tostr(head_hex, sizeof(head_hex), &head_id);
+
+	len = snprintf(stub, sizeof(stub),
+		"errortracker-stub 1\n"
+		"path %s\n"
+		"size %lld\n"
+		"mtime %lld.%09ld\n"
+		"head-bytes %zd\n"
+		"head-oid %s\n",
+		job->path, (long long) job->st.st_size,
+		(long long) job->st.st_mtim.tv_sec, (long) job->st.st_mtim.tv_nsec,
+		n, head_hex);
+	return store_blob(pool, &job->id, stub, (size_t) len);
+}
+
+static void hash_one(struct hash_pool *pool, struct blob_job *job) {
+	char abs[4096];
+	size_t size = (size_t) job->st.st_size;
+	char *buf;
+
+	if (job->source != NULL)
+		snprintf(abs, sizeof(abs), "%s", job->source);
+	else
+		snprintf(abs, sizeof(abs), "%s%s", pool->workdir, job->path);
+	if (job->stub) {
+		job->error = write_stub(pool, job, abs);
+		return;
+	}
+
+	buf = (char *) alloc_stats_malloc(ALLOC_HASHER, size ? size : 1);
+	if (buf == NULL || read_contents(abs, &job->st, buf, size) != 0)
+		job->error = -1;
+	else
+		job->error = store_blob(pool, &job->id, buf, size);
+	alloc_stats_free(ALLOC_HASHER, buf);
+}
+
+static void* hash_worker(void *arg) {
+	struct hash_pool *pool = (struct hash_pool *) arg;
+	struct blob_job *job;
+	size_t size;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next_job < pool->count) {
+		job = &pool->jobs[pool->next_job++];
+		if (job->filtered)
+			continue;
+		size = bytes_needed(job);
+
+		/* Wait for room in the memory budget; a file bigger than the whole
+		 * budget waits until it is the only one held
+		 */
+		while (pool->bytes_held > 0 && pool->bytes_held + size > pool->max_bytes)
+			pthread_cond_wait(&pool->budget_freed, &pool->lock);
+		pool->bytes_held += size;
+		pthread_mutex_unlock(&pool->lock);
+
+		hash_one(pool, job);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->bytes_held -= size;
+		if (job->error != 0)
+			pool->failed++;
+		pthread_cond_broadcast(&pool->budget_freed);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+size_t hash_blobs(git_odb *odb, git_odb_backend *staging, const char *workdir,
+	struct blob_job *jobs, size_t count, unsigned int threads, size_t max_bytes) {
+	struct hash_pool pool;
+	pthread_t *workers;
+	unsigned int i, started = 0;
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned int) cpus : 1;
+	}
+	if (threads > count)
+		threads = count ? (unsigned int) count : 1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.odb = odb;
+	pool.staging = staging;
+	pool.workdir = workdir;
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.max_bytes = max_bytes;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_mutex_init(&pool.staging_lock, NULL);
+	pthread_cond_init(&pool.budget_freed, NULL);
+
+	/* The calling thread is one of the workers */
+	workers = (pthread_t *) alloc_stats_calloc(ALLOC_HASHER, threads, sizeof(pthread_t));
+	for (i = 1; workers != NULL && i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, hash_worker, &pool) != 0)
+			break;
+		started++;
+	}
+	hash_worker(&pool);
+	for (i = 1; i <= started; i++)
+		pthread_join(workers[i], NULL);
+
+	alloc_stats_free(ALLOC_HASHER, workers);
+	pthread_cond_destroy(&pool.budget_freed);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_mutex_destroy(&pool.staging_lock);
+	return pool.failed;
+}
+
+void blob_job_index_entry(git_index_entry *entry, const struct blob_job *job) {
+	const struct stat *st = &job->st;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->ctime.seconds = (int32_t) st->st_ctim.tv_sec;
+	entry->ctime.nanoseconds = (uint32_t) st->st_ctim.tv_nsec;
+	entry->mtime.seconds = (int32_t) st->st_mtim.tv_sec;
+	entry->mtime.nanoseconds = (uint32_t) st->st_mtim.tv_nsec;
+	entry->dev = (uint32_t) st->st_dev;
+	entry->ino = (uint32_t) st->st_ino;
+	entry->uid = (uint32_t) st->st_uid;
+	entry->gid = (uint32_t) st->st_gid;
+	entry->file_size = (uint32_t) st->st_size;
+	if (S_ISLNK(st->st_mode))
+		entry->mode = GIT_FILEMODE_LINK;
+	else if (st->st_mode & S_IXUSR)
+		entry->mode = GIT_FILEMODE_BLOB_EXECUTABLE;
+	else
+		entry->mode = GIT_FILEMODE_BLOB;
+	git_oid_cpy(&entry->id, &job->id);
+	entry->path = job->path;
+}
@@ -0,0 +1,74 @@
+/*
+ * Parallel creation of blobs for the files of a snapshot.
+ *
+ * After a branch switch or a code generator run a snapshot can have
+ * thousands of changed files, and reading, hashing and compressing them one
+ * after another dominates the time taken to record an error. hash_blobs()
+ * spreads that work over a pool of threads while capping how many bytes of
+ * file contents are held in memory at once. Results are written back into the
+ * caller's job array, so callers can apply them in whatever deterministic
+ * order they built the array in.
+ */
+
+#ifndef BLOB_HASHER_H
+#define BLOB_HASHER_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <sys/stat.h>
+
+struct blob_job {
+	/* Path relative to the working directory, and its lstat() result */
+	const char *path;
+	struct stat st;
+
+	/* Where to read the file from instead of <path> in the working
+	 * directory, if set: its captured copy (see file_capture.h)
+	 */
+	const char *source;
+
+	/* Store a stub describing the file instead of its contents; used for
+	 * files over the snapshot size limit
+	 */
+	int stub;
+
+	/* The path has .gitattributes filters (eol conversion, ident, ...)
+	 * that its blob has to go through, so hash_blobs leaves it to the
+	 * caller, who adds it with libgit2
+	 */
+	int filtered;
+
+	/* Set by hash_blobs: the blob's id, or a non-zero error */
+	git_oid id;
+	int error;
+};
+
+/* Number of leading bytes of a stubbed file that its stub records the hash of */
+#define BLOB_STUB_HEAD_BYTES (64 * 1024)
+
+/* Below this many files the thread pool costs more than it saves */
+#define BLOB_HASHER_MIN_PARALLEL 16
+
+/* Writes a blob to <odb> for every job's file under <workdir> (symlinks are
+ * stored as their target, like git does). A stub job's blob is a short text
+ * record of the file's path, size, mtime and the blob id of its first
+ * BLOB_STUB_HEAD_BYTES bytes. Uses up to <threads> threads (0 for
+ * one per online CPU) and keeps at most <max_bytes> of file contents in memory,
+ * except that a single file larger than that is still read on its own.
+ * Filtered jobs are skipped. Returns the number of jobs that failed.
+ *
+ * If <staging> is non-NULL new blobs are written straight to that backend
+ * (the repository's in-memory mempack) instead of through <odb>, up to
+ * <max_bytes> of them: the mempack holds them uncompressed until it is
+ * flushed. Blobs past that are written through <odb>, which then has to be
+ * one without the mempack, as loose objects the workers compress themselves.
+ * The backend isn't thread-safe, so objects are hashed in parallel and only
+ * the exists check and the copy into the backend are serialized.
+ */
+size_t hash_blobs(git_odb *odb, git_odb_backend *staging, const char *workdir,
+	struct blob_job *jobs, size_t count, unsigned int threads, size_t max_bytes);
+
+/* Fills <entry> for adding job <job> to an index; entry->path points into the job */
+void blob_job_index_entry(git_index_entry *entry, const struct blob_job *job);
+
+#endif
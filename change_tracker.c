@@ -0,0 +1,417 @@
+/*
+ * inotify-based tracking of changed paths in a working tree. See change_tracker.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "change_tracker.h"
+#include "alloc_stats.h"
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+	IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+
+/*
+ **
+ **
+ ** Dirty path set
+ **
+ **
+ */
+
+static size_t hash_path(const char *path) {
+	/* FNV-1a */
+	size_t h = 2166136261u;
+	while (*path) {
+		h ^= (unsigned char) *path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void dirty_insert(struct change_tracker *t, char *path);
+
+static void dirty_grow(struct change_tracker *t) {
+	char **old = t->dirty;
+	size_t old_cap = t->dirty_cap, i;
+
+	t->dirty_cap = old_cap ? old_cap * 2 : 64;
+	t->dirty = (char **) alloc_stats_calloc(ALLOC_TRACKER, t->dirty_cap, sizeof(char *));
+	t->dirty_count = 0;
+	for (i = 0; i < old_cap; i++)
+		if (old[i] != NULL)
+			dirty_insert(t, old[i]);
+	alloc_stats_free(ALLOC_TRACKER, old);
+}
+
+static void dirty_insert(struct change_tracker *t, char *path) {
+	/* Takes ownership of <path> */
+	size_t i;
+
+	if ((t->dirty_count + 1) * 2 > t->dirty_cap)
+		dirty_grow(t);
+	i = hash_path(path) & (t->dirty_cap - 1);
+	while (t->dirty[i] != NULL) {
+		if (strcmp(t->dirty[i], path) == 0) {
+			alloc_stats_free(ALLOC_TRACKER, path);
+			return;
+		}
+		i = (i + 1) & (t->dirty_cap - 1);
+	}
+	t->dirty[i] = path;
+	t->dirty_count++;
+}
+
+static void mark_dirty(struct change_tracker *t, const char *dir, const char *name) {
+	/* Adds <dir>/<name> to the dirty set */
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = (char *) alloc_stats_malloc(ALLOC_TRACKER, dir_len + name_len + 2);
+
+	if (path == NULL) {
+		t->needs_rescan = 1;
+		return;
+	}
+	if (dir_len == 0) {
+		memcpy(path, name, name_len + 1);
+	}
+	else {
+		memcpy(path, dir, dir_len);
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+	}
+	dirty_insert(t, path);
+}
+
+
+/*
+ **
+ **
+ ** Watch management
+ **
+ **
+ */
+
+static void forget_watch(struct change_tracker *t, int wd) {
+	if (wd >= 0 && (size_t) wd < t->watch_cap && t->watch_dirs[wd] != NULL) {
+		alloc_stats_free(ALLOC_TRACKER, t->watch_dirs[wd]);
+		t->watch_dirs[wd] = NULL;
+	}
+}
+
+static int remember_watch(struct change_tracker *t, int wd, const char *dir) {
+	if ((size_t) wd >= t->watch_cap) {
+		size_t cap = t->watch_cap ? t->watch_cap : 256;
+		char **grown;
+		while (cap <= (size_t) wd)
+			cap *= 2;
+		grown = (char **) alloc_stats_realloc(ALLOC_TRACKER, t->watch_dirs, cap * sizeof(char *));
+		if (grown == NULL)
+			return -1;
+		memset(grown + t->watch_cap, 0, (cap - t->watch_cap) * sizeof(char *));
+		t->watch_dirs = grown;
+		t->watch_cap = cap;
+	}
+	alloc_stats_free(ALLOC_TRACKER, t->watch_dirs[wd]);
+	t->watch_dirs[wd] = alloc_stats_strdup(ALLOC_TRACKER, dir);
+	return t->watch_dirs[wd] == NULL ? -1 : 0;
+}
+
+static int skips_path(struct change_tracker *t, const char *dir, const char *name, int is_dir) {
+	/* Whether the owner leaves out <dir>/<name> */
+	char path[4096];
+
+	if (t->skip == NULL)
+		return 0;
+	snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] != '\0' ? "/" : "", name);
+	return t->skip(t->skip_payload, path, is_dir);
+}
+
+static int skips_dir(struct change_tracker *t, const char *dir) {
+	/* Whether <dir> goes unwatched: a .git, a nested repository or one the
+	 * owner leaves out. Watching every gitignored build tree would run out
+	 * of watches on a large repository, and rescan every snapshot after.
+	 */
+	const char *slash = strrchr(dir, '/');
+	char abs[4096];
+	struct stat st;
+
+	if (!strcmp(slash != NULL ? slash + 1 : dir, ".git"))
+		return 1;
+	snprintf(abs, sizeof(abs), "%s%s/.git", t->root, dir);
+	if (lstat(abs, &st) == 0)
+		return 1;
+	return t->skip != NULL && t->skip(t->skip_payload, dir, 1);
+}
+
+static void watch_tree(struct change_tracker *t, const char *dir, int mark_files) {
+	/* Adds a watch on <dir> (relative to the root) and every directory below it.
+	 * When <mark_files> is set every file found is added to the dirty set; this
+	 * is used for directories that appear after startup, whose contents were
+	 * never seen by a snapshot.
+	 */
+	char abs[4096];
+	DIR *d;
+	struct dirent *entry;
+	struct stat st;
+	char *child;
+	int wd;
+
+	snprintf(abs, sizeof(abs), "%s%s", t->root, dir);
+	wd = inotify_add_watch(t->fd, abs, WATCH_MASK);
+	if (wd < 0) {
+		/* Most likely out of watches (fs.inotify.max_user_watches) or not
+		 * allowed in; changes under this directory can't be seen, so rescan
+		 * until a later attempt at watching it works
+		 */
+		if (errno != ENOENT && errno != ENOTDIR) {
+			t->needs_rescan = 1;
+			t->incomplete = 1;
+		}
+		return;
+	}
+	if (remember_watch(t, wd, dir) != 0) {
+		t->needs_rescan = 1;
+		t->incomplete = 1;
+		return;
+	}
+
+	d = opendir(abs);
+	if (d == NULL)
+		return;
+	while ((entry = readdir(d)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		child = (char *) alloc_stats_malloc(ALLOC_TRACKER, strlen(dir) + strlen(entry->d_name) + 2);
+		if (child == NULL) {
+			t->needs_rescan = 1;
+			t->incomplete = 1;
+			break;
+		}
+		if (dir[0] == '\0')
+			strcpy(child, entry->d_name);
+		else
+			sprintf(child, "%s/%s", dir, entry->d_name);
+
+		snprintf(abs, sizeof(abs), "%s%s", t->root, child);
+		if (lstat(abs, &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (!skips_dir(t, child))
+				watch_tree(t, child, mark_files);
+		}
+		else if (mark_files && !skips_path(t, "", child, 0))
+			mark_dirty(t, "", child);
+		alloc_stats_free(ALLOC_TRACKER, child);
+	}
+	closedir(d);
+}
+
+static void unwatch_tree(struct change_tracker *t, const char *dir) {
+	/* Drops the watches on <dir> and everything below it; used when a directory
+	 * is moved away, since its watches would otherwise report the old path
+	 */
+	size_t len = strlen(dir), i;
+	for (i = 0; i < t->watch_cap; i++) {
+		char *watched = t->watch_dirs[i];
+		if (watched == NULL)
+			continue;
+		if (!strcmp(watched, dir) || (!strncmp(watched, dir, len) && watched[len] == '/')) {
+			inotify_rm_watch(t->fd, (int) i);
+			forget_watch(t, (int) i);
+		}
+	}
+}
+
+static void rewatch_tree(struct change_tracker *t) {
+	/* Drops every watch and watches the whole tree again. A new inotify
+	 * instance is used so no event queued for an old watch can be taken for
+	 * one on a new watch with the same descriptor.
+	 */
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	size_t i;
+
+	if (fd < 0) {
+		t->incomplete = 1;
+		return;
+	}
+	close(t->fd);
+	t->fd = fd;
+	for (i = 0; i < t->watch_cap; i++)
+		forget_watch(t, (int) i);
+	t->rewatch = 0;
+	t->incomplete = 0;
+	watch_tree(t, "", 0);
+}
+
+
+/*
+ **
+ **
+ ** Public interface
+ **
+ **
+ */
+
+struct change_tracker* change_tracker_new(const char *workdir,
+	int (*skip)(void *payload, const char *path, int is_dir), void *skip_payload) {
+	struct change_tracker *t = (struct change_tracker *) alloc_stats_calloc(ALLOC_TRACKER, 1, sizeof(struct change_tracker));
+	size_t len = strlen(workdir);
+
+	if (t == NULL)
+		return NULL;
+	t->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (t->fd < 0) {
+		perror("inotify_init1");
+		alloc_stats_free(ALLOC_TRACKER, t);
+		return NULL;
+	}
+	t->root = (char *) alloc_stats_malloc(ALLOC_TRACKER, len + 2);
+	if (t->root == NULL) {
+		close(t->fd);
+		alloc_stats_free(ALLOC_TRACKER, t);
+		return NULL;
+	}
+	strcpy(t->root, workdir);
+	if (len == 0 || workdir[len - 1] != '/')
+		strcat(t->root, "/");
+	t->root_len = strlen(t->root);
+	t->skip = skip;
+	t->skip_payload = skip_payload;
+
+	/* Nothing has been snapshotted with this tracker yet */
+	t->needs_rescan = 1;
+	watch_tree(t, "", 0);
+	return t;
+}
+
+void change_tracker_poll(struct change_tracker *t) {
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	const char *dir;
+	char *path;
+
+	while ((len = read(t->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Directories created meanwhile went unwatched */
+				t->needs_rescan = 1;
+				t->rewatch = 1;
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				forget_watch(t, ev->wd);
+				continue;
+			}
+			if (ev->wd < 0 || (size_t) ev->wd >= t->watch_cap || t->watch_dirs[ev->wd] == NULL)
+				continue;
+			if (ev->len == 0)
+				continue;
+
+			dir = t->watch_dirs[ev->wd];
+			/* The path itself is dirty, directory or not: a removed or
+			 * moved-away directory tells the snapshot to drop everything
+			 * under it. Unless it is left out, so a failing build rewriting
+			 * its ignored outputs doesn't look like a change every time.
+			 */
+			if (!skips_path(t, dir, ev->name, (ev->mask & IN_ISDIR) != 0))
+				mark_dirty(t, dir, ev->name);
+			/* Directories it ignored may not be any more, or the other way
+			 * round; a rescan picks up what went unwatched
+			 */
+			if (!strcmp(ev->name, ".gitignore")) {
+				t->needs_rescan = 1;
+				t->rewatch = 1;
+			}
+
+			if (!(ev->mask & IN_ISDIR))
+				continue;
+			path = (char *) alloc_stats_malloc(ALLOC_TRACKER, strlen(dir) + strlen(ev->name) + 2);
+			if (path == NULL) {
+				t->needs_rescan = 1;
+				t->rewatch = 1;
+				continue;
+			}
+			if (dir[0] == '\0')
+				strcpy(path, ev->name);
+			else
+				sprintf(path, "%s/%s", dir, ev->name);
+			if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+				unwatch_tree(t, path);
+			if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && !skips_dir(t, path))
+				watch_tree(t, path, 1);
+			alloc_stats_free(ALLOC_TRACKER, path);
+		}
+	}
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+size_t change_tracker_take(struct change_tracker *t, char ***paths) {
+	size_t i, n = 0;
+	char **out = (char **) alloc_stats_malloc(ALLOC_TRACKER, (t->dirty_count ? t->dirty_count : 1) * sizeof(char *));
+
+	if (out == NULL) {
+		*paths = NULL;
+		t->needs_rescan = 1;
+		return 0;
+	}
+	for (i = 0; i < t->dirty_cap; i++) {
+		if (t->dirty[i] != NULL) {
+			out[n++] = t->dirty[i];
+			t->dirty[i] = NULL;
+		}
+	}
+	t->dirty_count = 0;
+	qsort(out, n, sizeof(char *), compare_paths);
+	*paths = out;
+	return n;
+}
+
+void change_tracker_free_paths(char **paths, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++)
+		alloc_stats_free(ALLOC_TRACKER, paths[i]);
+	alloc_stats_free(ALLOC_TRACKER, paths);
+}
+
+static void forget_dirty(struct change_tracker *t) {
+	size_t i;
+	for (i = 0; i < t->dirty_cap; i++) {
+		alloc_stats_free(ALLOC_TRACKER, t->dirty[i]);
+		t->dirty[i] = NULL;
+	}
+	t->dirty_count = 0;
+}
+
+void change_tracker_rescanned(struct change_tracker *t) {
+	if (t->rewatch || t->incomplete)
+		rewatch_tree(t);
+	forget_dirty(t);
+	t->needs_rescan = t->incomplete;
+}
+
+void change_tracker_free(struct change_tracker *t) {
+	size_t i;
+	if (t == NULL)
+		return;
+	close(t->fd);
+	for (i = 0; i < t->watch_cap; i++)
+		alloc_stats_free(ALLOC_TRACKER, t->watch_dirs[i]);
+	alloc_stats_free(ALLOC_TRACKER, t->watch_dirs);
+	forget_dirty(t);
+	alloc_stats_free(ALLOC_TRACKER, t->dirty);
+	alloc_stats_free(ALLOC_TRACKER, t->root);
+	alloc_stats_free(ALLOC_TRACKER, t);
+}
@@ -0,0 +1,90 @@
+/*
+ * Tracks which paths in a working tree changed between error snapshots.
+ *
+ * Walking and stat-ing the whole working tree for every snapshot is too slow
+ * on large repositories, so the long-lived analyzer keeps an inotify watch on
+ * every directory of the tree and remembers the paths it hears about. A
+ * snapshot then only has to look at those paths. Whenever the tracker cannot
+ * vouch for the full set of changes (at startup, after the kernel's event
+ * queue overflowed, or if a watch could not be added) it asks for a rescan.
+ *
+ * Before that rescan the watches are rebuilt from scratch, so directories
+ * created while events were being lost are watched from then on, and watches
+ * that failed are tried again. For as long as some directory still can't be
+ * watched, every snapshot rescans.
+ *
+ * Directories a rescan wouldn't descend into aren't watched: the repository's
+ * .git, nested repositories and whatever the owner's <skip> callback leaves
+ * out (gitignored build trees, .errortrackerignore). Changes to paths it
+ * leaves out don't make the dirty set either. A change to a .gitignore can
+ * change which those are, so it has the watches rebuilt.
+ */
+
+#ifndef CHANGE_TRACKER_H
+#define CHANGE_TRACKER_H
+
+#include <stddef.h>
+
+struct change_tracker {
+	/* inotify file descriptor, non-blocking; poll it with select() */
+	int fd;
+	/* Working directory being watched, always ending in '/' */
+	char *root;
+	size_t root_len;
+
+	/* Returns 1 to leave <path> (relative to root) out; a directory left out
+	 * isn't watched. Called with <skip_payload>. May be NULL.
+	 */
+	int (*skip)(void *payload, const char *path, int is_dir);
+	void *skip_payload;
+
+	/* Directory (relative to root, "" for the root itself) of each watch,
+	 * indexed by watch descriptor
+	 */
+	char **watch_dirs;
+	size_t watch_cap;
+
+	/* Open-addressed hash set of paths (relative to root) changed since the
+	 * last call to change_tracker_take
+	 */
+	char **dirty;
+	size_t dirty_count;
+	size_t dirty_cap;
+
+	/* Set when the dirty set can't be trusted and the whole tree must be scanned */
+	int needs_rescan;
+	/* Set when events may have been missed for directories whose watches
+	 * are stale or missing; the watches are rebuilt before the next rescan
+	 */
+	int rewatch;
+	/* Set while some directory isn't watched, which keeps needs_rescan set */
+	int incomplete;
+};
+
+/* Starts watching the working tree rooted at <workdir>, leaving out what
+ * <skip> says to (see above). Returns NULL if inotify is unavailable, in
+ * which case callers should always scan the whole tree.
+ */
+struct change_tracker* change_tracker_new(const char *workdir,
+	int (*skip)(void *payload, const char *path, int is_dir), void *skip_payload);
+
+/* Drains every pending inotify event without blocking */
+void change_tracker_poll(struct change_tracker *tracker);
+
+/* Hands the current dirty set to the caller as a sorted array of paths
+ * relative to the working directory and starts a new, empty set. Free the
+ * result with change_tracker_free_paths.
+ */
+size_t change_tracker_take(struct change_tracker *tracker, char ***paths);
+void change_tracker_free_paths(char **paths, size_t count);
+
+/* Called right before the caller scans the whole tree; rebuilds the watches
+ * if they can't be trusted, forgets the dirty set and clears needs_rescan
+ * unless a directory still isn't watched. Changes made while the scan runs
+ * are recorded again and picked up by the next snapshot.
+ */
+void change_tracker_rescanned(struct change_tracker *tracker);
+
+void change_tracker_free(struct change_tracker *tracker);
+
+#endif
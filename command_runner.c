@@ -0,0 +1,296 @@
+/*
+ * Running a command under the error tracker without a terminal. See
+ * command_runner.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "command_runner.h"
+#include "error_detect.h"
+
+/* Most bytes moved by one tee() or splice() */
+static const size_t SPLICE_CHUNK = 1024 * 1024;
+/* Capacity asked for the command's pipes and the analysis pipes, so a build
+ * writing a lot wakes us up less often
+ */
+static const int PIPE_BYTES = 1024 * 1024;
+/* Largest read of output for analysis */
+#define SCAN_BUFFER_BYTES (64 * 1024)
+/* Rate at which stdout is analyzed at most, and how far a quiet spell lets it
+ * get ahead. A build writing faster than that fills the analysis pipe, and
+ * stdout is then forwarded without being looked at until there is room again
+ */
+static const double STDOUT_SCAN_BYTES_PER_SECOND = 32.0 * 1024 * 1024;
+static const double STDOUT_SCAN_BURST_BYTES = 4.0 * 1024 * 1024;
+/* Output kept from the start of the line with the error */
+static const size_t ERROR_CONTEXT_BYTES = 1024;
+
+struct stream {
+	enum run_stream which;
+	int in;        /* our end of the command's pipe, -1 once it is closed */
+	int out;       /* where the output is forwarded to */
+	int spliced;   /* whether <out> can be written with splice() */
+	int scan[2];   /* pipe the analysis reads a tee()d copy from */
+};
+
+static pid_t child = 0;
+/* stdout bytes that may be analyzed right now, and when that was worked out */
+static double scan_allowance = 0;
+static struct timespec allowance_time;
+
+static void forward_signal(int signo) {
+	if (child > 0)
+		kill(child, signo);
+}
+
+static int can_splice(int fd) {
+	/* splice() can write to pipes, sockets, devices such as /dev/null and files
+	 * not opened for appending; a terminal needs write()
+	 */
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fstat(fd, &st) != 0)
+		return 0;
+	return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || (S_ISCHR(st.st_mode) && !isatty(fd)) ||
+		(S_ISREG(st.st_mode) && !(flags & O_APPEND));
+}
+
+static int has_priority(const struct run_result *r, enum run_stream which) {
+	/* Whether an error already found outranks one on <which> */
+	return r->error_len > 0 && (r->error_stream == RUN_STDERR || which == RUN_STDOUT);
+}
+
+static void keep_error(struct run_result *r, enum run_stream which, const char *buf, size_t len, size_t offset) {
+	/* Keeps the output from the start of the line with the match at <offset> */
+	size_t start = offset, end;
+
+	while (start > 0 && buf[start - 1] != '\n' && offset - start < ERROR_CONTEXT_BYTES / 2)
+		start--;
+	end = len - start < ERROR_CONTEXT_BYTES ? len : start + ERROR_CONTEXT_BYTES;
+	if (end - start > sizeof(r->error))
+		end = start + sizeof(r->error);
+	memcpy(r->error, buf + start, end - start);
+	r->error_len = end - start;
+	r->error_offset = offset - start;
+	r->error_stream = which;
+}
+
+static void analyze(const struct stream *s, struct run_result *r, char *buf, size_t len) {
+	/* <buf> has room for a terminating NUL after its <len> bytes. Matches
+	 * split across two reads are missed; errors are rarely written in pieces
+	 */
+	int offset;
+
+	output_tail_append(&r->tail, buf, len);
+	r->scanned[s->which] += len;
+	if (has_priority(r, s->which))
+		return;
+	buf[len] = '\0';
+	if (s->which == RUN_STDERR ? detect_error(buf, &offset) : prefilter_error(buf, len, &offset))
+		keep_error(r, s->which, buf, len, (size_t) offset);
+}
+
+static void drain_scan(const struct stream *s, struct run_result *r, size_t budget) {
+	/* Analyzes up to <budget> bytes of what was tee()d for analysis */
+	static char buf[SCAN_BUFFER_BYTES + 1];
+	ssize_t n;
+
+	while (budget > 0 && (n = read(s->scan[0], buf, budget < SCAN_BUFFER_BYTES ? budget : SCAN_BUFFER_BYTES)) > 0) {
+		analyze(s, r, buf, (size_t) n);
+		budget -= (size_t) n;
+	}
+}
+
+static size_t stdout_budget(void) {
+	/* Tops the allowance up for the time that passed */
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	scan_allowance += STDOUT_SCAN_BYTES_PER_SECOND * ((double) (now.tv_sec - allowance_time.tv_sec) +
+		(double) (now.tv_nsec - allowance_time.tv_nsec) / 1e9);
+	if (scan_allowance > STDOUT_SCAN_BURST_BYTES)
+		scan_allowance = STDOUT_SCAN_BURST_BYTES;
+	allowance_time = now;
+	return (size_t) scan_allowance;
+}
+
+static int forward_spliced(struct stream *s, struct run_result *r) {
+	/* Forwards what is waiting in the command's pipe without copying it,
+	 * leaving a copy in the analysis pipe if it has room. Returns 0 at end of
+	 * stream or once the output can't be written any more
+	 */
+	ssize_t teed, moved;
+	size_t done = 0;
+	uint64_t before;
+
+	teed = tee(s->in, s->scan[1], SPLICE_CHUNK, SPLICE_F_NONBLOCK);
+	if (teed < 0 && errno == EAGAIN && s->which == RUN_STDERR) {
+		/* stderr is never skipped: make room */
+		drain_scan(s, r, SIZE_MAX);
+		teed = tee(s->in, s->scan[1], SPLICE_CHUNK, SPLICE_F_NONBLOCK);
+	}
+	if (teed == 0)
+		return 0;
+
+	/* Exactly what was copied, so the next tee() starts with new output */
+	do {
+		moved = splice(s->in, NULL, s->out, NULL, teed > 0 ? (size_t) teed - done : SPLICE_CHUNK, SPLICE_F_MOVE);
+		if (moved < 0 && errno == EINTR)
+			continue;
+		if (moved <= 0)
+			return 0;
+		done += (size_t) moved;
+	} while (teed > 0 && done < (size_t) teed);
+	r->bytes[s->which] += done;
+
+	if (s->which == RUN_STDERR) {
+		drain_scan(s, r, SIZE_MAX);
+	}
+	else {
+		before = r->scanned[RUN_STDOUT];
+		drain_scan(s, r, stdout_budget());
+		scan_allowance -= (double) (r->scanned[RUN_STDOUT] - before);
+	}
+	return 1;
+}
+
+static int forward_copied(struct stream *s, struct run_result *r) {
+	/* Forwards output through a buffer, for outputs splice() can't write */
+	static char buf[SCAN_BUFFER_BYTES + 1];
+	ssize_t n = read(s->in, buf, SCAN_BUFFER_BYTES), written, w;
+
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 1;
+	if (n <= 0)
+		return 0;
+	for (written = 0; written < n; written += w) {
+		w = write(s->out, buf + written, (size_t) (n - written));
+		if (w < 0 && errno == EINTR)
+			w = 0;
+		else if (w <= 0)
+			return 0;
+	}
+	r->bytes[s->which] += (size_t) n;
+	if (s->which == RUN_STDERR || stdout_budget() >= (size_t) n) {
+		analyze(s, r, buf, (size_t) n);
+		if (s->which == RUN_STDOUT)
+			scan_allowance -= (double) n;
+	}
+	return 1;
+}
+
+int command_run(char **argv, struct run_result *r) {
+	struct stream streams[RUN_STREAMS];
+	struct pollfd fds[RUN_STREAMS];
+	enum run_stream polled[RUN_STREAMS];
+	struct sigaction ignore, forward, old_int, old_quit, old_term, old_hup, old_pipe;
+	int pipes[RUN_STREAMS][2], i, n, status;
+
+	memset(r, 0, sizeof(*r));
+	scan_allowance = STDOUT_SCAN_BURST_BYTES;
+	clock_gettime(CLOCK_MONOTONIC, &allowance_time);
+	for (i = 0; i < RUN_STREAMS; i++) {
+		streams[i].which = (enum run_stream) i;
+		streams[i].out = i == RUN_STDOUT ? STDOUT_FILENO : STDERR_FILENO;
+		streams[i].scan[0] = streams[i].scan[1] = -1;
+		if (pipe2(pipes[i], O_CLOEXEC) != 0)
+			return -1;
+		fcntl(pipes[i][0], F_SETPIPE_SZ, PIPE_BYTES);
+		streams[i].in = pipes[i][0];
+		streams[i].spliced = can_splice(streams[i].out) && pipe2(streams[i].scan, O_CLOEXEC | O_NONBLOCK) == 0;
+		if (streams[i].spliced)
+			fcntl(streams[i].scan[0], F_SETPIPE_SZ, PIPE_BYTES);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	child = fork();
+	if (child < 0)
+		return -1;
+	if (child == 0) {
+		dup2(pipes[RUN_STDOUT][1], STDOUT_FILENO);
+		dup2(pipes[RUN_STDERR][1], STDERR_FILENO);
+		execvp(argv[0], argv);
+		fprintf(stderr, "errortracker: %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	for (i = 0; i < RUN_STREAMS; i++)
+		close(pipes[i][1]);
+
+	/* Like system(): an interrupt from the terminal reaches the command too,
+	 * and we stay around to record how it ended. A termination request is
+	 * passed on to it. A closed output is noticed as EPIPE, and closing the
+	 * command's pipe in turn lets it get its own SIGPIPE
+	 */
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	memset(&forward, 0, sizeof(forward));
+	forward.sa_handler = forward_signal;
+	sigaction(SIGINT, &ignore, &old_int);
+	sigaction(SIGQUIT, &ignore, &old_quit);
+	sigaction(SIGPIPE, &ignore, &old_pipe);
+	sigaction(SIGTERM, &forward, &old_term);
+	sigaction(SIGHUP, &forward, &old_hup);
+
+	for (;;) {
+		/* stderr first, so it is dealt with before stdout in every round */
+		n = 0;
+		for (i = RUN_STREAMS - 1; i >= 0; i--) {
+			if (streams[i].in < 0)
+				continue;
+			fds[n].fd = streams[i].in;
+			fds[n].events = POLLIN;
+			polled[n++] = (enum run_stream) i;
+		}
+		if (n == 0)
+			break;
+		if (poll(fds, (nfds_t) n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct stream *s = &streams[polled[i]];
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (!(s->spliced ? forward_spliced(s, r) : forward_copied(s, r))) {
+				close(s->in);
+				s->in = -1;
+			}
+		}
+	}
+
+	for (i = 0; i < RUN_STREAMS; i++) {
+		if (streams[i].in >= 0)
+			close(streams[i].in);
+		if (streams[i].spliced) {
+			/* What the command wrote last is where its error usually is */
+			drain_scan(&streams[i], r, SIZE_MAX);
+			close(streams[i].scan[0]);
+			close(streams[i].scan[1]);
+		}
+	}
+	while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+		;
+	child = 0;
+	r->status = WIFEXITED(status) ? WEXITSTATUS(status) : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGQUIT, &old_quit, NULL);
+	sigaction(SIGPIPE, &old_pipe, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGHUP, &old_hup, NULL);
+	return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Running a command under the error tracker without a terminal.
+ *
+ * monitor wraps an interactive shell in a pseudo-terminal, which merges the
+ * command's stdout and stderr and costs a copy of every byte through the pty
+ * and a read() for every small chunk. CI steps and cron jobs need none of
+ * that. command_run() gives the command separate pipes for stdout and
+ * stderr and forwards each to where ours goes. Where that is a pipe, socket or
+ * plain file, it uses splice(), so forwarding never copies the output through
+ * this process. A copy for analysis is taken with tee().
+ *
+ * stderr has priority: all of it is run through the error pattern, and an
+ * error found there is the one recorded. stdout is only searched with the
+ * prefilter, within a budget. When a build writes more than the analysis can
+ * keep up with, the excess is forwarded without being looked at, so logs of
+ * many gigabytes cost little more than the splicing.
+ */
+
+#ifndef COMMAND_RUNNER_H
+#define COMMAND_RUNNER_H
+
+#include <stdint.h>
+#include "error_event.h"
+#include "output_tail.h"
+
+enum run_stream {
+	RUN_STDOUT,
+	RUN_STDERR,
+	RUN_STREAMS
+};
+
+struct run_result {
+	/* Exit status, or 128 + the signal that killed the command */
+	int status;
+	/* The first error found, preferring stderr: the output around it and where
+	 * in that the match starts. error_len is 0 if none was found.
+	 */
+	char error[ERROR_EVENT_MAX_MESSAGE];
+	size_t error_len;
+	size_t error_offset;
+	enum run_stream error_stream;
+	/* The end of the output of both streams, in the order it was read */
+	struct output_tail tail;
+	/* Bytes forwarded, and of those, run through detection */
+	uint64_t bytes[RUN_STREAMS];
+	uint64_t scanned[RUN_STREAMS];
+};
+
+/* Runs <argv> (searched for in PATH) to completion with stdin inherited,
+ * forwarding its output and looking for errors in it. Returns 0 once the
+ * command has finished, with <result> filled in, or -1 if it couldn't be
+ * started.
+ */
+int command_run(char **argv, struct run_result *result);
+
+#endif
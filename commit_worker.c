@@ -0,0 +1,378 @@
+/*
+ * Journal-fed commit thread. See commit_worker.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <git2.h>
+#include "commit_worker.h"
+#include "alloc_stats.h"
+#include "arena.h"
+#include "create_error_commit.h"
+#include "governor.h"
+#include "probes.h"
+#include "trace.h"
+#include "journal.h"
+#include "repo_context.h"
+
+/* Attempts at committing an entry before it is given up */
+static const uint32_t MAX_COMMIT_ATTEMPTS = 3;
+/* How long to wait before retrying entries whose commit failed */
+static const long RETRY_DELAY_SECONDS = 1;
+/* Most change tracker descriptors waited on at once */
+#define MAX_WATCH_FDS 16
+/* Queue items carved out of the heap at a time */
+static const size_t ITEMS_PER_SLAB = 64;
+/* libgit2's caches grow towards these over a long session: objects it has
+ * parsed, and the windows of packfiles it has mapped (one packfile is written
+ * per snapshot)
+ */
+static const size_t OBJECT_CACHE_BYTES = 16 * 1024 * 1024;
+static const size_t PACK_MAP_BYTES = 64 * 1024 * 1024;
+
+struct work_item {
+	struct journal *journal;
+	size_t slot;
+	/* When it was first queued, if the dequeue probe was on then */
+	uint64_t queued_at;
+	/* Set for a hint instead of an entry */
+	char *git_dir;
+	struct work_item *next;
+};
+
+/* The journals this process has opened; only touched by the main thread */
+struct journal_ref {
+	char *git_dir;
+	struct journal *journal;
+	struct journal_ref *next;
+};
+static struct journal_ref *journals = NULL;
+
+static pthread_t worker_thread;
+static int worker_running = 0;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work_item *queue_head = NULL, *queue_tail = NULL;
+/* Where queued items come from, so queueing an error doesn't touch the heap
+ * once the pool has grown to the usual backlog
+ */
+static struct pool item_pool;
+static int stopping = 0;
+/* Entries queued and not yet committed or given up on */
+static size_t uncommitted = 0;
+/* Set by SIGUSR1 */
+static volatile sig_atomic_t stats_requested = 0;
+/* Told about every entry that is done with; see commit_worker_observe() */
+static void (*observer)(int committed) = NULL;
+
+
+/*
+ **
+ **
+ ** Queue
+ **
+ **
+ */
+
+static void enqueue(struct work_item *item, int wake) {
+	pthread_mutex_lock(&queue_lock);
+	item->next = NULL;
+	if (queue_tail != NULL)
+		queue_tail->next = item;
+	else
+		queue_head = item;
+	queue_tail = item;
+	pthread_mutex_unlock(&queue_lock);
+	/* A full pipe already means a wakeup is pending */
+	if (wake && write(wake_pipe[1], "", 1) < 0) {}
+}
+
+static struct work_item* take_all(int *stop) {
+	struct work_item *items;
+
+	pthread_mutex_lock(&queue_lock);
+	items = queue_head;
+	queue_head = queue_tail = NULL;
+	*stop = stopping;
+	pthread_mutex_unlock(&queue_lock);
+	return items;
+}
+
+static int queue_empty(void) {
+	int empty;
+	pthread_mutex_lock(&queue_lock);
+	empty = queue_head == NULL;
+	pthread_mutex_unlock(&queue_lock);
+	return empty;
+}
+
+static void enqueue_entry(struct journal *j, size_t slot) {
+	struct work_item *item = (struct work_item *) pool_get(&item_pool);
+	if (item == NULL)
+		return;
+	item->journal = j;
+	item->slot = slot;
+	if (PROBE_ENABLED(dequeue))
+		item->queued_at = probe_now();
+	PROBE2(enqueue, slot, __sync_add_and_fetch(&uncommitted, 1));
+	enqueue(item, 1);
+}
+
+
+/*
+ **
+ **
+ ** Worker thread
+ **
+ **
+ */
+
+static void commit_entry(struct work_item *item, int final) {
+	/* Takes the snapshot for one journal entry. Failed entries are retried
+	 * later, unless this is the last pass before exiting, in which case they
+	 * stay in the journal for the next analyzer to adopt
+	 */
+	const struct journal_entry *entry = &item->journal->entries[item->slot];
+	struct error_event event = entry->event;
+	struct trace_span span;
+	struct repo_context *ctx;
+	int result;
+	uint32_t attempts;
+	uint64_t started = PROBE_ENABLED(commit) ? probe_now() : 0;
+
+	if (PROBE_ENABLED(dequeue))
+		PROBE2(dequeue, item->slot, item->queued_at != 0 ? probe_now() - item->queued_at : 0);
+	TRACE_BEGIN(&span, "commit_entry");
+	ctx = repo_context_get(entry->git_dir);
+	result = ctx != NULL ? create_error_event(ctx, &event, entry->output, entry->output_len) : -1;
+	TRACE_END(&span);
+	if (PROBE_ENABLED(commit))
+		PROBE2(commit, (uint32_t) result, started != 0 ? probe_now() - started : 0);
+
+	if (result == 0) {
+		journal_complete(item->journal, item->slot, 1);
+		pool_put(&item_pool, item);
+		__sync_fetch_and_sub(&uncommitted, 1);
+		if (observer != NULL)
+			observer(1);
+		return;
+	}
+	attempts = journal_complete(item->journal, item->slot, 0);
+	if (attempts >= MAX_COMMIT_ATTEMPTS) {
+		printf("Giving up on committing an error to %s after %u attempts\n", entry->git_dir, attempts);
+		journal_discard(item->journal, item->slot);
+		pool_put(&item_pool, item);
+		__sync_fetch_and_sub(&uncommitted, 1);
+		if (observer != NULL)
+			observer(0);
+	}
+	else if (final) {
+		pool_put(&item_pool, item);
+		__sync_fetch_and_sub(&uncommitted, 1);
+		if (observer != NULL)
+			observer(0);
+	}
+	else {
+		enqueue(item, 0);
+	}
+}
+
+static void request_stats(int signo) {
+	(void) signo;
+	stats_requested = 1;
+}
+
+static void* worker_main(void *arg) {
+	int watch_fds[MAX_WATCH_FDS];
+	size_t watch_count, i;
+	struct work_item *items, *next;
+	struct timeval retry;
+	fd_set read_set;
+	int max_fd, stop = 0;
+	char drain[64];
+
+	trace_name_thread("commit worker");
+	while (!stop) {
+		/* Sleep until there is work, draining the change trackers' events
+		 * meanwhile so the kernel's inotify queues don't overflow
+		 */
+		FD_ZERO(&read_set);
+		FD_SET(wake_pipe[0], &read_set);
+		max_fd = wake_pipe[0];
+		watch_count = repo_context_watch_fds(watch_fds, MAX_WATCH_FDS);
+		for (i = 0; i < watch_count; i++) {
+			FD_SET(watch_fds[i], &read_set);
+			if (watch_fds[i] > max_fd)
+				max_fd = watch_fds[i];
+		}
+		retry.tv_sec = RETRY_DELAY_SECONDS;
+		retry.tv_usec = 0;
+		if (select(max_fd + 1, &read_set, NULL, NULL, queue_empty() ? NULL : &retry) > 0) {
+			for (i = 0; i < watch_count; i++) {
+				if (FD_ISSET(watch_fds[i], &read_set)) {
+					repo_context_poll_trackers();
+					break;
+				}
+			}
+			if (FD_ISSET(wake_pipe[0], &read_set))
+				while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+		}
+		if (stats_requested) {
+			stats_requested = 0;
+			alloc_stats_print(stderr);
+			governor_print(stderr);
+		}
+		/* Snapshots compete with the build too */
+		governor_adjust_thread();
+
+		for (items = take_all(&stop); items != NULL; items = next) {
+			next = items->next;
+			if (items->git_dir != NULL) {
+				/* Open the repository now so its tracker sees every edit */
+				repo_context_get(items->git_dir);
+				alloc_stats_free(ALLOC_WORKER, items->git_dir);
+				pool_put(&item_pool, items);
+			}
+			else {
+				commit_entry(items, stop);
+			}
+		}
+		/* Out of work: a good moment to write out the spans */
+		trace_flush();
+	}
+
+	/* Folds any session refs and writes everything out */
+	repo_context_free_all();
+	return arg;
+}
+
+
+/*
+ **
+ **
+ ** Main thread API
+ **
+ **
+ */
+
+static struct journal* get_journal(const char *git_dir) {
+	/* Returns this process's journal for <git_dir>, opening it on first use
+	 * and queueing the entries it adopted from analyzers that died
+	 */
+	struct journal_ref *ref;
+	size_t *slots, count, i;
+
+	for (ref = journals; ref != NULL; ref = ref->next)
+		if (strcmp(ref->git_dir, git_dir) == 0)
+			return ref->journal;
+
+	ref = (struct journal_ref *) alloc_stats_calloc(ALLOC_WORKER, 1, sizeof(struct journal_ref));
+	if (ref == NULL)
+		return NULL;
+	ref->journal = journal_open(git_dir);
+	if (ref->journal == NULL) {
+		alloc_stats_free(ALLOC_WORKER, ref);
+		return NULL;
+	}
+	ref->git_dir = alloc_stats_strdup(ALLOC_WORKER, git_dir);
+	ref->next = journals;
+	journals = ref;
+
+	slots = (size_t *) alloc_stats_malloc(ALLOC_WORKER, ref->journal->count * sizeof(size_t));
+	if (slots != NULL) {
+		count = journal_pending(ref->journal, slots, ref->journal->count);
+		for (i = 0; i < count; i++)
+			enqueue_entry(ref->journal, slots[i]);
+		alloc_stats_free(ALLOC_WORKER, slots);
+	}
+	return ref->journal;
+}
+
+int commit_worker_start(void) {
+	struct sigaction action;
+	sigset_t stats_signal;
+
+	/* Sets up libgit2's global state, which it needs once two threads use it */
+	git_libgit2_init();
+	git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t) OBJECT_CACHE_BYTES);
+	git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, PACK_MAP_BYTES);
+	pool_init(&item_pool, ALLOC_WORKER, sizeof(struct work_item), ITEMS_PER_SLAB);
+	if (pipe(wake_pipe) != 0)
+		return -1;
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = request_stats;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+	if (pthread_create(&worker_thread, NULL, worker_main, NULL) != 0)
+		return -1;
+	worker_running = 1;
+	/* Leave SIGUSR1 to the worker, so it interrupts its wait and not a read
+	 * of terminal output
+	 */
+	sigemptyset(&stats_signal);
+	sigaddset(&stats_signal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &stats_signal, NULL);
+	return 0;
+}
+
+int commit_worker_record(const char *git_dir, const struct error_event *event,
+	const char *output, size_t output_len) {
+	struct journal *j = get_journal(git_dir);
+	size_t slot;
+
+	if (j == NULL || journal_append(j, git_dir, event, output, output_len, &slot) != 0)
+		return -1;
+	enqueue_entry(j, slot);
+	return 0;
+}
+
+void commit_worker_observe(void (*fn)(int committed)) {
+	observer = fn;
+}
+
+size_t commit_worker_backlog(void) {
+	return __sync_fetch_and_add(&uncommitted, 0);
+}
+
+void commit_worker_hint(const char *git_dir) {
+	struct work_item *item;
+
+	if (get_journal(git_dir) == NULL)
+		return;
+	item = (struct work_item *) pool_get(&item_pool);
+	if (item == NULL)
+		return;
+	item->git_dir = alloc_stats_strdup(ALLOC_WORKER, git_dir);
+	enqueue(item, 1);
+}
+
+void commit_worker_stop(void) {
+	struct journal_ref *next;
+
+	if (worker_running) {
+		pthread_mutex_lock(&queue_lock);
+		stopping = 1;
+		pthread_mutex_unlock(&queue_lock);
+		if (write(wake_pipe[1], "", 1) < 0) {}
+		pthread_join(worker_thread, NULL);
+		worker_running = 0;
+	}
+	while (journals != NULL) {
+		next = journals->next;
+		journal_close(journals->journal);
+		alloc_stats_free(ALLOC_WORKER, journals->git_dir);
+		alloc_stats_free(ALLOC_WORKER, journals);
+		journals = next;
+	}
+	pool_free(&item_pool);
+	git_libgit2_shutdown();
+}
@@ -0,0 +1,56 @@
+/*
+ * Background thread that turns journaled error events into commits.
+ *
+ * The analyzer's main thread only reads terminal output, detects errors and
+ * appends them to the journal of the repository they belong to (see
+ * journal.h), so detection never waits for git. The worker thread owns every
+ * repository context: it takes the snapshots, drains the change trackers
+ * while idle and marks journal entries done once they are committed.
+ *
+ * Sending the analyzer SIGUSR1 makes the worker print the allocation stats
+ * (see alloc_stats.h) and the load shedding stats (see governor.h) to stderr.
+ * The worker follows the governor's scheduling priority.
+ */
+
+#ifndef COMMIT_WORKER_H
+#define COMMIT_WORKER_H
+
+#include "error_event.h"
+
+/* Starts the worker thread; returns 0 on success. Also caps libgit2's caches,
+ * which would otherwise keep growing for as long as the analyzer runs.
+ */
+int commit_worker_start(void);
+
+/* Journals <event> for the repository at <git_dir>, with the <output_len>
+ * bytes of output leading up to it, and queues its commit.
+ * Returns once the event is in the journal, or -1 if it could not be
+ * journaled. Called from the main thread only.
+ */
+int commit_worker_record(const char *git_dir, const struct error_event *event,
+	const char *output, size_t output_len);
+
+/* Tells the worker the shell is working in the repository at <git_dir>, so it
+ * opens it (and starts tracking changes) ahead of the first error there, and
+ * recovers any errors left in that repository's journals by analyzers that
+ * died. Called from the main thread only.
+ */
+void commit_worker_hint(const char *git_dir);
+
+/* Number of journaled errors not yet committed or given up on; callable from
+ * any thread
+ */
+size_t commit_worker_backlog(void);
+
+/* Has the worker call <observer> each time it is done with a journaled error:
+ * with 1 once it is committed, 0 once it is given up on or left in the journal
+ * at exit. Called before commit_worker_start().
+ */
+void commit_worker_observe(void (*observer)(int committed));
+
+/* Commits everything still queued, stops the worker and closes the journals
+ * and repositories
+ */
+void commit_worker_stop(void);
+
+#endif
@@ -7,10 +7,40 @@
 #include <git2.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "repo_context.h"
+#include "change_tracker.h"
+#include "blob_hasher.h"
+#include "error_event.h"
+#include "errindex.h"
+#include "error_ref.h"
+#include "alloc_stats.h"
+#include "snapshot_tree.h"
+#include "file_capture.h"
+#include "trace.h"
 const char* ERROR_BRANCH_NAME = "_error";
 const char* MASTER_BRANCH_NAME = "master";
 const char* COMMIT_MESSAGE = "Attempting to add files to commit";
+const char* ERROR_REF_NAME = "refs/heads/_error";
+/* Most file contents held in memory at once while hashing a snapshot */
+const size_t SNAPSHOT_HASH_BUDGET = 64 * 1024 * 1024;
+/* Most a snapshot's capture copies where files can't be reflinked */
+static const off_t SNAPSHOT_CAPTURE_COPY_BUDGET = 64 * 1024 * 1024;
+/* Times a snapshot is rebuilt on a new tip when other sessions keep moving the branch */
+const int MAX_REBASE_ATTEMPTS = 10;
+/* A session ref is folded onto _error once it holds this many commits or its
+ * oldest unfolded commit is this many seconds old
+ */
+const size_t SESSION_FOLD_COMMITS = 32;
+const time_t SESSION_FOLD_SECONDS = 60;
+/* Where a snapshot stores the output leading up to its error */
+const char* OUTPUT_LOG_PATH = ".errortracker/output.log";
+/* Files a targeted snapshot picks up from each directory an error refers to */
+const size_t TARGETED_MAX_NEIGHBOURS = 256;
 
 /*
  ** 
@@ -20,6 +50,12 @@ const char* COMMIT_MESSAGE = "Attempting to add files to commit";
  **
  */
 
+/* Private to this file; the header is included by every program that snapshots */
+static void fail(const char *msg, const char *arg);
+static void usage(const char *error, const char *arg);
+static size_t is_prefixed(const char *arg, const char *pfx);
+static uint32_t parse_shared(const char *shared);
+
 static void fail(const char *msg, const char *arg)
 {
 	/* not actually good error handling */
@@ -30,27 +66,40 @@ static void fail(const char *msg, const char *arg)
 	exit(1);
 }
 
-static char* build_commit_message(const char *message, int strip_comments, char comment_char) {
-	// Get a pointer to a git buffer
-	git_buf *output = (git_buf * ) malloc(sizeof(git_buf));
-	output->ptr = NULL;
-	output->size = 0;
-	output->asize = 0;
-
-	const git_error *e;
-
-	int prettify_result = git_message_prettify(output, message, 0, 'a');
-	switch(prettify_result) {
-		case 0:
-			break;
-		default:
-			e = giterr_last();
-			printf("Method 'build_commit_message' failed with error code %d and message %s\n", prettify_result, e->message);
+static char* build_commit_message(struct arena *arena, const char *message, int strip_comments, char comment_char) {
+	/* Returns <message> cleaned up the way git_message_prettify() cleans up
+	 * commit messages, in <arena>, or NULL on failure: trailing whitespace
+	 * is stripped from every line, runs of blank lines become one, leading and
+	 * trailing blank lines go and the message ends in a newline. Done here
+	 * rather than by libgit2 so the message never goes through a git_buf
+	 */
+	size_t used = 0, line_len, blank = 0;
+	const char *line, *end;
+	char *out = (char *) arena_alloc(arena, strlen(message) + 2);
+
+	if (out == NULL)
+		return NULL;
+	for (line = message; *line != '\0'; line = *end == '\n' ? end + 1 : end) {
+		end = strchr(line, '\n');
+		if (end == NULL)
+			end = line + strlen(line);
+		if (strip_comments && line[0] == comment_char)
+			continue;
+		for (line_len = (size_t) (end - line); line_len > 0 && isspace((unsigned char) line[line_len - 1]); line_len--)
+			;
+		if (line_len == 0) {
+			blank = used > 0;
+			continue;
+		}
+		if (blank)
+			out[used++] = '\n';
+		blank = 0;
+		memcpy(out + used, line, line_len);
+		used += line_len;
+		out[used++] = '\n';
 	}
-
-	char *prettified_message = output->ptr;
-	free(output);
-	return prettified_message;
+	out[used] = '\0';
+	return out;
 }
 
 static void usage(const char *error, const char *arg)
@@ -101,60 +150,533 @@ static uint32_t parse_shared(const char *shared)
 git_signature* get_signature(git_repository *repo) {
 	/* Returns git signature for creating commits on the given repo */
 	git_signature *sig;
-	if (git_signature_default(&sig, repo) < 0)
-		fail("Unable to create a commit signature.",
-			 "Perhaps 'user.name' and 'user.email' are not set");
+	if (git_signature_default(&sig, repo) < 0) {
+		printf("Unable to create a commit signature. Perhaps 'user.name' and 'user.email' are not set\n");
+		return NULL;
+	}
+	return sig;
+}
+
+git_signature* get_commit_signature(struct repo_context *ctx) {
+	/* Returns a signature for a commit made right now on the repo behind <ctx>.
+	 * The name and email come from the context's cached signature, so the config
+	 * is only read again when it changes; the caller frees the result. Returns
+	 * NULL if no signature can be made.
+	 */
+	git_signature *sig;
+	if (ctx->signature == NULL) {
+		printf("Unable to create a commit signature. Perhaps 'user.name' and 'user.email' are not set\n");
+		return NULL;
+	}
+	if (git_signature_now(&sig, ctx->signature->name, ctx->signature->email) < 0) {
+		printf("Unable to create a commit signature.\n");
+		return NULL;
+	}
 	return sig;
 }
 
 
-git_tree* get_working_dir(git_repository *repo) {
+struct path_list {
+	char **paths;
+	size_t count;
+	size_t cap;
+	/* Where the list and its paths live if not on the heap; nothing in it is
+	 * freed then, as the arena is reset as a whole
+	 */
+	struct arena *arena;
+};
+
+static void path_list_add(struct path_list *list, const char *path) {
+	size_t cap = list->cap ? list->cap * 2 : 256;
+	char **grown;
+	char *copy;
+
+	if (list->count == list->cap) {
+		if (list->arena != NULL) {
+			grown = (char **) arena_alloc(list->arena, cap * sizeof(char *));
+			if (grown != NULL && list->count > 0)
+				memcpy(grown, list->paths, list->count * sizeof(char *));
+		}
+		else {
+			grown = (char **) alloc_stats_realloc(ALLOC_SNAPSHOT, list->paths, cap * sizeof(char *));
+		}
+		if (grown == NULL)
+			return;
+		list->paths = grown;
+		list->cap = cap;
+	}
+	copy = list->arena != NULL ? arena_strdup(list->arena, path) : alloc_stats_strdup(ALLOC_SNAPSHOT, path);
+	if (copy != NULL)
+		list->paths[list->count++] = copy;
+}
+
+static int compare_path_ptrs(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int prune_directory(git_repository *repo, git_index *index_obj, const char *dir,
+	const struct path_list *seen, struct path_list *unseen);
+
+static int stat_matches_entry(struct repo_context *ctx, const git_index_entry *entry, const struct stat *st) {
+	/* Returns 1 if the file described by <st> is known to still have the
+	 * contents recorded in <entry>, so it doesn't need to be hashed again
+	 */
+	if (entry == NULL)
+		return 0;
+	if ((uint32_t) st->st_size != entry->file_size ||
+		(uint32_t) st->st_ino != entry->ino ||
+		st->st_mtim.tv_sec != entry->mtime.seconds ||
+		st->st_mtim.tv_nsec != entry->mtime.nanoseconds ||
+		st->st_ctim.tv_sec != entry->ctime.seconds ||
+		st->st_ctim.tv_nsec != entry->ctime.nanoseconds)
+		return 0;
+	if (S_ISLNK(st->st_mode) != (entry->mode == GIT_FILEMODE_LINK))
+		return 0;
+	/* A file modified in the same instant the index was written may have
+	 * changed again without its stat data changing ("racy git")
+	 */
+	if (!ctx->index_stamp.exists ||
+		entry->mtime.seconds > ctx->index_stamp.mtime.tv_sec ||
+		(entry->mtime.seconds == ctx->index_stamp.mtime.tv_sec &&
+		 entry->mtime.nanoseconds >= ctx->index_stamp.mtime.tv_nsec))
+		return 0;
+	return 1;
+}
+
+static int update_index_path(struct repo_context *ctx, git_index *index_obj, const char *path, struct blob_job *job) {
+	/* Brings the index entry for the single working-directory <path> in line
+	 * with what is on disk. Returns 1 if the file's contents have to be hashed,
+	 * in which case <job> is filled in, 0 if the index is already up to date
+	 * and a libgit2 error code otherwise.
+	 */
+	git_repository *repo = ctx->repo;
+	const git_index_entry *entry;
+	git_filter_list *filters = NULL;
+	char abs[4096];
+	struct stat st;
+	int ignored = 0;
+
+	snprintf(abs, sizeof(abs), "%s%s", git_repository_workdir(repo), path);
+	if (lstat(abs, &st) != 0 || path_filter_excluded(ctx->filter, path, S_ISDIR(st.st_mode))) {
+		/* Deleted, moved away or excluded by .errortrackerignore; if it was a
+		 * directory, so is everything under it
+		 */
+		git_index_remove_bypath(index_obj, path);
+		return git_index_remove_directory(index_obj, path, 0);
+	}
+	/* Files inside a directory are reported on their own; only entries for
+	 * files that disappeared along with an older directory need dropping
+	 */
+	if (S_ISDIR(st.st_mode))
+		return prune_directory(repo, index_obj, path, NULL, NULL);
+	if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+		return 0;
+
+	/* Events such as a touch or a rewrite with identical contents leave
+	 * nothing to do if the stat data still matches the index
+	 */
+	entry = git_index_get_bypath(index_obj, path, 0);
+	if (stat_matches_entry(ctx, entry, &st))
+		return 0;
+
+	/* Match add_all: ignored files are only picked up if already tracked */
+	if (entry == NULL && git_ignore_path_is_ignored(&ignored, repo, path) == 0 && ignored)
+		return 0;
+
+	job->path = path;
+	job->st = st;
+	/* Core dumps, datasets and the like are recorded, but not stored */
+	job->stub = S_ISREG(st.st_mode) && st.st_size > ctx->max_file_size;
+	/* Hashing the raw bytes of a file with filters (autocrlf, eol, ident)
+	 * would give a different blob than git add does, and every such file
+	 * would show as modified. Only those take libgit2's slower path.
+	 */
+	if (S_ISREG(st.st_mode) && !job->stub &&
+		git_filter_list_load(&filters, repo, NULL, path, GIT_FILTER_TO_ODB, 0) == 0 && filters != NULL) {
+		job->filtered = 1;
+		git_filter_list_free(filters);
+	}
+	return 1;
+}
+
+static int update_paths(struct repo_context *ctx, git_index *index_obj, char **paths, size_t count,
+	int capture_files) {
+	/* Updates the index entries for the sorted working-directory <paths>. Files
+	 * whose contents need hashing are collected first and, when there are
+	 * enough of them, hashed and written on a thread pool; the results are
+	 * then added to the index in path order so snapshots are reproducible.
+	 * <capture_files> is set for change sets, which are small enough to
+	 * capture first; a full rescan reads the working tree directly
+	 */
+	struct blob_job *jobs = (struct blob_job *) alloc_stats_calloc(ALLOC_SNAPSHOT, count ? count : 1, sizeof(struct blob_job));
+	struct file_capture *capture = NULL;
+	git_index_entry entry;
+	struct timespec start, end;
+	char abs[4096];
+	size_t i, to_hash = 0;
+	int result = 0, path_result;
+
+	if (jobs == NULL)
+		return -1;
+	for (i = 0; i < count; i++) {
+		path_result = update_index_path(ctx, index_obj, paths[i], &jobs[to_hash]);
+		if (path_result == 1)
+			to_hash++;
+		else if (path_result < 0)
+			result = path_result;
+	}
+
+	// Capture the files first, so the working tree only has to hold still for
+	// as long as cloning them takes rather than for the whole hashing phase.
+	// Files that can't be captured are read from the working tree as before
+	if (capture_files && ctx->capture_files && to_hash > 0)
+		capture = file_capture_begin(git_repository_path(ctx->repo), SNAPSHOT_CAPTURE_COPY_BUDGET);
+	if (capture != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < to_hash; i++) {
+			if (jobs[i].filtered)
+				continue;
+			snprintf(abs, sizeof(abs), "%s%s", git_repository_workdir(ctx->repo), jobs[i].path);
+			jobs[i].source = file_capture_add(capture, abs, &jobs[i].st, jobs[i].stub);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("Captured %zu files (%zu cloned, %zu copied) in %.2f ms\n", capture->count,
+			capture->cloned, capture->copied,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	}
+
+	printf("Hashing %zu of %zu changed paths\n", to_hash, count);
+	hash_blobs(ctx->mempack != NULL ? ctx->loose_odb : ctx->odb, ctx->mempack,
+		git_repository_workdir(ctx->repo), jobs, to_hash,
+		to_hash >= BLOB_HASHER_MIN_PARALLEL ? 0 : 1, SNAPSHOT_HASH_BUDGET);
+	file_capture_end(capture);
+
+	for (i = 0; i < to_hash; i++) {
+		if (jobs[i].filtered || (jobs[i].error != 0 && !jobs[i].stub)) {
+			/* libgit2 applies the path's filters; it also has another go
+			 * at a file that changed while it was read
+			 */
+			path_result = git_index_add_bypath(index_obj, jobs[i].path);
+		}
+		else if (jobs[i].error != 0) {
+			path_result = jobs[i].error;
+		}
+		else {
+			blob_job_index_entry(&entry, &jobs[i]);
+			path_result = git_index_add(index_obj, &entry);
+		}
+		if (path_result < 0)
+			result = path_result;
+	}
+	alloc_stats_free(ALLOC_SNAPSHOT, jobs);
+	return result;
+}
+
+static void walk_working_dir(struct repo_context *ctx, const char *dir, struct path_list *out) {
+	/* Collects every file under <dir> (relative to the working directory),
+	 * skipping .git, ignored or excluded directories and nested repositories
+	 */
+	git_repository *repo = ctx->repo;
+	const char *workdir = git_repository_workdir(repo);
+	char abs[4096], child[4096];
+	struct dirent *dirent;
+	struct stat st;
+	int ignored;
+	DIR *d;
+
+	snprintf(abs, sizeof(abs), "%s%s", workdir, dir);
+	d = opendir(abs);
+	if (d == NULL)
+		return;
+	while ((dirent = readdir(d)) != NULL) {
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..") ||
+			!strcmp(dirent->d_name, ".git"))
+			continue;
+		snprintf(child, sizeof(child), "%s%s%s", dir, dir[0] ? "/" : "", dirent->d_name);
+		snprintf(abs, sizeof(abs), "%s%s", workdir, child);
+		if (lstat(abs, &st) != 0)
+			continue;
+		if (path_filter_excluded(ctx->filter, child, S_ISDIR(st.st_mode)))
+			continue;
+		if (!S_ISDIR(st.st_mode)) {
+			path_list_add(out, child);
+			continue;
+		}
+		strcat(abs, "/.git");
+		if (lstat(abs, &st) == 0)
+			continue;
+		strcat(child, "/");
+		ignored = 0;
+		if (git_ignore_path_is_ignored(&ignored, repo, child) == 0 && ignored)
+			continue;
+		child[strlen(child) - 1] = '\0';
+		walk_working_dir(ctx, child, out);
+	}
+	closedir(d);
+}
+
+static int prune_directory(git_repository *repo, git_index *index_obj, const char *dir,
+	const struct path_list *seen, struct path_list *unseen) {
+	/* Drops index entries under <dir> ("" for the whole tree) whose files no
+	 * longer exist. If <seen> is given, entries whose files exist but aren't
+	 * in it (tracked files inside ignored directories) are added to <unseen>.
+	 * Walks the index backwards so removals don't shift the entries still to
+	 * be visited
+	 */
+	const char *workdir = git_repository_workdir(repo);
+	size_t dir_len = strlen(dir);
+	size_t i = git_index_entrycount(index_obj);
+	char abs[4096], path[4096];
+	const char *key;
+	struct stat st;
+
+	while (i-- > 0) {
+		const git_index_entry *entry = git_index_get_byindex(index_obj, i);
+		if (dir_len > 0 && (strncmp(entry->path, dir, dir_len) != 0 || entry->path[dir_len] != '/'))
+			continue;
+		snprintf(abs, sizeof(abs), "%s%s", workdir, entry->path);
+		if (lstat(abs, &st) == 0) {
+			key = entry->path;
+			if (seen != NULL && bsearch(&key, seen->paths, seen->count, sizeof(char *), compare_path_ptrs) == NULL)
+				path_list_add(unseen, entry->path);
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s", entry->path);
+		git_index_remove_bypath(index_obj, path);
+	}
+	return 0;
+}
+
+static int scan_working_dir(struct repo_context *ctx, git_index *index_obj) {
+	/* Brings the whole index in line with the working directory: adds every
+	 * non-ignored file and drops entries whose files were deleted
+	 */
+	struct path_list files = {NULL, 0, 0, NULL};
+	struct path_list unseen = {NULL, 0, 0, NULL};
+	size_t i;
+	int result;
+
+	walk_working_dir(ctx, "", &files);
+	qsort(files.paths, files.count, sizeof(char *), compare_path_ptrs);
+	prune_directory(ctx->repo, index_obj, "", &files, &unseen);
+	for (i = 0; i < unseen.count; i++)
+		path_list_add(&files, unseen.paths[i]);
+	qsort(files.paths, files.count, sizeof(char *), compare_path_ptrs);
+
+	result = update_paths(ctx, index_obj, files.paths, files.count, 0);
+
+	for (i = 0; i < files.count; i++)
+		alloc_stats_free(ALLOC_SNAPSHOT, files.paths[i]);
+	for (i = 0; i < unseen.count; i++)
+		alloc_stats_free(ALLOC_SNAPSHOT, unseen.paths[i]);
+	alloc_stats_free(ALLOC_SNAPSHOT, files.paths);
+	alloc_stats_free(ALLOC_SNAPSHOT, unseen.paths);
+	return result;
+}
+
+static int target_path(struct repo_context *ctx, const char *location, char *out, size_t size) {
+	/* Turns a path as an error wrote it into one relative to the working
+	 * directory. Fails for paths outside it or that don't name a file
+	 */
+	const char *workdir = git_repository_workdir(ctx->repo);
+	size_t workdir_len = strlen(workdir);
+	char abs[4096];
+	struct stat st;
+
+	if (location[0] == '/') {
+		if (strncmp(location, workdir, workdir_len) != 0)
+			return -1;
+		location += workdir_len;
+	}
+	while (location[0] == '.' && location[1] == '/')
+		location += 2;
+	/* Index paths are normalized */
+	if (location[0] == '\0' || strstr(location, "/./") != NULL || strstr(location, "..") != NULL)
+		return -1;
+	snprintf(abs, sizeof(abs), "%s%s", workdir, location);
+	if (lstat(abs, &st) != 0 || S_ISDIR(st.st_mode))
+		return -1;
+	snprintf(out, size, "%s", location);
+	return 0;
+}
+
+static void add_neighbours(struct repo_context *ctx, const char *path, struct path_list *out) {
+	/* Adds the files next to <path>: headers, generated sources and configs an
+	 * error in a file usually involves. Subdirectories aren't descended into
+	 */
+	const char *workdir = git_repository_workdir(ctx->repo);
+	const char *slash = strrchr(path, '/');
+	int dir_len = slash != NULL ? (int) (slash - path) : 0;
+	char abs[4096], child[4096];
+	struct dirent *dirent;
+	struct stat st;
+	size_t added = 0;
+	DIR *d;
+
+	snprintf(abs, sizeof(abs), "%s%.*s", workdir, dir_len, path);
+	d = opendir(abs);
+	if (d == NULL)
+		return;
+	while ((dirent = readdir(d)) != NULL && added < TARGETED_MAX_NEIGHBOURS) {
+		if (dirent->d_name[0] == '.' && (!strcmp(dirent->d_name, ".") ||
+			!strcmp(dirent->d_name, "..") || !strcmp(dirent->d_name, ".git")))
+			continue;
+		snprintf(child, sizeof(child), "%.*s%s%s", dir_len, path, dir_len ? "/" : "", dirent->d_name);
+		snprintf(abs, sizeof(abs), "%s%s", workdir, child);
+		if (lstat(abs, &st) != 0 || S_ISDIR(st.st_mode) || path_filter_excluded(ctx->filter, child, 0))
+			continue;
+		path_list_add(out, child);
+		added++;
+	}
+	closedir(d);
+}
+
+static size_t targeted_paths(struct repo_context *ctx, const struct error_location *targets,
+	size_t target_count, struct path_list *out) {
+	/* Collects what a targeted snapshot looks at: the files the error refers
+	 * to, the rest of their directories and whatever the tracker saw change.
+	 * Returns how many of the targets were found in the working directory
+	 */
+	char path[4096], **dirty = NULL;
+	size_t i, j, found = 0, dirty_count = 0;
+
+	for (i = 0; i < target_count; i++) {
+		if (target_path(ctx, targets[i].path, path, sizeof(path)) != 0)
+			continue;
+		found++;
+		path_list_add(out, path);
+		add_neighbours(ctx, path, out);
+	}
+	if (found == 0)
+		return 0;
+	if (ctx->tracker != NULL) {
+		dirty_count = change_tracker_take(ctx->tracker, &dirty);
+		for (i = 0; i < dirty_count; i++)
+			path_list_add(out, dirty[i]);
+		change_tracker_free_paths(dirty, dirty_count);
+	}
+
+	/* Files in the same directory are found once per target in it */
+	qsort(out->paths, out->count, sizeof(char *), compare_path_ptrs);
+	for (i = 0, j = 0; i < out->count; i++) {
+		if (j > 0 && strcmp(out->paths[j - 1], out->paths[i]) == 0) {
+			if (out->arena == NULL)
+				alloc_stats_free(ALLOC_SNAPSHOT, out->paths[i]);
+		}
+		else {
+			out->paths[j++] = out->paths[i];
+		}
+	}
+	out->count = j;
+	return found;
+}
+
+git_tree* get_working_dir(struct repo_context *ctx, const struct error_location *targets, size_t target_count) {
 	/* 
 	 * Returns a git_tree object containing the contents of the working directory 
-	 * (of the current branch) of the provided repo
+	 * (of the current branch) of the provided repo. Given the locations an
+	 * error refers to, and with targeted snapshots enabled, only the files
+	 * around them and the tracker's dirty set are brought up to date
 	 */	
-	git_index* index_obj;
+	git_repository *repo = ctx->repo;
+	git_index* index_obj = NULL;
 	git_tree *tree_obj = NULL;
-	git_oid *tree_oid = (git_oid *) malloc(sizeof(git_oid));
+	git_oid tree_oid;
+	char **changed = NULL;
+	size_t changed_count = 0;
+	struct path_list targeted = {NULL, 0, 0, &ctx->arena};
+	struct trace_span span;
 	const git_error *e;
-	// Load current repo's index into the index_obj variable
 
+	// Re-running a failing command without touching anything gives the same
+	// tree as last time. When the tracker is sure nothing changed (it hasn't
+	// lost events and nothing is dirty), reuse it without loading the index.
+	// Ignored files, such as the build outputs a failing command rewrites,
+	// never make it into the dirty set
+	ctx->snapshot_reused = 0;
+	TRACE_BEGIN(&span, "tracker_poll");
+	if (ctx->tracker != NULL)
+		change_tracker_poll(ctx->tracker);
+	TRACE_END(&span);
+	if (ctx->tracker != NULL && !ctx->tracker->needs_rescan && ctx->tracker->dirty_count == 0 &&
+		ctx->has_snapshot_tree && git_tree_lookup(&tree_obj, repo, &ctx->snapshot_tree) == 0) {
+		printf("Working directory unchanged since the last snapshot\n");
+		ctx->snapshot_reused = 1;
+		return tree_obj;
+	}
+	// Load current repo's index into the index_obj variable. This is the error
+	// tracker's private index (see repo_context.h), not the user's .git/index
+
+	TRACE_BEGIN(&span, "index_load");
 	int error = git_repository_index(&index_obj, repo);
+	TRACE_END(&span);
 	switch(error) {
 		case 0:
 			printf("Successfully loaded/created index object\n");
 			break;
 		default:
-			e = giterr_last();
-			printf("Error %d/%d: %s\n", error, e->klass, e->message);		
+			e = git_error_last();
+			printf("Error %d/%d: %s\n", error, e ? e->klass : 0, e ? e->message : "unknown error");
+			return NULL;
 	}	
 
-	// See http://git.kaarsemaker.net/libgit2/blob/5173ea921d4ccbbe7d61ddce9a0920c2e1c82035/tests-clar/index/addall.c
-	// Add files to index
-	
-	git_strarray paths = {NULL, 0};
-	char* strs[1];
-	strs[0] = "*";
-	paths.strings = strs;
-	paths.count   = 1;
-
-	int add_result = git_index_add_all(index_obj, &paths, 0, NULL, NULL);
-	// int add_result = git_index_read(index_obj, 1);
+	// Add files to index. The index persists between snapshots, so once it has
+	// been synced with the whole working directory only the paths the change
+	// tracker saw since the last snapshot need to be looked at again
+	int add_result;
+	TRACE_BEGIN(&span, "index_add");
+	if (ctx->targeted_snapshots && target_count > 0 &&
+		targeted_paths(ctx, targets, target_count, &targeted) > 0) {
+		// Everything else keeps whatever the index last recorded for it, which
+		// is nothing for files no snapshot has seen yet. A rescan the tracker
+		// asked for is left to the next full snapshot
+		printf("Targeted snapshot of %zu paths\n", targeted.count);
+		changed = targeted.paths;
+		changed_count = targeted.count;
+		add_result = update_paths(ctx, index_obj, changed, changed_count, 1);
+	}
+	else if (ctx->tracker == NULL || ctx->tracker->needs_rescan) {
+		if (ctx->tracker != NULL)
+			change_tracker_rescanned(ctx->tracker);
+		add_result = scan_working_dir(ctx, index_obj);
+	}
+	else {
+		// Only the paths the tracker saw change
+		changed_count = change_tracker_take(ctx->tracker, &changed);
+		add_result = update_paths(ctx, index_obj, changed, changed_count, 1);
+	}
+	TRACE_END(&span);
 
 	switch(add_result) {
 		case 0:
 			printf("Successfully added working directory files to index object\n");
 			break;
 		default:
-			e = giterr_last();
-			printf("Error %d/%d: %s\n", error, e->klass, e->message);
+			e = git_error_last();
+			printf("Error %d/%d: %s\n", add_result, e ? e->klass : 0, e ? e->message : "unknown error");
+			// The index may be partially updated; resync everything next time
+			if (ctx->tracker != NULL)
+				ctx->tracker->needs_rescan = 1;
 		}
 	
 
-	// Write index to tree
-
-	
-	int tree_conversion = git_index_write_tree(tree_oid, index_obj);
+	// Write index to tree. When only tracked paths changed since the last
+	// snapshot, its tree is updated along those paths; otherwise the whole
+	// tree is written from the index
+	int tree_conversion = -1;
+	TRACE_BEGIN(&span, "write_tree");
+	if (changed != NULL && add_result == 0 && ctx->has_snapshot_tree)
+		tree_conversion = snapshot_tree_update(repo, index_obj, &ctx->snapshot_tree,
+			changed, changed_count, &tree_oid);
+	if (tree_conversion != 0)
+		tree_conversion = git_index_write_tree(&tree_oid, index_obj);
+	TRACE_END(&span);
+	// Targeted paths live in the snapshot's arena
+	if (targeted.paths == NULL)
+		change_tracker_free_paths(changed, changed_count);
+	ctx->has_snapshot_tree = tree_conversion == 0;
+	if (ctx->has_snapshot_tree)
+		git_oid_cpy(&ctx->snapshot_tree, &tree_oid);
 	printf("Done attemping to write to tree\n");
 	switch(tree_conversion) {
 		case 0:
@@ -170,18 +692,16 @@ git_tree* get_working_dir(git_repository *repo) {
 
 	// Look up the tree object using tree_oid 
 	printf("About to lookup tree\n");
-	int tree_lookup = git_tree_lookup(&tree_obj, repo, tree_oid);
+	int tree_lookup = git_tree_lookup(&tree_obj, repo, &tree_oid);
 
 	switch(tree_lookup) {
 		case 0:
 			printf("Successfully looked-up tree\n");
 			break;
 		default:
-			e = giterr_last();
-			printf("Error %d/%d: %s\n", tree_lookup, e->klass, e->message);		
+			e = git_error_last();
+			printf("Error %d/%d: %s\n", tree_lookup, e ? e->klass : 0, e ? e->message : "unknown error");
 	}
-	// Free tree oid
-	free(tree_oid);
 	return tree_obj;
 }
 
@@ -204,8 +724,14 @@ git_reference* _create_branch(git_repository *repo, const char* name, git_commit
 	git_reference* output_reference;
 	// Set force to 1 to overwrite existing branch with same name in the case of a collision
 	int force = 0;
-	git_signature *signature = get_signature(repo);
-	git_branch_create(&output_reference, repo, name, target, force, signature, message);
+	char ref_name[256];
+
+	/* git_branch_create writes a reflog message of its own; creating the ref
+	 * directly keeps <message>. The reflog identity comes from the config.
+	 */
+	snprintf(ref_name, sizeof(ref_name), "refs/heads/%s", name);
+	if (git_reference_create(&output_reference, repo, ref_name, git_commit_id(target), force, message) != 0)
+		output_reference = NULL;
 	return output_reference;
 }
 
@@ -220,35 +746,34 @@ git_reference* create_branch(git_repository *repo, const char* name, const char*
 
 	/* Pointer for storing a reference to the target branch */
 	git_reference* target_reference;
-	/* Pointer for storing a reference to the HEAD commit of the target branch */
-	git_reference* target_branch_head_reference;
 	/* Pointer for storing the actual HEAD commit object of the target branch */
 	git_commit* target;
-	/* Pointer to the oid of the HEAD commit of the target branch */
-	const git_oid* target_oid;
+	/* The branch created, if any */
+	git_reference* created = NULL;
 
 	/* Load a reference to the target branch into the target_reference pointer */
 	switch(git_branch_lookup(&target_reference, repo, target_branch_name, GIT_BRANCH_LOCAL)) {
 		case GIT_ENOTFOUND:
 			printf("Failed to find branch with name %s\n", target_branch_name);
 			break;
-		default:
-			/* Get the HEAD commit of the branch referenced by target_reference. This loads a 
-			 * git_reference object (that we still need to convert into a git_commit object) into
-			 * the target_branch_head_reference pointer
-			 */
-			git_repository_head(&target_branch_head_reference, repo);		
-			/* Look up the actual HEAD commit object from the target branch using the oid contained
-			 * in the target_branch_head_reference object - we get this using the git_reference_target
+		case 0:
+			/* Look up the HEAD commit object of the target branch using the oid the
+			 * branch reference points at - we get this using the git_reference_target
 			 * API method
 			 */
-			target_oid = git_reference_target(target_branch_head_reference);
-			git_commit_lookup(&target, repo, target_oid);		
-			/* Use _create_branch helper function to 
-			 * create a branch based off the HEAD commit of the target branch
-			 */
-			_create_branch(repo, name, target, message);			 
+			if (git_commit_lookup(&target, repo, git_reference_target(target_reference)) == 0) {
+				/* Use _create_branch helper function to 
+				 * create a branch based off the HEAD commit of the target branch
+				 */
+				created = _create_branch(repo, name, target, message);
+				git_commit_free(target);
+			}
+			git_reference_free(target_reference);
+			break;
+		default:
+			break;
 	}
+	return created;
 }
 
 
@@ -261,19 +786,25 @@ git_reference* create_branch(git_repository *repo, const char* name, const char*
  */
 
 
-int _create_commit(git_repository *repo, git_tree *tree_obj, const char *message, char *branch_name, const git_commit *parents[], size_t parent_count) {
+int _create_commit(struct repo_context *ctx, git_tree *tree_obj, const char *message, char *branch_name, const git_commit *parents[], size_t parent_count) {
 
 
-	/* Helper function for creating a commit on the repository represented by <repo> */
+	/* Helper function for creating a commit on the repository represented by <ctx> */
 	printf("DEBUG: In _create_commit\n");
 
 	// Get commit signature
-	git_signature *signature = get_signature(repo);
+	git_repository *repo = ctx->repo;
+	git_signature *signature = get_commit_signature(ctx);
+	if (signature == NULL)
+		return -1;
 	// Set author and committer signatures to the commit signature
 	git_signature *author = signature;
 	git_signature *committer = signature;
-	git_oid *commit_oid = (git_oid *) malloc(sizeof(git_oid));
+	git_oid commit_oid, expected_oid, rebased_oid;
+	const git_oid *expected = NULL;
 	const git_error *e;
+	struct trace_span span;
+	int attempt;
 
 	// ------------------------------------------- TEMP debug stuff so that parent count is set to 0 -----------------------------------       //
 	// parent_count = 0;
@@ -281,35 +812,79 @@ int _create_commit(git_repository *repo, git_tree *tree_obj, const char *message
 
 	printf("DEBUG: _create_commit: Ready to call git_commit_create with %zu parents \n", parent_count);
 	
-	int commit_result = git_commit_create(commit_oid, repo, branch_name, author, committer,
+	// Create the commit without moving any ref yet: until the staged objects are
+	// flushed to a packfile the commit only exists in memory
+	TRACE_BEGIN(&span, "commit_create");
+	int commit_result = git_commit_create(&commit_oid, repo, NULL, author, committer,
 		NULL, message, tree_obj, parent_count, parents);
+	TRACE_END(&span);
+	TRACE_BEGIN(&span, "flush_objects");
+	if (commit_result == 0)
+		commit_result = repo_context_flush_objects(ctx);
+	TRACE_END(&span);
+
+	// Move the branch, but only if it still points at the commit we built on. A
+	// session's first commit is built on _error but creates the session ref
+	if (parent_count > 0) {
+		git_oid_cpy(&expected_oid, git_commit_id(parents[0]));
+		expected = &expected_oid;
+	}
+	if (branch_name != NULL && ctx->session_ref != NULL && strcmp(branch_name, ctx->session_ref) == 0)
+		expected = ctx->has_session_tip ? &ctx->session_tip : NULL;
+
+	for (attempt = 0; commit_result == 0 && branch_name != NULL; attempt++) {
+		TRACE_BEGIN(&span, "ref_swap");
+		commit_result = error_ref_swap(repo, branch_name, &commit_oid, expected, "errortracker: snapshot");
+		TRACE_END(&span);
+		if (commit_result != GIT_EMODIFIED || attempt + 1 >= MAX_REBASE_ATTEMPTS)
+			break;
 
+		// Another session got there first: rebuild the snapshot on its commit
+		printf("DEBUG - _create_commit: %s moved, rebasing\n", branch_name);
+		if ((commit_result = git_reference_name_to_id(&expected_oid, repo, branch_name)) != 0)
+			break;
+		expected = &expected_oid;
+		TRACE_BEGIN(&span, "rebase");
+		commit_result = error_ref_replay(repo, &commit_oid, expected, &rebased_oid);
+		TRACE_END(&span);
+		if (commit_result == 0)
+			commit_result = repo_context_flush_objects(ctx);
+		git_oid_cpy(&commit_oid, &rebased_oid);
+	}
 
 	switch(commit_result) {
 		case 0:
 			printf("DEBUG - _create_commit: Successfully created commit\n");
+			// Keep the cached tips in step with the ref we just moved
+			if (branch_name != NULL && strcmp(branch_name, ERROR_REF_NAME) == 0)
+				repo_context_set_error_tip(ctx, &commit_oid);
+			else if (branch_name != NULL && ctx->session_ref != NULL && strcmp(branch_name, ctx->session_ref) == 0) {
+				git_oid_cpy(&ctx->session_tip, &commit_oid);
+				ctx->has_session_tip = 1;
+			}
 			break;
 		default:
-			e = giterr_last();
-			printf("_create_commit failed with error %d/%d: %s\n", commit_result, e->klass, e->message);		
+			e = git_error_last();
+			printf("_create_commit failed with error %d/%d: %s\n", commit_result,
+				e ? e->klass : 0, e ? e->message : "unknown error");
 	}
 
-	free(commit_oid);
+	git_signature_free(signature);
 	return commit_result;
 
 }
 
 
-int create_commit(git_repository *repo, char *branch_name, const git_commit *parents[], git_tree *tree_obj, const char *message) {
+int create_commit(struct repo_context *ctx, char *branch_name, const git_commit *parents[],
+	size_t parent_count, git_tree *tree_obj, const char *message) {
 
 	/* Creates a commit on the given repo using the provided index object and
 	 * the provided message
 	 */
 
-	size_t parent_count = sizeof(parents) / sizeof(git_commit*);
-	int result = _create_commit(repo, tree_obj, message, branch_name, parents, parent_count);
+	int result = _create_commit(ctx, tree_obj, message, branch_name, parents, parent_count);
 	if(result != 0) {
-		fail("create_commit failed", NULL);
+		printf("create_commit failed\n");
 	}	
 	else {
 		printf("create_commit succeeded\n");
@@ -327,28 +902,24 @@ int create_commit(git_repository *repo, char *branch_name, const git_commit *par
  **
  */
 
-git_reference* get_error_branch(git_repository *repo)
+const git_oid* get_error_tip(struct repo_context *ctx)
 {
-	/* Returns a reference object representing the _error branch in repo
-	 * represented by the provided *repo argument
-	 */	
-	git_reference* out = NULL;
-	/* Find the _error branch used to track runtime errors */
-	switch(git_branch_lookup(&out, repo, ERROR_BRANCH_NAME, GIT_BRANCH_LOCAL)) {
-		/* If the branch doesn't exist, create it */
-		case GIT_ENOTFOUND:
-			printf("Could not find branch with name %s, creating it now...\n", ERROR_BRANCH_NAME);
-			out = create_branch(repo, ERROR_BRANCH_NAME, MASTER_BRANCH_NAME, "Creating error branch dawg\n");
-			printf("Done.\n");
-			break;
-		/* If an 'invalid spec' error occurred, print the error and exit the program without doing other stuff */
-		case GIT_EINVALIDSPEC:
-			printf("Invalid spec error, see https://libgit2.github.com/libgit2/#HEAD/group/branch/git_branch_lookup\n");
-			break;
-		default:
-			printf("Successfully acquired error branch\n");
-	}
-	return out;
+	/* Returns the oid of the head commit of the _error branch in the repo
+	 * represented by <ctx>, creating the branch if it doesn't exist yet
+	 */
+	git_reference* created;
+	if (ctx->has_error_tip)
+		return &ctx->error_tip;
+
+	/* The _error branch used to track runtime errors doesn't exist, create it */
+	printf("Could not find branch with name %s, creating it now...\n", ERROR_BRANCH_NAME);
+	created = create_branch(ctx->repo, ERROR_BRANCH_NAME, MASTER_BRANCH_NAME, "Creating error branch dawg\n");
+	if (created == NULL)
+		return NULL;
+	repo_context_set_error_tip(ctx, git_reference_target(created));
+	git_reference_free(created);
+	printf("Done.\n");
+	return &ctx->error_tip;
 }
 
 git_reference* master_branch(git_repository *repo) {
@@ -360,39 +931,120 @@ git_reference* master_branch(git_repository *repo) {
 	return out;	
 }
 
-git_repository* current_repo() {
-	git_repository* out;
-	char* path = ".git";
-	switch(git_repository_open(&out, path)) {
-		case GIT_ENOTFOUND:
-			printf("Failed to open git repository at current directory - run git init to make sure one exists\n");
-			break;
-		default:
-			printf("Successfully acquired current repo\n");
-	}
+struct repo_context* current_repo() {
+	/* Returns the long-lived context for the repository enclosing the current
+	 * directory; the repository is only opened the first time this is called
+	 */
+	struct repo_context* out = repo_context_for_dir(".");
+	if (out == NULL)
+		printf("Failed to open git repository at current directory - run git init to make sure one exists\n");
 	return out;
 }
 
 
 
-int create_error_branch_commit(git_repository *repo, const char *message) {
+static char* session_commit_message(struct arena *arena, const char *message, const char *session) {
+	/* Adds the Error-Session trailer to <message>, joining the Error-* trailers
+	 * of an error event if it ends with them; the result is in <arena>
+	 */
+	size_t len = strlen(message);
+	int has_trailers = strstr(message, "\nError-Fingerprint: ") != NULL && len > 0 && message[len - 1] == '\n';
+	size_t size = len + strlen(session) + 32;
+	char *out = (char *) arena_alloc(arena, size);
+
+	if (out != NULL)
+		snprintf(out, size, "%s%s%s%s\n", message, has_trailers ? "" : "\n\n",
+			ERROR_REF_SESSION_TRAILER, session);
+	return out;
+}
+
+static char* delay_commit_message(struct arena *arena, const char *message, int64_t detected) {
+	/* Adds the Error-Snapshot-Delay trailer to <message>: how many seconds
+	 * after the error was detected at <detected> its files were read. The
+	 * snapshot is taken by the commit worker, so files written again in the
+	 * meantime are recorded as they are now rather than as they were then.
+	 * The result is in <arena>
+	 */
+	size_t len = strlen(message), size = len + 64;
+	int64_t delay = (int64_t) time(NULL) - detected;
+	char *out = (char *) arena_alloc(arena, size);
+
+	// A message cut short to fit doesn't end in a newline
+	if (out != NULL)
+		snprintf(out, size, "%s%sError-Snapshot-Delay: %" PRId64 "\n", message,
+			len > 0 && message[len - 1] == '\n' ? "" : "\n", delay > 0 ? delay : 0);
+	return out;
+}
+
+static git_tree* add_output_log(struct repo_context *ctx, git_tree *tree, const char *output, size_t output_len) {
+	/* Returns <tree> with the output stored at OUTPUT_LOG_PATH, freeing <tree>,
+	 * or <tree> itself if that fails. Blobs are addressed by their contents,
+	 * so the same output is only ever stored once
+	 */
+	git_oid blob, with_output;
+	git_tree *out;
+
+	if (git_blob_create_from_buffer(&blob, ctx->repo, output, output_len) != 0 ||
+		snapshot_tree_add_file(ctx->repo, git_tree_id(tree), OUTPUT_LOG_PATH, &blob, &with_output) != 0 ||
+		git_tree_lookup(&out, ctx->repo, &with_output) != 0) {
+		printf("Failed to add the command's output to the snapshot\n");
+		return tree;
+	}
+	git_tree_free(tree);
+	return out;
+}
+
+static int commit_snapshot(struct repo_context *ctx, const char *message, int64_t detected,
+	const struct error_location *targets, size_t target_count, const char *output, size_t output_len) {
 	/* Creates a commit on the _error branch of the given repository using the current
-	 * working directory of the master branch
+	 * working directory of the master branch. With session refs enabled the commit
+	 * goes to this session's ref instead and reaches _error when the session is folded.
+	 * <detected> is when the error was detected, if it came from an error event, and
+	 * 0 otherwise. <targets> are the locations the error refers to, for targeted
+	 * snapshots, and <output> is the output leading up to it, if any
 	 */	
+	git_repository *repo = ctx->repo;
+	struct trace_span whole, span;
+	char *delayed_message;
 
+	TRACE_BEGIN(&whole, "commit_snapshot");
+	// Whatever the last snapshot left in the arena is no longer referenced
+	arena_reset(&ctx->arena);
+	// Commits left on the session ref from when session refs were enabled
+	if (!ctx->use_session_ref && ctx->has_session_tip)
+		error_ref_fold_session(ctx, ctx->session_ref);
 
 	printf("DEBUG - create_error_branch_commit: Getting working tree from repo\n");
 	git_tree *working_tree;
-	working_tree = get_working_dir(repo);
+	TRACE_BEGIN(&span, "get_working_dir");
+	working_tree = get_working_dir(ctx, targets, target_count);
+	TRACE_END(&span);
+	// The message's trailers end it, so the delay joins them
+	if (detected != 0 && (delayed_message = delay_commit_message(&ctx->arena, message, detected)) != NULL)
+		message = delayed_message;
+	// Only the commit gets the output; the context keeps the working directory's
+	// own tree for the next snapshot to build on
+	TRACE_BEGIN(&span, "add_output_log");
+	if (working_tree != NULL && output_len > 0)
+		working_tree = add_output_log(ctx, working_tree, output, output_len);
+	TRACE_END(&span);
 	printf("DEBUG - create_error_branch_commit: Got working tree from repo\n");
 
-	// Get a reference to the head commit of the error branch and look up its oid
-	// Branches are just named references to commits, so looking up the error_branch
-	// reference should give us a reference to its head
-	const git_reference* error_branch_reference = get_error_branch(repo);
-	const git_oid* error_branch_oid = git_reference_target(error_branch_reference);
+	// Get the oid of the head commit of the error branch. The context caches it
+	// and only re-reads the ref when it changes on disk
+	const git_oid* error_branch_oid = get_error_tip(ctx);
+	if(error_branch_oid == NULL) {
+		printf("create_error_branch_commit failed to find or create the error branch\n");
+		git_tree_free(working_tree);
+		TRACE_END(&whole);
+		return GIT_ENOTFOUND;
+	}
 	printf("DEBUG - create_error_branch_commit: Got error branch\n");
 
+	// A session builds on its own last commit
+	if (ctx->use_session_ref && ctx->has_session_tip)
+		error_branch_oid = &ctx->session_tip;
+
 	// Initialize a commit object to store the error branch's head commit (the parent of the
 	// commit we're about to create)
 	git_commit* parent_commit;
@@ -400,7 +1052,10 @@ int create_error_branch_commit(git_repository *repo, const char *message) {
 	int commit_lookup_result = git_commit_lookup(&parent_commit, repo, error_branch_oid);
 
 	if(commit_lookup_result != 0) {
-		fail("create_error_branch_commit failed at commit_lookup_result", NULL);
+		printf("create_error_branch_commit failed at commit_lookup_result\n");
+		git_tree_free(working_tree);
+		TRACE_END(&whole);
+		return commit_lookup_result;
 	}	
 	else {
 		printf("DEBUG - create_error_branch_commit: Looked up error branch head commit\n");
@@ -411,24 +1066,86 @@ int create_error_branch_commit(git_repository *repo, const char *message) {
 
 	// Create our commit
 	int error_branch_commit_create_result;
-	char* ref = "refs/heads/_error";
-	char *prettified_message = build_commit_message(message, 0, 'a');
-
-	error_branch_commit_create_result = create_commit(repo, ref, parents, working_tree, message);
+	char* ref = ctx->use_session_ref ? ctx->session_ref : (char *) ERROR_REF_NAME;
+	char *prettified_message = build_commit_message(&ctx->arena, message, 0, '#');
+	if (prettified_message != NULL)
+		message = prettified_message;
+	char *session_message = ctx->use_session_ref ?
+		session_commit_message(&ctx->arena, message, error_ref_session_name()) : NULL;
+
+	TRACE_BEGIN(&span, "create_commit");
+	error_branch_commit_create_result = create_commit(ctx, ref, parents, 1, working_tree,
+		session_message ? session_message : message);
+	TRACE_END(&span);
 	if(error_branch_commit_create_result != 0) {
-		fail("create_error_branch_commit failed at create_commit", NULL);
+		printf("create_error_branch_commit failed at create_commit\n");
 	}	
 	else {
 		printf("DEBUG - create_error_branch_commit: succeeded with result %d\n", error_branch_commit_create_result);
+
+		// Save the index so its stat data lets the next snapshot skip unchanged files.
+		// This waits until the commit's objects are in a packfile, so the index never
+		// refers to blobs that only ever existed in memory. A reused tree left it as is
+		TRACE_BEGIN(&span, "write_index");
+		if (!ctx->snapshot_reused && repo_context_write_index(ctx) != 0) {
+			const git_error *e = git_error_last();
+			printf("Failed to write the error tracker's index: %s\n", e ? e->message : "unknown error");
+		}
+		TRACE_END(&span);
+	}
+
+	// Fold the session onto _error once enough has piled up on it
+	if (error_branch_commit_create_result == 0 && ctx->use_session_ref) {
+		if (ctx->session_pending++ == 0)
+			ctx->session_started = time(NULL);
+		if (ctx->session_pending >= SESSION_FOLD_COMMITS ||
+			time(NULL) - ctx->session_started >= SESSION_FOLD_SECONDS) {
+			TRACE_BEGIN(&span, "fold_session");
+			error_ref_fold_session(ctx, ctx->session_ref);
+			TRACE_END(&span);
+		}
 	}
 
 	git_commit_free(parent_commit);
 	git_tree_free(working_tree);
 	printf("Done freeing stuff\n");
+	TRACE_END(&whole);
 	return error_branch_commit_create_result;
 }
 
+int create_error_branch_commit(struct repo_context *ctx, const char *message) {
+	return commit_snapshot(ctx, message, 0, NULL, 0, NULL, 0);
+}
+
 int create_error(const char *message) {
-	git_repository *repo = current_repo();
-	create_error_branch_commit(repo, message);
-}
\ No newline at end of file
+	struct repo_context *ctx = current_repo();
+	if (ctx == NULL)
+		return -1;
+	return create_error_branch_commit(ctx, message);
+}
+
+int create_error_event(struct repo_context *ctx, const struct error_event *event,
+	const char *output, size_t output_len) {
+	/* Records <event> on the _error branch of the repository behind <ctx>, with
+	 * trailers describing it in the commit message and the <output_len> bytes of
+	 * output leading up to it in .errortracker/output.log, and adds it to the error
+	 * index so it can be queried without walking the branch. Commits on a
+	 * session ref are indexed when the session is folded. The snapshot is of
+	 * the files as they are now; an Error-Snapshot-Delay trailer says how long
+	 * after the error that was.
+	 */
+	char message[ERROR_EVENT_MAX_COMMIT_MESSAGE];
+	struct error_location locations[ERROR_EVENT_MAX_LOCATIONS];
+	size_t location_count = error_event_locations(event, locations, ERROR_EVENT_MAX_LOCATIONS);
+	int result, on_session = ctx->use_session_ref;
+	struct trace_span span;
+
+	error_event_commit_message(event, message, sizeof(message));
+	result = commit_snapshot(ctx, message, event->when, locations, location_count, output, output_len);
+	TRACE_BEGIN(&span, "errindex_append");
+	if (result == 0 && !on_session &&
+		errindex_append(git_repository_path(ctx->repo), event, &ctx->error_tip) != 0)
+		printf("Failed to add the error to the error index\n");
+	TRACE_END(&span);
+	return result;
+}
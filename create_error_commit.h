@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "repo_context.h"
+#include "error_event.h"
 static const char* ERROR_BRANCH_NAME = "_error";
 static const char* MASTER_BRANCH_NAME = "master";
 static const char* COMMIT_MESSAGE = "Attempting to add files to commit";
@@ -22,12 +24,9 @@ static const char* COMMIT_MESSAGE = "Attempting to add files to commit";
  **
  */
 
-static void fail(const char *msg, const char *arg);
-static void usage(const char *error, const char *arg);
-static size_t is_prefixed(const char *arg, const char *pfx);
-static uint32_t parse_shared(const char *shared);
 git_signature* get_signature(git_repository *repo);
-git_tree* get_working_dir(git_repository *repo);
+git_signature* get_commit_signature(struct repo_context *ctx);
+git_tree* get_working_dir(struct repo_context *ctx, const struct error_location *targets, size_t target_count);
 
 
 
@@ -52,11 +51,11 @@ git_reference* create_branch(git_repository *repo, const char* name, const char*
  */
 
 
-int _create_commit(git_repository *repo, git_tree *tree_obj, const char *message,
+int _create_commit(struct repo_context *ctx, git_tree *tree_obj, const char *message,
  char *branch_name, const git_commit *parents[], size_t parent_count);
 
-int create_commit(git_repository *repo, char *branch_name, const git_commit *parents[],
- git_tree *tree_obj, const char *message);
+int create_commit(struct repo_context *ctx, char *branch_name, const git_commit *parents[],
+ size_t parent_count, git_tree *tree_obj, const char *message);
 
 
 /*
@@ -68,8 +67,10 @@ int create_commit(git_repository *repo, char *branch_name, const git_commit *par
  **
  */
 
-git_reference* get_error_branch(git_repository *repo);
+const git_oid* get_error_tip(struct repo_context *ctx);
 git_reference* master_branch(git_repository *repo);
-git_repository* current_repo();
-int create_error_branch_commit(git_repository *repo, const char *message);
-int create_error(const char *message);
\ No newline at end of file
+struct repo_context* current_repo();
+int create_error_branch_commit(struct repo_context *ctx, const char *message);
+int create_error(const char *message);
+int create_error_event(struct repo_context *ctx, const struct error_event *event,
+	const char *output, size_t output_len);
\ No newline at end of file
@@ -0,0 +1,520 @@
+/*
+ * Append-only error index with sorted, mmap'd segments. See errindex.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "errindex.h"
+
+static const char* INDEX_DIR_NAME = "errortracker/errindex";
+static const char* PRIVATE_DIR_NAME = "errortracker";
+static const char* SEGMENT_MAGIC = "ETIX";
+static const uint32_t SEGMENT_VERSION = 1;
+/* The log is folded into a new segment once it holds this many records */
+static const size_t LOG_FLUSH_RECORDS = 4096;
+
+struct segment_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+};
+
+struct record_list {
+	struct errindex_record *records;
+	size_t count;
+	size_t cap;
+};
+
+static int record_list_add(struct record_list *list, const struct errindex_record *record) {
+	struct errindex_record *grown;
+	if (list->count == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		grown = (struct errindex_record *) realloc(list->records, list->cap * sizeof(*grown));
+		if (grown == NULL)
+			return -1;
+		list->records = grown;
+	}
+	list->records[list->count++] = *record;
+	return 0;
+}
+
+static int compare_by_fingerprint(const void *a, const void *b) {
+	const struct errindex_record *x = (const struct errindex_record *) a;
+	const struct errindex_record *y = (const struct errindex_record *) b;
+	if (x->fingerprint != y->fingerprint)
+		return x->fingerprint < y->fingerprint ? -1 : 1;
+	if (x->when != y->when)
+		return x->when < y->when ? -1 : 1;
+	return memcmp(x->commit, y->commit, sizeof(x->commit));
+}
+
+static int compare_by_time(const void *a, const void *b) {
+	const struct errindex_record *x = (const struct errindex_record *) a;
+	const struct errindex_record *y = (const struct errindex_record *) b;
+	if (x->when != y->when)
+		return x->when < y->when ? -1 : 1;
+	return compare_by_fingerprint(a, b);
+}
+
+static int record_matches(const struct errindex_record *record, const struct errindex_query *query) {
+	if (query->has_fingerprint && record->fingerprint != query->fingerprint)
+		return 0;
+	if (query->has_rule && record->rule != query->rule)
+		return 0;
+	if (query->has_command && record->command_hash != query->command_hash)
+		return 0;
+	if (query->since && record->when < query->since)
+		return 0;
+	if (query->until && record->when > query->until)
+		return 0;
+	return 1;
+}
+
+
+/*
+ **
+ **
+ ** Files and locking
+ **
+ **
+ */
+
+static void index_file(char *out, size_t size, const char *git_dir, const char *name) {
+	/* git_repository_path always ends in a '/' */
+	snprintf(out, size, "%s%s%s%s", git_dir, INDEX_DIR_NAME, name ? "/" : "", name ? name : "");
+}
+
+static int lock_index(const char *git_dir, int operation) {
+	/* Returns a descriptor holding the index lock, to be close()d to release
+	 * it, or -1 (with errno EWOULDBLOCK if LOCK_NB was given and the lock is
+	 * taken)
+	 */
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", git_dir, PRIVATE_DIR_NAME);
+	mkdir(path, 0755);
+	index_file(path, sizeof(path), git_dir, NULL);
+	mkdir(path, 0755);
+	index_file(path, sizeof(path), git_dir, "lock");
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, operation) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int read_log(const char *git_dir, struct record_list *out) {
+	/* Appends the records in the log to <out>. A torn record at the end, left
+	 * by an appender that died mid-write, is ignored
+	 */
+	struct errindex_record record;
+	char path[4096];
+	ssize_t n;
+	int fd;
+
+	index_file(path, sizeof(path), git_dir, "log");
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	while ((n = read(fd, &record, sizeof(record))) == (ssize_t) sizeof(record)) {
+		if (record_list_add(out, &record) != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static int compare_gens(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static size_t list_segments(const char *git_dir, uint64_t **out) {
+	/* Returns the generations of the existing segments, in ascending order */
+	char path[4096], *end;
+	uint64_t *gens = NULL, *grown;
+	size_t count = 0, cap = 0;
+	struct dirent *dirent;
+	uint64_t gen;
+	DIR *d;
+
+	index_file(path, sizeof(path), git_dir, NULL);
+	d = opendir(path);
+	if (d != NULL) {
+		while ((dirent = readdir(d)) != NULL) {
+			if (strncmp(dirent->d_name, "seg-", 4) != 0)
+				continue;
+			gen = strtoull(dirent->d_name + 4, &end, 16);
+			if (*end != '\0')
+				continue;
+			if (count == cap) {
+				cap = cap ? cap * 2 : 8;
+				grown = (uint64_t *) realloc(gens, cap * sizeof(uint64_t));
+				if (grown == NULL)
+					break;
+				gens = grown;
+			}
+			gens[count++] = gen;
+		}
+		closedir(d);
+	}
+	if (count > 1)
+		qsort(gens, count, sizeof(uint64_t), compare_gens);
+	*out = gens;
+	return count;
+}
+
+static void segment_file(char *out, size_t size, const char *git_dir, uint64_t gen) {
+	char name[32];
+	snprintf(name, sizeof(name), "seg-%016llx", (unsigned long long) gen);
+	index_file(out, size, git_dir, name);
+}
+
+static const struct errindex_record* map_segment(const char *git_dir, uint64_t gen, size_t *count,
+	void **map, size_t *map_size) {
+	/* Maps segment <gen> read-only and returns its records, or NULL if it is
+	 * missing or damaged. The caller munmap()s <map>.
+	 */
+	const struct segment_header *header;
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	segment_file(path, sizeof(path), git_dir, gen);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct segment_header)) {
+		close(fd);
+		return NULL;
+	}
+	*map_size = (size_t) st.st_size;
+	*map = mmap(NULL, *map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED)
+		return NULL;
+
+	header = (const struct segment_header *) *map;
+	if (memcmp(header->magic, SEGMENT_MAGIC, 4) != 0 || header->version != SEGMENT_VERSION ||
+		header->count != (*map_size - sizeof(*header)) / sizeof(struct errindex_record)) {
+		fprintf(stderr, "errindex: ignoring damaged segment %s\n", path);
+		munmap(*map, *map_size);
+		return NULL;
+	}
+	*count = (size_t) header->count;
+	return (const struct errindex_record *) (header + 1);
+}
+
+static int write_segment(const char *git_dir, uint64_t gen, struct errindex_record *records, size_t count) {
+	/* Sorts <records> and writes them as segment <gen>, atomically */
+	struct segment_header header;
+	char path[4096], tmp[4200];
+	FILE *f;
+	int ok;
+
+	qsort(records, count, sizeof(*records), compare_by_fingerprint);
+	memcpy(header.magic, SEGMENT_MAGIC, 4);
+	header.version = SEGMENT_VERSION;
+	header.count = count;
+
+	segment_file(path, sizeof(path), git_dir, gen);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (f == NULL)
+		return -1;
+	ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		(count == 0 || fwrite(records, sizeof(*records), count, f) == count);
+	ok = fflush(f) == 0 && ok;
+	ok = fsync(fileno(f)) == 0 && ok;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_segments(const char *git_dir, const uint64_t *gens, size_t count, struct record_list *out) {
+	const struct errindex_record *records;
+	size_t i, j, n, map_size;
+	void *map;
+
+	for (i = 0; i < count; i++) {
+		records = map_segment(git_dir, gens[i], &n, &map, &map_size);
+		if (records == NULL)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (record_list_add(out, &records[j]) != 0) {
+				munmap(map, map_size);
+				return -1;
+			}
+		}
+		munmap(map, map_size);
+	}
+	return 0;
+}
+
+static int replace_all(const char *git_dir, struct record_list *records, const uint64_t *old_gens,
+	size_t old_count, int drop_log) {
+	/* With the lock held exclusively: writes <records> as one new segment,
+	 * then deletes the segments in <old_gens> and, if <drop_log>, the log.
+	 * The new segment is renamed into place before anything is deleted, so a
+	 * crash in between leaves duplicates, never gaps; errindex_find drops
+	 * the duplicates and the next compaction removes them.
+	 */
+	char path[4096];
+	uint64_t gen = old_count ? old_gens[old_count - 1] + 1 : 1;
+	uint64_t *all;
+	size_t all_count, i;
+
+	/* Segments written by the log flush since <old_gens> was listed */
+	all_count = list_segments(git_dir, &all);
+	if (all_count > 0 && all[all_count - 1] >= gen)
+		gen = all[all_count - 1] + 1;
+	free(all);
+
+	if (write_segment(git_dir, gen, records->records, records->count) != 0)
+		return -1;
+	if (drop_log) {
+		index_file(path, sizeof(path), git_dir, "log");
+		unlink(path);
+	}
+	for (i = 0; i < old_count; i++) {
+		segment_file(path, sizeof(path), git_dir, old_gens[i]);
+		unlink(path);
+	}
+	return 0;
+}
+
+static void flush_log(const char *git_dir) {
+	/* Folds the log into a new segment, unless another process holds the
+	 * lock, in which case a later append will do it
+	 */
+	struct record_list log = {NULL, 0, 0};
+	int lock = lock_index(git_dir, LOCK_EX | LOCK_NB);
+
+	if (lock < 0)
+		return;
+	if (read_log(git_dir, &log) == 0 && log.count >= LOG_FLUSH_RECORDS)
+		replace_all(git_dir, &log, NULL, 0, 1);
+	free(log.records);
+	close(lock);
+}
+
+
+/*
+ **
+ **
+ ** Public API
+ **
+ **
+ */
+
+int errindex_append(const char *git_dir, const struct error_event *event, const git_oid *commit) {
+	struct errindex_record record;
+	char path[4096];
+	struct stat st;
+	int lock, fd, full = 0;
+	ssize_t written;
+
+	memset(&record, 0, sizeof(record));
+	record.fingerprint = event->fingerprint;
+	record.when = event->when;
+	record.command_hash = error_command_hash(event->command);
+	record.rule = event->rule;
+	memcpy(record.commit, commit->id, sizeof(record.commit));
+
+	lock = lock_index(git_dir, LOCK_SH);
+	if (lock < 0)
+		return -1;
+	/* O_APPEND writes of one record are atomic with respect to each other,
+	 * so concurrent analyzers only need the shared lock
+	 */
+	index_file(path, sizeof(path), git_dir, "log");
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		close(lock);
+		return -1;
+	}
+	written = write(fd, &record, sizeof(record));
+	if (fstat(fd, &st) == 0)
+		full = (size_t) st.st_size >= LOG_FLUSH_RECORDS * sizeof(record);
+	close(fd);
+	close(lock);
+
+	if (full)
+		flush_log(git_dir);
+	return written == (ssize_t) sizeof(record) ? 0 : -1;
+}
+
+int errindex_find(const char *git_dir, const struct errindex_query *query,
+	struct errindex_record **out, size_t *count) {
+	struct record_list found = {NULL, 0, 0};
+	struct record_list log = {NULL, 0, 0};
+	const struct errindex_record *records;
+	size_t segment_count, i, j, n, lo, hi, mid, map_size;
+	uint64_t *gens;
+	void *map;
+	int lock, result = 0;
+
+	lock = lock_index(git_dir, LOCK_SH);
+	if (lock < 0)
+		return -1;
+
+	segment_count = list_segments(git_dir, &gens);
+	for (i = 0; i < segment_count && result == 0; i++) {
+		records = map_segment(git_dir, gens[i], &n, &map, &map_size);
+		if (records == NULL)
+			continue;
+		lo = 0;
+		hi = n;
+		if (query->has_fingerprint) {
+			/* Segments are sorted by fingerprint: binary search for the first
+			 * record with it and stop at the first one without
+			 */
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (records[mid].fingerprint < query->fingerprint)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			hi = n;
+		}
+		for (j = lo; j < hi; j++) {
+			if (query->has_fingerprint && records[j].fingerprint != query->fingerprint)
+				break;
+			if (record_matches(&records[j], query) && record_list_add(&found, &records[j]) != 0)
+				result = -1;
+		}
+		munmap(map, map_size);
+	}
+	free(gens);
+
+	if (result == 0 && read_log(git_dir, &log) == 0) {
+		for (j = 0; j < log.count && result == 0; j++)
+			if (record_matches(&log.records[j], query))
+				result = record_list_add(&found, &log.records[j]);
+	}
+	free(log.records);
+	close(lock);
+
+	if (result != 0) {
+		free(found.records);
+		return -1;
+	}
+
+	/* Sort by time and drop records left in two files by an interrupted
+	 * compaction
+	 */
+	qsort(found.records, found.count, sizeof(*found.records), compare_by_time);
+	for (i = 0, n = 0; i < found.count; i++)
+		if (n == 0 || compare_by_time(&found.records[n - 1], &found.records[i]) != 0)
+			found.records[n++] = found.records[i];
+
+	*out = found.records;
+	*count = n;
+	return 0;
+}
+
+int errindex_compact(const char *git_dir) {
+	struct record_list all = {NULL, 0, 0};
+	uint64_t *gens;
+	size_t count;
+	int lock, result;
+
+	lock = lock_index(git_dir, LOCK_EX);
+	if (lock < 0)
+		return -1;
+	count = list_segments(git_dir, &gens);
+	result = read_segments(git_dir, gens, count, &all);
+	if (result == 0)
+		result = read_log(git_dir, &all);
+	if (result == 0 && (count > 1 || all.count > 0))
+		result = replace_all(git_dir, &all, gens, count, 1);
+	free(gens);
+	free(all.records);
+	close(lock);
+	return result;
+}
+
+int errindex_rebuild(git_repository *repo, const char *ref_name, const char *hide_ref_name) {
+	const char *git_dir = git_repository_path(repo);
+	struct record_list all = {NULL, 0, 0};
+	struct record_list log = {NULL, 0, 0};
+	struct errindex_record record;
+	struct error_event event;
+	int64_t newest = 0;
+	git_revwalk *walk;
+	git_commit *commit;
+	git_oid id, hide;
+	uint64_t *gens;
+	size_t count;
+	int lock, result;
+
+	if ((result = git_revwalk_new(&walk, repo)) != 0)
+		return result;
+	git_revwalk_simplify_first_parent(walk);
+	if ((result = git_revwalk_push_ref(walk, ref_name)) != 0) {
+		git_revwalk_free(walk);
+		return result;
+	}
+	if (hide_ref_name != NULL && git_reference_name_to_id(&hide, repo, hide_ref_name) == 0)
+		git_revwalk_hide(walk, &hide);
+
+	while (result == 0 && git_revwalk_next(&id, walk) == 0) {
+		if (git_commit_lookup(&commit, repo, &id) != 0)
+			continue;
+		/* Snapshots from before the trailers existed can't be indexed */
+		if (error_event_parse_trailers(git_commit_message(commit), &event) == 0) {
+			memset(&record, 0, sizeof(record));
+			record.fingerprint = event.fingerprint;
+			record.when = event.when ? event.when : (int64_t) git_commit_time(commit);
+			record.command_hash = error_command_hash(event.command);
+			record.rule = event.rule;
+			memcpy(record.commit, id.id, sizeof(record.commit));
+			if (record.when > newest)
+				newest = record.when;
+			result = record_list_add(&all, &record);
+		}
+		git_commit_free(commit);
+	}
+	git_revwalk_free(walk);
+
+	if (result == 0) {
+		lock = lock_index(git_dir, LOCK_EX);
+		if (lock < 0) {
+			result = -1;
+		}
+		else {
+			/* Keep errors an analyzer appended after the walk saw the tip */
+			if (read_log(git_dir, &log) == 0) {
+				for (count = 0; count < log.count && result == 0; count++)
+					if (log.records[count].when > newest)
+						result = record_list_add(&all, &log.records[count]);
+			}
+			count = list_segments(git_dir, &gens);
+			if (result == 0)
+				result = replace_all(git_dir, &all, gens, count, 1);
+			free(gens);
+			free(log.records);
+			close(lock);
+		}
+	}
+	free(all.records);
+	return result;
+}
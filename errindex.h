@@ -0,0 +1,67 @@
+/*
+ * Sidecar index of the errors recorded on the _error branch.
+ *
+ * Answering "when did this error first show up?" from the branch itself means
+ * walking every snapshot and parsing its message. The error index keeps one
+ * fixed-size record per error commit in .git/errortracker/errindex/ instead:
+ *
+ *   log          records appended by the analyzer, in arrival order
+ *   seg-<gen>    immutable segments, sorted by fingerprint and then time,
+ *                which queries mmap and binary search
+ *   lock         flock()ed shared by appenders and readers, exclusively
+ *                while the log is folded into a segment
+ *
+ * The index is derived data: errindex_rebuild() recreates it from the Error-*
+ * trailers of the commits on the branch.
+ */
+
+#ifndef ERRINDEX_H
+#define ERRINDEX_H
+
+#include <stdint.h>
+#include <git2.h>
+#include "error_event.h"
+
+/* On-disk record, 64 bytes in host byte order; the index is a local cache */
+struct errindex_record {
+	uint64_t fingerprint;
+	int64_t when;
+	uint64_t command_hash;
+	uint32_t rule;
+	unsigned char commit[20];
+	unsigned char reserved[16];
+};
+
+/* Which records a query selects; unset fields match everything */
+struct errindex_query {
+	int has_fingerprint;
+	uint64_t fingerprint;
+	int has_rule;
+	uint32_t rule;
+	int has_command;
+	uint64_t command_hash;
+	int64_t since;            /* 0 for no lower bound */
+	int64_t until;            /* 0 for no upper bound */
+};
+
+/* Records that <event> was committed as <commit> in the repository whose git
+ * directory is <git_dir>. Returns 0 on success and -1 on failure.
+ */
+int errindex_append(const char *git_dir, const struct error_event *event, const git_oid *commit);
+
+/* Finds every record matching <query>, sorted by time, oldest first. On
+ * success returns 0 and stores a malloc()ed array in <out> (NULL if nothing
+ * matched) and its length in <count>; returns -1 on failure.
+ */
+int errindex_find(const char *git_dir, const struct errindex_query *query,
+	struct errindex_record **out, size_t *count);
+
+/* Merges the log and every segment into a single segment */
+int errindex_compact(const char *git_dir);
+
+/* Throws the index away and recreates it from the commits on <ref_name>,
+ * stopping at history shared with <hide_ref_name> (may be NULL)
+ */
+int errindex_rebuild(git_repository *repo, const char *ref_name, const char *hide_ref_name);
+
+#endif
@@ -0,0 +1,637 @@
+/*
+ * Error detection in terminal output. See error_detect.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <pcre.h>
+#include "error_detect.h"
+#include "pattern_syntax.h"
+#include "probes.h"
+#include "trace.h"
+
+/* The rules used when there is no rules file, or nothing in it */
+static const char DEFAULT_RULES[] = "exception|error";
+/* Longest rules file read; the rest is ignored */
+#define RULES_MAX_BYTES (64 * 1024)
+/* Most words the prefilter searches for, and the longest one kept */
+#define RULES_MAX_WORDS 64
+#define RULES_MAX_WORD 64
+/* Shortest word worth prefiltering for */
+#define RULES_MIN_WORD 3
+/* How long the rules file has to be left alone before it is reloaded, so an
+ * editor's several writes make one reload
+ */
+static const int RULES_SETTLE_MS = 100;
+/* How often a reload checks whether the scans using the old rules are done */
+static const useconds_t RULES_DRAIN_US = 1000;
+
+struct rule_set {
+  pcre *pattern;
+  pcre_extra *pattern_extra;
+  size_t rule_count;
+  /* What prefilter_error searches for, lowercased */
+  size_t word_count;
+  size_t word_len[RULES_MAX_WORDS];
+  char words[RULES_MAX_WORDS][RULES_MAX_WORD];
+  /* Whether some word starts with a byte, in either case */
+  unsigned char first[256];
+  /* The rules no word could be found for, which prefilter_error still has
+   * to run; NULL if there are none
+   */
+  pcre *fallback;
+  pcre_extra *fallback_extra;
+};
+
+/* The rules scans use. Replaced whole by a reload, never changed in place. */
+static struct rule_set *volatile current_rules = NULL;
+/* Scans in progress, counted by the parity of the epoch they started in. A
+ * reload bumps the epoch after swapping in the new rules, then waits for the
+ * old parity's count to reach 0 before freeing the old rules.
+ */
+static volatile unsigned long rules_epoch = 0;
+static volatile long rules_readers[2] = {0, 0};
+/* Serialises loading and swapping */
+static pthread_mutex_t rules_lock = PTHREAD_MUTEX_INITIALIZER;
+static char rules_path[4096];
+
+static pthread_t watcher;
+static int watching = 0;
+/* Written to to stop the watcher */
+static int stop_pipe[2] = {-1, -1};
+
+
+/*
+ **
+ **
+ ** Rule sets
+ **
+ **
+ */
+
+static void free_rules(struct rule_set *rules) {
+  if (rules == NULL)
+    return;
+  if (rules->pattern_extra != NULL)
+    pcre_free_study(rules->pattern_extra);
+  if (rules->pattern != NULL)
+    pcre_free(rules->pattern);
+  if (rules->fallback_extra != NULL)
+    pcre_free_study(rules->fallback_extra);
+  if (rules->fallback != NULL)
+    pcre_free(rules->fallback);
+  free(rules);
+}
+
+static void add_word(struct rule_set *rules, const char *word, size_t len) {
+  size_t i;
+
+  for (i = 0; i < rules->word_count; i++)
+    if (rules->word_len[i] == len && memcmp(rules->words[i], word, len) == 0)
+      return;
+  memcpy(rules->words[rules->word_count], word, len);
+  rules->word_len[rules->word_count++] = len;
+  rules->first[(unsigned char) tolower((unsigned char) word[0])] = 1;
+  rules->first[(unsigned char) toupper((unsigned char) word[0])] = 1;
+}
+
+static int add_rule_words(struct rule_set *rules, const char *rule) {
+  /* Takes the longest run of plain characters out of each top-level branch
+   * of <rule>, as the word prefilter_error looks for in place of the branch.
+   * Characters inside groups and classes, escapes other than escaped
+   * punctuation and characters a quantifier makes optional are left out, so
+   * the word is in every match of the branch. Returns -1, adding nothing, if
+   * a branch has no such run of RULES_MIN_WORD characters, the rule uses
+   * syntax this doesn't follow (see pattern_syntax.h) or the words don't fit;
+   * the rule is then left to PCRE.
+   */
+  char run[RULES_MAX_WORD], best[RULES_MAX_WORDS][RULES_MAX_WORD];
+  size_t run_len = 0, best_len[RULES_MAX_WORDS], branches = 0, i, n;
+  int depth = 0, literal, optional;
+  const char *p;
+  char c;
+
+  if (pattern_changes_syntax(rule))
+    return -1;
+  best_len[0] = 0;
+  for (p = rule; ; p++) {
+    c = *p;
+    literal = -1;
+    optional = 0;
+    n = 1;
+    if (c == '\\') {
+      if ((n = pattern_escape_length(p, &literal)) == 0)
+        return -1;
+    }
+    else if (c == '[') {
+      if ((n = pattern_class_length(p)) == 0)
+        return -1;
+    }
+    else if (c == '{') {
+      /* A '{' that doesn't start a quantifier is an ordinary character */
+      if ((n = pattern_quantifier_length(p)) == 0) {
+        n = 1;
+        literal = (unsigned char) c;
+      }
+      else {
+        optional = p[1] == '0';
+      }
+    }
+    else if (c == '?' || c == '*') {
+      optional = 1;
+    }
+    else if (c != '\0' && strchr("^$.|+()", c) == NULL) {
+      literal = (unsigned char) c;
+    }
+    p += n - 1;
+
+    /* A quantifier that allows no repeats takes the character before it out
+     * of the run
+     */
+    if (optional && run_len > 0)
+      run_len--;
+    if (literal >= 0 && depth == 0) {
+      if (run_len < RULES_MAX_WORD - 1)
+        run[run_len++] = (char) tolower(literal);
+      continue;
+    }
+
+    if (run_len > best_len[branches]) {
+      memcpy(best[branches], run, run_len);
+      best_len[branches] = run_len;
+    }
+    run_len = 0;
+    if (c == '\0' || (c == '|' && depth == 0)) {
+      if (best_len[branches] < RULES_MIN_WORD)
+        return -1;
+      if (c == '\0')
+        break;
+      if (++branches == RULES_MAX_WORDS)
+        return -1;
+      best_len[branches] = 0;
+    }
+    else if (c == '(')
+      depth++;
+    else if (c == ')' && depth > 0)
+      depth--;
+  }
+  if (rules->word_count + branches + 1 > RULES_MAX_WORDS)
+    return -1;
+  for (i = 0; i <= branches; i++)
+    add_word(rules, best[i], best_len[i]);
+  return 0;
+}
+
+static struct rule_set* compile_rules(const char *text, const char *source) {
+  /* One rule per line; blank lines and ones starting with '#' are skipped.
+   * Each rule is compiled on its own first so a mistake is reported with its
+   * line, then all of them are compiled into one alternation that is matched
+   * in one pass. The rules the prefilter can't find words for are compiled
+   * into a second alternation for it. Returns NULL if a rule doesn't compile.
+   */
+  struct rule_set *rules = (struct rule_set *) calloc(1, sizeof(struct rule_set));
+  const char *line, *end, *pcreErrorStr;
+  char *rule = NULL, *combined = NULL, *fallback = NULL;
+  size_t len, combined_len = 0, fallback_len = 0;
+  int pcreErrorOffset, line_number = 0, captures;
+  pcre *check;
+
+  if (rules == NULL)
+    return NULL;
+  combined = (char *) malloc(strlen(text) * 6 + sizeof(DEFAULT_RULES));
+  fallback = (char *) malloc(strlen(text) * 6 + 1);
+  rule = (char *) malloc(strlen(text) + 1);
+  if (combined == NULL || fallback == NULL || rule == NULL)
+    goto fail;
+
+  for (line = text; *line != '\0'; line = *end ? end + 1 : end) {
+    end = strchr(line, '\n');
+    if (end == NULL)
+      end = line + strlen(line);
+    line_number++;
+    while (line < end && isspace((unsigned char) *line))
+      line++;
+    len = (size_t) (end - line);
+    while (len > 0 && isspace((unsigned char) line[len - 1]))
+      len--;
+    if (len == 0 || line[0] == '#')
+      continue;
+    memcpy(rule, line, len);
+    rule[len] = '\0';
+
+    check = pcre_compile(rule, PCRE_CASELESS, &pcreErrorStr, &pcreErrorOffset, NULL);
+    if (check == NULL) {
+      printf("ERROR: %s:%d: Could not compile '%s': %s\n", source, line_number, rule, pcreErrorStr);
+      goto fail;
+    }
+    /* The rules are run as one pattern, so a rule's groups are numbered
+     * after those of the rules before it
+     */
+    if (pcre_fullinfo(check, NULL, PCRE_INFO_CAPTURECOUNT, &captures) != 0)
+      captures = 0;
+    pcre_free(check);
+    if (pattern_refers_by_number(rule, captures)) {
+      printf("ERROR: %s:%d: '%s' refers to a group by number, which the rules before it would shift; name the group instead\n",
+        source, line_number, rule);
+      goto fail;
+    }
+    if (add_rule_words(rules, rule) != 0)
+      fallback_len += (size_t) sprintf(fallback + fallback_len, "%s(?:%s)",
+        fallback_len > 0 ? "|" : "", rule);
+    combined_len += (size_t) sprintf(combined + combined_len, "%s(?:%s)",
+      rules->rule_count > 0 ? "|" : "", rule);
+    rules->rule_count++;
+  }
+  if (rules->rule_count == 0) {
+    strcpy(combined, DEFAULT_RULES);
+    add_rule_words(rules, DEFAULT_RULES);
+    rules->rule_count = 1;
+  }
+
+  rules->pattern = pcre_compile(combined, PCRE_CASELESS, &pcreErrorStr, &pcreErrorOffset, NULL);
+  if (rules->pattern == NULL) {
+    printf("ERROR: %s: Could not compile the rules: %s\n", source, pcreErrorStr);
+    goto fail;
+  }
+  /* pcre_study() returns NULL both on errors and when there is nothing to
+   * optimise; only pcreErrorStr tells them apart
+   */
+  rules->pattern_extra = pcre_study(rules->pattern, 0, &pcreErrorStr);
+  if (pcreErrorStr != NULL) {
+    printf("ERROR: %s: Could not study the rules: %s\n", source, pcreErrorStr);
+    goto fail;
+  }
+  if (fallback_len > 0) {
+    rules->fallback = pcre_compile(fallback, PCRE_CASELESS, &pcreErrorStr, &pcreErrorOffset, NULL);
+    if (rules->fallback == NULL) {
+      printf("ERROR: %s: Could not compile the rules: %s\n", source, pcreErrorStr);
+      goto fail;
+    }
+    rules->fallback_extra = pcre_study(rules->fallback, 0, &pcreErrorStr);
+  }
+  free(rule);
+  free(combined);
+  free(fallback);
+  return rules;
+
+fail:
+  free(rule);
+  free(combined);
+  free(fallback);
+  free_rules(rules);
+  return NULL;
+}
+
+static void find_rules_path(void) {
+  const char *path = getenv(RULES_ENV), *home;
+
+  if (path != NULL && path[0] != '\0') {
+    snprintf(rules_path, sizeof(rules_path), "%s", path);
+  }
+  else {
+    home = getenv("HOME");
+    snprintf(rules_path, sizeof(rules_path), "%s/%s", home != NULL ? home : "", RULES_FILE);
+  }
+}
+
+static struct rule_set* load_rules(void) {
+  /* The rules in the rules file, or the built-in ones if there isn't one */
+  char *text;
+  ssize_t r;
+  size_t used = 0;
+  int fd = open(rules_path, O_RDONLY | O_CLOEXEC);
+  struct rule_set *rules;
+
+  if (fd < 0) {
+    if (errno != ENOENT)
+      perror(rules_path);
+    return compile_rules(DEFAULT_RULES, "built-in rules");
+  }
+  text = (char *) malloc(RULES_MAX_BYTES + 1);
+  if (text == NULL) {
+    close(fd);
+    return NULL;
+  }
+  while (used < RULES_MAX_BYTES && (r = read(fd, text + used, RULES_MAX_BYTES - used)) != 0) {
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      perror(rules_path);
+      break;
+    }
+    used += (size_t) r;
+  }
+  close(fd);
+  text[used] = '\0';
+  rules = compile_rules(text, rules_path);
+  free(text);
+  return rules;
+}
+
+static void publish_rules(struct rule_set *rules) {
+  /* Swaps in <rules> and frees the ones it replaces once no scan can be
+   * using them. Scans never wait for this; only the caller does. Called with
+   * rules_lock held.
+   */
+  struct rule_set *old = current_rules;
+  unsigned long epoch;
+
+  __sync_synchronize();
+  current_rules = rules;
+  /* A scan that starts after this sees the new epoch and so the new rules */
+  epoch = __sync_fetch_and_add(&rules_epoch, 1);
+  while (rules_readers[epoch & 1] != 0)
+    usleep(RULES_DRAIN_US);
+  free_rules(old);
+}
+
+static void init_rules(void) {
+  /* Loads the rules on first use; a broken rules file falls back on the
+   * built-in rules
+   */
+  struct rule_set *rules;
+
+  pthread_mutex_lock(&rules_lock);
+  if (current_rules == NULL) {
+    find_rules_path();
+    rules = load_rules();
+    if (rules == NULL)
+      rules = compile_rules(DEFAULT_RULES, "built-in rules");
+    if (rules == NULL)
+      exit(1);
+    publish_rules(rules);
+  }
+  pthread_mutex_unlock(&rules_lock);
+}
+
+static struct rule_set* pin_rules(unsigned long *epoch) {
+  /* Returns the current rules, which stay valid until unpin_rules(<epoch>).
+   * Costs two atomic adds and never blocks on a reload.
+   */
+  unsigned long e;
+
+  if (current_rules == NULL)
+    init_rules();
+  for (;;) {
+    e = rules_epoch;
+    __sync_fetch_and_add(&rules_readers[e & 1], 1);
+    /* If a reload bumped the epoch in between, it may not have seen this
+     * scan; count it under the new epoch instead
+     */
+    if (rules_epoch == e)
+      break;
+    __sync_fetch_and_sub(&rules_readers[e & 1], 1);
+  }
+  *epoch = e;
+  return current_rules;
+}
+
+static void unpin_rules(unsigned long epoch) {
+  __sync_fetch_and_sub(&rules_readers[epoch & 1], 1);
+}
+
+
+/*
+ **
+ **
+ ** Watching the rules file
+ **
+ **
+ */
+
+static int names_rules_file(const char *events, ssize_t len, const char *base) {
+  /* Whether any of the inotify events in <events> are about <base> */
+  const struct inotify_event *event;
+  const char *p;
+  int found = 0;
+
+  for (p = events; p < events + len; p += sizeof(struct inotify_event) + event->len) {
+    event = (const struct inotify_event *) p;
+    if (event->len > 0 && strcmp(event->name, base) == 0)
+      found = 1;
+  }
+  return found;
+}
+
+static void* watch_rules(void *arg) {
+  /* Watches the directory the rules file is in rather than the file itself,
+   * as editors tend to save by writing a new file and renaming it over the
+   * old one
+   */
+  char dir[4096], events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const char *base;
+  char *slash;
+  struct pollfd fds[2];
+  struct rule_set *rules;
+  struct trace_span span;
+  int fd, changed, timeout;
+  ssize_t len;
+
+  trace_name_thread("rules watcher");
+  snprintf(dir, sizeof(dir), "%s", rules_path);
+  slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+    base = rules_path;
+  }
+  else {
+    *slash = '\0';
+    base = rules_path + (slash - dir) + 1;
+    if (slash == dir)
+      strcpy(dir, "/");
+  }
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+        IN_DELETE | IN_ONLYDIR) < 0) {
+    perror(dir);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  fds[0].fd = stop_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = fd;
+  fds[1].events = POLLIN;
+  changed = 0;
+  while (1) {
+    /* Once the file has changed, wait for it to settle before reloading */
+    timeout = changed ? RULES_SETTLE_MS : -1;
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("rules watcher");
+      break;
+    }
+    if (fds[0].revents != 0)
+      break;
+    if (fds[1].revents != 0) {
+      while ((len = read(fd, events, sizeof(events))) > 0)
+        if (names_rules_file(events, len, base))
+          changed = 1;
+      continue;
+    }
+    if (!changed)
+      continue;
+
+    /* Compiled here, so scans carry on with the old rules meanwhile */
+    changed = 0;
+    TRACE_BEGIN(&span, "rules_reload");
+    rules = load_rules();
+    if (rules != NULL) {
+      pthread_mutex_lock(&rules_lock);
+      publish_rules(rules);
+      pthread_mutex_unlock(&rules_lock);
+      printf("Reloaded %zu error rules from %s\n", rules->rule_count, rules_path);
+    }
+    else {
+      printf("Keeping the current error rules\n");
+    }
+    TRACE_END(&span);
+    trace_flush();
+  }
+  close(fd);
+  return NULL;
+}
+
+int watch_error_rules(void) {
+  if (watching)
+    return 0;
+  if (current_rules == NULL)
+    init_rules();
+  if (pipe(stop_pipe) != 0)
+    return -1;
+  if (pthread_create(&watcher, NULL, watch_rules, NULL) != 0) {
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return -1;
+  }
+  watching = 1;
+  return 0;
+}
+
+/* Stops the watcher and frees the rules */
+void free_error_pattern(void) {
+  if (watching) {
+    if (write(stop_pipe[1], "", 1) < 0)
+      perror("rules watcher");
+    pthread_join(watcher, NULL);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    watching = 0;
+  }
+  pthread_mutex_lock(&rules_lock);
+  free_rules(current_rules);
+  current_rules = NULL;
+  pthread_mutex_unlock(&rules_lock);
+}
+
+
+/*
+ **
+ **
+ ** Scanning
+ **
+ **
+ */
+
+/* The cheap version of detect_error used under load: a case-insensitive
+ * search for the words the rules are made of, without PCRE, followed by the
+ * rules no word was found for, if there are any. Returns 1 and sets
+ * <match_offset> if one of them matches the <len> bytes of output.
+ */
+int prefilter_error(const char *terminal_output, size_t len, int *match_offset) {
+  size_t i, w;
+  int ovector[3];
+  struct trace_span span;
+  struct rule_set *rules;
+  unsigned long epoch;
+  uint64_t started = PROBE_ENABLED(match) ? probe_now() : 0;
+
+  TRACE_BEGIN(&span, "prefilter_error");
+  rules = pin_rules(&epoch);
+  for (i = 0; i < len; i++) {
+    if (!rules->first[(unsigned char) terminal_output[i]])
+      continue;
+    for (w = 0; w < rules->word_count; w++) {
+      if (len - i >= rules->word_len[w] &&
+          strncasecmp(terminal_output + i, rules->words[w], rules->word_len[w]) == 0) {
+        unpin_rules(epoch);
+        *match_offset = (int) i;
+        TRACE_END(&span);
+        if (PROBE_ENABLED(match))
+          PROBE4(match, i, len, started != 0 ? probe_now() - started : 0, 1);
+        return 1;
+      }
+    }
+  }
+  if (rules->fallback != NULL &&
+      pcre_exec(rules->fallback, rules->fallback_extra, terminal_output, (int) len, 0, 0, ovector, 3) >= 0) {
+    unpin_rules(epoch);
+    *match_offset = ovector[0];
+    TRACE_END(&span);
+    if (PROBE_ENABLED(match))
+      PROBE4(match, ovector[0], len, started != 0 ? probe_now() - started : 0, 1);
+    return 1;
+  }
+  unpin_rules(epoch);
+  TRACE_END(&span);
+  return 0;
+}
+
+
+/* Returns 1 if an error was present in the output and 0 otherwise; on a match
+ * <match_offset> is set to where in the output it starts
+ */
+int detect_error(char* terminal_output, int *match_offset) {
+  int pcreExecRet;
+  int subStrVec[30];
+  struct trace_span span;
+  struct rule_set *rules;
+  unsigned long epoch;
+  uint64_t started = PROBE_ENABLED(match) ? probe_now() : 0;
+
+  TRACE_BEGIN(&span, "detect_error");
+  rules = pin_rules(&epoch);
+
+  /* Try to find the regex in terminal_output, and report results. */
+  pcreExecRet = pcre_exec(rules->pattern,
+                          rules->pattern_extra,
+                          terminal_output, 
+                          strlen(terminal_output),  // length of string
+                          0,                      // Start looking at this point
+                          0,                      // OPTIONS
+                          subStrVec,
+                          30);                    // Length of subStrVec
+  unpin_rules(epoch);
+  TRACE_END(&span);
+
+  // Report what happened in the pcre_exec call..
+  if(pcreExecRet < 0) { // Something bad happened..
+    switch(pcreExecRet) {
+    case PCRE_ERROR_NOMATCH      :                                                      return 0;
+    case PCRE_ERROR_NULL         : printf("Something was null\n");                      break;
+    case PCRE_ERROR_BADOPTION    : printf("A bad option was passed\n");                 break;
+    case PCRE_ERROR_BADMAGIC     : printf("Magic number bad (compiled re corrupt?)\n"); break;
+    case PCRE_ERROR_UNKNOWN_NODE : printf("Something kooky in the compiled re\n");      break;
+    case PCRE_ERROR_NOMEMORY     : printf("Ran out of memory\n");                       break;
+    default                      : printf("Unknown error\n");                           break;
+    } /* end switch */
+    return 0;
+  } 
+
+  /* We have a match */
+  *match_offset = subStrVec[0];
+  if (PROBE_ENABLED(match))
+    PROBE4(match, subStrVec[0], strlen(terminal_output), started != 0 ? probe_now() - started : 0, 0);
+  return 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Error detection in terminal output.
+ *
+ * Output is matched against a set of rules, PCRE patterns read one per line
+ * from the file named by ERRORTRACKER_RULES, or ~/.errortrackerrules. Blank
+ * lines and lines starting with '#' are skipped, matching is case-insensitive,
+ * and with no file, or nothing in it, the rule is "exception|error". The rules
+ * are loaded on first use. They are run as one pattern, so a rule can't refer
+ * to a group by number (\1, (?1), (?R)); named groups work, and a rules file
+ * that numbers them is rejected.
+ *
+ * A long-running analyzer calls watch_error_rules() to pick up edits to the
+ * file without restarting the shell. A thread of its own notices the change
+ * through inotify, compiles the new rules and swaps them in with one pointer
+ * store; scans already under way finish with the old rules, which are freed
+ * once they have. Scans never wait for a reload. If the new rules don't
+ * compile the old ones are kept.
+ *
+ * prefilter_error() is the cheap alternative for when there is too much
+ * output to run the rules over all of it (see governor.h): a plain search for
+ * the longest word that has to appear in each rule. A rule without such a
+ * word, or one written in syntax the word finder doesn't follow, is still
+ * run through PCRE.
+ */
+
+#ifndef ERROR_DETECT_H
+#define ERROR_DETECT_H
+
+#include <stddef.h>
+
+#define RULES_ENV "ERRORTRACKER_RULES"
+/* The rules file, in the home directory, if ERRORTRACKER_RULES isn't set */
+#define RULES_FILE ".errortrackerrules"
+
+/* Returns 1 if the NUL-terminated <terminal_output> contains an error, setting
+ * <match_offset> to where the match starts, and 0 otherwise
+ */
+int detect_error(char* terminal_output, int *match_offset);
+
+/* Like detect_error for the <len> bytes at <terminal_output>, with PCRE only
+ * for the rules the prefilter has no words for
+ */
+int prefilter_error(const char *terminal_output, size_t len, int *match_offset);
+
+/* Loads the rules and starts reloading them whenever the rules file changes.
+ * Returns 0, or -1 if the watcher couldn't be started.
+ */
+int watch_error_rules(void);
+
+/* Stops watching the rules file and frees the rules */
+void free_error_pattern(void);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Error events, fingerprints and their commit message trailers. See error_event.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <inttypes.h>
+#include "error_event.h"
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+/* Hex runs at least this long are treated as addresses/hashes and ignored */
+static const size_t MIN_HEX_RUN = 6;
+
+static uint64_t fnv_byte(uint64_t h, unsigned char c) {
+	return (h ^ c) * FNV_PRIME;
+}
+
+static size_t hex_run(const char *s, size_t len) {
+	/* Length of the address or hash starting at <s>, or 0. Words made only of
+	 * the letters a-f ("facade") don't count.
+	 */
+	size_t i = 0;
+	int digits = 0;
+	if (len >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		i = 2;
+	while (i < len && isxdigit((unsigned char) s[i])) {
+		digits |= isdigit((unsigned char) s[i]);
+		i++;
+	}
+	if (!digits || (i < len && isalnum((unsigned char) s[i])))
+		return 0;
+	return i;
+}
+
+uint64_t error_fingerprint(const char *line, size_t len) {
+	uint64_t h = FNV_OFFSET;
+	int pending_space = 0;
+	size_t i = 0, run;
+	unsigned char c;
+
+	while (i < len) {
+		c = (unsigned char) line[i];
+
+		/* Terminal escape sequences: ESC [ params final-byte */
+		if (c == 0x1b) {
+			i++;
+			if (i < len && line[i] == '[') {
+				i++;
+				while (i < len && !isalpha((unsigned char) line[i]))
+					i++;
+			}
+			i++;
+			continue;
+		}
+		if (isspace(c)) {
+			pending_space = 1;
+			i++;
+			continue;
+		}
+		if (pending_space) {
+			h = fnv_byte(h, ' ');
+			pending_space = 0;
+		}
+		/* Numbers and long hex strings vary between occurrences of the same error */
+		run = hex_run(line + i, len - i);
+		if (isdigit(c) || run >= MIN_HEX_RUN) {
+			if (run < 1)
+				run = 1;
+			while (i + run < len && isdigit((unsigned char) line[i + run]))
+				run++;
+			h = fnv_byte(h, '#');
+			i += run;
+			continue;
+		}
+		h = fnv_byte(h, (unsigned char) tolower(c));
+		i++;
+	}
+	return h;
+}
+
+uint64_t error_command_hash(const char *command) {
+	uint64_t h = FNV_OFFSET;
+	while (command != NULL && *command)
+		h = fnv_byte(h, (unsigned char) *command++);
+	return h;
+}
+
+void error_event_init(struct error_event *event, const char *text, size_t len, size_t match_offset,
+	uint32_t rule, const char *command) {
+	size_t start = match_offset, end = match_offset, copy;
+
+	memset(event, 0, sizeof(*event));
+	event->when = (int64_t) time(NULL);
+	event->rule = rule;
+	if (command != NULL)
+		snprintf(event->command, sizeof(event->command), "%s", command);
+
+	copy = len < sizeof(event->message) - 1 ? len : sizeof(event->message) - 1;
+	memcpy(event->message, text, copy);
+	event->message[copy] = '\0';
+
+	/* Fingerprint just the line the match is on */
+	if (match_offset > len)
+		start = end = len;
+	while (start > 0 && text[start - 1] != '\n' && text[start - 1] != '\r')
+		start--;
+	while (end < len && text[end] != '\n' && text[end] != '\r')
+		end++;
+	event->fingerprint = error_fingerprint(text + start, end - start);
+}
+
+static int is_path_char(unsigned char c) {
+	return isalnum(c) || (c != '\0' && strchr("_./-+~@", c) != NULL);
+}
+
+static int add_location(struct error_location *out, size_t count, size_t max,
+	const char *path, size_t path_len, const char *line) {
+	/* Appends the reference unless it is already there; returns the new count */
+	size_t i;
+	uint32_t number = (uint32_t) strtoul(line, NULL, 10);
+
+	if (count >= max || path_len == 0 || path_len >= ERROR_LOCATION_MAX_PATH || number == 0)
+		return (int) count;
+	for (i = 0; i < count; i++)
+		if (out[i].line == number && strlen(out[i].path) == path_len && !strncmp(out[i].path, path, path_len))
+			return (int) count;
+	memcpy(out[count].path, path, path_len);
+	out[count].path[path_len] = '\0';
+	out[count].line = number;
+	return (int) count + 1;
+}
+
+static int plausible_path(const char *path, size_t len) {
+	/* Rules out what merely looks like a reference: times ("12:30:45"), words
+	 * ("error:3"), versions ("1.2:3") and URLs ("http://host:80")
+	 */
+	size_t i;
+	int alpha = 0, slash = 0, extension = 0;
+
+	if (len >= 2 && path[0] == '/' && path[1] == '/')
+		return 0;
+	for (i = 0; i < len; i++) {
+		alpha |= isalpha((unsigned char) path[i]);
+		slash |= path[i] == '/';
+		if (path[i] == '.')
+			extension = i + 1 < len && isalpha((unsigned char) path[i + 1]);
+	}
+	return alpha && (slash || extension);
+}
+
+size_t error_event_locations(const struct error_event *event, struct error_location *out, size_t max) {
+	static const char PYTHON_FILE[] = "File \"";
+	static const char PYTHON_LINE[] = "\", line ";
+	const char *text = event->message, *end;
+	size_t i, start, count = 0;
+
+	for (i = 0; text[i] != '\0' && count < max; i++) {
+		/* Python tracebacks: File "x.py", line 10 */
+		if (!strncmp(text + i, PYTHON_FILE, sizeof(PYTHON_FILE) - 1)) {
+			start = i + sizeof(PYTHON_FILE) - 1;
+			end = strchr(text + start, '"');
+			if (end != NULL && !strncmp(end, PYTHON_LINE, sizeof(PYTHON_LINE) - 1) &&
+				isdigit((unsigned char) end[sizeof(PYTHON_LINE) - 1]))
+				count = add_location(out, count, max, text + start, (size_t) (end - text) - start,
+					end + sizeof(PYTHON_LINE) - 1);
+			continue;
+		}
+		/* Compilers, linters and stack traces: path:line, often followed
+		 * by :column
+		 */
+		if (text[i] != ':' || !isdigit((unsigned char) text[i + 1]))
+			continue;
+		for (start = i; start > 0 && is_path_char((unsigned char) text[start - 1]); start--)
+			;
+		for (end = text + i + 1; isdigit((unsigned char) *end); end++)
+			;
+		if (!isalnum((unsigned char) *end) && plausible_path(text + start, i - start))
+			count = add_location(out, count, max, text + start, i - start, text + i + 1);
+	}
+	return count;
+}
+
+size_t error_event_commit_message(const struct error_event *event, char *out, size_t size) {
+	struct error_location locations[ERROR_EVENT_MAX_LOCATIONS];
+	size_t count = error_event_locations(event, locations, ERROR_EVENT_MAX_LOCATIONS), i;
+	int n = snprintf(out, size,
+		"%s\n\n"
+		"Error-Fingerprint: %016" PRIx64 "\n"
+		"Error-Rule: %" PRIu32 "\n"
+		"Error-Time: %" PRId64 "\n"
+		"Error-Command: %s\n",
+		event->message, event->fingerprint, event->rule, event->when, event->command);
+	int more;
+
+	if (n < 0)
+		return 0;
+	for (i = 0; i < count && (size_t) n < size; i++) {
+		more = snprintf(out + n, size - (size_t) n, "Error-Location: %s:%" PRIu32 "\n",
+			locations[i].path, locations[i].line);
+		if (more < 0)
+			break;
+		n += more;
+	}
+	return (size_t) n < size ? (size_t) n : size - 1;
+}
+
+int error_event_parse_trailers(const char *message, struct error_event *event) {
+	const char *line;
+	const char *end;
+	int found = 0;
+
+	memset(event, 0, sizeof(*event));
+	for (line = message; line != NULL && *line; line = end ? end + 1 : NULL) {
+		end = strchr(line, '\n');
+		if (!strncmp(line, "Error-Fingerprint: ", 19)) {
+			event->fingerprint = strtoull(line + 19, NULL, 16);
+			found = 1;
+		}
+		else if (!strncmp(line, "Error-Rule: ", 12))
+			event->rule = (uint32_t) strtoul(line + 12, NULL, 10);
+		else if (!strncmp(line, "Error-Time: ", 12))
+			event->when = strtoll(line + 12, NULL, 10);
+		else if (!strncmp(line, "Error-Command: ", 15)) {
+			size_t len = end ? (size_t) (end - line - 15) : strlen(line + 15);
+			if (len >= sizeof(event->command))
+				len = sizeof(event->command) - 1;
+			memcpy(event->command, line + 15, len);
+			event->command[len] = '\0';
+		}
+	}
+	return found ? 0 : -1;
+}
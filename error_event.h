@@ -0,0 +1,73 @@
+/*
+ * A detected error, as handed from the analyzer to the commit machinery.
+ *
+ * Besides the output that matched, an event carries what is needed to find
+ * it again later: when it happened, which detection rule fired, the command
+ * that was running and a fingerprint of the error line. The fingerprint
+ * ignores numbers, addresses and whitespace, so the same error reported with
+ * a different line number, pid or pointer maps to the same value.
+ *
+ * The files and lines an error points at ("foo.c:42:", "File "x.py", line
+ * 10") are pulled out of its output, recorded as Error-Location trailers and
+ * used to scope targeted snapshots.
+ */
+
+#ifndef ERROR_EVENT_H
+#define ERROR_EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ERROR_EVENT_MAX_COMMAND 256
+#define ERROR_EVENT_MAX_MESSAGE 4096
+#define ERROR_EVENT_MAX_LOCATIONS 8
+#define ERROR_LOCATION_MAX_PATH 256
+/* Room for everything error_event_commit_message writes */
+#define ERROR_EVENT_MAX_COMMIT_MESSAGE (ERROR_EVENT_MAX_MESSAGE + 512 + \
+	ERROR_EVENT_MAX_LOCATIONS * (ERROR_LOCATION_MAX_PATH + 32))
+
+struct error_event {
+	int64_t when;             /* seconds since the epoch */
+	uint32_t rule;            /* index of the detection rule that matched */
+	uint64_t fingerprint;     /* error_fingerprint() of the matching line */
+	char command[ERROR_EVENT_MAX_COMMAND];
+	char message[ERROR_EVENT_MAX_MESSAGE];
+};
+
+/* A file and line referred to by an error */
+struct error_location {
+	char path[ERROR_LOCATION_MAX_PATH];   /* as written in the output */
+	uint32_t line;
+};
+
+/* Fills <event> for output <text> (not necessarily NUL-terminated) in which
+ * rule <rule> matched at byte <match_offset>. <command> may be NULL.
+ */
+void error_event_init(struct error_event *event, const char *text, size_t len, size_t match_offset,
+	uint32_t rule, const char *command);
+
+/* Fingerprint of an error line; see the top of this file */
+uint64_t error_fingerprint(const char *line, size_t len);
+
+/* Stable hash of a command line, as stored in the error index */
+uint64_t error_command_hash(const char *command);
+
+/* Extracts the file:line references in <event>'s output, in the order they
+ * appear and without duplicates. Stores at most <max> in <out> and returns
+ * how many were stored.
+ */
+size_t error_event_locations(const struct error_event *event, struct error_location *out, size_t max);
+
+/* Writes the commit message for <event>: the matched output followed by
+ * Error-* trailers that let the error index be rebuilt from history, and an
+ * Error-Location trailer for each file:line reference. Returns the length
+ * written (truncated to fit <size>).
+ */
+size_t error_event_commit_message(const struct error_event *event, char *out, size_t size);
+
+/* Reads the Error-* trailers back out of a commit message written by
+ * error_event_commit_message. Returns 0 if they were found, -1 otherwise.
+ */
+int error_event_parse_trailers(const char *message, struct error_event *event);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Compare-and-swap updates of _error and per-session refs. See error_ref.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include "error_ref.h"
+#include "error_event.h"
+#include "errindex.h"
+
+static const char* ERROR_REF_NAME = "refs/heads/_error";
+/* How long to keep retrying a ref whose lock another process holds */
+static const int MAX_LOCK_WAITS = 200;
+static const long MAX_LOCK_WAIT_US = 5000;
+/* Attempts at folding a session while other sessions keep moving _error */
+static const int MAX_FOLD_ATTEMPTS = 10;
+
+static void lock_backoff(int attempt) {
+	/* Random, slowly growing pause so contending sessions spread out */
+	struct timespec ts;
+	long us = (rand() % MAX_LOCK_WAIT_US) * (attempt < 4 ? attempt + 1 : 4) / 4 + 100;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = us * 1000;
+	nanosleep(&ts, NULL);
+}
+
+int error_ref_swap(git_repository *repo, const char *ref_name, const git_oid *id,
+	const git_oid *expected, const char *log_message) {
+	git_reference *ref = NULL;
+	int attempt, result = GIT_ELOCKED;
+
+	for (attempt = 0; attempt < MAX_LOCK_WAITS && result == GIT_ELOCKED; attempt++) {
+		if (attempt > 0)
+			lock_backoff(attempt);
+		result = git_reference_create_matching(&ref, repo, ref_name, id, 1, expected, log_message);
+	}
+	if (result == 0)
+		git_reference_free(ref);
+	/* A ref that was expected but has been deleted has also been moved */
+	if (result == GIT_ENOTFOUND && expected != NULL)
+		result = GIT_EMODIFIED;
+	return result;
+}
+
+int error_ref_replay(git_repository *repo, const git_oid *original, const git_oid *onto, git_oid *out) {
+	git_commit *commit, *parent = NULL;
+	const git_commit *parents[1];
+	git_tree *tree;
+	int result;
+
+	if ((result = git_commit_lookup(&commit, repo, original)) != 0)
+		return result;
+	if (onto != NULL)
+		result = git_commit_lookup(&parent, repo, onto);
+	if (result == 0 && (result = git_commit_tree(&tree, commit)) == 0) {
+		parents[0] = parent;
+		result = git_commit_create(out, repo, NULL,
+			git_commit_author(commit), git_commit_committer(commit),
+			git_commit_message_encoding(commit), git_commit_message(commit),
+			tree, parent ? 1 : 0, parents);
+		git_tree_free(tree);
+	}
+	git_commit_free(parent);
+	git_commit_free(commit);
+	return result;
+}
+
+const char* error_ref_session_name(void) {
+	static char name[128];
+	char host[64];
+	size_t i;
+
+	if (name[0] != '\0')
+		return name;
+	if (gethostname(host, sizeof(host)) != 0)
+		snprintf(host, sizeof(host), "localhost");
+	host[sizeof(host) - 1] = '\0';
+	/* Keep the ref name valid whatever the host is called */
+	for (i = 0; host[i]; i++) {
+		char c = host[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '.' || c == '_') || (c == '.' && (i == 0 || host[i - 1] == '.')))
+			host[i] = '_';
+	}
+	snprintf(name, sizeof(name), "%s-%d", host, (int) getpid());
+	return name;
+}
+
+
+/*
+ **
+ **
+ ** Folding sessions
+ **
+ **
+ */
+
+static int is_session_commit(const git_commit *commit, const char *session) {
+	/* Whether <commit> carries this session's Error-Session trailer */
+	const char *message = git_commit_message(commit);
+	size_t len = strlen(session);
+	const char *p;
+
+	for (p = message; (p = strstr(p, ERROR_REF_SESSION_TRAILER)) != NULL; p++) {
+		if ((p == message || p[-1] == '\n') &&
+			strncmp(p + strlen(ERROR_REF_SESSION_TRAILER), session, len) == 0) {
+			p += strlen(ERROR_REF_SESSION_TRAILER) + len;
+			if (*p == '\n' || *p == '\0')
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static size_t list_session_commits(git_repository *repo, const git_oid *tip, const char *session,
+	git_oid **out, git_oid *base, int *has_base) {
+	/* Lists the session's commits, newest first, by following first parents
+	 * from <tip> until a commit without the session's trailer. That commit,
+	 * the _error tip the session started from, is stored in <base>.
+	 */
+	git_oid id, *list = NULL, *grown;
+	size_t count = 0, cap = 0;
+	git_commit *commit;
+
+	*has_base = 0;
+	git_oid_cpy(&id, tip);
+	while (git_commit_lookup(&commit, repo, &id) == 0) {
+		if (!is_session_commit(commit, session)) {
+			git_oid_cpy(base, &id);
+			*has_base = 1;
+			git_commit_free(commit);
+			break;
+		}
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			grown = (git_oid *) realloc(list, cap * sizeof(git_oid));
+			if (grown == NULL) {
+				git_commit_free(commit);
+				break;
+			}
+			list = grown;
+		}
+		git_oid_cpy(&list[count++], &id);
+		if (git_commit_parentcount(commit) == 0) {
+			git_commit_free(commit);
+			break;
+		}
+		git_oid_cpy(&id, git_commit_parent_id(commit, 0));
+		git_commit_free(commit);
+	}
+	*out = list;
+	return count;
+}
+
+static void index_folded(struct repo_context *ctx, const git_oid *originals, const git_oid *folded, size_t count) {
+	/* Session commits only enter the error index once they are on _error */
+	struct error_event event;
+	git_commit *commit;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (git_commit_lookup(&commit, ctx->repo, &originals[i]) != 0)
+			continue;
+		if (error_event_parse_trailers(git_commit_message(commit), &event) == 0) {
+			if (event.when == 0)
+				event.when = (int64_t) git_commit_time(commit);
+			errindex_append(git_repository_path(ctx->repo), &event, &folded[i]);
+		}
+		git_commit_free(commit);
+	}
+}
+
+int error_ref_fold_session(struct repo_context *ctx, const char *ref_name) {
+	const char *session = ref_name + strlen(ERROR_REF_SESSION_PREFIX);
+	git_oid session_tip, base, onto, parent, *list, *folded;
+	git_reference *ref;
+	size_t count, i;
+	int has_base, has_onto, has_parent, attempt, result = 0;
+
+	if (git_reference_name_to_id(&session_tip, ctx->repo, ref_name) != 0)
+		return 0;
+	count = list_session_commits(ctx->repo, &session_tip, session, &list, &base, &has_base);
+	folded = (git_oid *) calloc(count ? count : 1, sizeof(git_oid));
+	if (folded == NULL) {
+		free(list);
+		return -1;
+	}
+
+	for (attempt = 0; count > 0 && attempt < MAX_FOLD_ATTEMPTS; attempt++) {
+		/* The tip the swap expects to replace */
+		has_onto = git_reference_name_to_id(&onto, ctx->repo, ERROR_REF_NAME) == 0;
+
+		if (has_base && has_onto && git_oid_equal(&base, &onto)) {
+			/* Nothing reached _error since the session started: fast-forward */
+			for (i = 0; i < count; i++)
+				git_oid_cpy(&folded[i], &list[i]);
+		}
+		else {
+			/* Rebase the session, oldest commit first, onto the current tip
+			 * (or where the session started, if _error has gone)
+			 */
+			has_parent = has_onto || has_base;
+			git_oid_cpy(&parent, has_onto ? &onto : &base);
+			result = 0;
+			for (i = count; i-- > 0 && result == 0; ) {
+				result = error_ref_replay(ctx->repo, &list[i], has_parent ? &parent : NULL, &folded[i]);
+				git_oid_cpy(&parent, &folded[i]);
+				has_parent = 1;
+			}
+			if (result == 0)
+				result = repo_context_flush_objects(ctx);
+			if (result != 0)
+				break;
+		}
+
+		result = error_ref_swap(ctx->repo, ERROR_REF_NAME, &folded[0], has_onto ? &onto : NULL,
+			"errortracker: fold session");
+		if (result != GIT_EMODIFIED)
+			break;
+	}
+
+	if (count > 0 && result == 0) {
+		repo_context_set_error_tip(ctx, &folded[0]);
+		index_folded(ctx, list, folded, count);
+		printf("Folded %zu commits from %s onto _error\n", count, ref_name);
+	}
+	if (result == 0 && git_reference_lookup(&ref, ctx->repo, ref_name) == 0) {
+		/* Only if the session hasn't committed again in the meantime */
+		if (git_oid_equal(git_reference_target(ref), &session_tip))
+			git_reference_delete(ref);
+		git_reference_free(ref);
+	}
+	if (result == 0 && ctx->session_ref != NULL && strcmp(ref_name, ctx->session_ref) == 0 &&
+		ctx->has_session_tip && git_oid_equal(&ctx->session_tip, &session_tip)) {
+		ctx->has_session_tip = 0;
+		ctx->session_pending = 0;
+	}
+	free(folded);
+	free(list);
+	return result;
+}
+
+struct session_list {
+	char **names;
+	size_t count;
+	size_t cap;
+};
+
+static int collect_session(const char *name, void *payload) {
+	struct session_list *list = (struct session_list *) payload;
+	char **grown;
+
+	if (list->count == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 16;
+		grown = (char **) realloc(list->names, list->cap * sizeof(char *));
+		if (grown == NULL)
+			return -1;
+		list->names = grown;
+	}
+	list->names[list->count++] = strdup(name);
+	return 0;
+}
+
+static int session_abandoned(git_repository *repo, const char *ref_name, int64_t stale_after) {
+	const char *session = ref_name + strlen(ERROR_REF_SESSION_PREFIX);
+	const char *own = error_ref_session_name();
+	const char *dash = strrchr(session, '-');
+	const char *own_dash = strrchr(own, '-');
+	git_commit *commit;
+	git_oid tip;
+	int64_t age;
+	pid_t pid;
+
+	if (strcmp(session, own) == 0 || dash == NULL)
+		return 0;
+	/* Same host: the session is over once its analyzer has exited */
+	if (own_dash != NULL && dash - session == own_dash - own && strncmp(session, own, dash - session) == 0) {
+		pid = (pid_t) strtol(dash + 1, NULL, 10);
+		if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+			return 1;
+	}
+	/* Any host: nothing committed for a long time */
+	if (stale_after <= 0 || git_reference_name_to_id(&tip, repo, ref_name) != 0 ||
+		git_commit_lookup(&commit, repo, &tip) != 0)
+		return 0;
+	age = (int64_t) time(NULL) - (int64_t) git_commit_time(commit);
+	git_commit_free(commit);
+	return age > stale_after;
+}
+
+int error_ref_fold_abandoned(struct repo_context *ctx, int64_t stale_after) {
+	struct session_list sessions = {NULL, 0, 0};
+	int result = 0, fold_result;
+	size_t i;
+
+	git_reference_foreach_glob(ctx->repo, ERROR_REF_SESSION_PREFIX "*", collect_session, &sessions);
+	for (i = 0; i < sessions.count; i++) {
+		if (session_abandoned(ctx->repo, sessions.names[i], stale_after)) {
+			fold_result = error_ref_fold_session(ctx, sessions.names[i]);
+			if (fold_result != 0)
+				result = fold_result;
+		}
+		free(sessions.names[i]);
+	}
+	free(sessions.names);
+	return result;
+}
@@ -0,0 +1,58 @@
+/*
+ * Moving the _error branch safely while many sessions record errors at once.
+ *
+ * A snapshot is built on the _error tip its analyzer last saw, and the ref is
+ * then moved with a compare-and-swap. If another session moved it first, the
+ * snapshot is re-created on the new tip and the swap retried, so no session's
+ * commit is lost and none of them has to give up.
+ *
+ * With git config errortracker.sessionRefs set, every analyzer commits to its
+ * own ref instead, refs/errortracker/<host>-<pid>, which no other process
+ * writes, so sessions never contend for a ref lock at all. Now and then its
+ * commits are folded onto _error in a single swap. Commits made on a session
+ * ref carry an Error-Session trailer, which is how a fold tells where the
+ * session's commits end. errortracker maintain folds the sessions of
+ * analyzers that have exited without folding their own.
+ */
+
+#ifndef ERROR_REF_H
+#define ERROR_REF_H
+
+#include <stdint.h>
+#include <git2.h>
+#include "repo_context.h"
+
+#define ERROR_REF_SESSION_PREFIX "refs/errortracker/"
+#define ERROR_REF_SESSION_TRAILER "Error-Session: "
+
+/* Moves <ref_name> to <id> if it still points at <expected> (or
+ * unconditionally if <expected> is NULL), waiting out other processes holding
+ * the ref's lock. The reflog entry gets <log_message> and the identity from
+ * the repository's config. Returns GIT_EMODIFIED if the ref was moved by
+ * someone else, 0 on success and another libgit2 error code on failure.
+ */
+int error_ref_swap(git_repository *repo, const char *ref_name, const git_oid *id,
+	const git_oid *expected, const char *log_message);
+
+/* Re-creates commit <original> with the same tree, message and signatures but
+ * with <onto> as its only parent (or none, if <onto> is NULL). The new commit
+ * id is stored in <out>.
+ */
+int error_ref_replay(git_repository *repo, const git_oid *original, const git_oid *onto, git_oid *out);
+
+/* This process's session name, "<host>-<pid>" */
+const char* error_ref_session_name(void);
+
+/* Folds the commits on session ref <ref_name> onto the _error branch of the
+ * repository behind <ctx>, adds them to the error index and deletes the
+ * session ref. Returns 0 on success (including when there was nothing to
+ * fold) and a libgit2 error code otherwise.
+ */
+int error_ref_fold_session(struct repo_context *ctx, const char *ref_name);
+
+/* Folds the session refs left behind by analyzers on this host that have
+ * exited, and those of any host that haven't moved for <stale_after> seconds
+ */
+int error_ref_fold_abandoned(struct repo_context *ctx, int64_t stale_after);
+
+#endif
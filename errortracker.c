@@ -0,0 +1,562 @@
+/*
+ * Command-line front end for working with the error tracker's data outside
+ * of a monitored terminal session.
+ *
+ *   errortracker maintain [options]   apply retention, repack, write commit-graph
+ *   errortracker query [options]      look errors up in the error index
+ *   errortracker run [options] -- <command>
+ *                                     run a command, recording it if it fails
+ *   errortracker grep [options] <pattern> [<recording>...]
+ *                                     search session recordings
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <git2.h>
+#include "repo_context.h"
+#include "maintenance.h"
+#include "errindex.h"
+#include "error_event.h"
+#include "command_runner.h"
+#include "create_error_commit.h"
+#include "error_detect.h"
+#include "trace.h"
+#include "recording.h"
+
+static const char* DEFAULT_REPO_PATH = ".git";
+static const unsigned int DEFAULT_DUTY_PERCENT = 25;
+static const char* ERROR_REF_NAME = "refs/heads/_error";
+static const char* MASTER_REF_NAME = "refs/heads/master";
+/* What errortracker grep --check searches for: patterns with syntax the
+ * trigram extraction has to step over rather than read as text (see
+ * pattern_syntax.h), and some that it reads text out of
+ */
+static const char* CHECK_PATTERNS[] = {
+	"a{100}", "x{2,5}", "\\x41BC", "\\101bc", "\\p{Greek}", "\\x{263a}", "\\N{U+263A}",
+	"ab{0,3}cd", "[]x]yz", "[[:alpha:]xyz]+q", "\\Qa.b\\E", "(?x) e r r o r", "error\\.c",
+	"warn|err(or)?s?", "\\berror\\b: \\w+", "make\\[\\d+\\]", NULL
+};
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: errortracker <command> [options]\n"
+		"\n"
+		"commands:\n"
+		"  maintain [-C <repo>] [--max-age <days>] [--max-count <n>] [--max-size <bytes>]\n"
+		"           [--duty <percent>] [--no-repack] [--every <seconds>]\n"
+		"  query    [-C <repo>] [--first | --last | --all | --count]\n"
+		"           [--fingerprint <hex> | --text <error line>] [--rule <n>]\n"
+		"           [--since <time>] [--until <time>] [--command <command line>]\n"
+		"  query    [-C <repo>] --rebuild\n"
+		"  run      [-C <repo>] -- <command> [<args>]\n"
+		"  grep     [-i] [-l] [--reindex] [--stats] <pattern> [<recording>...]\n"
+		"  grep     [-i] --check [<recording>...]\n");
+	exit(1);
+}
+
+static struct repo_context* open_repo(const char *path) {
+	struct repo_context *ctx;
+
+	/* Only run takes a snapshot, and only one, so there is nothing for a
+	 * change tracker to save
+	 */
+	repo_context_disable_tracking();
+	ctx = repo_context_get(path);
+	if (ctx == NULL) {
+		fprintf(stderr, "errortracker: could not open repository at %s\n", path);
+		exit(1);
+	}
+	return ctx;
+}
+
+
+/*
+ **
+ **
+ ** errortracker maintain
+ **
+ **
+ */
+
+static int cmd_maintain(int argc, char **argv) {
+	static const struct option options[] = {
+		{ "max-age", required_argument, NULL, 'a' },
+		{ "max-count", required_argument, NULL, 'n' },
+		{ "max-size", required_argument, NULL, 's' },
+		{ "duty", required_argument, NULL, 'd' },
+		{ "no-repack", no_argument, NULL, 'R' },
+		{ "every", required_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *repo_path = DEFAULT_REPO_PATH;
+	struct retention_policy policy, overrides;
+	struct maintenance_budget budget;
+	struct repo_context *ctx;
+	long every = 0;
+	int opt, result;
+
+	memset(&overrides, 0, sizeof(overrides));
+	memset(&budget, 0, sizeof(budget));
+	budget.duty_percent = DEFAULT_DUTY_PERCENT;
+
+	while ((opt = getopt_long(argc, argv, "C:", options, NULL)) != -1) {
+		switch (opt) {
+			case 'C': repo_path = optarg; break;
+			case 'a': overrides.max_age = strtoll(optarg, NULL, 10) * 24 * 60 * 60; break;
+			case 'n': overrides.max_count = strtoul(optarg, NULL, 10); break;
+			case 's': overrides.max_bytes = strtoull(optarg, NULL, 10); break;
+			case 'd': budget.duty_percent = (unsigned int) strtoul(optarg, NULL, 10); break;
+			case 'R': budget.no_repack = 1; break;
+			case 'e': every = strtol(optarg, NULL, 10); break;
+			default: usage();
+		}
+	}
+	if (budget.duty_percent == 0 || budget.duty_percent > 100)
+		usage();
+
+	maintenance_lower_priority();
+	ctx = open_repo(repo_path);
+
+	do {
+		/* Re-read the policy every round so config changes apply to a
+		 * long-running background maintainer
+		 */
+		retention_policy_from_config(&policy, ctx->repo);
+		if (overrides.max_age)
+			policy.max_age = overrides.max_age;
+		if (overrides.max_count)
+			policy.max_count = overrides.max_count;
+		if (overrides.max_bytes)
+			policy.max_bytes = overrides.max_bytes;
+
+		result = maintain_error_branch(ctx, &policy, &budget);
+		if (every > 0)
+			sleep((unsigned int) every);
+	} while (every > 0);
+
+	return result == 0 ? 0 : 1;
+}
+
+
+/*
+ **
+ **
+ ** errortracker query
+ **
+ **
+ */
+
+enum query_mode { QUERY_ALL, QUERY_FIRST, QUERY_LAST, QUERY_COUNT };
+
+static int64_t parse_time(const char *arg) {
+	/* Seconds since the epoch, or a YYYY-MM-DD[THH:MM:SS] local time */
+	struct tm tm;
+	char *end;
+	long long seconds = strtoll(arg, &end, 10);
+
+	if (*end == '\0')
+		return (int64_t) seconds;
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(arg, "%Y-%m-%d", &tm);
+	if (end != NULL && *end == 'T')
+		end = strptime(end + 1, "%H:%M:%S", &tm);
+	if (end == NULL || *end != '\0')
+		usage();
+	tm.tm_isdst = -1;
+	return (int64_t) mktime(&tm);
+}
+
+static void print_record(git_repository *repo, const struct errindex_record *record) {
+	/* One line per error: commit, time, fingerprint, rule and the first line
+	 * of the error as recorded in the commit message
+	 */
+	char hex[GIT_OID_HEXSZ + 1], when[32];
+	const char *summary = "";
+	git_commit *commit = NULL;
+	time_t t = (time_t) record->when;
+	git_oid id;
+
+	memcpy(id.id, record->commit, sizeof(record->commit));
+	git_oid_tostr(hex, sizeof(hex), &id);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	if (git_commit_lookup(&commit, repo, &id) == 0)
+		summary = git_commit_summary(commit);
+	printf("%s %s %016" PRIx64 " %" PRIu32 " %s\n", hex, when, record->fingerprint, record->rule,
+		summary ? summary : "");
+	git_commit_free(commit);
+}
+
+static int cmd_query(int argc, char **argv) {
+	static const struct option options[] = {
+		{ "first", no_argument, NULL, 'f' },
+		{ "last", no_argument, NULL, 'l' },
+		{ "all", no_argument, NULL, 'A' },
+		{ "count", no_argument, NULL, 'c' },
+		{ "fingerprint", required_argument, NULL, 'p' },
+		{ "text", required_argument, NULL, 't' },
+		{ "rule", required_argument, NULL, 'r' },
+		{ "since", required_argument, NULL, 's' },
+		{ "until", required_argument, NULL, 'u' },
+		{ "command", required_argument, NULL, 'm' },
+		{ "rebuild", no_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *repo_path = DEFAULT_REPO_PATH;
+	enum query_mode mode = QUERY_ALL;
+	struct errindex_query query;
+	struct errindex_record *records;
+	struct repo_context *ctx;
+	size_t count, i;
+	int opt, rebuild = 0;
+
+	memset(&query, 0, sizeof(query));
+	while ((opt = getopt_long(argc, argv, "C:", options, NULL)) != -1) {
+		switch (opt) {
+			case 'C': repo_path = optarg; break;
+			case 'f': mode = QUERY_FIRST; break;
+			case 'l': mode = QUERY_LAST; break;
+			case 'A': mode = QUERY_ALL; break;
+			case 'c': mode = QUERY_COUNT; break;
+			case 'p':
+				query.has_fingerprint = 1;
+				query.fingerprint = strtoull(optarg, NULL, 16);
+				break;
+			case 't':
+				/* Normalized the same way as the error lines that were indexed */
+				query.has_fingerprint = 1;
+				query.fingerprint = error_fingerprint(optarg, strlen(optarg));
+				break;
+			case 'r':
+				query.has_rule = 1;
+				query.rule = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 's': query.since = parse_time(optarg); break;
+			case 'u': query.until = parse_time(optarg); break;
+			case 'm':
+				query.has_command = 1;
+				query.command_hash = error_command_hash(optarg);
+				break;
+			case 'R': rebuild = 1; break;
+			default: usage();
+		}
+	}
+
+	ctx = open_repo(repo_path);
+	if (rebuild) {
+		if (errindex_rebuild(ctx->repo, ERROR_REF_NAME, MASTER_REF_NAME) != 0) {
+			fprintf(stderr, "errortracker: failed to rebuild the error index\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	if (errindex_find(git_repository_path(ctx->repo), &query, &records, &count) != 0) {
+		fprintf(stderr, "errortracker: failed to read the error index\n");
+		return 1;
+	}
+	switch (mode) {
+		case QUERY_COUNT:
+			printf("%zu\n", count);
+			break;
+		case QUERY_FIRST:
+			if (count > 0)
+				print_record(ctx->repo, &records[0]);
+			break;
+		case QUERY_LAST:
+			if (count > 0)
+				print_record(ctx->repo, &records[count - 1]);
+			break;
+		default:
+			for (i = 0; i < count; i++)
+				print_record(ctx->repo, &records[i]);
+	}
+	free(records);
+	return count > 0 || mode == QUERY_COUNT ? 0 : 1;
+}
+
+
+/*
+ **
+ **
+ ** errortracker run
+ **
+ **
+ */
+
+static void record_failure(const char *repo_path, char **argv, const struct run_result *run) {
+	/* Snapshots the repository for a command that exited with a non-zero
+	 * status, with the error found in its output (if any) as the message
+	 */
+	static char tail[OUTPUT_TAIL_BYTES];
+	char git_dir[4096], command[ERROR_EVENT_MAX_COMMAND], text[ERROR_EVENT_MAX_MESSAGE];
+	struct error_event event;
+	size_t len = 0, tail_len;
+	int i, n;
+
+	if (repo_path != NULL)
+		snprintf(git_dir, sizeof(git_dir), "%s", repo_path);
+	else if (repo_context_discover(".", git_dir, sizeof(git_dir)) != 0) {
+		fprintf(stderr, "errortracker: not in a git repository, so the failure isn't recorded\n");
+		return;
+	}
+	command[0] = '\0';
+	for (i = 0; argv[i] != NULL && len < sizeof(command); i++) {
+		n = snprintf(command + len, sizeof(command) - len, "%s%s", i ? " " : "", argv[i]);
+		len += n > 0 ? (size_t) n : 0;
+	}
+
+	/* The line with the error is what the failure is fingerprinted by; when
+	 * none was found, the command line and its status
+	 */
+	if (run->error_len > 0)
+		n = snprintf(text, sizeof(text), "%.*s\n\nExited with status %d", (int) run->error_len, run->error, run->status);
+	else
+		n = snprintf(text, sizeof(text), "%s exited with status %d", command, run->status);
+	len = n < 0 ? 0 : (size_t) n < sizeof(text) ? (size_t) n : sizeof(text) - 1;
+	error_event_init(&event, text, len, run->error_len > 0 ? run->error_offset : 0, 0, command);
+
+	tail_len = output_tail_copy(&run->tail, OUTPUT_TAIL_BYTES, tail);
+	if (create_error_event(open_repo(git_dir), &event, tail, tail_len) != 0)
+		fprintf(stderr, "errortracker: failed to record the failure\n");
+}
+
+static int cmd_run(int argc, char **argv) {
+	static const struct option options[] = {
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *repo_path = NULL;
+	struct run_result *run;
+	int opt, status;
+
+	/* Options end at the command, with or without a "--" before it */
+	while ((opt = getopt_long(argc, argv, "+C:", options, NULL)) != -1) {
+		switch (opt) {
+			case 'C': repo_path = optarg; break;
+			default: usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	run = (struct run_result *) malloc(sizeof(struct run_result));
+	if (run == NULL || command_run(argv + optind, run) != 0) {
+		perror("errortracker: run");
+		free(run);
+		return 127;
+	}
+	status = run->status;
+	if (status != 0)
+		record_failure(repo_path, argv + optind, run);
+	free(run);
+	free_error_pattern();
+	/* Exit as the command did, so the CI step or cron job still fails */
+	return status;
+}
+
+
+/*
+ **
+ **
+ ** errortracker grep
+ **
+ **
+ */
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static char** list_recordings(size_t *count) {
+	/* The recordings in the recordings directory, oldest first, since they
+	 * are named by when they started
+	 */
+	char dir[4096], path[4400], **names = NULL, **grown;
+	size_t cap = 0, len, suffix_len = strlen(RECORDING_SUFFIX);
+	struct dirent *dirent;
+	DIR *d;
+
+	*count = 0;
+	recording_dir(dir, sizeof(dir));
+	d = opendir(dir);
+	if (d == NULL)
+		return NULL;
+	while ((dirent = readdir(d)) != NULL) {
+		len = strlen(dirent->d_name);
+		if (len <= suffix_len || strcmp(dirent->d_name + len - suffix_len, RECORDING_SUFFIX) != 0)
+			continue;
+		if (*count == cap) {
+			cap = cap ? cap * 2 : 64;
+			grown = (char **) realloc(names, cap * sizeof(char *));
+			if (grown == NULL)
+				break;
+			names = grown;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+		names[(*count)++] = strdup(path);
+	}
+	closedir(d);
+	if (*count > 1)
+		qsort(names, *count, sizeof(char *), compare_names);
+	return names;
+}
+
+static int check_pattern(const char *pattern, int ignore_case, char **recordings, size_t count) {
+	/* Greps <recordings> for <pattern> with their indexes and without.
+	 * Returns 0 if the two find the same lines, 1 if they don't and -1 if the
+	 * pattern doesn't compile.
+	 */
+	struct recording_grep_stats indexed_stats, full_stats;
+	struct recording_pattern *p;
+	char *indexed = NULL, *full = NULL;
+	size_t indexed_size = 0, full_size = 0, i;
+	FILE *indexed_out, *full_out;
+	int result;
+
+	p = recording_pattern_compile(pattern, ignore_case);
+	if (p == NULL)
+		return -1;
+	memset(&indexed_stats, 0, sizeof(indexed_stats));
+	memset(&full_stats, 0, sizeof(full_stats));
+	indexed_out = open_memstream(&indexed, &indexed_size);
+	full_out = open_memstream(&full, &full_size);
+	if (indexed_out == NULL || full_out == NULL) {
+		perror("open_memstream");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		recording_grep(recordings[i], p, 0, 1, indexed_out, &indexed_stats);
+		recording_grep(recordings[i], p, 0, 0, full_out, &full_stats);
+	}
+	fclose(indexed_out);
+	fclose(full_out);
+
+	result = indexed_size != full_size || memcmp(indexed, full, full_size) != 0;
+	printf("%-8s %s: %" PRIu64 " matches without the index, %" PRIu64 " with it, scanning %" PRIu64 " of %" PRIu64 " bytes\n",
+		result ? "MISMATCH" : "ok", pattern, full_stats.matches, indexed_stats.matches,
+		indexed_stats.bytes_scanned, indexed_stats.bytes);
+	free(indexed);
+	free(full);
+	recording_pattern_free(p);
+	return result;
+}
+
+static int cmd_grep(int argc, char **argv) {
+	static const struct option options[] = {
+		{ "ignore-case", no_argument, NULL, 'i' },
+		{ "files-with-matches", no_argument, NULL, 'l' },
+		{ "reindex", no_argument, NULL, 'R' },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "check", no_argument, NULL, 'K' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct recording_grep_stats stats;
+	struct recording_pattern *pattern;
+	struct timespec started, finished;
+	char **recordings, **listed = NULL;
+	size_t count, i;
+	int opt, ignore_case = 0, files_only = 0, reindex = 0, print_stats = 0, check = 0, matched = 0, r;
+
+	while ((opt = getopt_long(argc, argv, "il", options, NULL)) != -1) {
+		switch (opt) {
+			case 'i': ignore_case = 1; break;
+			case 'l': files_only = 1; break;
+			case 'R': reindex = 1; break;
+			case 'S': print_stats = 1; break;
+			case 'K': check = 1; break;
+			default: usage();
+		}
+	}
+
+	/* The index may only ever narrow a search down, never change what it
+	 * finds; a pattern that doesn't compile here is left out
+	 */
+	if (check) {
+		if (optind < argc) {
+			recordings = argv + optind;
+			count = (size_t) (argc - optind);
+		}
+		else {
+			recordings = listed = list_recordings(&count);
+		}
+		for (i = 0; CHECK_PATTERNS[i] != NULL; i++)
+			if (check_pattern(CHECK_PATTERNS[i], ignore_case, recordings, count) > 0)
+				matched = 1;
+		for (i = 0; listed != NULL && i < count; i++)
+			free(listed[i]);
+		free(listed);
+		return matched;
+	}
+
+	if (optind >= argc)
+		usage();
+	pattern = recording_pattern_compile(argv[optind], ignore_case);
+	if (pattern == NULL)
+		return 1;
+	if (optind + 1 < argc) {
+		recordings = argv + optind + 1;
+		count = (size_t) (argc - optind - 1);
+	}
+	else {
+		recordings = listed = list_recordings(&count);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < count; i++) {
+		/* Catches up the index of a recording whose monitor died, or one
+		 * made before recordings were indexed
+		 */
+		if (reindex && recording_reindex(recordings[i]) != 0)
+			fprintf(stderr, "errortracker: could not index %s\n", recordings[i]);
+		r = recording_grep(recordings[i], pattern, files_only, 1, stdout, &stats);
+		if (r < 0)
+			perror(recordings[i]);
+		else if (r > 0)
+			matched = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	if (print_stats) {
+		fprintf(stderr, "%zu recordings, %" PRIu64 " bytes, %" PRIu64 " scanned (%.1f%%), %" PRIu64 " matches in %.3f s\n",
+			count, stats.bytes, stats.bytes_scanned,
+			stats.bytes ? 100.0 * (double) stats.bytes_scanned / (double) stats.bytes : 0.0, stats.matches,
+			(double) (finished.tv_sec - started.tv_sec) + (double) (finished.tv_nsec - started.tv_nsec) / 1e9);
+	}
+
+	for (i = 0; listed != NULL && i < count; i++)
+		free(listed[i]);
+	free(listed);
+	recording_pattern_free(pattern);
+	return matched ? 0 : 1;
+}
+
+
+int main(int argc, char **argv) {
+	int result;
+
+	if (argc < 2)
+		usage();
+	trace_init("errortracker");
+	git_libgit2_init();
+
+	if (strcmp(argv[1], "maintain") == 0)
+		result = cmd_maintain(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "query") == 0)
+		result = cmd_query(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "run") == 0)
+		result = cmd_run(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "grep") == 0)
+		result = cmd_grep(argc - 1, argv + 1);
+	else
+		usage();
+
+	repo_context_free_all();
+	git_libgit2_shutdown();
+	return result;
+}
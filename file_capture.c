@@ -0,0 +1,211 @@
+/*
+ * Capture of a snapshot's files before they are hashed. See file_capture.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "file_capture.h"
+#include "error_ref.h"
+#include "alloc_stats.h"
+
+static const char* PRIVATE_DIR_NAME = "errortracker";
+static const char* CAPTURE_DIR_NAME = "errortracker/capture";
+/* A capture directory untouched for this long belongs to a crashed process */
+static const time_t STALE_CAPTURE_SECONDS = 60 * 60;
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+static void remove_capture_dir(const char *dir) {
+	struct dirent *dirent;
+	char path[4096];
+	DIR *d = opendir(dir);
+
+	if (d == NULL)
+		return;
+	while ((dirent = readdir(d)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static void sweep_stale(const char *capture_dir, const char *own) {
+	/* Removes the captures of processes that died in the middle of one */
+	struct dirent *dirent;
+	struct stat st;
+	char path[4096];
+	time_t now = time(NULL);
+	DIR *d = opendir(capture_dir);
+
+	if (d == NULL)
+		return;
+	while ((dirent = readdir(d)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", capture_dir, dirent->d_name);
+		/* Our own is left over from an earlier process with our pid */
+		if (strcmp(dirent->d_name, own) == 0 ||
+			(stat(path, &st) == 0 && now - st.st_mtime > STALE_CAPTURE_SECONDS))
+			remove_capture_dir(path);
+	}
+	closedir(d);
+}
+
+struct file_capture* file_capture_begin(const char *git_dir, off_t copy_budget) {
+	struct file_capture *c;
+	char dir[4096], root[4200];
+
+	/* git_repository_path always ends in a '/' */
+	snprintf(dir, sizeof(dir), "%s%s", git_dir, PRIVATE_DIR_NAME);
+	mkdir(dir, 0755);
+	snprintf(dir, sizeof(dir), "%s%s", git_dir, CAPTURE_DIR_NAME);
+	mkdir(dir, 0755);
+	sweep_stale(dir, error_ref_session_name());
+
+	snprintf(root, sizeof(root), "%s/%s", dir, error_ref_session_name());
+	if (mkdir(root, 0700) != 0)
+		return NULL;
+	c = (struct file_capture *) alloc_stats_calloc(ALLOC_SNAPSHOT, 1, sizeof(struct file_capture));
+	if (c == NULL) {
+		rmdir(root);
+		return NULL;
+	}
+	c->copy_budget = copy_budget;
+	strcat(root, "/");
+	c->root = alloc_stats_strdup(ALLOC_SNAPSHOT, root);
+	if (c->root == NULL) {
+		file_capture_end(c);
+		return NULL;
+	}
+	return c;
+}
+
+static int copy_contents(int src, int dst, off_t size) {
+	/* Copies <size> bytes in the kernel if it can, through a buffer if not */
+	char buf[COPY_BUFFER_SIZE];
+	off_t done = 0;
+	ssize_t n = 0, written;
+
+	while (done < size && (n = copy_file_range(src, NULL, dst, NULL, (size_t) (size - done), 0)) > 0)
+		done += n;
+	if (done == size)
+		return 0;
+	/* Unsupported here (old kernel, across filesystems): copy it ourselves */
+	if (done != 0 || n == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP))
+		return -1;
+	while (done < size && (n = read(src, buf, sizeof(buf))) > 0) {
+		for (written = 0; written < n; ) {
+			ssize_t w = write(dst, buf + written, (size_t) (n - written));
+			if (w <= 0)
+				return -1;
+			written += w;
+		}
+		done += n;
+	}
+	return done == size ? 0 : -1;
+}
+
+static int unchanged(int fd, const struct stat *st) {
+	/* Whether the open file still has the size and mtime recorded in <st> */
+	struct stat now;
+	return fstat(fd, &now) == 0 && now.st_size == st->st_size &&
+		now.st_mtim.tv_sec == st->st_mtim.tv_sec && now.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+const char* file_capture_add(struct file_capture *c, const char *abs, const struct stat *st, int clone_only) {
+	char path[4200], *copy, **grown;
+	int src, dst, cloned = 0, result = -1;
+
+	if (!S_ISREG(st->st_mode))
+		return NULL;
+	if (c->copied_bytes + st->st_size > c->copy_budget)
+		clone_only = 1;
+	/* Nothing to gain from opening it */
+	if (clone_only && c->clone_unsupported)
+		return NULL;
+	src = open(abs, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (src < 0)
+		return NULL;
+	if (!unchanged(src, st)) {
+		close(src);
+		return NULL;
+	}
+	snprintf(path, sizeof(path), "%s%zu", c->root, c->count);
+	dst = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (dst < 0) {
+		close(src);
+		return NULL;
+	}
+
+	if (!c->clone_unsupported && ioctl(dst, FICLONE, src) == 0) {
+		cloned = 1;
+		result = 0;
+	}
+	else {
+		/* Not a reflink-capable filesystem, or across filesystems */
+		if (!c->clone_unsupported && (errno == EOPNOTSUPP || errno == EXDEV ||
+			errno == EINVAL || errno == ENOTTY))
+			c->clone_unsupported = 1;
+		if (!clone_only)
+			result = copy_contents(src, dst, st->st_size);
+	}
+	/* Written while we copied it: hash the working tree file instead */
+	if (result == 0 && !unchanged(src, st))
+		result = -1;
+	close(dst);
+	close(src);
+
+	if (result == 0 && c->count == c->cap) {
+		grown = (char **) alloc_stats_realloc(ALLOC_SNAPSHOT, c->paths, (c->cap ? c->cap * 2 : 64) * sizeof(char *));
+		if (grown == NULL) {
+			result = -1;
+		}
+		else {
+			c->paths = grown;
+			c->cap = c->cap ? c->cap * 2 : 64;
+		}
+	}
+	copy = result == 0 ? alloc_stats_strdup(ALLOC_SNAPSHOT, path) : NULL;
+	if (copy == NULL) {
+		unlink(path);
+		return NULL;
+	}
+	c->paths[c->count++] = copy;
+	if (cloned) {
+		c->cloned++;
+	}
+	else {
+		c->copied++;
+		c->copied_bytes += st->st_size;
+	}
+	return copy;
+}
+
+void file_capture_end(struct file_capture *c) {
+	size_t i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->count; i++) {
+		unlink(c->paths[i]);
+		alloc_stats_free(ALLOC_SNAPSHOT, c->paths[i]);
+	}
+	if (c->root != NULL) {
+		rmdir(c->root);
+		alloc_stats_free(ALLOC_SNAPSHOT, c->root);
+	}
+	alloc_stats_free(ALLOC_SNAPSHOT, c->paths);
+	alloc_stats_free(ALLOC_SNAPSHOT, c);
+}
@@ -0,0 +1,62 @@
+/*
+ * Capture of a snapshot's files before they are hashed.
+ *
+ * A snapshot is only right if the files don't change while it is taken, and
+ * reading, hashing and compressing a large dirty set takes long enough for
+ * the build or editor that caused the error to write them again. So a
+ * snapshot is taken in two phases. The capture phase copies every file that
+ * needs hashing into a staging directory under .git/errortracker/capture,
+ * using reflinks (FICLONE) where the filesystem supports them, which share
+ * the data and take microseconds per file, and copy_file_range() otherwise.
+ * The hashing phase then reads the staged copies on the hasher threads, at
+ * whatever pace, while the working tree is free to change again.
+ *
+ * Copying is only worth it for small change sets: a capture copies at most
+ * its copy budget, and files beyond it are only captured if they can be
+ * reflinked. Once the filesystem has refused a reflink, no more are tried.
+ */
+
+#ifndef FILE_CAPTURE_H
+#define FILE_CAPTURE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct file_capture {
+	/* Staging directory, with a trailing '/' */
+	char *root;
+	/* Copies made, as paths the caller reads them from */
+	char **paths;
+	size_t count;
+	size_t cap;
+	/* How they were made */
+	size_t cloned;
+	size_t copied;
+	/* Bytes copied so far, and how many may be */
+	off_t copied_bytes;
+	off_t copy_budget;
+	/* FICLONE failed with EOPNOTSUPP, EXDEV or the like */
+	int clone_unsupported;
+};
+
+/* Starts a capture for the repository with git directory <git_dir> that
+ * copies at most <copy_budget> bytes, removing whatever captures of crashed
+ * processes left behind. Returns NULL if the
+ * staging directory can't be created; callers then read the working tree
+ * directly.
+ */
+struct file_capture* file_capture_begin(const char *git_dir, off_t copy_budget);
+
+/* Captures the file at <abs>, whose lstat() result at the time its snapshot
+ * entry was made is <st>. Returns the path of the copy, valid until
+ * file_capture_end, or NULL if the file isn't captured: it is a symlink (read
+ * atomically anyway), it changed since <st>, or it couldn't be copied. With
+ * <clone_only> set, or the copy budget spent, the file is only captured if it
+ * can be reflinked; used for files too big to copy quickly.
+ */
+const char* file_capture_add(struct file_capture *c, const char *abs, const struct stat *st, int clone_only);
+
+/* Deletes the staged copies and frees the capture */
+void file_capture_end(struct file_capture *c);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Load shedding for the analyzer. See governor.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "governor.h"
+#include "commit_worker.h"
+
+/* How often the pressure is re-evaluated, and the load average re-read */
+static const long long EVALUATE_INTERVAL_MS = 100;
+static const long long LOAD_INTERVAL_MS = 1000;
+/* How long the pressure has to stay below the current level before stepping
+ * down one level
+ */
+static const long long RECOVERY_MS = 2000;
+/* Size of a terminal's input queue (N_TTY_BUF_SIZE), for input that isn't a pipe */
+static const int TTY_BUFFER_BYTES = 4096;
+/* Added to a governed thread's nice value under pressure */
+static const int PRESSURE_NICE = 10;
+
+/* Pressure at which each level is switched to: the fraction of the input
+ * buffer holding unread output, errors journaled but not yet committed, and
+ * the load average per CPU. Any one of them is enough.
+ */
+static const double INPUT_FILL[GOVERNOR_LEVELS] = { 0, 0.25, 0.5, 0.9 };
+static const size_t UNCOMMITTED[GOVERNOR_LEVELS] = { 0, 8, 16, 64 };
+static const double LOAD_PER_CPU[GOVERNOR_LEVELS] = { 0, 1.5, 2.0, 4.0 };
+
+static const char* LEVEL_NAMES[GOVERNOR_LEVELS] = { "full", "prefilter", "sampled", "paused" };
+
+static int input_fd = -1;
+static int input_capacity = 4096;
+static long cpus = 1;
+static double load_per_cpu = 0;
+static volatile int current = GOVERNOR_FULL;
+static long long last_evaluated = 0, last_load = 0, level_since = 0;
+/* When the pressure dropped below the current level, or -1 */
+static long long calm_since = -1;
+static struct governor_stats stats;
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void read_load(void) {
+	/* Without stdio, whose FILE would be allocated on every read */
+	char buf[128];
+	int fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	load_per_cpu = strtod(buf, NULL) / (double) cpus;
+}
+
+static enum governor_level pressure(long long now) {
+	/* The highest level any of the inputs calls for */
+	size_t uncommitted = commit_worker_backlog();
+	double fill;
+	int queued = 0, l, level = GOVERNOR_FULL;
+
+	if (ioctl(input_fd, FIONREAD, &queued) != 0)
+		queued = 0;
+	fill = (double) queued / (double) input_capacity;
+	if (now - last_load >= LOAD_INTERVAL_MS) {
+		read_load();
+		last_load = now;
+	}
+	for (l = GOVERNOR_FULL + 1; l < GOVERNOR_LEVELS; l++)
+		if (fill >= INPUT_FILL[l] || uncommitted >= UNCOMMITTED[l] || load_per_cpu >= LOAD_PER_CPU[l])
+			level = l;
+	return (enum governor_level) level;
+}
+
+static void switch_to(int level, long long now) {
+	__sync_fetch_and_add(&stats.millis[current], (uint64_t) (now - level_since));
+	__sync_fetch_and_add(&stats.entered[level], 1);
+	if (level > current)
+		__sync_fetch_and_add(&stats.degradations, 1);
+	printf("Load shedding: %s -> %s\n", LEVEL_NAMES[current], LEVEL_NAMES[level]);
+	level_since = now;
+	current = level;
+}
+
+void governor_init(int fd) {
+	int capacity;
+
+	input_fd = fd;
+	capacity = fcntl(fd, F_GETPIPE_SZ);
+	input_capacity = capacity > 0 ? capacity : TTY_BUFFER_BYTES;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	memset(&stats, 0, sizeof(stats));
+	stats.entered[GOVERNOR_FULL] = 1;
+	current = GOVERNOR_FULL;
+	level_since = last_evaluated = now_ms();
+	calm_since = -1;
+	read_load();
+	last_load = level_since;
+}
+
+enum governor_level governor_update(size_t bytes) {
+	long long now = now_ms();
+	int target;
+
+	if (input_fd >= 0 && now - last_evaluated >= EVALUATE_INTERVAL_MS) {
+		last_evaluated = now;
+		target = pressure(now);
+		if (target > current) {
+			/* Falling behind: shed as much as it takes straight away */
+			switch_to(target, now);
+			calm_since = -1;
+		}
+		else if (target == current) {
+			calm_since = -1;
+		}
+		else if (calm_since < 0) {
+			calm_since = now;
+		}
+		else if (now - calm_since >= RECOVERY_MS) {
+			/* Recover gradually, so a burst that pauses briefly doesn't
+			 * bounce between the extremes
+			 */
+			switch_to(current - 1, now);
+			calm_since = now;
+		}
+	}
+	__sync_fetch_and_add(&stats.bytes[current], (uint64_t) bytes);
+	return (enum governor_level) current;
+}
+
+enum governor_level governor_level(void) {
+	return (enum governor_level) current;
+}
+
+void governor_adjust_thread(void) {
+	/* Linux applies nice values and policies per thread, so each thread sets
+	 * its own. Getting the priority back needs RLIMIT_NICE headroom or
+	 * CAP_SYS_NICE; where that is refused the thread stays niced, which only
+	 * costs latency while the host is busy anyway. What was refused is only
+	 * tried again once the level changes.
+	 */
+	static __thread int attempted = GOVERNOR_FULL, applied_idle = 0, applied_niced = 0;
+	static __thread int base_nice = 0, have_base = 0;
+	int level = current, idle, niced, result = 0;
+	pid_t tid;
+	struct sched_param param;
+
+	if (level == attempted)
+		return;
+	attempted = level;
+	tid = (pid_t) syscall(SYS_gettid);
+	if (!have_base) {
+		errno = 0;
+		base_nice = getpriority(PRIO_PROCESS, (id_t) tid);
+		if (errno != 0)
+			base_nice = 0;
+		have_base = 1;
+	}
+	idle = level >= GOVERNOR_SAMPLED;
+	niced = level >= GOVERNOR_PREFILTER;
+	memset(&param, 0, sizeof(param));
+	if (idle != applied_idle) {
+		if (sched_setscheduler(tid, idle ? SCHED_IDLE : SCHED_OTHER, &param) == 0)
+			applied_idle = idle;
+		else
+			result = -1;
+	}
+	if (niced != applied_niced) {
+		if (setpriority(PRIO_PROCESS, (id_t) tid, niced ? base_nice + PRESSURE_NICE : base_nice) == 0)
+			applied_niced = niced;
+		else
+			result = -1;
+	}
+	__sync_fetch_and_add(&stats.priority_changes, 1);
+	if (result != 0)
+		__sync_fetch_and_add(&stats.priority_failures, 1);
+}
+
+const char* governor_level_name(enum governor_level level) {
+	return level < GOVERNOR_LEVELS ? LEVEL_NAMES[level] : "unknown";
+}
+
+void governor_get(struct governor_stats *out) {
+	*out = stats;
+	/* Including the time spent at the current level so far */
+	out->millis[current] += (uint64_t) (now_ms() - level_since);
+}
+
+void governor_print(FILE *out) {
+	struct governor_stats s;
+	int l;
+
+	governor_get(&s);
+	fprintf(out, "%-10s %10s %14s %12s\n", "level", "entered", "bytes", "seconds");
+	for (l = 0; l < GOVERNOR_LEVELS; l++)
+		fprintf(out, "%-10s %10llu %14llu %12.1f\n", LEVEL_NAMES[l], (unsigned long long) s.entered[l],
+			(unsigned long long) s.bytes[l], (double) s.millis[l] / 1000.0);
+	fprintf(out, "degradations: %llu, priority changes: %llu (%llu refused), now %s\n",
+		(unsigned long long) s.degradations, (unsigned long long) s.priority_changes,
+		(unsigned long long) s.priority_failures, LEVEL_NAMES[current]);
+}
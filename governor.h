@@ -0,0 +1,78 @@
+/*
+ * Load shedding for the analyzer.
+ *
+ * The analyzer runs next to whatever produces the output it reads, so during a
+ * build or test run that floods the terminal it competes with that build for
+ * CPU, and if it falls behind the terminal blocks the build on a full buffer.
+ * The governor watches how far behind the analyzer is (unread terminal output
+ * and errors not yet committed) and how busy the host is, and sheds work one
+ * level at a time:
+ *
+ *   full       every chunk of output goes through the error pattern
+ *   prefilter  chunks are only searched for the pattern's words, without PCRE
+ *   sampled    only the tail of each command's output is searched, once the
+ *              command finishes
+ *   paused     output is read and thrown away
+ *
+ * Under pressure the commit worker, which calls governor_adjust_thread(), also
+ * drops its scheduling priority: niced at prefilter, SCHED_IDLE from sampled
+ * on. The thread reading the terminal never does, as demoting it would only
+ * leave the build blocked on a fuller buffer.
+ * Pressure raises the level at once; it is lowered one step at a time, once
+ * the pressure has stayed below the current level for a while. Every change
+ * is counted, and the stats are printed when the analyzer exits or gets
+ * SIGUSR1.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum governor_level {
+	GOVERNOR_FULL,
+	GOVERNOR_PREFILTER,
+	GOVERNOR_SAMPLED,
+	GOVERNOR_PAUSED,
+	GOVERNOR_LEVELS
+};
+
+struct governor_stats {
+	uint64_t entered[GOVERNOR_LEVELS];   /* times each level was switched to */
+	uint64_t bytes[GOVERNOR_LEVELS];     /* output read at each level */
+	uint64_t millis[GOVERNOR_LEVELS];    /* time spent at each level */
+	uint64_t degradations;               /* switches to a lower-fidelity level */
+	uint64_t priority_changes;           /* scheduling changes made by threads */
+	uint64_t priority_failures;          /* of which were refused */
+};
+
+/* Starts governing an analyzer that reads its output from <input_fd> */
+void governor_init(int input_fd);
+
+/* Re-evaluates the pressure, at most every few milliseconds, and returns the
+ * level to process the next chunk of output at. <bytes> is the size of that
+ * chunk, counted against the level. Called from the main thread only.
+ */
+enum governor_level governor_update(size_t bytes);
+
+/* The current level; callable from any thread */
+enum governor_level governor_level(void);
+
+/* Brings the calling thread's nice value and scheduling policy in line with
+ * the current level. Cheap when nothing changed. Only for background threads,
+ * never the one reading the analyzer's input.
+ */
+void governor_adjust_thread(void);
+
+/* The level's name as printed in the stats */
+const char* governor_level_name(enum governor_level level);
+
+/* Copies the counters to <out> */
+void governor_get(struct governor_stats *out);
+
+/* Prints the counters */
+void governor_print(FILE *out);
+
+#endif
@@ -0,0 +1,460 @@
+/*
+ * mmap'd journal of pending error events. See journal.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "error_ref.h"
+
+static const char* JOURNAL_DIR_NAME = "errortracker/journal";
+static const char* PRIVATE_DIR_NAME = "errortracker";
+static const char JOURNAL_MAGIC[8] = "ETJRNL2";
+static const size_t JOURNAL_SLOTS = 128;
+/* The header gets a page to itself so the entries stay page-aligned */
+static const size_t JOURNAL_HEADER_SIZE = 4096;
+
+struct journal_header {
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t count;
+};
+
+
+/*
+ **
+ **
+ ** Checksums
+ **
+ **
+ */
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+	uint32_t c, n, k;
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *) data;
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t entry_checksum(const struct journal_entry *entry) {
+	uint32_t crc = crc32_update(0, &entry->seq, sizeof(entry->seq));
+	crc = crc32_update(crc, entry->git_dir, sizeof(entry->git_dir));
+	crc = crc32_update(crc, &entry->event, sizeof(entry->event));
+	crc = crc32_update(crc, &entry->output_len, sizeof(entry->output_len));
+	/* Only the part in use, which for most errors is a fraction of the slot */
+	return crc32_update(crc, entry->output,
+		entry->output_len < sizeof(entry->output) ? entry->output_len : sizeof(entry->output));
+}
+
+
+/*
+ **
+ **
+ ** Opening and adopting journals
+ **
+ **
+ */
+
+static void journal_name(char *out, size_t size) {
+	/* <host>-<pid> comes round again after a reboot, which is just when a
+	 * journal is left behind to adopt; the boot id and the process's start
+	 * time (in clock ticks since boot) make the name this process's alone
+	 */
+	char boot_id[64] = "", stat_line[1024], *paren;
+	unsigned long long start = 0;
+	size_t n;
+	FILE *f;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (f != NULL) {
+		if (fgets(boot_id, sizeof(boot_id), f) == NULL)
+			boot_id[0] = '\0';
+		fclose(f);
+	}
+	/* Its first group is plenty */
+	boot_id[strcspn(boot_id, "-\n")] = '\0';
+	f = fopen("/proc/self/stat", "r");
+	if (f != NULL) {
+		n = fread(stat_line, 1, sizeof(stat_line) - 1, f);
+		stat_line[n] = '\0';
+		fclose(f);
+		/* Field 22, counting from the state that follows the command name */
+		paren = strrchr(stat_line, ')');
+		if (paren != NULL)
+			sscanf(paren + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+				" %*d %*d %*d %*d %*d %*d %llu", &start);
+	}
+	snprintf(out, size, "%s-%s-%llu", error_ref_session_name(), boot_id[0] ? boot_id : "0", start);
+}
+
+static void journal_dir(char *out, size_t size, const char *git_dir) {
+	/* git_repository_path always ends in a '/' */
+	snprintf(out, size, "%s%s", git_dir, PRIVATE_DIR_NAME);
+	mkdir(out, 0755);
+	snprintf(out, size, "%s%s", git_dir, JOURNAL_DIR_NAME);
+	mkdir(out, 0755);
+}
+
+/* An abandoned journal being adopted. It stays locked and mapped until its
+ * entries are safely in ours.
+ */
+struct orphan {
+	char *path;
+	int fd;
+	void *map;
+	size_t map_size;
+	struct journal_entry *slots;
+	size_t count;
+};
+
+static int compare_seq(const void *a, const void *b) {
+	const struct journal_entry *x = *(const struct journal_entry * const *) a;
+	const struct journal_entry *y = *(const struct journal_entry * const *) b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int open_orphan(const char *path, struct orphan *o) {
+	/* Locks and maps the journal at <path> if it belongs to an analyzer that
+	 * has exited. Returns 0 if it did.
+	 */
+	const struct journal_header *header;
+	struct stat st;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	/* Its owner holds the lock for as long as it runs */
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 ||
+		(size_t) st.st_size < JOURNAL_HEADER_SIZE) {
+		close(fd);
+		return -1;
+	}
+	o->map_size = (size_t) st.st_size;
+	o->map = mmap(NULL, o->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (o->map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	header = (const struct journal_header *) o->map;
+	if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+		header->entry_size != sizeof(struct journal_entry) ||
+		JOURNAL_HEADER_SIZE + (size_t) header->count * sizeof(struct journal_entry) > o->map_size) {
+		printf("Ignoring unreadable error journal %s\n", path);
+		munmap(o->map, o->map_size);
+		close(fd);
+		return -1;
+	}
+	o->path = strdup(path);
+	if (o->path == NULL) {
+		munmap(o->map, o->map_size);
+		close(fd);
+		return -1;
+	}
+	o->fd = fd;
+	o->slots = (struct journal_entry *) ((char *) o->map + JOURNAL_HEADER_SIZE);
+	o->count = header->count;
+	return 0;
+}
+
+static void release_orphan(struct orphan *o) {
+	/* Deletes the journal if none of its entries are left, and unlocks it */
+	size_t i;
+	int pending = 0;
+
+	for (i = 0; i < o->count; i++)
+		pending |= o->slots[i].state == JOURNAL_PENDING;
+	if (pending)
+		msync(o->map, o->map_size, MS_SYNC);
+	else
+		unlink(o->path);
+	munmap(o->map, o->map_size);
+	close(o->fd);
+	free(o->path);
+}
+
+static size_t adopt_orphans(const char *dir, const char *own, struct orphan **out_orphans,
+	size_t *out_orphan_count, struct journal_entry ***out) {
+	/* Opens every abandoned journal in <dir> but the one named <own> and
+	 * collects pointers to their valid pending entries, oldest first within
+	 * each journal
+	 */
+	struct orphan *orphans = NULL, *grown_orphans;
+	struct journal_entry **entries = NULL, **grown;
+	size_t count = 0, cap = 0, orphan_count = 0, orphan_cap = 0, first, i;
+	struct dirent *dirent;
+	struct orphan *o;
+	char path[4096];
+	DIR *d = opendir(dir);
+
+	if (d != NULL) {
+		while ((dirent = readdir(d)) != NULL) {
+			if (dirent->d_name[0] == '.' || strcmp(dirent->d_name, own) == 0)
+				continue;
+			if (orphan_count == orphan_cap) {
+				grown_orphans = (struct orphan *) realloc(orphans, (orphan_cap ? orphan_cap * 2 : 4) * sizeof(struct orphan));
+				if (grown_orphans == NULL)
+					break;
+				orphans = grown_orphans;
+				orphan_cap = orphan_cap ? orphan_cap * 2 : 4;
+			}
+			snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+			o = &orphans[orphan_count];
+			if (open_orphan(path, o) != 0)
+				continue;
+			orphan_count++;
+
+			first = count;
+			for (i = 0; i < o->count; i++) {
+				if (o->slots[i].state != JOURNAL_PENDING)
+					continue;
+				if (o->slots[i].checksum != entry_checksum(&o->slots[i])) {
+					printf("Dropping a damaged entry from error journal %s\n", path);
+					o->slots[i].state = JOURNAL_DONE;
+					continue;
+				}
+				if (count == cap) {
+					grown = (struct journal_entry **) realloc(entries, (cap ? cap * 2 : 16) * sizeof(struct journal_entry *));
+					/* What isn't collected stays in the orphan */
+					if (grown == NULL)
+						break;
+					entries = grown;
+					cap = cap ? cap * 2 : 16;
+				}
+				entries[count++] = &o->slots[i];
+			}
+			qsort(entries + first, count - first, sizeof(struct journal_entry *), compare_seq);
+		}
+		closedir(d);
+	}
+	*out_orphans = orphans;
+	*out_orphan_count = orphan_count;
+	*out = entries;
+	return count;
+}
+
+static int create_journal(struct journal *j) {
+	/* Creates, locks and maps the file at j->path. An existing file there
+	 * is someone else's journal and is left alone.
+	 */
+	struct journal_header *header;
+
+	j->count = JOURNAL_SLOTS;
+	j->map_size = JOURNAL_HEADER_SIZE + JOURNAL_SLOTS * sizeof(struct journal_entry);
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (j->fd < 0)
+		return -1;
+	/* An analyzer looking for orphans may hold the lock for a moment, until
+	 * it sees the file is still empty
+	 */
+	if (flock(j->fd, LOCK_EX) != 0 || ftruncate(j->fd, (off_t) j->map_size) != 0) {
+		unlink(j->path);
+		close(j->fd);
+		return -1;
+	}
+	j->map = mmap(NULL, j->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+	if (j->map == MAP_FAILED) {
+		unlink(j->path);
+		close(j->fd);
+		return -1;
+	}
+	header = (struct journal_header *) j->map;
+	memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	header->entry_size = sizeof(struct journal_entry);
+	header->count = (uint32_t) j->count;
+	j->entries = (struct journal_entry *) ((char *) j->map + JOURNAL_HEADER_SIZE);
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->freed, NULL);
+	return 0;
+}
+
+struct journal* journal_open(const char *git_dir) {
+	struct journal *j = (struct journal *) calloc(1, sizeof(struct journal));
+	struct journal_entry **adopted;
+	struct orphan *orphans;
+	char dir[4096], name[256], path[4400];
+	size_t adopted_count, orphan_count, copied, i, slot;
+
+	if (j == NULL)
+		return NULL;
+	if (crc_table[1] == 0)
+		crc_init();
+
+	journal_dir(dir, sizeof(dir), git_dir);
+	journal_name(name, sizeof(name));
+	adopted_count = adopt_orphans(dir, name, &orphans, &orphan_count, &adopted);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	j->path = strdup(path);
+	if (j->path == NULL || create_journal(j) != 0) {
+		perror("error journal");
+		/* The orphans are left untouched for the next analyzer */
+		for (i = 0; i < orphan_count; i++)
+			release_orphan(&orphans[i]);
+		free(orphans);
+		free(adopted);
+		free(j->path);
+		free(j);
+		return NULL;
+	}
+
+	/* An orphan entry is only marked done once its copy is on disk, so a
+	 * crash in between leaves it to be adopted again. More orphans than
+	 * slots is only possible after many crashes in a row; the rest stay in
+	 * their journals for the next analyzer rather than blocking startup.
+	 */
+	copied = adopted_count < j->count ? adopted_count : j->count;
+	for (i = 0; i < copied; i++)
+		journal_append(j, adopted[i]->git_dir, &adopted[i]->event, adopted[i]->output,
+			adopted[i]->output_len, &slot);
+	if (copied > 0 && msync(j->map, j->map_size, MS_SYNC) != 0)
+		copied = 0;
+	for (i = 0; i < copied; i++)
+		adopted[i]->state = JOURNAL_DONE;
+	for (i = 0; i < orphan_count; i++)
+		release_orphan(&orphans[i]);
+	if (copied > 0)
+		printf("Recovered %zu uncommitted errors from a previous session\n", copied);
+	if (copied < adopted_count)
+		printf("Left %zu uncommitted errors from a previous session for later\n", adopted_count - copied);
+	free(orphans);
+	free(adopted);
+	return j;
+}
+
+
+/*
+ **
+ **
+ ** Entries
+ **
+ **
+ */
+
+int journal_append(struct journal *j, const char *git_dir, const struct error_event *event,
+	const char *output, size_t output_len, size_t *slot) {
+	struct journal_entry *entry = NULL;
+	size_t i, start, end;
+
+	pthread_mutex_lock(&j->lock);
+	while (entry == NULL) {
+		for (i = 0; i < j->count; i++) {
+			if (j->entries[i].state != JOURNAL_PENDING) {
+				entry = &j->entries[i];
+				break;
+			}
+		}
+		/* Full: the commit worker is far behind, so detection waits for it */
+		if (entry == NULL)
+			pthread_cond_wait(&j->freed, &j->lock);
+	}
+
+	entry->state = JOURNAL_FREE;
+	entry->seq = j->next_seq++;
+	entry->attempts = 0;
+	memset(entry->git_dir, 0, sizeof(entry->git_dir));
+	snprintf(entry->git_dir, sizeof(entry->git_dir), "%s", git_dir);
+	entry->event = *event;
+	if (output_len > sizeof(entry->output)) {
+		output += output_len - sizeof(entry->output);
+		output_len = sizeof(entry->output);
+	}
+	if (output_len > 0)
+		memcpy(entry->output, output, output_len);
+	entry->output_len = (uint32_t) output_len;
+	entry->checksum = entry_checksum(entry);
+	/* The entry only counts once it is complete */
+	__sync_synchronize();
+	entry->state = JOURNAL_PENDING;
+	*slot = (size_t) (entry - j->entries);
+	pthread_mutex_unlock(&j->lock);
+
+	/* The shared mapping already survives the process dying; this schedules
+	 * the write-back so the entry also survives the machine going down
+	 */
+	start = (size_t) ((char *) entry - (char *) j->map) & ~(size_t) 4095;
+	end = (size_t) ((char *) (entry + 1) - (char *) j->map);
+	msync((char *) j->map + start, end - start, MS_ASYNC);
+	return 0;
+}
+
+size_t journal_pending(struct journal *j, size_t *slots, size_t max) {
+	size_t i, k, count = 0, tmp;
+
+	pthread_mutex_lock(&j->lock);
+	for (i = 0; i < j->count && count < max; i++)
+		if (j->entries[i].state == JOURNAL_PENDING)
+			slots[count++] = i;
+	/* Oldest first; there are at most a few hundred */
+	for (i = 1; i < count; i++) {
+		for (k = i; k > 0 && j->entries[slots[k - 1]].seq > j->entries[slots[k]].seq; k--) {
+			tmp = slots[k];
+			slots[k] = slots[k - 1];
+			slots[k - 1] = tmp;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	return count;
+}
+
+uint32_t journal_complete(struct journal *j, size_t slot, int committed) {
+	uint32_t attempts;
+
+	pthread_mutex_lock(&j->lock);
+	if (committed) {
+		j->entries[slot].state = JOURNAL_DONE;
+		pthread_cond_signal(&j->freed);
+	}
+	else {
+		j->entries[slot].attempts++;
+	}
+	attempts = j->entries[slot].attempts;
+	pthread_mutex_unlock(&j->lock);
+	return attempts;
+}
+
+void journal_discard(struct journal *j, size_t slot) {
+	pthread_mutex_lock(&j->lock);
+	j->entries[slot].state = JOURNAL_DONE;
+	pthread_cond_signal(&j->freed);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_close(struct journal *j) {
+	size_t i;
+	int pending = 0;
+
+	if (j == NULL)
+		return;
+	for (i = 0; i < j->count; i++)
+		pending |= j->entries[i].state == JOURNAL_PENDING;
+	msync(j->map, j->map_size, MS_SYNC);
+	munmap(j->map, j->map_size);
+	/* Left in place, the next analyzer to open this repository adopts it */
+	if (!pending)
+		unlink(j->path);
+	close(j->fd);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->freed);
+	free(j->path);
+	free(j);
+}
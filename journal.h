@@ -0,0 +1,95 @@
+/*
+ * Crash-safe journal of detected errors that have yet to be committed.
+ *
+ * Taking a snapshot can take a while, and an analyzer that dies in the middle
+ * of one would lose the error. So detection only appends the event to a
+ * journal, a fixed array of checksummed slots in a file mmap()ed from
+ * .git/errortracker/journal/<host>-<pid>-<boot>-<start> (the boot id and the
+ * process's start time keep a name from coming round again), and snapshots
+ * are taken from the journal later by the commit worker (see
+ * commit_worker.h). A slot is marked done once its commit is on the branch.
+ *
+ * The analyzer holds an flock on its journal for as long as it runs. Any
+ * journal in the directory that can be locked therefore belongs to an analyzer
+ * that has exited, and its unfinished entries are adopted: copied into the
+ * adopter's journal and committed from there. Entries are committed at least
+ * once; a crash at the wrong moment can cause one to be committed twice.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "error_event.h"
+#include "output_tail.h"
+
+#define JOURNAL_MAX_GIT_DIR 1024
+
+struct journal_entry {
+	uint32_t state;           /* JOURNAL_* below */
+	uint32_t checksum;        /* CRC-32 of seq, git_dir, event and output */
+	uint64_t seq;             /* order in which entries were appended */
+	uint32_t attempts;        /* failed attempts at committing it */
+	uint32_t output_len;      /* bytes used in output */
+	char git_dir[JOURNAL_MAX_GIT_DIR];
+	struct error_event event;
+	/* The end of the command's output up to the error (see output_tail.h) */
+	char output[OUTPUT_TAIL_BYTES];
+};
+
+enum {
+	JOURNAL_FREE = 0,
+	JOURNAL_PENDING = 1,
+	JOURNAL_DONE = 2
+};
+
+struct journal {
+	char *path;
+	int fd;
+	void *map;
+	size_t map_size;
+	struct journal_entry *entries;
+	size_t count;
+	uint64_t next_seq;
+	/* Serializes slot state changes between the analyzer and the commit
+	 * worker; <freed> is signalled whenever a slot becomes free
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+};
+
+/* Creates this process's journal in the git directory <git_dir> and adopts
+ * the unfinished entries of journals left behind there. Returns NULL on
+ * failure.
+ */
+struct journal* journal_open(const char *git_dir);
+
+/* Appends <event>, to be committed to the repository at <git_dir> along with
+ * the <output_len> bytes of <output> leading up to it, waiting for a free slot
+ * if the journal is full. Output beyond OUTPUT_TAIL_BYTES is cut from the
+ * front. Stores the slot in <slot>. Returns 0 once the entry is in the
+ * journal, -1 on failure.
+ */
+int journal_append(struct journal *j, const char *git_dir, const struct error_event *event,
+	const char *output, size_t output_len, size_t *slot);
+
+/* Lists the slots of pending entries, oldest first, in <slots> (at most
+ * <max>), returning how many there are
+ */
+size_t journal_pending(struct journal *j, size_t *slots, size_t max);
+
+/* Records the outcome of committing the entry in <slot>: it is done if
+ * <committed> is set, otherwise its attempt count goes up. Returns the
+ * number of failed attempts so far.
+ */
+uint32_t journal_complete(struct journal *j, size_t slot, int committed);
+
+/* Gives the entry in <slot> up after too many failed attempts */
+void journal_discard(struct journal *j, size_t slot);
+
+/* Unmaps and closes the journal, deleting its file if nothing is pending */
+void journal_close(struct journal *j);
+
+#endif
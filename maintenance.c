@@ -0,0 +1,421 @@
+/*
+ * Retention, repacking and commit-graph upkeep for the _error branch.
+ * See maintenance.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "maintenance.h"
+#include "errindex.h"
+#include "error_ref.h"
+
+static const char* ERROR_REF_NAME = "refs/heads/_error";
+static const char* MASTER_REF_NAME = "refs/heads/master";
+
+/* Commits rewritten between duty-cycle pauses */
+static const size_t REWRITE_CHUNK = 64;
+/* Attempts at moving _error when new errors keep arriving during a rewrite */
+static const int MAX_REF_ATTEMPTS = 5;
+/* Session refs of other hosts are folded once they haven't moved for this long */
+static const int64_t SESSION_STALE_AFTER = 7 * 24 * 60 * 60;
+/* Length of one on/off period when throttling a git child process */
+static const long THROTTLE_PERIOD_MS = 100;
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+
+/*
+ **
+ **
+ ** Staying out of the way
+ **
+ **
+ */
+
+void maintenance_lower_priority(void) {
+	struct sched_param param;
+
+	if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+		perror("setpriority");
+	memset(&param, 0, sizeof(param));
+	if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+		perror("sched_setscheduler");
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+		perror("ioprio_set");
+}
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double seconds) {
+	struct timespec ts;
+	if (seconds <= 0)
+		return;
+	ts.tv_sec = (time_t) seconds;
+	ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+static void duty_pause(const struct maintenance_budget *budget, double busy_since) {
+	/* Sleeps long enough that the work done since <busy_since> stays within
+	 * the duty cycle
+	 */
+	double busy = now_seconds() - busy_since;
+	unsigned int duty = budget->duty_percent;
+	if (duty == 0 || duty >= 100)
+		return;
+	sleep_seconds(busy * (100 - duty) / duty);
+}
+
+static int run_git(struct repo_context *ctx, const struct maintenance_budget *budget, char *const args[]) {
+	/* Runs `git --git-dir=<repo> <args>` in its own process group, stopping and
+	 * continuing the group so it only runs for the budget's share of the time
+	 */
+	char git_dir[4096];
+	char *argv[32];
+	size_t i, n = 0;
+	long on_ms, off_ms;
+	int status;
+	pid_t pid, done;
+	struct timespec on, off;
+
+	snprintf(git_dir, sizeof(git_dir), "--git-dir=%s", git_repository_path(ctx->repo));
+	argv[n++] = "git";
+	argv[n++] = git_dir;
+	for (i = 0; args[i] != NULL && n < 31; i++)
+		argv[n++] = args[i];
+	argv[n] = NULL;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		setpgid(0, 0);
+		execvp("git", argv);
+		perror("execvp git");
+		_exit(127);
+	}
+	setpgid(pid, pid);
+
+	on_ms = THROTTLE_PERIOD_MS * (budget->duty_percent ? budget->duty_percent : 100) / 100;
+	off_ms = THROTTLE_PERIOD_MS - on_ms;
+	on.tv_sec = on_ms / 1000;
+	on.tv_nsec = (on_ms % 1000) * 1000000;
+	off.tv_sec = off_ms / 1000;
+	off.tv_nsec = (off_ms % 1000) * 1000000;
+
+	while ((done = waitpid(pid, &status, WNOHANG)) == 0) {
+		nanosleep(&on, NULL);
+		if (off_ms <= 0)
+			continue;
+		kill(-pid, SIGSTOP);
+		nanosleep(&off, NULL);
+		kill(-pid, SIGCONT);
+	}
+	if (done < 0) {
+		perror("waitpid");
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+
+/*
+ **
+ **
+ ** Retention
+ **
+ **
+ */
+
+void retention_policy_from_config(struct retention_policy *policy, git_repository *repo) {
+	git_config *config;
+	int64_t value;
+
+	memset(policy, 0, sizeof(*policy));
+	if (git_repository_config(&config, repo) != 0)
+		return;
+	if (git_config_get_int64(&value, config, "errortracker.maxAge") == 0 && value > 0)
+		policy->max_age = value * 24 * 60 * 60;
+	if (git_config_get_int64(&value, config, "errortracker.maxCount") == 0 && value > 0)
+		policy->max_count = (size_t) value;
+	if (git_config_get_int64(&value, config, "errortracker.maxSize") == 0 && value > 0)
+		policy->max_bytes = (uint64_t) value;
+	git_config_free(config);
+}
+
+static uint64_t tree_added_bytes(git_repository *repo, git_odb *odb, const git_oid *tree_id, const git_oid *parent_id) {
+	/* Returns the total size of the blobs in <tree_id> that aren't at the same
+	 * path in <parent_id>. Only subtrees whose ids differ are visited, so this
+	 * costs about as much as the change between the two trees.
+	 */
+	git_tree *tree = NULL, *parent = NULL;
+	const git_tree_entry *entry, *old;
+	size_t i, count, len;
+	git_object_t type;
+	uint64_t total = 0;
+
+	if (parent_id != NULL && git_oid_equal(tree_id, parent_id))
+		return 0;
+	if (git_tree_lookup(&tree, repo, tree_id) != 0)
+		return 0;
+	if (parent_id != NULL)
+		git_tree_lookup(&parent, repo, parent_id);
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		entry = git_tree_entry_byindex(tree, i);
+		old = parent ? git_tree_entry_byname(parent, git_tree_entry_name(entry)) : NULL;
+		if (old != NULL && git_oid_equal(git_tree_entry_id(entry), git_tree_entry_id(old)))
+			continue;
+		if (git_tree_entry_type(entry) == GIT_OBJECT_TREE)
+			total += tree_added_bytes(repo, odb, git_tree_entry_id(entry),
+				old && git_tree_entry_type(old) == GIT_OBJECT_TREE ? git_tree_entry_id(old) : NULL);
+		else if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB &&
+			git_odb_read_header(&len, &type, odb, git_tree_entry_id(entry)) == 0)
+			total += len;
+	}
+	git_tree_free(parent);
+	git_tree_free(tree);
+	return total;
+}
+
+static size_t list_snapshots(git_repository *repo, const git_oid *tip, const git_oid *stop, git_oid **out) {
+	/* Lists the first-parent history of <tip>, newest first, that isn't
+	 * reachable from master (or from <stop>, if given)
+	 */
+	git_revwalk *walk;
+	git_oid id, master, *list = NULL, *grown;
+	size_t count = 0, cap = 0;
+
+	*out = NULL;
+	if (git_revwalk_new(&walk, repo) != 0)
+		return 0;
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
+	git_revwalk_simplify_first_parent(walk);
+	git_revwalk_push(walk, tip);
+	if (git_reference_name_to_id(&master, repo, MASTER_REF_NAME) == 0)
+		git_revwalk_hide(walk, &master);
+	if (stop != NULL)
+		git_revwalk_hide(walk, stop);
+
+	while (git_revwalk_next(&id, walk) == 0) {
+		if (count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			grown = (git_oid *) realloc(list, cap * sizeof(git_oid));
+			if (grown == NULL)
+				break;
+			list = grown;
+		}
+		git_oid_cpy(&list[count++], &id);
+	}
+	git_revwalk_free(walk);
+	*out = list;
+	return count;
+}
+
+static size_t snapshots_to_keep(struct repo_context *ctx, const git_oid *list, size_t count,
+	const struct retention_policy *policy) {
+	/* Returns how many of the newest snapshots in <list> the policy keeps */
+	time_t now = time(NULL);
+	uint64_t bytes = 0;
+	git_commit *commit;
+	size_t keep;
+
+	for (keep = 0; keep < count; keep++) {
+		if (policy->max_count && keep >= policy->max_count)
+			break;
+		if (git_commit_lookup(&commit, ctx->repo, &list[keep]) != 0)
+			break;
+		if (policy->max_age && now - (time_t) git_commit_time(commit) > policy->max_age) {
+			git_commit_free(commit);
+			break;
+		}
+		if (policy->max_bytes) {
+			git_commit *parent = NULL;
+			if (git_commit_parentcount(commit) > 0)
+				git_commit_parent(&parent, commit, 0);
+			bytes += tree_added_bytes(ctx->repo, ctx->odb, git_commit_tree_id(commit),
+				parent ? git_commit_tree_id(parent) : NULL);
+			git_commit_free(parent);
+			if (bytes > policy->max_bytes) {
+				git_commit_free(commit);
+				break;
+			}
+		}
+		git_commit_free(commit);
+	}
+	/* The newest snapshot always survives */
+	return keep ? keep : 1;
+}
+
+static int replay_commits(struct repo_context *ctx, const git_oid *list, size_t count,
+	const git_oid *onto, git_oid *new_tip, const struct maintenance_budget *budget) {
+	/* Re-creates the commits list[count-1] (oldest) .. list[0] (newest) on top of
+	 * <onto> (NULL for a root commit), keeping their trees, messages and
+	 * signatures. Stores the id of the last one in <new_tip>.
+	 */
+	git_oid parent_id;
+	double busy_since = now_seconds();
+	size_t i;
+	int result = 0;
+
+	if (onto != NULL)
+		git_oid_cpy(&parent_id, onto);
+	for (i = count; i-- > 0 && result == 0; ) {
+		result = error_ref_replay(ctx->repo, &list[i],
+			onto != NULL || i != count - 1 ? &parent_id : NULL, &parent_id);
+
+		if ((count - i) % REWRITE_CHUNK == 0) {
+			duty_pause(budget, busy_since);
+			busy_since = now_seconds();
+		}
+	}
+	if (result == 0)
+		git_oid_cpy(new_tip, &parent_id);
+	return result;
+}
+
+static int apply_retention(struct repo_context *ctx, const struct retention_policy *policy,
+	const struct maintenance_budget *budget) {
+	/* Drops the snapshots the policy doesn't keep by re-parenting the oldest
+	 * survivor onto the commit _error branched off from. Errors recorded while
+	 * the rewrite runs are replayed on top before the ref is moved.
+	 */
+	git_oid *list, *newer, old_tip, new_tip, base;
+	git_commit *oldest;
+	size_t count, keep, n_newer;
+	int has_base, attempt, result;
+
+	if (!ctx->has_error_tip)
+		return 0;
+	git_oid_cpy(&old_tip, &ctx->error_tip);
+	count = list_snapshots(ctx->repo, &old_tip, NULL, &list);
+	if (count == 0) {
+		free(list);
+		return 0;
+	}
+	keep = snapshots_to_keep(ctx, list, count, policy);
+	if (keep >= count) {
+		printf("Keeping all %zu snapshots\n", count);
+		free(list);
+		return 0;
+	}
+
+	/* The parent of the oldest snapshot is where _error forked off */
+	if ((result = git_commit_lookup(&oldest, ctx->repo, &list[count - 1])) != 0) {
+		free(list);
+		return result;
+	}
+	has_base = git_commit_parentcount(oldest) > 0;
+	if (has_base)
+		git_oid_cpy(&base, git_commit_parent_id(oldest, 0));
+	git_commit_free(oldest);
+
+	printf("Dropping %zu of %zu snapshots\n", count - keep, count);
+	result = replay_commits(ctx, list, keep, has_base ? &base : NULL, &new_tip, budget);
+	free(list);
+
+	for (attempt = 0; result == 0 && attempt < MAX_REF_ATTEMPTS; attempt++) {
+		if ((result = repo_context_flush_objects(ctx)) != 0)
+			break;
+		result = error_ref_swap(ctx->repo, ERROR_REF_NAME, &new_tip, &old_tip,
+			"errortracker: apply retention policy");
+		if (result == 0) {
+			repo_context_set_error_tip(ctx, &new_tip);
+			return 0;
+		}
+		if (result != GIT_EMODIFIED)
+			break;
+
+		/* New errors arrived; carry them over onto the rewritten history */
+		repo_context_refresh(ctx);
+		n_newer = list_snapshots(ctx->repo, &ctx->error_tip, &old_tip, &newer);
+		git_oid_cpy(&old_tip, &ctx->error_tip);
+		result = replay_commits(ctx, newer, n_newer, &new_tip, &new_tip, budget);
+		free(newer);
+	}
+	return result;
+}
+
+
+/*
+ **
+ **
+ ** Entry point
+ **
+ **
+ */
+
+int maintain_error_branch(struct repo_context *ctx, const struct retention_policy *policy,
+	const struct maintenance_budget *budget) {
+	char *expire_reflog[] = { "reflog", "expire", "--expire-unreachable=now", (char *) ERROR_REF_NAME, NULL };
+	char *repack[] = { "-c", "pack.threads=1", "repack", "-a", "-d", "-l", "-q",
+		"--window-memory=64m", NULL };
+	char *commit_graph[] = { "commit-graph", "write", "--reachable", "--split", NULL };
+	git_oid old_tip;
+	int had_tip, result;
+
+	/* Sessions whose analyzer died before folding them; done first so their
+	 * errors are subject to the retention policy like any other
+	 */
+	if (error_ref_fold_abandoned(ctx, SESSION_STALE_AFTER) != 0)
+		printf("Failed to fold some abandoned session refs\n");
+
+	repo_context_refresh(ctx);
+	had_tip = ctx->has_error_tip;
+	if (had_tip)
+		git_oid_cpy(&old_tip, &ctx->error_tip);
+	if ((result = apply_retention(ctx, policy, budget)) != 0) {
+		const git_error *e = git_error_last();
+		printf("Failed to apply the retention policy: %s\n", e ? e->message : "unknown error");
+		return result;
+	}
+
+	/* Rewriting history gave every surviving snapshot a new commit id, so the
+	 * error index is rebuilt from the trailers; otherwise its segments are
+	 * just merged
+	 */
+	if (had_tip && ctx->has_error_tip && !git_oid_equal(&old_tip, &ctx->error_tip))
+		result = errindex_rebuild(ctx->repo, ERROR_REF_NAME, MASTER_REF_NAME);
+	else
+		result = errindex_compact(git_repository_path(ctx->repo));
+	if (result != 0)
+		printf("Failed to update the error index\n");
+	if (budget->no_repack)
+		return 0;
+
+	/* The dropped snapshots are only reachable from the reflog now. A full
+	 * repack puts the survivors in one pack with master's objects, where the
+	 * snapshot blobs delta against the files they were edited from, and
+	 * replaces the one-pack-per-error packs left by the analyzer
+	 */
+	if (run_git(ctx, budget, expire_reflog) != 0)
+		printf("Failed to expire the _error reflog\n");
+	if ((result = run_git(ctx, budget, repack)) != 0) {
+		printf("git repack failed with status %d\n", result);
+		return result;
+	}
+	if ((result = run_git(ctx, budget, commit_graph)) != 0) {
+		printf("git commit-graph failed with status %d\n", result);
+		return result;
+	}
+	git_odb_refresh(ctx->odb);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Background upkeep of the _error branch.
+ *
+ * The _error branch only ever grows: every error adds a commit, a tree and
+ * whatever blobs changed, and each commit arrives as its own small packfile.
+ * maintain_error_branch() keeps it bounded. It drops the oldest snapshots
+ * according to a retention policy, repacks what survives so snapshot blobs
+ * become deltas against the rest of the repository, and keeps a commit-graph
+ * file so walking _error stays fast. All of it runs at idle CPU and I/O
+ * priority and is throttled to a duty cycle, so it never competes with
+ * interactive work.
+ */
+
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include <stdint.h>
+#include "repo_context.h"
+
+/* Snapshots are kept, newest first, until any limit is reached; 0 means no limit */
+struct retention_policy {
+	int64_t max_age;      /* seconds */
+	size_t max_count;     /* commits */
+	uint64_t max_bytes;   /* bytes of blobs a snapshot added over its parent */
+};
+
+struct maintenance_budget {
+	/* Percentage of wall-clock time maintenance may run for (1-100) */
+	unsigned int duty_percent;
+	/* Skip the repack and commit-graph steps */
+	int no_repack;
+};
+
+/* Fills <policy> from git config errortracker.maxAge (days),
+ * errortracker.maxCount and errortracker.maxSize
+ */
+void retention_policy_from_config(struct retention_policy *policy, git_repository *repo);
+
+/* Lowers the calling process to idle CPU and I/O scheduling */
+void maintenance_lower_priority(void);
+
+/* Runs one round of maintenance on the repository behind <ctx>. Returns 0 on
+ * success, or the libgit2 error code of the step that failed.
+ */
+int maintain_error_branch(struct repo_context *ctx, const struct retention_policy *policy,
+	const struct maintenance_budget *budget);
+
+#endif
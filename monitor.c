@@ -8,6 +8,10 @@
 #include <sys/select.h>
 #include <termios.h>
 #include "create_error_commit.h"
+#include "shell_proc.h"
+#include "probes.h"
+#include "trace.h"
+#include "recording.h"
 
 const int STDIN = 0;
 const int STDOUT = 1;
@@ -15,6 +19,14 @@ const int STDERR = 2;
 const int BUF_SIZE = 256;
 const int MAX_SLAVENAME = 1000;
 
+/* The typescript of the session, with its trigram index (see recording.h) */
+static struct recording *recording = NULL;
+
+static void close_recording(void) {
+  recording_close(recording);
+  recording = NULL;
+}
+
 
 void monitor_pty(fd_set *read_set, int pty_master_fd, int analyzer_fd, char* buf) {
 
@@ -23,6 +35,7 @@ void monitor_pty(fd_set *read_set, int pty_master_fd, int analyzer_fd, char* buf
        * the <read_set> file-descriptor-set
        */
       int num_read;
+      struct trace_span span;
       FD_SET(STDIN, read_set);
       FD_SET(pty_master_fd, read_set);
       FD_SET(analyzer_fd, read_set);
@@ -30,9 +43,11 @@ void monitor_pty(fd_set *read_set, int pty_master_fd, int analyzer_fd, char* buf
       /* Filter out all file-descriptors that aren't ready to be read 
        * so that read_set only includes file descriptors from which we can read.
        */
+      TRACE_BEGIN(&span, "monitor_select");
       if (select(analyzer_fd + 1, read_set, NULL, NULL, NULL) == -1) {
           perror("select");
       }
+      TRACE_END(&span);
 
       /* Temporary - flag for reading analyzer output */
       int read_analyzer = 1;
@@ -44,12 +59,16 @@ void monitor_pty(fd_set *read_set, int pty_master_fd, int analyzer_fd, char* buf
        */
       if (FD_ISSET(STDIN, read_set)) {   
           /* Read the STDIN into the buffer */
+          TRACE_BEGIN(&span, "monitor_input");
           num_read = read(STDIN, buf, BUF_SIZE);
           if (num_read <= 0)
               exit(EXIT_SUCCESS);
+          PROBE2(monitor_read, STDIN, num_read);
           /* Write from the buffer to the pty master */
           if (write(pty_master_fd, buf, num_read) != num_read)
               perror("partial/failed write (pty_master_fd)");
+          PROBE2(monitor_write, pty_master_fd, num_read);
+          TRACE_END(&span);
 
           /* Write from the buffer to the analyzer fd */
           /*
@@ -65,15 +84,23 @@ void monitor_pty(fd_set *read_set, int pty_master_fd, int analyzer_fd, char* buf
 
       if (FD_ISSET(pty_master_fd, read_set)) {    
           /* Read the pty (bash) output into buf */
+          TRACE_BEGIN(&span, "monitor_output");
           num_read = read(pty_master_fd, buf, BUF_SIZE);  
           if (num_read <= 0)
               exit(EXIT_SUCCESS);
+          PROBE2(monitor_read, pty_master_fd, num_read);
 
           /* Write from the buffer to the terminal STDOUT and the analyzer fd */  
           if (write(STDOUT, buf, num_read) != num_read)
               perror("partial/failed write (STDOUT)");
+          if (recording != NULL && recording_write(recording, buf, num_read) != 0) {
+              perror("partial/failed write (typescript)");
+              close_recording();
+          }
           if (write(analyzer_fd, buf, num_read) != num_read)
               perror("partial/failed write (analyzer_fd)");
+          PROBE2(monitor_write, analyzer_fd, num_read);
+          TRACE_END(&span);
       }
 
       /* Process output from the analyzer fd; currently, we write it to the terminal
@@ -126,7 +153,7 @@ int main(int argc, char* argv[]) {
   //  sruct winsize win;
   struct termios tty_orig;
   struct winsize ws;
-  int pty_master_fd, script_fd;
+  int pty_master_fd;
   char slave_filename[MAX_SLAVENAME];
   pid_t pid, analyzer_pid;
   int slave_filedes;
@@ -134,6 +161,9 @@ int main(int argc, char* argv[]) {
   fd_set read_set;
   int num_read;
 
+  /* ERRORTRACKER_TRACE is passed down, so the analyzer traces to the same file */
+  trace_init("monitor");
+
   /* Retrieve the attributes of terminal on which we are started */
 
   if (tcgetattr(STDIN, &tty_orig) == -1)
@@ -170,14 +200,6 @@ int main(int argc, char* argv[]) {
    * won't execute this code
    */
 
-   /* Open auxilliary FDs to which we write our output */
-  script_fd = open((argc > 1) ? argv[1] : "typescript",
-                      O_WRONLY | O_CREAT | O_TRUNC,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
-                              S_IROTH | S_IWOTH);
-  if (script_fd == -1)
-      perror("open typescript");
-
   /* Initialize variables for forking off the terminal-output-analyzer program in
    * a separate PTY
    */
@@ -200,10 +222,26 @@ int main(int argc, char* argv[]) {
     if (shell == NULL || *shell == '\0')
         shell = "/bin/sh";
 
+    /* Lets the analyzer look up which command the shell is running */
+    char shell_pid[32];
+    snprintf(shell_pid, sizeof(shell_pid), "%d", (int) pid);
+    setenv(SHELL_PID_ENV, shell_pid, 1);
+
     execlp("analyzer", "analyzer", (char *) NULL);
     return 0;
   }
 
+  /* Record the session to the file given, or to a new one in the
+   * recordings directory, for errortracker grep. Only once both children
+   * are forked: the recording has a thread indexing it, which a fork
+   * wouldn't carry over.
+   */
+  recording = recording_open((argc > 1) ? argv[1] : NULL);
+  if (recording == NULL)
+      perror("open typescript");
+  else
+      atexit(close_recording);
+
   /* Parent process - monitor user input to the terminal and process it.
    * This call (to monitor_terminal) results in an infinite while loop until the terminal itself
    * is closed or this program is terminated
@@ -0,0 +1,41 @@
+/*
+ * Ring of a command's last output. See output_tail.h.
+ */
+
+#include <string.h>
+#include "output_tail.h"
+
+void output_tail_reset(struct output_tail *tail) {
+	tail->head = 0;
+	tail->len = 0;
+}
+
+void output_tail_append(struct output_tail *tail, const char *data, size_t len) {
+	size_t n;
+
+	/* Only the last OUTPUT_TAIL_BYTES of <data> can survive anyway */
+	if (len > OUTPUT_TAIL_BYTES) {
+		data += len - OUTPUT_TAIL_BYTES;
+		len = OUTPUT_TAIL_BYTES;
+	}
+	while (len > 0) {
+		n = OUTPUT_TAIL_BYTES - tail->head;
+		if (n > len)
+			n = len;
+		memcpy(tail->data + tail->head, data, n);
+		tail->head = (tail->head + n) % OUTPUT_TAIL_BYTES;
+		tail->len = tail->len + n > OUTPUT_TAIL_BYTES ? OUTPUT_TAIL_BYTES : tail->len + n;
+		data += n;
+		len -= n;
+	}
+}
+
+size_t output_tail_copy(const struct output_tail *tail, size_t max, char *out) {
+	size_t n = max < tail->len ? max : tail->len;
+	size_t start = (tail->head + OUTPUT_TAIL_BYTES - n) % OUTPUT_TAIL_BYTES;
+	size_t first = OUTPUT_TAIL_BYTES - start < n ? OUTPUT_TAIL_BYTES - start : n;
+
+	memcpy(out, tail->data + start, first);
+	memcpy(out + first, tail->data, n - first);
+	return n;
+}
@@ -0,0 +1,36 @@
+/*
+ * The last stretch of a command's output.
+ *
+ * The chunk of output an error was detected in is rarely enough to tell what
+ * went wrong: the compiler's first complaint, the failing test's name and the
+ * command's own summary are usually a few screens apart. The analyzer keeps
+ * the last OUTPUT_TAIL_BYTES of the current command's output in a ring, and
+ * an error's snapshot stores it as .errortracker/output.log, so memory stays
+ * bounded and recordings never have to be read back.
+ */
+
+#ifndef OUTPUT_TAIL_H
+#define OUTPUT_TAIL_H
+
+#include <stddef.h>
+
+#define OUTPUT_TAIL_BYTES (16 * 1024)
+
+struct output_tail {
+	char data[OUTPUT_TAIL_BYTES];
+	size_t head;   /* where the next byte goes */
+	size_t len;    /* bytes held, at most OUTPUT_TAIL_BYTES */
+};
+
+/* Empties <tail>, for a new command */
+void output_tail_reset(struct output_tail *tail);
+
+/* Appends <len> bytes of output, overwriting the oldest once full */
+void output_tail_append(struct output_tail *tail, const char *data, size_t len);
+
+/* Copies the last <max> bytes held (or all of them, if fewer) to <out> in
+ * order, returning how many were copied
+ */
+size_t output_tail_copy(const struct output_tail *tail, size_t max, char *out);
+
+#endif
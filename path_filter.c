@@ -0,0 +1,242 @@
+/*
+ * Compiled .errortrackerignore patterns. See path_filter.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "path_filter.h"
+
+#define MAX_COMPONENTS 256
+
+/* What a pattern ending at a trie node matches */
+#define MATCH_ANY 1    /* a file or a directory */
+#define MATCH_DIR 2    /* only a directory (pattern ended in '/') */
+
+struct trie_node;
+
+struct trie_edge {
+	char *component;
+	struct trie_node *node;
+};
+
+struct trie_node {
+	int match;
+
+	/* Literal components, sorted once compiled so they can be binary searched */
+	struct trie_edge *literal;
+	size_t n_literal;
+	/* Components containing wildcards, tried one by one with fnmatch */
+	struct trie_edge *glob;
+	size_t n_glob;
+	/* A "**" component */
+	struct trie_node *any_depth;
+};
+
+struct path_filter {
+	struct trie_node root;
+	size_t patterns;
+};
+
+
+/*
+ **
+ **
+ ** Compiling patterns
+ **
+ **
+ */
+
+static struct trie_node* edge_target(struct trie_edge **edges, size_t *count, const char *component) {
+	/* Returns the node reached from <edges> by <component>, adding it if needed */
+	struct trie_edge *grown;
+	size_t i;
+
+	for (i = 0; i < *count; i++)
+		if (strcmp((*edges)[i].component, component) == 0)
+			return (*edges)[i].node;
+
+	grown = (struct trie_edge *) realloc(*edges, (*count + 1) * sizeof(struct trie_edge));
+	if (grown == NULL)
+		return NULL;
+	*edges = grown;
+	grown[*count].component = strdup(component);
+	grown[*count].node = (struct trie_node *) calloc(1, sizeof(struct trie_node));
+	if (grown[*count].component == NULL || grown[*count].node == NULL)
+		return NULL;
+	return grown[(*count)++].node;
+}
+
+static struct trie_node* child_for(struct trie_node *node, const char *component) {
+	if (strcmp(component, "**") == 0) {
+		if (node->any_depth == NULL)
+			node->any_depth = (struct trie_node *) calloc(1, sizeof(struct trie_node));
+		return node->any_depth;
+	}
+	if (strpbrk(component, "*?[\\") != NULL)
+		return edge_target(&node->glob, &node->n_glob, component);
+	return edge_target(&node->literal, &node->n_literal, component);
+}
+
+static int add_pattern(struct path_filter *filter, char *pattern) {
+	/* Adds one pattern line (modified in place) to the trie */
+	struct trie_node *node = &filter->root;
+	size_t len = strlen(pattern);
+	int dir_only = 0, anchored;
+	char *component, *save;
+
+	/* Trim trailing whitespace and the directory marker */
+	while (len > 0 && (pattern[len - 1] == ' ' || pattern[len - 1] == '\t' || pattern[len - 1] == '\r'))
+		pattern[--len] = '\0';
+	if (len > 0 && pattern[len - 1] == '/') {
+		dir_only = 1;
+		pattern[--len] = '\0';
+	}
+	if (len == 0 || pattern[0] == '#' || pattern[0] == '!')
+		return 0;
+
+	/* Like .gitignore, a slash anywhere but the end anchors the pattern;
+	 * otherwise it may match at any depth
+	 */
+	anchored = strchr(pattern, '/') != NULL;
+	if (pattern[0] == '/')
+		pattern++;
+	if (!anchored)
+		node = child_for(node, "**");
+
+	for (component = strtok_r(pattern, "/", &save); component != NULL && node != NULL;
+		 component = strtok_r(NULL, "/", &save))
+		node = child_for(node, component);
+	if (node == NULL)
+		return -1;
+
+	node->match |= dir_only ? MATCH_DIR : MATCH_ANY;
+	filter->patterns++;
+	return 0;
+}
+
+static int compare_edges(const void *a, const void *b) {
+	return strcmp(((const struct trie_edge *) a)->component, ((const struct trie_edge *) b)->component);
+}
+
+static void finish_node(struct trie_node *node) {
+	/* Sorts literal edges so lookups can binary search them */
+	size_t i;
+	qsort(node->literal, node->n_literal, sizeof(struct trie_edge), compare_edges);
+	for (i = 0; i < node->n_literal; i++)
+		finish_node(node->literal[i].node);
+	for (i = 0; i < node->n_glob; i++)
+		finish_node(node->glob[i].node);
+	if (node->any_depth != NULL)
+		finish_node(node->any_depth);
+}
+
+struct path_filter* path_filter_load(const char *ignore_file) {
+	struct path_filter *filter = (struct path_filter *) calloc(1, sizeof(struct path_filter));
+	char line[4096];
+	FILE *f;
+
+	if (filter == NULL)
+		return NULL;
+	f = fopen(ignore_file, "r");
+	if (f == NULL)
+		return filter;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (add_pattern(filter, line) != 0) {
+			fclose(f);
+			path_filter_free(filter);
+			return NULL;
+		}
+	}
+	fclose(f);
+	finish_node(&filter->root);
+	return filter;
+}
+
+
+/*
+ **
+ **
+ ** Matching paths
+ **
+ **
+ */
+
+static int node_matches(const struct trie_node *node, char **parts, size_t i, size_t n, int is_dir) {
+	/* Returns 1 if some pattern continuing from <node> matches parts[i..n),
+	 * or one of the directories along the way
+	 */
+	struct trie_edge key, *edge;
+	size_t j;
+
+	/* Reaching a pattern's end on a directory excludes everything under it;
+	 * reaching it on the last component excludes that path
+	 */
+	if (node->match != 0 && i > 0) {
+		if (i < n || is_dir || (node->match & MATCH_ANY))
+			return 1;
+	}
+	if (node->any_depth != NULL) {
+		for (j = i; j <= n; j++)
+			if (node_matches(node->any_depth, parts, j, n, is_dir))
+				return 1;
+	}
+	if (i == n)
+		return 0;
+
+	key.component = parts[i];
+	edge = (struct trie_edge *) bsearch(&key, node->literal, node->n_literal,
+		sizeof(struct trie_edge), compare_edges);
+	if (edge != NULL && node_matches(edge->node, parts, i + 1, n, is_dir))
+		return 1;
+	for (j = 0; j < node->n_glob; j++) {
+		if (fnmatch(node->glob[j].component, parts[i], 0) == 0 &&
+			node_matches(node->glob[j].node, parts, i + 1, n, is_dir))
+			return 1;
+	}
+	return 0;
+}
+
+int path_filter_excluded(const struct path_filter *filter, const char *path, int is_dir) {
+	char copy[4096];
+	char *parts[MAX_COMPONENTS];
+	char *component, *save;
+	size_t n = 0;
+
+	if (filter == NULL || filter->patterns == 0)
+		return 0;
+	snprintf(copy, sizeof(copy), "%s", path);
+	for (component = strtok_r(copy, "/", &save); component != NULL && n < MAX_COMPONENTS;
+		 component = strtok_r(NULL, "/", &save))
+		parts[n++] = component;
+	return node_matches(&filter->root, parts, 0, n, is_dir);
+}
+
+static void free_node(struct trie_node *node) {
+	size_t i;
+	for (i = 0; i < node->n_literal; i++) {
+		free(node->literal[i].component);
+		free_node(node->literal[i].node);
+		free(node->literal[i].node);
+	}
+	for (i = 0; i < node->n_glob; i++) {
+		free(node->glob[i].component);
+		free_node(node->glob[i].node);
+		free(node->glob[i].node);
+	}
+	free(node->literal);
+	free(node->glob);
+	if (node->any_depth != NULL) {
+		free_node(node->any_depth);
+		free(node->any_depth);
+	}
+}
+
+void path_filter_free(struct path_filter *filter) {
+	if (filter == NULL)
+		return;
+	free_node(&filter->root);
+	free(filter);
+}
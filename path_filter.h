@@ -0,0 +1,36 @@
+/*
+ * Paths that should never be swept into an error snapshot.
+ *
+ * Core dumps, build outputs and datasets that aren't in .gitignore would
+ * otherwise be hashed and stored with every error. The patterns listed in a
+ * working directory's .errortrackerignore are compiled once into a trie keyed
+ * by path component, so checking a path costs one lookup per component rather
+ * than one match per pattern.
+ *
+ * The file uses a subset of .gitignore syntax: one pattern per line, '#'
+ * starts a comment, a trailing '/' only matches directories, a pattern
+ * containing a '/' (other than a trailing one) is anchored to the top of the
+ * working directory and any other pattern matches at every depth. Components
+ * may use the fnmatch wildcards '*', '?' and '[...]', and a "**" component
+ * matches any number of directories. Negated ('!') patterns are not supported.
+ */
+
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+struct path_filter;
+
+/* Compiles the patterns in the file at <ignore_file>. A missing file gives a
+ * filter that excludes nothing. Returns NULL only if out of memory.
+ */
+struct path_filter* path_filter_load(const char *ignore_file);
+
+/* Returns 1 if <path> (relative to the working directory, '/'-separated) or
+ * one of its parent directories is excluded. <is_dir> says whether <path>
+ * itself names a directory.
+ */
+int path_filter_excluded(const struct path_filter *filter, const char *path, int is_dir);
+
+void path_filter_free(struct path_filter *filter);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Stepping over PCRE pattern syntax. See pattern_syntax.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "pattern_syntax.h"
+
+static size_t through(const char *p, const char *s, char close) {
+	/* Length from <p> to just past the first <close> after <s>, or 0 */
+	const char *end = strchr(s + 1, close);
+	return end != NULL ? (size_t) (end + 1 - p) : 0;
+}
+
+static size_t digits(const char *p, const char *s) {
+	/* Length from <p> to the end of the digits at <s>, if there are any. Octal
+	 * escapes and back-references may be followed by literal digits; those
+	 * are stepped over too, which only loses a little text.
+	 */
+	if (!isdigit((unsigned char) *s))
+		return 0;
+	while (isdigit((unsigned char) *s))
+		s++;
+	return (size_t) (s - p);
+}
+
+size_t pattern_escape_length(const char *p, int *literal) {
+	const char *s = p + 2;
+	unsigned char c = (unsigned char) p[1];
+
+	*literal = -1;
+	if (c == '\0')
+		return 0;
+	if (!isalnum(c)) {
+		*literal = c;
+		return 2;
+	}
+	if (isdigit(c))
+		return digits(p, p + 1);
+	switch (c) {
+		/* Character types, assertions and control characters */
+		case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
+		case 'h': case 'H': case 'v': case 'V': case 'R': case 'X': case 'C':
+		case 'b': case 'B': case 'A': case 'z': case 'Z': case 'G': case 'K':
+		case 'a': case 'e': case 'f': case 'n': case 'r': case 't':
+			return 2;
+		case 'c':
+			return *s != '\0' ? 3 : 0;
+		case 'x':
+			if (*s == '{')
+				return through(p, s, '}');
+			while (s < p + 4 && isxdigit((unsigned char) *s))
+				s++;
+			return (size_t) (s - p);
+		case 'o':
+			return *s == '{' ? through(p, s, '}') : 0;
+		/* \N on its own is any character but a newline */
+		case 'N':
+			return *s == '{' ? through(p, s, '}') : 2;
+		case 'p': case 'P':
+			if (*s == '{')
+				return through(p, s, '}');
+			return isalpha((unsigned char) *s) ? 3 : 0;
+		case 'g':
+			if (*s == '{')
+				return through(p, s, '}');
+			if (*s == '<')
+				return through(p, s, '>');
+			if (*s == '\'')
+				return through(p, s, '\'');
+			return digits(p, *s == '+' || *s == '-' ? s + 1 : s);
+		case 'k':
+			if (*s == '{')
+				return through(p, s, '}');
+			if (*s == '<')
+				return through(p, s, '>');
+			if (*s == '\'')
+				return through(p, s, '\'');
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+size_t pattern_quantifier_length(const char *p) {
+	const char *s = p + 1;
+
+	if (!isdigit((unsigned char) *s))
+		return 0;
+	while (isdigit((unsigned char) *s))
+		s++;
+	if (*s == ',')
+		for (s++; isdigit((unsigned char) *s); s++)
+			;
+	return *s == '}' ? (size_t) (s + 1 - p) : 0;
+}
+
+size_t pattern_class_length(const char *p) {
+	const char *s = p + 1, *end;
+	size_t n;
+	int literal;
+
+	if (*s == '^')
+		s++;
+	/* A ']' straight after the '[' is one of the class's characters */
+	if (*s == ']')
+		s++;
+	while (*s != ']') {
+		if (*s == '\0')
+			return 0;
+		if (*s == '\\') {
+			if ((n = pattern_escape_length(s, &literal)) == 0)
+				return 0;
+			s += n;
+		}
+		else if (s[0] == '[' && s[1] == ':' && (end = strstr(s + 2, ":]")) != NULL) {
+			/* A POSIX class such as [:alpha:] */
+			s = end + 2;
+		}
+		else {
+			s++;
+		}
+	}
+	return (size_t) (s + 1 - p);
+}
+
+int pattern_changes_syntax(const char *pattern) {
+	const char *p;
+
+	if (strncmp(pattern, "(*", 2) == 0)
+		return 1;
+	for (p = strstr(pattern, "(?"); p != NULL; p = strstr(p, "(?")) {
+		/* Up to the ')', ':' or '-' that ends the options being set */
+		for (p += 2; isalpha((unsigned char) *p); p++)
+			if (*p == 'x')
+				return 1;
+	}
+	return 0;
+}
+
+int pattern_refers_by_number(const char *pattern, int capture_count) {
+	const char *p = pattern, *s, *end;
+	size_t n;
+	int literal;
+
+	while (*p != '\0') {
+		if (p[0] == '\\' && p[1] == 'Q') {
+			end = strstr(p + 2, "\\E");
+			if (end == NULL)
+				return 0;
+			p = end + 2;
+		}
+		else if (p[0] == '\\') {
+			/* \1 to \9 are always back-references; a longer number is one if
+			 * there are that many groups, and an octal escape if not
+			 */
+			if (p[1] >= '1' && p[1] <= '9' && (p[2] < '0' || p[2] > '9' || atoi(p + 1) <= capture_count))
+				return 1;
+			if (p[1] == 'g') {
+				s = p + 2;
+				if (*s == '{' || *s == '<' || *s == '\'')
+					s++;
+				if (isdigit((unsigned char) *s))
+					return 1;
+			}
+			n = pattern_escape_length(p, &literal);
+			p += n > 0 ? n : 2;
+		}
+		else if (p[0] == '[') {
+			n = pattern_class_length(p);
+			p += n > 0 ? n : 1;
+		}
+		else {
+			if (p[0] == '(' && p[1] == '?') {
+				/* A call such as (?1) or (?R), or a condition on one */
+				s = p[2] == '(' ? p + 3 : p + 2;
+				if (isdigit((unsigned char) *s) || *s == 'R')
+					return 1;
+			}
+			p++;
+		}
+	}
+	return 0;
+}
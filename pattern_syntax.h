@@ -0,0 +1,51 @@
+/*
+ * Just enough of PCRE's pattern syntax to find the literal text every match
+ * of a pattern has to contain.
+ *
+ * The prefilter's words (error_detect.c) and the trigrams an indexed search
+ * looks up (recording.c) both come from runs of plain characters in a
+ * pattern. Anything that takes an operand has to be stepped over whole, or
+ * its operand is read as text that has to appear: the 100 of a{100}, the 41
+ * of \x41, the Greek of \p{Greek}. These return the length of such a
+ * construct, or 0 for one they don't know, which callers take to mean the
+ * pattern is beyond them.
+ */
+
+#ifndef PATTERN_SYNTAX_H
+#define PATTERN_SYNTAX_H
+
+#include <stddef.h>
+
+/* Length of the escape at <p>, which starts with a backslash, operand
+ * included. Sets <literal> to the character it stands for if it is escaped
+ * punctuation such as \. or \\, and to -1 otherwise. Returns 0 for an escape
+ * it doesn't know, and for \Q, which callers deal with themselves.
+ */
+size_t pattern_escape_length(const char *p, int *literal);
+
+/* Length of the {m}, {m,} or {m,n} quantifier at <p>, or 0 if the '{' there
+ * is a literal one
+ */
+size_t pattern_quantifier_length(const char *p);
+
+/* Length of the character class at <p>, from its '[' to its closing ']'.
+ * Returns 0 if it isn't closed or holds an escape that isn't known.
+ */
+size_t pattern_class_length(const char *p);
+
+/* Whether <pattern> changes what its text means: an option setting like
+ * (?x) or (?ix: turns on extended mode, where whitespace and # comments
+ * aren't literal, or a leading (*UTF8) or the like makes characters more
+ * than a byte
+ */
+int pattern_changes_syntax(const char *pattern);
+
+/* Whether <pattern>, which has <capture_count> capturing groups, refers to a
+ * group by its number or recurses into the whole pattern: \1, \g2, (?1),
+ * (?R), (?(1)...) and the like. Those go wrong once the pattern is joined
+ * with others, which shifts its group numbers. Relative and named references
+ * are fine.
+ */
+int pattern_refers_by_number(const char *pattern, int capture_count);
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * The semaphores of the USDT probes. See probes.h.
+ */
+
+#include <time.h>
+#include "probes.h"
+
+PROBE_DEFINE(monitor_read);
+PROBE_DEFINE(monitor_write);
+PROBE_DEFINE(chunk);
+PROBE_DEFINE(match);
+PROBE_DEFINE(enqueue);
+PROBE_DEFINE(dequeue);
+PROBE_DEFINE(commit);
+PROBE_DEFINE(span_start);
+PROBE_DEFINE(span_end);
+
+uint64_t probe_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
@@ -0,0 +1,109 @@
+/*
+ * Statically defined tracepoints (USDT) for perf and bpftrace.
+ *
+ * Each probe is a nop at the probe site plus an entry in the .note.stapsdt
+ * section, in the format sys/sdt.h produces, so nothing needs to be installed
+ * to build or run with them. A tracer finds the probes in the binary:
+ *
+ *   bpftrace -l 'usdt:./analyzer:*'
+ *   bpftrace -e 'usdt:./analyzer:errortracker:span_end { @[str(arg0)] = hist(arg2); }'
+ *   perf buildid-cache --add ./analyzer; perf record -e sdt_errortracker:chunk ...
+ *
+ * Every probe has a semaphore, which a tracer raises while it is attached.
+ * Probes whose arguments take work to compute, such as a latency, only do
+ * that work while it is raised (see PROBE_ENABLED). All arguments are 64 bit
+ * unsigned; latencies are in nanoseconds. The probes are:
+ *
+ *   monitor_read(fd, bytes)              monitor read output or input
+ *   monitor_write(fd, bytes)             monitor forwarded it
+ *   chunk(bytes, governor level)         the analyzer read a chunk of output
+ *   match(offset, bytes, ns, prefilter)  the error pattern matched a chunk
+ *   enqueue(slot, backlog)               an error was journaled
+ *   dequeue(slot, ns queued)             the commit worker took it up
+ *   commit(result, ns)                   and committed it (result 0) or failed
+ *   span_start(name)                     a trace span started (see trace.h),
+ *   span_end(name, start, ns)            e.g. a phase of a snapshot, and ended
+ *
+ * Names are pointers to C strings. Building with -DERRORTRACKER_NO_PROBES, or
+ * for an architecture other than x86-64 and AArch64, leaves them out.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__GNUC__) && !defined(ERRORTRACKER_NO_PROBES)
+
+#define PROBE_SEMAPHORE(name) errortracker_##name##_semaphore
+/* Whether a tracer is attached to the probe */
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name) != 0, 0)
+
+#define PROBE_DECLARE(name) extern volatile unsigned short PROBE_SEMAPHORE(name)
+#define PROBE_DEFINE(name) \
+	__attribute__((used, section(".probes"))) volatile unsigned short PROBE_SEMAPHORE(name) = 0
+
+/* The probe site and its note. _.stapsdt.base lets tracers work out where
+ * the probe is once the binary is loaded at another address
+ */
+#define PROBE_ASM(name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte errortracker_" #name "_semaphore\n" \
+	".asciz \"errortracker\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define PROBE_ARG(a) "nor" ((uint64_t) (a))
+#define PROBE1(name, a) \
+	__asm__ __volatile__ (PROBE_ASM(name, "8@%0") :: PROBE_ARG(a))
+#define PROBE2(name, a, b) \
+	__asm__ __volatile__ (PROBE_ASM(name, "8@%0 8@%1") :: PROBE_ARG(a), PROBE_ARG(b))
+#define PROBE3(name, a, b, c) \
+	__asm__ __volatile__ (PROBE_ASM(name, "8@%0 8@%1 8@%2") :: PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c))
+#define PROBE4(name, a, b, c, d) \
+	__asm__ __volatile__ (PROBE_ASM(name, "8@%0 8@%1 8@%2 8@%3") :: \
+		PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c), PROBE_ARG(d))
+
+#else
+
+#define PROBE_ENABLED(name) 0
+#define PROBE_DECLARE(name) struct probe_unused_##name
+#define PROBE_DEFINE(name) struct probe_unused_##name
+#define PROBE1(name, a) ((void) 0)
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#define PROBE4(name, a, b, c, d) ((void) 0)
+
+#endif
+
+PROBE_DECLARE(monitor_read);
+PROBE_DECLARE(monitor_write);
+PROBE_DECLARE(chunk);
+PROBE_DECLARE(match);
+PROBE_DECLARE(enqueue);
+PROBE_DECLARE(dequeue);
+PROBE_DECLARE(commit);
+PROBE_DECLARE(span_start);
+PROBE_DECLARE(span_end);
+
+/* Monotonic time in nanoseconds, for the probes' latencies */
+uint64_t probe_now(void);
+
+#endif
@@ -0,0 +1,1001 @@
+/*
+ * Session recordings and their trigram index. See recording.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pcre.h>
+#include "recording.h"
+#include "pattern_syntax.h"
+
+static const char SEGMENT_MAGIC[4] = { 'E', 'T', 'T', 'G' };
+static const uint32_t SEGMENT_VERSION = 1;
+/* A segment is also written once its blocks hold this many distinct trigrams,
+ * which bounds the memory the index takes while recording
+ */
+static const size_t SEGMENT_MAX_PAIRS = 2 * 1024 * 1024;
+/* Trigrams are 24 bits */
+#define TRIGRAM_SPACE (1 << 24)
+/* Words in a bitmap of a segment's blocks */
+#define BLOCK_WORDS ((RECORDING_SEGMENT_BLOCKS + 63) / 64)
+/* Branches of a pattern, and trigrams per branch, used to narrow a search */
+#define PATTERN_MAX_BRANCHES 16
+#define PATTERN_MAX_TRIGRAMS 32
+/* Most bytes handed to pcre_exec at once */
+static const size_t SCAN_CHUNK = 64 * 1024 * 1024;
+/* Bytes read at a time by recording_reindex() and the indexing thread */
+#define REINDEX_CHUNK (1024 * 1024)
+
+static unsigned char fold(unsigned char c) {
+	return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+void recording_dir(char *out, size_t size) {
+	const char *dir = getenv(RECORDINGS_ENV), *home;
+
+	if (dir != NULL && dir[0] != '\0') {
+		snprintf(out, size, "%s", dir);
+	}
+	else {
+		home = getenv("HOME");
+		snprintf(out, size, "%s/%s", home != NULL ? home : "", RECORDINGS_DIR);
+	}
+}
+
+static void index_path(char *out, size_t size, const char *path) {
+	snprintf(out, size, "%s%s", path, RECORDING_INDEX_SUFFIX);
+}
+
+
+/*
+ **
+ **
+ ** Building the index
+ **
+ **
+ */
+
+struct indexer {
+	uint64_t offset;           /* bytes indexed */
+	uint32_t window;           /* the last three bytes, folded */
+	unsigned int run;          /* bytes in <window> since the last line break */
+	/* Trigrams already seen in the current block */
+	unsigned char *seen;
+	/* (trigram << 8 | block) for each trigram seen in each block of the
+	 * segment, in block order
+	 */
+	uint32_t *pairs;
+	size_t pair_count;
+	size_t pair_cap;
+	size_t block_first_pair;   /* where the current block's pairs start */
+	uint64_t segment_start;
+	uint64_t block_start;
+	uint32_t block_count;      /* blocks finished in the segment */
+	uint64_t block_ends[RECORDING_SEGMENT_BLOCKS];
+	/* Set once a trigram couldn't be stored or a segment written; nothing
+	 * more is indexed, so searches scan the rest of the recording instead
+	 * of trusting an index that misses something
+	 */
+	int failed;
+};
+
+struct recording {
+	int fd;
+	int read_fd;               /* what the indexing thread reads back */
+	int index_fd;              /* flock()ed for as long as it is being recorded */
+	struct indexer ix;         /* the indexing thread's, until it is joined */
+	pthread_t thread;
+	int threaded;              /* if it started; if not, output is indexed as it is written */
+	/* The rest is shared with the indexing thread, under <lock> */
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	uint64_t written;          /* bytes in the recording */
+	int idle;                  /* the thread is waiting on <more> */
+	int closing;
+};
+
+static int indexer_init(struct indexer *ix, uint64_t offset) {
+	memset(ix, 0, sizeof(*ix));
+	ix->offset = offset;
+	ix->segment_start = offset;
+	ix->block_start = offset;
+	ix->seen = (unsigned char *) calloc(TRIGRAM_SPACE / 8, 1);
+	return ix->seen != NULL ? 0 : -1;
+}
+
+static void indexer_free(struct indexer *ix) {
+	free(ix->seen);
+	free(ix->pairs);
+	ix->seen = NULL;
+	ix->pairs = NULL;
+}
+
+static void add_trigram(struct indexer *ix, uint32_t trigram) {
+	uint32_t *grown;
+
+	if ((ix->seen[trigram >> 3] & (1 << (trigram & 7))) || ix->failed)
+		return;
+	if (ix->pair_count == ix->pair_cap) {
+		ix->pair_cap = ix->pair_cap ? ix->pair_cap * 2 : 64 * 1024;
+		grown = (uint32_t *) realloc(ix->pairs, ix->pair_cap * sizeof(uint32_t));
+		if (grown == NULL) {
+			ix->pair_cap = ix->pair_count;
+			ix->failed = 1;
+			return;
+		}
+		ix->pairs = grown;
+	}
+	ix->seen[trigram >> 3] |= (unsigned char) (1 << (trigram & 7));
+	ix->pairs[ix->pair_count++] = trigram << 8 | ix->block_count;
+}
+
+static void sort_pairs(uint32_t *pairs, uint32_t *tmp, size_t n) {
+	/* Radix sort on the trigram. Pairs are added in block order, so they are
+	 * already sorted on the low byte and the pass over it can be skipped.
+	 */
+	size_t counts[256], i, sum, c;
+	unsigned int shift;
+	uint32_t *from = pairs, *to = tmp, *swap;
+
+	for (shift = 8; shift < 32; shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < n; i++)
+			counts[(from[i] >> shift) & 0xff]++;
+		for (sum = 0, i = 0; i < 256; i++) {
+			c = counts[i];
+			counts[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			to[counts[(from[i] >> shift) & 0xff]++] = from[i];
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	/* Three passes leave the result in <tmp> */
+	memcpy(pairs, from, n * sizeof(uint32_t));
+}
+
+static size_t put_varint(unsigned char *out, uint32_t v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (unsigned char) v;
+	return n;
+}
+
+static int write_segment(struct indexer *ix, int fd) {
+	/* Turns the segment's pairs into a sorted trigram table and posting
+	 * lists and appends it to the index in one write
+	 */
+	struct recording_segment *header;
+	uint64_t *block_ends;
+	uint32_t *tmp, *trigrams, *starts, trigram, block, prev;
+	unsigned char *postings;
+	size_t trigram_count = 0, used = 0, size, i;
+	char *out;
+	ssize_t written;
+	int result = 0;
+
+	if (ix->block_count == 0 || ix->failed)
+		return 0;
+	tmp = (uint32_t *) malloc((ix->pair_count ? ix->pair_count : 1) * sizeof(uint32_t));
+	if (tmp == NULL) {
+		ix->failed = 1;
+		return -1;
+	}
+	sort_pairs(ix->pairs, tmp, ix->pair_count);
+	free(tmp);
+	for (i = 0; i < ix->pair_count; i++)
+		if (i == 0 || ix->pairs[i] >> 8 != ix->pairs[i - 1] >> 8)
+			trigram_count++;
+
+	/* Deltas between blocks of a segment fit in two varint bytes */
+	size = sizeof(struct recording_segment) + ix->block_count * sizeof(uint64_t) +
+		(2 * trigram_count + 1) * sizeof(uint32_t) + 2 * ix->pair_count + 8;
+	out = (char *) calloc(1, size);
+	if (out == NULL) {
+		ix->failed = 1;
+		return -1;
+	}
+	header = (struct recording_segment *) out;
+	block_ends = (uint64_t *) (header + 1);
+	trigrams = (uint32_t *) (block_ends + ix->block_count);
+	starts = trigrams + trigram_count;
+	postings = (unsigned char *) (starts + trigram_count + 1);
+
+	memcpy(block_ends, ix->block_ends, ix->block_count * sizeof(uint64_t));
+	trigram_count = 0;
+	prev = 0;
+	for (i = 0; i < ix->pair_count; i++) {
+		trigram = ix->pairs[i] >> 8;
+		block = ix->pairs[i] & 0xff;
+		if (i == 0 || trigram != ix->pairs[i - 1] >> 8) {
+			trigrams[trigram_count] = trigram;
+			starts[trigram_count++] = (uint32_t) used;
+			prev = 0;
+			used += put_varint(postings + used, block);
+		}
+		else {
+			used += put_varint(postings + used, block - prev);
+		}
+		prev = block;
+	}
+	starts[trigram_count] = (uint32_t) used;
+	/* Pad so the next segment's block ends are aligned */
+	size = (size_t) ((char *) postings - out) + used;
+	used += ((size + 7) & ~(size_t) 7) - size;
+
+	memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+	header->version = SEGMENT_VERSION;
+	header->start = ix->segment_start;
+	header->block_count = ix->block_count;
+	header->trigram_count = (uint32_t) trigram_count;
+	header->postings_size = used;
+	header->size = (uint64_t) ((char *) postings - out) + used;
+
+	/* A write cut short leaves a torn segment, which readers ignore */
+	written = write(fd, out, (size_t) header->size);
+	if (written != (ssize_t) header->size) {
+		ix->failed = 1;
+		result = -1;
+	}
+	free(out);
+
+	ix->pair_count = 0;
+	ix->block_first_pair = 0;
+	ix->block_count = 0;
+	ix->segment_start = ix->block_start;
+	return result;
+}
+
+static int end_block(struct indexer *ix, int fd) {
+	size_t i;
+
+	for (i = ix->block_first_pair; i < ix->pair_count; i++)
+		ix->seen[ix->pairs[i] >> 11] &= (unsigned char) ~(1 << ((ix->pairs[i] >> 8) & 7));
+	ix->block_ends[ix->block_count++] = ix->offset;
+	ix->block_first_pair = ix->pair_count;
+	ix->block_start = ix->offset;
+	if (ix->block_count == RECORDING_SEGMENT_BLOCKS || ix->pair_count >= SEGMENT_MAX_PAIRS)
+		return write_segment(ix, fd);
+	return 0;
+}
+
+static int indexer_feed(struct indexer *ix, const char *data, size_t len, int fd) {
+	/* A few instructions a byte: this runs on everything the shell prints */
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i;
+	int result = 0;
+
+	if (ix->failed)
+		return 0;
+	for (i = 0; i < len; i++) {
+		ix->offset++;
+		if (p[i] == '\n') {
+			ix->run = 0;
+			if (ix->offset - ix->block_start >= RECORDING_BLOCK && end_block(ix, fd) != 0)
+				result = -1;
+			continue;
+		}
+		ix->window = ((ix->window << 8) | fold(p[i])) & (TRIGRAM_SPACE - 1);
+		if (ix->run < 2)
+			ix->run++;
+		else
+			add_trigram(ix, ix->window);
+	}
+	return ix->failed ? -1 : result;
+}
+
+static int indexer_finish(struct indexer *ix, int fd) {
+	/* Ends the last block, mid-line if need be, and writes out the segment */
+	int result = 0;
+
+	if (ix->offset > ix->block_start)
+		result = end_block(ix, fd);
+	if (write_segment(ix, fd) != 0)
+		result = -1;
+	return result;
+}
+
+
+/*
+ **
+ **
+ ** Recording
+ **
+ **
+ */
+
+static int index_written(struct recording *r, char *buf, uint64_t written) {
+	/* Reads back and indexes the recording up to <written> */
+	ssize_t n;
+	int result = 0;
+
+	while (r->ix.offset < written && !r->ix.failed) {
+		n = pread(r->read_fd, buf, (size_t) (written - r->ix.offset < REINDEX_CHUNK ?
+			written - r->ix.offset : REINDEX_CHUNK), (off_t) r->ix.offset);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			/* Searches scan whatever the index stops short of */
+			r->ix.failed = 1;
+			return -1;
+		}
+		if (indexer_feed(&r->ix, buf, (size_t) n, r->index_fd) != 0)
+			result = -1;
+	}
+	return result;
+}
+
+static void* index_main(void *arg) {
+	/* Indexes the recording from the file, behind monitor, so relaying the
+	 * shell's output only costs it the write
+	 */
+	struct recording *r = (struct recording *) arg;
+	char *buf = (char *) malloc(REINDEX_CHUNK);
+	uint64_t written;
+
+	if (buf == NULL)
+		r->ix.failed = 1;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while ((r->ix.failed || r->ix.offset == r->written) && !r->closing) {
+			r->idle = 1;
+			pthread_cond_wait(&r->more, &r->lock);
+			r->idle = 0;
+		}
+		if (r->ix.failed || r->ix.offset == r->written)
+			break;
+		written = r->written;
+		pthread_mutex_unlock(&r->lock);
+		if (index_written(r, buf, written) != 0)
+			perror("recording index");
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	free(buf);
+	return NULL;
+}
+
+static void mkdirs(const char *dir) {
+	/* Creates <dir> and its missing parents */
+	char path[4096], *slash;
+
+	snprintf(path, sizeof(path), "%s", dir);
+	for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(path, 0755);
+		*slash = '/';
+	}
+	mkdir(path, 0755);
+}
+
+struct recording* recording_open(const char *path) {
+	char dir[4096], name[4096], index[4200], when[32];
+	struct recording *r;
+	time_t now = time(NULL);
+	sigset_t all, old;
+	int saved;
+
+	if (path == NULL) {
+		recording_dir(dir, sizeof(dir));
+		mkdirs(dir);
+		strftime(when, sizeof(when), "%Y-%m-%d-%H%M%S", localtime(&now));
+		snprintf(name, sizeof(name), "%s/%s-%d%s", dir, when, (int) getpid(), RECORDING_SUFFIX);
+		path = name;
+	}
+	r = (struct recording *) calloc(1, sizeof(struct recording));
+	if (r == NULL)
+		return NULL;
+	r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	r->read_fd = r->fd < 0 ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+	index_path(index, sizeof(index), path);
+	r->index_fd = r->read_fd < 0 ? -1 : open(index, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (r->index_fd < 0 || indexer_init(&r->ix, 0) != 0) {
+		saved = errno;
+		if (r->index_fd >= 0)
+			close(r->index_fd);
+		if (r->read_fd >= 0)
+			close(r->read_fd);
+		if (r->fd >= 0)
+			close(r->fd);
+		indexer_free(&r->ix);
+		free(r);
+		errno = saved;
+		return NULL;
+	}
+	/* Keeps recording_reindex() off it. Two monitors recording to the same
+	 * file are left to overwrite each other, as they always have.
+	 */
+	flock(r->index_fd, LOCK_EX | LOCK_NB);
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->more, NULL);
+	/* Signals are left to the thread that relays the shell's output */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r->threaded = pthread_create(&r->thread, NULL, index_main, r) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return r;
+}
+
+int recording_write(struct recording *r, const char *data, size_t len) {
+	ssize_t w;
+	size_t done = 0;
+
+	while (done < len) {
+		w = write(r->fd, data + done, len - done);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += (size_t) w;
+	}
+	/* Only what made it into the recording is indexed, so the two agree */
+	if (!r->threaded) {
+		if (indexer_feed(&r->ix, data, done, r->index_fd) != 0)
+			perror("recording index");
+		return done == len ? 0 : -1;
+	}
+	pthread_mutex_lock(&r->lock);
+	r->written += done;
+	if (r->idle)
+		pthread_cond_signal(&r->more);
+	pthread_mutex_unlock(&r->lock);
+	return done == len ? 0 : -1;
+}
+
+void recording_close(struct recording *r) {
+	if (r == NULL)
+		return;
+	if (r->threaded) {
+		pthread_mutex_lock(&r->lock);
+		r->closing = 1;
+		pthread_cond_signal(&r->more);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+	}
+	pthread_cond_destroy(&r->more);
+	pthread_mutex_destroy(&r->lock);
+	if (indexer_finish(&r->ix, r->index_fd) != 0)
+		perror("recording index");
+	indexer_free(&r->ix);
+	close(r->index_fd);
+	close(r->read_fd);
+	close(r->fd);
+	free(r);
+}
+
+
+/*
+ **
+ **
+ ** Reading the index
+ **
+ **
+ */
+
+struct segment_view {
+	const struct recording_segment *header;
+	const uint64_t *block_ends;
+	const uint32_t *trigrams;
+	const uint32_t *starts;
+	const unsigned char *postings;
+};
+
+static size_t next_segment(const char *map, size_t size, size_t at, uint64_t start, uint64_t limit,
+	struct segment_view *view) {
+	/* Reads the segment at <at> in an index of <size> bytes, which has to
+	 * begin where the last one ended, at <start>, and can't go past <limit>
+	 * in the recording. Returns the size of the segment, or 0 at the end of
+	 * the index or at a torn or damaged segment.
+	 */
+	const struct recording_segment *h;
+	uint64_t need, prev;
+	uint32_t i;
+
+	if (size - at < sizeof(*h))
+		return 0;
+	h = (const struct recording_segment *) (map + at);
+	if (memcmp(h->magic, SEGMENT_MAGIC, sizeof(h->magic)) != 0 || h->version != SEGMENT_VERSION ||
+		h->start != start || h->block_count == 0 || h->block_count > RECORDING_SEGMENT_BLOCKS ||
+		h->size > size - at || h->size % 8 != 0)
+		return 0;
+	need = sizeof(*h) + (uint64_t) h->block_count * sizeof(uint64_t) +
+		(2 * (uint64_t) h->trigram_count + 1) * sizeof(uint32_t) + h->postings_size;
+	if (need != h->size)
+		return 0;
+
+	view->header = h;
+	view->block_ends = (const uint64_t *) (h + 1);
+	view->trigrams = (const uint32_t *) (view->block_ends + h->block_count);
+	view->starts = view->trigrams + h->trigram_count;
+	view->postings = (const unsigned char *) (view->starts + h->trigram_count + 1);
+	if (view->starts[h->trigram_count] > h->postings_size)
+		return 0;
+	for (prev = start, i = 0; i < h->block_count; i++) {
+		if (view->block_ends[i] < prev || view->block_ends[i] > limit)
+			return 0;
+		prev = view->block_ends[i];
+	}
+	return (size_t) h->size;
+}
+
+static int map_index(const char *path, char **map, size_t *size) {
+	/* Maps the index of the recording at <path>. Returns 0, with <map> NULL
+	 * if there is no index, or -1 on failure.
+	 */
+	char index[4200];
+	struct stat st;
+	int fd;
+
+	*map = NULL;
+	*size = 0;
+	index_path(index, sizeof(index), path);
+	fd = open(index, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size > 0) {
+		*map = (char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (*map == MAP_FAILED) {
+			*map = NULL;
+			close(fd);
+			return -1;
+		}
+		*size = (size_t) st.st_size;
+	}
+	close(fd);
+	return 0;
+}
+
+int recording_reindex(const char *path) {
+	/* Picks up from the end of the last whole segment: the rest of a
+	 * recording whose monitor died, or all of one made before it had an index
+	 */
+	struct segment_view view;
+	struct indexer ix;
+	struct stat st;
+	char index[4200], *map, *buf;
+	size_t map_size, at = 0, n;
+	uint64_t indexed = 0;
+	ssize_t r;
+	int fd, index_fd, result = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	index_path(index, sizeof(index), path);
+	index_fd = open(index, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (index_fd < 0) {
+		close(fd);
+		return -1;
+	}
+	/* monitor holds the lock while it records */
+	if (flock(index_fd, LOCK_EX | LOCK_NB) != 0) {
+		close(index_fd);
+		close(fd);
+		return errno == EWOULDBLOCK ? 0 : -1;
+	}
+
+	if (map_index(path, &map, &map_size) != 0) {
+		result = -1;
+		goto done;
+	}
+	while ((n = next_segment(map, map_size, at, indexed, (uint64_t) st.st_size, &view)) > 0) {
+		at += n;
+		indexed = view.block_ends[view.header->block_count - 1];
+	}
+	if (map != NULL)
+		munmap(map, map_size);
+	if (indexed == (uint64_t) st.st_size && at == map_size)
+		goto done;
+	/* Drop the torn segment, if any, before appending after it */
+	if (ftruncate(index_fd, (off_t) at) != 0 || indexer_init(&ix, indexed) != 0) {
+		result = -1;
+		goto done;
+	}
+
+	buf = (char *) malloc(REINDEX_CHUNK);
+	if (buf == NULL) {
+		indexer_free(&ix);
+		result = -1;
+		goto done;
+	}
+	while (indexed < (uint64_t) st.st_size) {
+		r = pread(fd, buf, REINDEX_CHUNK, (off_t) indexed);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		if ((uint64_t) r > (uint64_t) st.st_size - indexed)
+			r = (ssize_t) ((uint64_t) st.st_size - indexed);
+		if (indexer_feed(&ix, buf, (size_t) r, index_fd) != 0)
+			result = -1;
+		indexed += (uint64_t) r;
+	}
+	if (indexer_finish(&ix, index_fd) != 0)
+		result = -1;
+	free(buf);
+	indexer_free(&ix);
+
+done:
+	close(index_fd);
+	close(fd);
+	return result;
+}
+
+
+/*
+ **
+ **
+ ** Searching
+ **
+ **
+ */
+
+struct pattern_branch {
+	size_t count;
+	uint32_t trigrams[PATTERN_MAX_TRIGRAMS];
+};
+
+struct recording_pattern {
+	pcre *re;
+	pcre_extra *extra;
+	/* A line matches only if it contains every trigram of one of the
+	 * branches; with no branches every line might
+	 */
+	size_t branch_count;
+	struct pattern_branch branches[PATTERN_MAX_BRANCHES];
+};
+
+static void add_run(struct pattern_branch *branch, const unsigned char *run, size_t len) {
+	size_t i, j;
+	uint32_t trigram;
+
+	for (i = 0; i + 3 <= len && branch->count < PATTERN_MAX_TRIGRAMS; i++) {
+		trigram = (uint32_t) run[i] << 16 | (uint32_t) run[i + 1] << 8 | run[i + 2];
+		for (j = 0; j < branch->count && branch->trigrams[j] != trigram; j++)
+			;
+		if (j == branch->count)
+			branch->trigrams[branch->count++] = trigram;
+	}
+}
+
+static void find_trigrams(struct recording_pattern *p, const char *pattern) {
+	/* Collects the runs of literal characters in each top-level branch of
+	 * <pattern>: ones outside groups and classes, not made optional by a
+	 * quantifier, escaped punctuation and \Q...\E quoting included. Every
+	 * match of the branch contains them, and so their trigrams. Gives up,
+	 * leaving no branches, if any branch has no run of three characters or
+	 * the pattern uses syntax this doesn't follow (see pattern_syntax.h).
+	 */
+	unsigned char run[256];
+	size_t len = 0, n;
+	int depth = 0, quoted = 0, literal, optional;
+	struct pattern_branch *branch = &p->branches[0];
+	const char *s;
+	char c;
+
+	p->branch_count = 0;
+	if (pattern_changes_syntax(pattern))
+		return;
+	branch->count = 0;
+	for (s = pattern; ; s++) {
+		c = *s;
+		literal = -1;
+		optional = 0;
+		n = 1;
+		if (quoted && c != '\0') {
+			if (c == '\\' && s[1] == 'E') {
+				quoted = 0;
+				s++;
+				continue;
+			}
+			literal = (unsigned char) c;
+		}
+		else if (c == '\\' && s[1] == 'Q') {
+			quoted = 1;
+			s++;
+			continue;
+		}
+		else if (c == '\\') {
+			if ((n = pattern_escape_length(s, &literal)) == 0) {
+				p->branch_count = 0;
+				return;
+			}
+		}
+		else if (c == '[') {
+			if ((n = pattern_class_length(s)) == 0) {
+				p->branch_count = 0;
+				return;
+			}
+		}
+		else if (c == '{') {
+			/* A '{' that doesn't start a quantifier is an ordinary character */
+			if ((n = pattern_quantifier_length(s)) == 0) {
+				n = 1;
+				literal = (unsigned char) c;
+			}
+			else {
+				optional = s[1] == '0';
+			}
+		}
+		else if (c == '?' || c == '*') {
+			optional = 1;
+		}
+		else if (c != '\0' && strchr("^$.|+()", c) == NULL) {
+			literal = (unsigned char) c;
+		}
+		s += n - 1;
+		/* Trigrams don't span lines */
+		if (literal == '\n')
+			literal = -1;
+
+		/* A quantifier that allows no repeats makes the character before
+		 * it optional
+		 */
+		if (optional && len > 0)
+			len--;
+		if (literal >= 0 && depth == 0) {
+			if (len < sizeof(run))
+				run[len++] = fold((unsigned char) literal);
+			continue;
+		}
+		add_run(branch, run, len);
+		len = 0;
+		if (c == '\0' || (c == '|' && depth == 0 && literal < 0)) {
+			if (branch->count == 0) {
+				p->branch_count = 0;
+				return;
+			}
+			if (++p->branch_count == PATTERN_MAX_BRANCHES && c != '\0') {
+				p->branch_count = 0;
+				return;
+			}
+			if (c == '\0')
+				return;
+			branch = &p->branches[p->branch_count];
+			branch->count = 0;
+		}
+		else if (c == '(' && literal < 0)
+			depth++;
+		else if (c == ')' && literal < 0 && depth > 0)
+			depth--;
+	}
+}
+
+struct recording_pattern* recording_pattern_compile(const char *pattern, int ignore_case) {
+	struct recording_pattern *p;
+	const char *error;
+	int error_offset;
+
+	p = (struct recording_pattern *) calloc(1, sizeof(struct recording_pattern));
+	if (p == NULL)
+		return NULL;
+	p->re = pcre_compile(pattern, PCRE_MULTILINE | (ignore_case ? PCRE_CASELESS : 0),
+		&error, &error_offset, NULL);
+	if (p->re == NULL) {
+		fprintf(stderr, "errortracker: could not compile '%s': %s\n", pattern, error);
+		free(p);
+		return NULL;
+	}
+	p->extra = pcre_study(p->re, 0, &error);
+	find_trigrams(p, pattern);
+	return p;
+}
+
+void recording_pattern_free(struct recording_pattern *p) {
+	if (p == NULL)
+		return;
+	if (p->extra != NULL)
+		pcre_free_study(p->extra);
+	pcre_free(p->re);
+	free(p);
+}
+
+static int postings_of(const struct segment_view *view, uint32_t trigram, uint64_t *blocks) {
+	/* Sets the bits in <blocks> of the segment's blocks that contain
+	 * <trigram>. Returns 0 if none do.
+	 */
+	const unsigned char *p, *end;
+	size_t lo = 0, hi = view->header->trigram_count, mid;
+	uint32_t block = 0, delta;
+	unsigned int shift;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (view->trigrams[mid] < trigram)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == view->header->trigram_count || view->trigrams[lo] != trigram)
+		return 0;
+	if (view->starts[lo] > view->starts[lo + 1] || view->starts[lo + 1] > view->header->postings_size)
+		return 0;
+	p = view->postings + view->starts[lo];
+	end = view->postings + view->starts[lo + 1];
+	while (p < end) {
+		for (delta = 0, shift = 0; p < end && shift < 32; shift += 7) {
+			delta |= (uint32_t) (*p & 0x7f) << shift;
+			if (!(*p++ & 0x80))
+				break;
+		}
+		block += delta;
+		if (block < RECORDING_SEGMENT_BLOCKS)
+			blocks[block / 64] |= (uint64_t) 1 << (block % 64);
+	}
+	return 1;
+}
+
+static void candidate_blocks(const struct recording_pattern *p, const struct segment_view *view,
+	uint64_t *candidates) {
+	/* The blocks of the segment containing every trigram of some branch */
+	uint64_t branch[BLOCK_WORDS], blocks[BLOCK_WORDS];
+	size_t b, t, w;
+
+	if (p->branch_count == 0) {
+		memset(candidates, 0xff, BLOCK_WORDS * sizeof(uint64_t));
+		return;
+	}
+	memset(candidates, 0, BLOCK_WORDS * sizeof(uint64_t));
+	for (b = 0; b < p->branch_count; b++) {
+		memset(branch, 0xff, sizeof(branch));
+		for (t = 0; t < p->branches[b].count; t++) {
+			memset(blocks, 0, sizeof(blocks));
+			if (!postings_of(view, p->branches[b].trigrams[t], blocks)) {
+				memset(branch, 0, sizeof(branch));
+				break;
+			}
+			for (w = 0; w < BLOCK_WORDS; w++)
+				branch[w] &= blocks[w];
+		}
+		for (w = 0; w < BLOCK_WORDS; w++)
+			candidates[w] |= branch[w];
+	}
+}
+
+struct search {
+	const char *path;
+	const struct recording_pattern *p;
+	const char *data;
+	int files_only;
+	FILE *out;
+	uint64_t matches;
+	struct recording_grep_stats *stats;
+};
+
+static int scan_range(struct search *s, uint64_t start, uint64_t end) {
+	/* Runs the pattern over the lines in [<start>, <end>), which starts at
+	 * the beginning of a line, a chunk at a time. Returns 1 once files_only
+	 * has nothing more to find.
+	 */
+	const char *base, *line, *line_end, *chunk_end;
+	int ovector[3], rc, len, at;
+	uint64_t chunk;
+
+	s->stats->bytes_scanned += end - start;
+	while (start < end) {
+		chunk = end - start;
+		if (chunk > SCAN_CHUNK) {
+			/* Cut at a line break so no line is split between chunks */
+			chunk_end = (const char *) memrchr(s->data + start, '\n', SCAN_CHUNK);
+			chunk = chunk_end != NULL ? (uint64_t) (chunk_end - (s->data + start)) + 1 : SCAN_CHUNK;
+		}
+		base = s->data + start;
+		len = (int) chunk;
+		for (at = 0; at < len; ) {
+			rc = pcre_exec(s->p->re, s->p->extra, base, len, at, 0, ovector, 3);
+			if (rc < 0)
+				break;
+			line = (const char *) memrchr(base, '\n', (size_t) ovector[0]);
+			line = line != NULL ? line + 1 : base;
+			line_end = (const char *) memchr(base + ovector[0], '\n', (size_t) (len - ovector[0]));
+			if (line_end == NULL)
+				line_end = base + len;
+			s->matches++;
+			if (s->files_only) {
+				fprintf(s->out, "%s\n", s->path);
+				return 1;
+			}
+			fprintf(s->out, "%s:%llu:%.*s\n", s->path, (unsigned long long) (start + (uint64_t) (line - base)),
+				(int) (line_end - line - (line_end > line && line_end[-1] == '\r')), line);
+			at = (int) (line_end - base) + 1;
+			if (at <= ovector[1])
+				at = ovector[1] > ovector[0] ? ovector[1] : ovector[1] + 1;
+		}
+		start += chunk;
+	}
+	return 0;
+}
+
+int recording_grep(const char *path, const struct recording_pattern *p, int files_only, int use_index,
+	FILE *out, struct recording_grep_stats *stats) {
+	uint64_t candidates[BLOCK_WORDS], indexed = 0, range_start, begin;
+	struct segment_view view;
+	struct search s;
+	struct stat st;
+	char *index, *data;
+	size_t index_size = 0, at = 0, n;
+	uint32_t b;
+	int fd, done = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	stats->bytes += (uint64_t) st.st_size;
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	data = (char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	if (!use_index || map_index(path, &index, &index_size) != 0)
+		index = NULL;
+
+	memset(&s, 0, sizeof(s));
+	s.path = path;
+	s.p = p;
+	s.data = data;
+	s.files_only = files_only;
+	s.out = out;
+	s.stats = stats;
+
+	/* Candidate blocks next to each other are scanned as one range */
+	while (!done && (n = next_segment(index, index_size, at, indexed, (uint64_t) st.st_size, &view)) > 0) {
+		at += n;
+		candidate_blocks(p, &view, candidates);
+		range_start = indexed;
+		begin = indexed;
+		for (b = 0; b < view.header->block_count && !done; b++) {
+			if (!(candidates[b / 64] & ((uint64_t) 1 << (b % 64)))) {
+				if (range_start < begin)
+					done = scan_range(&s, range_start, begin);
+				range_start = view.block_ends[b];
+			}
+			begin = view.block_ends[b];
+		}
+		if (!done && range_start < begin)
+			done = scan_range(&s, range_start, begin);
+		indexed = begin;
+	}
+	/* Whatever the index doesn't cover yet */
+	if (!done && indexed < (uint64_t) st.st_size)
+		scan_range(&s, indexed, (uint64_t) st.st_size);
+
+	if (index != NULL)
+		munmap(index, index_size);
+	munmap(data, (size_t) st.st_size);
+	stats->matches += s.matches;
+	return s.matches > 0;
+}
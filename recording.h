@@ -0,0 +1,120 @@
+/*
+ * Session recordings and their trigram index.
+ *
+ * monitor records everything the shell prints, as script(1) would, to the
+ * file named on its command line or else to a new <date>-<pid>.typescript in
+ * the recordings directory ($ERRORTRACKER_RECORDINGS, or
+ * ~/.errortracker/recordings). Alongside each recording it writes
+ * <recording>.trigrams, an index of which trigrams (three-byte sequences,
+ * ASCII letters folded to lower case, none spanning a line) appear in which
+ * block of the recording. Blocks are about RECORDING_BLOCK bytes and end at a
+ * line break, so every line is in exactly one block.
+ *
+ * The index is built on a thread of its own, which reads back what has been
+ * written, so monitor only pays for the write on its way to the terminal. It
+ * is appended to in segments, one every RECORDING_SEGMENT_BLOCKS blocks and
+ * one when the recording is closed.
+ * A segment is a sorted table of the trigrams in its blocks, each with a
+ * posting list of block numbers, delta and varint encoded:
+ *
+ *   header         struct recording_segment, below
+ *   block ends     uint64_t, the offset just past each block
+ *   trigrams       uint32_t, ascending
+ *   posting starts uint32_t, one per trigram and one past the end
+ *   postings       varints, padded to a multiple of 8 bytes
+ *
+ * Everything is in host byte order; like the error index, it is a local
+ * cache. A segment torn by a crash is ignored, and whatever a recording's
+ * index doesn't cover is searched without it.
+ *
+ * recording_grep() mmaps the index, narrows a search down to the blocks that
+ * contain every trigram the pattern needs, and runs the pattern only over
+ * those. A pattern with no literal of three bytes or more searches every
+ * block. Like grep(1) it works a line at a time: a match that spans a line
+ * break is only found if both lines are in the same block.
+ *
+ * errortracker grep --reindex catches up the index of a recording whose
+ * monitor died before writing its last segment, or of one made before
+ * recordings were indexed.
+ */
+
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define RECORDINGS_ENV "ERRORTRACKER_RECORDINGS"
+/* Where recordings go, under the home directory, if ERRORTRACKER_RECORDINGS isn't set */
+#define RECORDINGS_DIR ".errortracker/recordings"
+#define RECORDING_SUFFIX ".typescript"
+#define RECORDING_INDEX_SUFFIX ".trigrams"
+
+/* Size a block reaches before it ends at the next line break */
+#define RECORDING_BLOCK (128 * 1024)
+/* Blocks per segment; block numbers in a segment fit in 8 bits */
+#define RECORDING_SEGMENT_BLOCKS 128
+
+struct recording_segment {
+	char magic[4];
+	uint32_t version;
+	uint64_t size;            /* of the whole segment, this header included */
+	uint64_t start;           /* offset of the first block in the recording */
+	uint32_t block_count;
+	uint32_t trigram_count;
+	uint64_t postings_size;
+};
+
+struct recording;
+
+/* Creates the recording at <path> (NULL for a new one in the recordings
+ * directory) and its index, and starts the thread that indexes it. Returns
+ * NULL, with errno set, on failure.
+ */
+struct recording* recording_open(const char *path);
+
+/* Appends <len> bytes of output to <r>, and hands them to its indexing
+ * thread. Returns 0, or -1 if the recording couldn't be written to.
+ */
+int recording_write(struct recording *r, const char *data, size_t len);
+
+/* Waits for the indexing thread to catch up, writes out the last segment and
+ * closes <r>
+ */
+void recording_close(struct recording *r);
+
+/* Indexes whatever part of the recording at <path> its index doesn't cover,
+ * unless it is being recorded. Returns 0, or -1 on failure.
+ */
+int recording_reindex(const char *path);
+
+/* Puts the recordings directory in <out> */
+void recording_dir(char *out, size_t size);
+
+/* A pattern compiled for recording_grep() */
+struct recording_pattern;
+
+struct recording_grep_stats {
+	uint64_t bytes;           /* in the recordings searched */
+	uint64_t bytes_scanned;   /* that the pattern had to be run over */
+	uint64_t matches;
+};
+
+/* Compiles the PCRE <pattern> and works out which trigrams a line has to
+ * contain to match it. Returns NULL, after saying why, if it doesn't compile.
+ */
+struct recording_pattern* recording_pattern_compile(const char *pattern, int ignore_case);
+
+void recording_pattern_free(struct recording_pattern *p);
+
+/* Prints each line of the recording at <path> that matches <p> to <out>, as
+ * <path>:<offset>:<line>, or only <path> if <files_only>, and adds to
+ * <stats>. Without <use_index> every line is scanned, as errortracker grep
+ * --check does to compare. Returns 1 if a line matched, 0 if none did and -1
+ * if the recording can't be read.
+ */
+int recording_grep(const char *path, const struct recording_pattern *p, int files_only, int use_index,
+	FILE *out, struct recording_grep_stats *stats);
+
+#endif
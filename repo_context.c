@@ -0,0 +1,609 @@
+/*
+ * Cache of open repositories and the values the error tracker reads from them
+ * on every error commit. See repo_context.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <git2/sys/mempack.h>
+#include <git2/sys/repository.h>
+#include "repo_context.h"
+#include "error_ref.h"
+#include "alloc_stats.h"
+#include "trace.h"
+
+static const char* ERROR_REF_NAME = "refs/heads/_error";
+static const char* PRIVATE_DIR_NAME = "errortracker";
+static const char* PRIVATE_INDEX_NAME = "errortracker/index";
+static const char* IGNORE_FILE_NAME = ".errortrackerignore";
+static const char* MAX_FILE_SIZE_KEY = "errortracker.maxFileSize";
+static const char* SESSION_REFS_KEY = "errortracker.sessionRefs";
+static const char* CAPTURE_FILES_KEY = "errortracker.captureFiles";
+static const char* TARGETED_SNAPSHOTS_KEY = "errortracker.targetedSnapshots";
+static const int64_t DEFAULT_MAX_FILE_SIZE = 32 * 1024 * 1024;
+/* Above the loose (1) and pack (2) backends, so new objects are written here */
+static const int MEMPACK_PRIORITY = 999;
+/* A packfile's 12-byte header plus its 20-byte trailing checksum */
+static const size_t EMPTY_PACK_SIZE = 32;
+/* Packs written between checks of whether the repository needs a gc */
+static const size_t PACKS_PER_GC = 16;
+
+/* Repositories kept open at once; the least recently used one is closed
+ * when another has to be opened
+ */
+static const size_t MAX_OPEN_CONTEXTS = 8;
+/* Size of the blocks a context's snapshot arena grows by; enough for the
+ * messages and a targeted snapshot's paths in one
+ */
+static const size_t SNAPSHOT_ARENA_BLOCK = 64 * 1024;
+/* How long a directory's discovered repository is trusted before it is looked
+ * up again, to notice a git init, a clone or a removed repository
+ */
+static const time_t DISCOVERY_TTL = 30;
+static const time_t DISCOVERY_MISS_TTL = 2;
+#define DISCOVERY_CACHE_SIZE 64
+
+/* Open repositories, most recently used first */
+static struct repo_context *contexts = NULL;
+
+/* Directory -> git directory lookups, direct-mapped by a hash of the directory */
+struct discovery_entry {
+	char *dir;
+	char *git_dir;            /* NULL if <dir> isn't inside a repository */
+	time_t checked;
+};
+static struct discovery_entry discovery_cache[DISCOVERY_CACHE_SIZE];
+/* Discovery is the one part of this file used from more than one thread */
+static pthread_mutex_t discovery_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether new contexts get a change tracker */
+static int tracking_enabled = 1;
+
+
+/*
+ **
+ **
+ ** File stamps
+ **
+ **
+ */
+
+static void stamp_file(struct file_stamp *stamp, const char *path) {
+	/* Records the identity of the file at <path>, or that it does not exist */
+	struct stat st;
+	memset(stamp, 0, sizeof(*stamp));
+	if (path == NULL || stat(path, &st) != 0)
+		return;
+	stamp->exists = 1;
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtim;
+}
+
+static int stamp_changed(const struct file_stamp *stamp, const char *path) {
+	/* Returns 1 if the file at <path> no longer matches <stamp> */
+	struct file_stamp now;
+	stamp_file(&now, path);
+	return now.exists != stamp->exists ||
+		now.dev != stamp->dev ||
+		now.ino != stamp->ino ||
+		now.size != stamp->size ||
+		now.mtime.tv_sec != stamp->mtime.tv_sec ||
+		now.mtime.tv_nsec != stamp->mtime.tv_nsec;
+}
+
+static void gitdir_file(char *out, size_t size, struct repo_context *ctx, const char *name) {
+	/* git_repository_path always ends in a '/' */
+	snprintf(out, size, "%s%s", git_repository_path(ctx->repo), name);
+}
+
+static void global_config_file(char *out, size_t size) {
+	const char *home = getenv("HOME");
+	if (home == NULL)
+		home = "";
+	snprintf(out, size, "%s/.gitconfig", home);
+}
+
+
+/*
+ **
+ **
+ ** Cached values
+ **
+ **
+ */
+
+static void load_signature(struct repo_context *ctx) {
+	char path[4096];
+
+	gitdir_file(path, sizeof(path), ctx, "config");
+	stamp_file(&ctx->config_stamp, path);
+	global_config_file(path, sizeof(path));
+	stamp_file(&ctx->global_config_stamp, path);
+
+	if (ctx->signature != NULL) {
+		git_signature_free(ctx->signature);
+		ctx->signature = NULL;
+	}
+	if (git_signature_default(&ctx->signature, ctx->repo) < 0) {
+		printf("Unable to create a commit signature. Perhaps 'user.name' and 'user.email' are not set\n");
+		ctx->signature = NULL;
+	}
+}
+
+static void ignore_file(char *out, size_t size, struct repo_context *ctx) {
+	const char *workdir = git_repository_workdir(ctx->repo);
+	snprintf(out, size, "%s%s", workdir ? workdir : "", IGNORE_FILE_NAME);
+}
+
+static void load_snapshot_policy(struct repo_context *ctx) {
+	/* (Re)loads the size limit, whether to commit to a session ref, whether to
+	 * capture files before hashing them, whether to take targeted snapshots and
+	 * the compiled .errortrackerignore patterns
+	 */
+	char path[4096];
+	git_config *config;
+	int64_t limit;
+	int session_refs, capture_files, targeted;
+
+	ctx->max_file_size = DEFAULT_MAX_FILE_SIZE;
+	ctx->use_session_ref = 0;
+	ctx->capture_files = 1;
+	ctx->targeted_snapshots = 0;
+	if (git_repository_config(&config, ctx->repo) == 0) {
+		if (git_config_get_int64(&limit, config, MAX_FILE_SIZE_KEY) == 0 && limit > 0)
+			ctx->max_file_size = limit;
+		if (git_config_get_bool(&session_refs, config, SESSION_REFS_KEY) == 0)
+			ctx->use_session_ref = session_refs;
+		if (git_config_get_bool(&capture_files, config, CAPTURE_FILES_KEY) == 0)
+			ctx->capture_files = capture_files;
+		if (git_config_get_bool(&targeted, config, TARGETED_SNAPSHOTS_KEY) == 0)
+			ctx->targeted_snapshots = targeted;
+		git_config_free(config);
+	}
+
+	ignore_file(path, sizeof(path), ctx);
+	stamp_file(&ctx->ignore_stamp, path);
+	path_filter_free(ctx->filter);
+	ctx->filter = path_filter_load(path);
+
+	/* Paths the old policy included or left out may now be treated
+	 * differently, and directories it left out may now need watching
+	 */
+	if (ctx->tracker != NULL) {
+		ctx->tracker->needs_rescan = 1;
+		ctx->tracker->rewatch = 1;
+	}
+}
+
+static int tracker_skips(void *payload, const char *path, int is_dir) {
+	/* Leaves out of the change tracker what a rescan leaves out of a
+	 * snapshot: excluded paths and ignored ones, unless they are tracked
+	 */
+	struct repo_context *ctx = (struct repo_context *) payload;
+	char name[4096];
+	size_t at;
+	int ignored = 0;
+
+	if (path_filter_excluded(ctx->filter, path, is_dir))
+		return 1;
+	snprintf(name, sizeof(name), "%s%s", path, is_dir ? "/" : "");
+	if (git_ignore_path_is_ignored(&ignored, ctx->repo, name) != 0 || !ignored)
+		return 0;
+	if (is_dir)
+		return git_index_find_prefix(&at, ctx->index, name) != 0;
+	return git_index_get_bypath(ctx->index, path, 0) == NULL;
+}
+
+static void load_error_tip(struct repo_context *ctx) {
+	char path[4096];
+
+	gitdir_file(path, sizeof(path), ctx, ERROR_REF_NAME);
+	stamp_file(&ctx->error_ref_stamp, path);
+	gitdir_file(path, sizeof(path), ctx, "packed-refs");
+	stamp_file(&ctx->packed_refs_stamp, path);
+
+	ctx->has_error_tip = git_reference_name_to_id(&ctx->error_tip, ctx->repo, ERROR_REF_NAME) == 0;
+}
+
+static void load_session_tip(struct repo_context *ctx) {
+	/* A previous context for this process (closed by the LRU) may have left
+	 * commits on the session ref
+	 */
+	char name[256];
+
+	snprintf(name, sizeof(name), "%s%s", ERROR_REF_SESSION_PREFIX, error_ref_session_name());
+	ctx->session_ref = alloc_stats_strdup(ALLOC_CONTEXT, name);
+	ctx->has_session_tip = git_reference_name_to_id(&ctx->session_tip, ctx->repo, name) == 0;
+	ctx->session_pending = ctx->has_session_tip;
+	ctx->session_started = time(NULL);
+}
+
+void repo_context_refresh(struct repo_context *ctx) {
+	char path[4096];
+	int config_changed, refs_changed;
+
+	gitdir_file(path, sizeof(path), ctx, "config");
+	config_changed = stamp_changed(&ctx->config_stamp, path);
+	global_config_file(path, sizeof(path));
+	config_changed |= stamp_changed(&ctx->global_config_stamp, path);
+	if (config_changed || ctx->signature == NULL)
+		load_signature(ctx);
+	ignore_file(path, sizeof(path), ctx);
+	if (config_changed || stamp_changed(&ctx->ignore_stamp, path))
+		load_snapshot_policy(ctx);
+
+	gitdir_file(path, sizeof(path), ctx, ERROR_REF_NAME);
+	refs_changed = stamp_changed(&ctx->error_ref_stamp, path);
+	gitdir_file(path, sizeof(path), ctx, "packed-refs");
+	refs_changed |= stamp_changed(&ctx->packed_refs_stamp, path);
+	if (refs_changed)
+		load_error_tip(ctx);
+}
+
+static int open_private_index(struct repo_context *ctx) {
+	/* Opens .git/errortracker/index, seeding a new one from the tree of the
+	 * _error tip so the first snapshot starts from the last one we took
+	 */
+	char path[4096];
+	struct stat st;
+	int is_new;
+	git_commit *tip_commit;
+	git_tree *tip_tree;
+
+	gitdir_file(path, sizeof(path), ctx, PRIVATE_DIR_NAME);
+	mkdir(path, 0755);
+	gitdir_file(path, sizeof(path), ctx, PRIVATE_INDEX_NAME);
+	is_new = stat(path, &st) != 0;
+
+	if (git_index_open(&ctx->index, path) != 0)
+		return -1;
+	if (is_new && ctx->has_error_tip &&
+		git_commit_lookup(&tip_commit, ctx->repo, &ctx->error_tip) == 0) {
+		if (git_commit_tree(&tip_tree, tip_commit) == 0) {
+			git_index_read_tree(ctx->index, tip_tree);
+			git_tree_free(tip_tree);
+		}
+		git_commit_free(tip_commit);
+	}
+	stamp_file(&ctx->index_stamp, path);
+
+	/* Everything that asks the repository for its index now gets ours */
+	git_repository_set_index(ctx->repo, ctx->index);
+	return 0;
+}
+
+int repo_context_write_index(struct repo_context *ctx) {
+	char path[4096];
+	int result = git_index_write(ctx->index);
+
+	gitdir_file(path, sizeof(path), ctx, PRIVATE_INDEX_NAME);
+	stamp_file(&ctx->index_stamp, path);
+	return result;
+}
+
+static void start_gc(struct repo_context *ctx) {
+	/* Every error commit arrives as its own small pack, and git slows down
+	 * with each pack it has to search. `git gc --auto` repacks them into one
+	 * past gc.autoPackLimit (50 by default) and otherwise exits at once; it
+	 * runs detached, at idle priority (which I/O priority follows), so
+	 * neither the commit worker nor the build waits for it
+	 */
+	char git_dir[4096];
+	char *argv[] = { "git", git_dir, "gc", "--auto", "--quiet", NULL };
+	struct sched_param param;
+	pid_t pid;
+	int fd;
+
+	snprintf(git_dir, sizeof(git_dir), "--git-dir=%s", git_repository_path(ctx->repo));
+	memset(&param, 0, sizeof(param));
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return;
+	}
+	if (pid == 0) {
+		/* Double fork, so there is no child to reap */
+		if (fork() != 0)
+			_exit(0);
+		setsid();
+		setpriority(PRIO_PROCESS, 0, 19);
+		sched_setscheduler(0, SCHED_IDLE, &param);
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execvp("git", argv);
+		_exit(127);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+int repo_context_flush_objects(struct repo_context *ctx) {
+	git_buf pack = GIT_BUF_INIT;
+	git_odb_writepack *writepack = NULL;
+	git_indexer_progress stats;
+	const git_error *e;
+	int result, written = 0;
+
+	if (ctx->mempack == NULL)
+		return 0;
+	result = git_mempack_dump(&pack, ctx->repo, ctx->mempack);
+	if (result == 0 && pack.size > EMPTY_PACK_SIZE) {
+		/* Index the pack into .git/objects/pack through the on-disk backend */
+		memset(&stats, 0, sizeof(stats));
+		result = git_odb_write_pack(&writepack, ctx->odb, NULL, NULL);
+		if (result == 0)
+			result = writepack->append(writepack, pack.ptr, pack.size, &stats);
+		if (result == 0)
+			result = writepack->commit(writepack, &stats);
+		written = result == 0;
+		if (writepack != NULL)
+			writepack->free(writepack);
+	}
+	git_buf_dispose(&pack);
+
+	if (result != 0) {
+		e = git_error_last();
+		printf("Failed to write snapshot objects to a packfile: %s\n", e ? e->message : "unknown error");
+		return result;
+	}
+	/* Only drop the staged objects once they are safely on disk */
+	git_mempack_reset(ctx->mempack);
+	if (written && ++ctx->packs_written % PACKS_PER_GC == 0)
+		start_gc(ctx);
+	return 0;
+}
+
+void repo_context_set_error_tip(struct repo_context *ctx, const git_oid *tip) {
+	char path[4096];
+
+	git_oid_cpy(&ctx->error_tip, tip);
+	ctx->has_error_tip = 1;
+	gitdir_file(path, sizeof(path), ctx, ERROR_REF_NAME);
+	stamp_file(&ctx->error_ref_stamp, path);
+	gitdir_file(path, sizeof(path), ctx, "packed-refs");
+	stamp_file(&ctx->packed_refs_stamp, path);
+}
+
+
+/*
+ **
+ **
+ ** Opening and closing contexts
+ **
+ **
+ */
+
+static void repo_context_free(struct repo_context *ctx) {
+	/* Don't leave this session's errors off _error until the next maintenance */
+	if (ctx->has_session_tip && error_ref_fold_session(ctx, ctx->session_ref) != 0)
+		printf("Failed to fold %s onto _error; errortracker maintain will retry\n", ctx->session_ref);
+	change_tracker_free(ctx->tracker);
+	path_filter_free(ctx->filter);
+	if (ctx->index != NULL)
+		git_index_free(ctx->index);
+	if (ctx->signature != NULL)
+		git_signature_free(ctx->signature);
+	if (ctx->refdb != NULL)
+		git_refdb_free(ctx->refdb);
+	if (ctx->loose_odb != NULL)
+		git_odb_free(ctx->loose_odb);
+	if (ctx->odb != NULL)
+		git_odb_free(ctx->odb);
+	if (ctx->repo != NULL)
+		git_repository_free(ctx->repo);
+	arena_free(&ctx->arena);
+	alloc_stats_free(ALLOC_CONTEXT, ctx->session_ref);
+	alloc_stats_free(ALLOC_CONTEXT, ctx->path);
+	alloc_stats_free(ALLOC_CONTEXT, ctx);
+}
+
+static struct repo_context* repo_context_open(const char *path) {
+	struct repo_context *ctx = (struct repo_context *) alloc_stats_calloc(ALLOC_CONTEXT, 1, sizeof(struct repo_context));
+	char objects[4096];
+	const git_error *e;
+
+	if (ctx == NULL)
+		return NULL;
+	ctx->path = alloc_stats_strdup(ALLOC_CONTEXT, path);
+	arena_init(&ctx->arena, ALLOC_SNAPSHOT, SNAPSHOT_ARENA_BLOCK);
+
+	if (git_repository_open(&ctx->repo, path) != 0) {
+		e = git_error_last();
+		printf("Failed to open git repository at %s: %s\n", path, e ? e->message : "unknown error");
+		ctx->repo = NULL;
+		repo_context_free(ctx);
+		return NULL;
+	}
+	if (git_repository_odb(&ctx->odb, ctx->repo) != 0 ||
+		git_repository_refdb(&ctx->refdb, ctx->repo) != 0) {
+		e = git_error_last();
+		printf("Failed to load object/reference database for %s: %s\n", path, e ? e->message : "unknown error");
+		repo_context_free(ctx);
+		return NULL;
+	}
+	gitdir_file(objects, sizeof(objects), ctx, "objects");
+	if (git_odb_open(&ctx->loose_odb, objects) != 0 ||
+		git_mempack_new(&ctx->mempack) != 0 ||
+		git_odb_add_backend(ctx->odb, ctx->mempack, MEMPACK_PRIORITY) != 0) {
+		/* Still usable, just with loose objects */
+		printf("Failed to stage objects in memory for %s; writing loose objects\n", path);
+		if (ctx->mempack != NULL)
+			ctx->mempack->free(ctx->mempack);
+		ctx->mempack = NULL;
+		if (ctx->loose_odb != NULL)
+			git_odb_free(ctx->loose_odb);
+		ctx->loose_odb = NULL;
+	}
+
+	load_signature(ctx);
+	load_snapshot_policy(ctx);
+	load_error_tip(ctx);
+	load_session_tip(ctx);
+	if (open_private_index(ctx) != 0) {
+		e = git_error_last();
+		printf("Failed to open the error tracker's index for %s: %s\n", path, e ? e->message : "unknown error");
+		repo_context_free(ctx);
+		return NULL;
+	}
+	if (tracking_enabled && git_repository_workdir(ctx->repo) != NULL)
+		ctx->tracker = change_tracker_new(git_repository_workdir(ctx->repo), tracker_skips, ctx);
+	return ctx;
+}
+
+struct repo_context* repo_context_get(const char *path) {
+	struct repo_context *ctx, **link, *evicted;
+	size_t open_count = 0;
+	struct trace_span span;
+
+	for (link = &contexts; *link != NULL; link = &(*link)->next) {
+		ctx = *link;
+		if (strcmp(ctx->path, path) == 0) {
+			/* Move to the front of the LRU list */
+			*link = ctx->next;
+			ctx->next = contexts;
+			contexts = ctx;
+			TRACE_BEGIN(&span, "repo_refresh");
+			repo_context_refresh(ctx);
+			TRACE_END(&span);
+			return ctx;
+		}
+	}
+
+	TRACE_BEGIN(&span, "repo_open");
+	ctx = repo_context_open(path);
+	TRACE_END(&span);
+	if (ctx == NULL)
+		return NULL;
+	ctx->next = contexts;
+	contexts = ctx;
+
+	/* Everything a snapshot needs is on disk by the time it returns, so the
+	 * least recently used repository can simply be closed
+	 */
+	for (link = &contexts; *link != NULL; link = &(*link)->next) {
+		if (++open_count > MAX_OPEN_CONTEXTS) {
+			evicted = *link;
+			*link = NULL;
+			while (evicted != NULL) {
+				ctx = evicted->next;
+				repo_context_free(evicted);
+				evicted = ctx;
+			}
+			break;
+		}
+	}
+	return contexts;
+}
+
+static unsigned int discovery_slot(const char *dir) {
+	unsigned int h = 2166136261u;
+	while (*dir)
+		h = (h ^ (unsigned char) *dir++) * 16777619u;
+	return h % DISCOVERY_CACHE_SIZE;
+}
+
+static const char* discover_git_dir(const char *dir) {
+	/* Returns the git directory of the repository enclosing <dir>, or NULL,
+	 * from the discovery cache when the cached answer is recent enough
+	 */
+	struct discovery_entry *entry = &discovery_cache[discovery_slot(dir)];
+	time_t now = time(NULL);
+	git_buf found = {NULL, 0, 0};
+	struct stat st;
+
+	if (entry->dir != NULL && strcmp(entry->dir, dir) == 0 &&
+		now - entry->checked < (entry->git_dir ? DISCOVERY_TTL : DISCOVERY_MISS_TTL) &&
+		(entry->git_dir == NULL || stat(entry->git_dir, &st) == 0))
+		return entry->git_dir;
+
+	/* Looking the same directory up again keeps its copy of the name */
+	if (entry->dir == NULL || strcmp(entry->dir, dir) != 0) {
+		alloc_stats_free(ALLOC_CONTEXT, entry->dir);
+		entry->dir = alloc_stats_strdup(ALLOC_CONTEXT, dir);
+	}
+	alloc_stats_free(ALLOC_CONTEXT, entry->git_dir);
+	entry->git_dir = NULL;
+	entry->checked = now;
+	/* Like git itself: stay on one filesystem and honour GIT_CEILING_DIRECTORIES */
+	if (git_repository_discover(&found, dir, 0, getenv("GIT_CEILING_DIRECTORIES")) == 0)
+		entry->git_dir = alloc_stats_strdup(ALLOC_CONTEXT, found.ptr);
+	git_buf_dispose(&found);
+	return entry->git_dir;
+}
+
+int repo_context_discover(const char *dir, char *out, size_t size) {
+	const char *git_dir;
+	int result = -1;
+
+	pthread_mutex_lock(&discovery_lock);
+	git_dir = discover_git_dir(dir);
+	if (git_dir != NULL && strlen(git_dir) < size) {
+		strcpy(out, git_dir);
+		result = 0;
+	}
+	pthread_mutex_unlock(&discovery_lock);
+	return result;
+}
+
+struct repo_context* repo_context_for_dir(const char *dir) {
+	char git_dir[4096];
+	if (repo_context_discover(dir, git_dir, sizeof(git_dir)) != 0)
+		return NULL;
+	return repo_context_get(git_dir);
+}
+
+size_t repo_context_watch_fds(int *fds, size_t max) {
+	struct repo_context *ctx;
+	size_t count = 0;
+
+	for (ctx = contexts; ctx != NULL && count < max; ctx = ctx->next)
+		if (ctx->tracker != NULL)
+			fds[count++] = ctx->tracker->fd;
+	return count;
+}
+
+void repo_context_poll_trackers(void) {
+	struct repo_context *ctx;
+
+	for (ctx = contexts; ctx != NULL; ctx = ctx->next)
+		if (ctx->tracker != NULL)
+			change_tracker_poll(ctx->tracker);
+}
+
+void repo_context_disable_tracking(void) {
+	tracking_enabled = 0;
+}
+
+void repo_context_free_all(void) {
+	struct repo_context *next;
+	size_t i;
+
+	while (contexts != NULL) {
+		next = contexts->next;
+		repo_context_free(contexts);
+		contexts = next;
+	}
+	pthread_mutex_lock(&discovery_lock);
+	for (i = 0; i < DISCOVERY_CACHE_SIZE; i++) {
+		alloc_stats_free(ALLOC_CONTEXT, discovery_cache[i].dir);
+		alloc_stats_free(ALLOC_CONTEXT, discovery_cache[i].git_dir);
+		discovery_cache[i].dir = NULL;
+		discovery_cache[i].git_dir = NULL;
+	}
+	pthread_mutex_unlock(&discovery_lock);
+}
@@ -0,0 +1,197 @@
+/*
+ * Long-lived per-repository state for the error tracker.
+ *
+ * Opening a repository, reading the config for a signature and resolving the
+ * _error branch are comparatively expensive, and the analyzer creates error
+ * commits against the same repository over and over. A repo_context keeps
+ * those handles open for the lifetime of the process and only reloads them
+ * when the files they were read from change on disk.
+ */
+
+#ifndef REPO_CONTEXT_H
+#define REPO_CONTEXT_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <sys/types.h>
+#include <time.h>
+#include "arena.h"
+#include "change_tracker.h"
+#include "path_filter.h"
+
+/* Written against the libgit2 1.x API: git_mempack_dump, and references and
+ * branches whose reflog identity comes from the repository's config
+ */
+#if !defined(LIBGIT2_VER_MAJOR) || LIBGIT2_VER_MAJOR < 1
+#error "errortracker needs libgit2 1.0 or later"
+#endif
+
+/* Identity of a file on disk, used to notice when a cached value is stale */
+struct file_stamp {
+	int exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+struct repo_context {
+	/* Path the repository was opened with; also the cache key */
+	char *path;
+	git_repository *repo;
+	git_odb *odb;
+	git_refdb *refdb;
+
+	/* In-memory object backend, registered ahead of the on-disk ones so the
+	 * objects a snapshot creates land here, blobs only up to the snapshot's
+	 * hashing budget (see blob_hasher.h). repo_context_flush_objects writes
+	 * them all out as one packfile instead of one loose file per object.
+	 * Owned by <odb>.
+	 */
+	git_odb_backend *mempack;
+	/* The repository's objects directory on its own, without the mempack.
+	 * Blobs past a snapshot's staging budget are written here as loose
+	 * objects instead of piling up uncompressed in the mempack. NULL
+	 * whenever <mempack> is.
+	 */
+	git_odb *loose_odb;
+	/* Packfiles written so far. Every PACKS_PER_GC of them `git gc --auto`
+	 * is started in the background, which folds them into one once there
+	 * are more than gc.autoPackLimit
+	 */
+	size_t packs_written;
+
+	/* Cached commit signature and the config files it was read from */
+	git_signature *signature;
+	struct file_stamp config_stamp;
+	struct file_stamp global_config_stamp;
+
+	/* Cached target of refs/heads/_error and the ref files it came from */
+	git_oid error_tip;
+	int has_error_tip;
+	struct file_stamp error_ref_stamp;
+	struct file_stamp packed_refs_stamp;
+
+	/* Watches the working directory so snapshots only revisit changed paths;
+	 * NULL for bare repositories or when inotify is unavailable
+	 */
+	struct change_tracker *tracker;
+
+	/* Private index at .git/errortracker/index that snapshots are built in. It
+	 * is installed as the repository's index, so the user's .git/index and its
+	 * lock are never touched, and it keeps the stat data of every file seen so
+	 * unchanged files aren't hashed again. index_stamp is the index file as we
+	 * last wrote it; entries modified at or after that time can't be trusted.
+	 */
+	git_index *index;
+	struct file_stamp index_stamp;
+
+	/* Tree of the index as of the last snapshot. The next snapshot rewrites
+	 * only the directories along the paths changed since (see snapshot_tree.h)
+	 */
+	git_oid snapshot_tree;
+	int has_snapshot_tree;
+	/* Set when the last snapshot reused that tree as is, because the tracker
+	 * saw nothing change since the one before
+	 */
+	int snapshot_reused;
+
+	/* Snapshot policy: paths from .errortrackerignore are left out entirely and
+	 * files over max_file_size (git config errortracker.maxFileSize) are stored
+	 * as stubs. Reloaded with the config and when the ignore file changes.
+	 */
+	struct path_filter *filter;
+	struct file_stamp ignore_stamp;
+	int64_t max_file_size;
+
+	/* Copy files into a staging directory before hashing them (see
+	 * file_capture.h); git config errortracker.captureFiles, on by default
+	 */
+	int capture_files;
+
+	/* Snapshot only the files an error refers to, their directories' other
+	 * files and the tracker's dirty set, never rescanning the whole tree for
+	 * one error (git config errortracker.targetedSnapshots, off by default)
+	 */
+	int targeted_snapshots;
+
+	/* Per-session ref that snapshots go to instead of _error when git config
+	 * errortracker.sessionRefs is set (see error_ref.h). Only this process
+	 * writes it, so its tip is cached without checking the ref file; pending
+	 * counts the commits on it not yet folded onto _error.
+	 */
+	int use_session_ref;
+	char *session_ref;
+	git_oid session_tip;
+	int has_session_tip;
+	size_t session_pending;
+	time_t session_started;
+
+	/* Messages and path lists of the snapshot being taken; reset at the start
+	 * of each one (see arena.h)
+	 */
+	struct arena arena;
+
+	struct repo_context *next;
+};
+
+/* Returns the context for the repository at <path>, opening it on first use.
+ * Cached values are revalidated against the files they came from before the
+ * context is returned. Returns NULL if the repository could not be opened.
+ *
+ * Only the most recently used few repositories are kept open, so a context
+ * may be freed by a later call to repo_context_get or repo_context_for_dir.
+ */
+struct repo_context* repo_context_get(const char *path);
+
+/* Returns the context for the repository enclosing directory <dir>, or NULL
+ * if there is none. Which repository encloses a directory is cached.
+ */
+struct repo_context* repo_context_for_dir(const char *dir);
+
+/* Stores the git directory of the repository enclosing <dir> in <out> without
+ * opening it. Unlike the rest of this API it may be called from any thread.
+ * Returns 0 on success and -1 if <dir> isn't inside a repository.
+ */
+int repo_context_discover(const char *dir, char *out, size_t size);
+
+/* Stores the change tracker descriptors of the open contexts in <fds> (at
+ * most <max>) and returns how many there are; when one becomes readable,
+ * call repo_context_poll_trackers
+ */
+size_t repo_context_watch_fds(int *fds, size_t max);
+
+/* Drains the pending events of every open context's change tracker */
+void repo_context_poll_trackers(void);
+
+/* Reloads any cached value whose backing file changed since it was read */
+void repo_context_refresh(struct repo_context *ctx);
+
+/* Records <tip> as the new _error tip after this process moved the ref itself,
+ * so that the next refresh does not treat our own write as an outside change.
+ */
+void repo_context_set_error_tip(struct repo_context *ctx, const git_oid *tip);
+
+/* Writes the private index back to disk, keeping its stat cache for the next
+ * process; returns the libgit2 error code
+ */
+int repo_context_write_index(struct repo_context *ctx);
+
+/* Writes every object staged in the context's mempack to a new packfile (with
+ * its index) and empties the mempack, starting `git gc --auto` in the
+ * background every so many packs. Must be called before a ref is pointed
+ * at a staged commit. Returns 0 on success or when nothing was staged.
+ */
+int repo_context_flush_objects(struct repo_context *ctx);
+
+/* Stops contexts opened from now on from watching their working directory.
+ * Used by one-shot commands that never take snapshots.
+ */
+void repo_context_disable_tracking(void);
+
+/* Closes every cached repository, folding any commits still on a session ref
+ * onto _error first, and forgets every discovered one
+ */
+void repo_context_free_all(void);
+
+#endif
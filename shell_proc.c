@@ -0,0 +1,139 @@
+/*
+ * Foreground job tracking through /proc. See shell_proc.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "shell_proc.h"
+
+/* Output after a gap this long starts a new burst, which a new job's output
+ * usually does, so the foreground job is read straight away
+ */
+static const long long BURST_GAP_MS = 10;
+/* Within a burst, how often the foreground job is read */
+static const long long UPDATE_INTERVAL_MS = 50;
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static pid_t read_tpgid(pid_t pid) {
+	/* Field 8 of /proc/<pid>/stat is the foreground process group of the
+	 * process's controlling terminal. The command name (field 2) may contain
+	 * spaces and parentheses, so parsing starts after its closing ')'.
+	 */
+	char path[64], buf[1024], *p;
+	int fd, field;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	p = strrchr(buf, ')');
+	if (p == NULL)
+		return 0;
+	/* p + 2 is field 3 (state) */
+	for (p += 2, field = 3; field < 8 && p != NULL; field++) {
+		p = strchr(p, ' ');
+		if (p != NULL)
+			p++;
+	}
+	return p ? (pid_t) strtol(p, NULL, 10) : 0;
+}
+
+static void read_cmdline(pid_t pid, char *out, size_t size) {
+	/* /proc/<pid>/cmdline separates arguments with NULs */
+	char path[64];
+	ssize_t n, i;
+	int fd;
+
+	out[0] = '\0';
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", (int) pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	n = read(fd, out, size - 1);
+	close(fd);
+	if (n <= 0) {
+		out[0] = '\0';
+		return;
+	}
+	while (n > 0 && out[n - 1] == '\0')
+		n--;
+	for (i = 0; i < n; i++)
+		if (out[i] == '\0')
+			out[i] = ' ';
+	out[n] = '\0';
+}
+
+void shell_proc_init(struct shell_proc *proc) {
+	const char *pid = getenv(SHELL_PID_ENV);
+
+	memset(proc, 0, sizeof(*proc));
+	if (pid != NULL)
+		proc->shell_pid = (pid_t) strtol(pid, NULL, 10);
+	proc->foreground = proc->shell_pid;
+}
+
+int shell_proc_update(struct shell_proc *proc) {
+	pid_t foreground;
+	long long now, last_call;
+
+	if (proc->shell_pid <= 0)
+		return 0;
+	now = now_ms();
+	last_call = proc->last_call;
+	proc->last_call = now;
+	if (now - last_call < BURST_GAP_MS && now - proc->last_read < UPDATE_INTERVAL_MS)
+		return 0;
+	proc->last_read = now;
+	foreground = read_tpgid(proc->shell_pid);
+	if (foreground <= 0 || foreground == proc->foreground)
+		return 0;
+
+	proc->foreground = foreground;
+	/* The group leader's command line names the job */
+	if (foreground != proc->shell_pid)
+		read_cmdline(foreground, proc->last_command, sizeof(proc->last_command));
+	return 1;
+}
+
+static int read_cwd(pid_t pid, char *out, size_t size) {
+	char path[64];
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/cwd", (int) pid);
+	n = readlink(path, out, size - 1);
+	if (n <= 0)
+		return -1;
+	out[n] = '\0';
+	/* The directory was removed from under the process */
+	if (n > 10 && strcmp(out + n - 10, " (deleted)") == 0)
+		return -1;
+	return 0;
+}
+
+int shell_proc_cwd(const struct shell_proc *proc, char *out, size_t size) {
+	/* A job such as "make -C dir" may have changed directory itself, so ask
+	 * the foreground job before the shell
+	 */
+	if (proc->shell_pid <= 0)
+		return -1;
+	if (proc->foreground > 0 && proc->foreground != proc->shell_pid &&
+		read_cwd(proc->foreground, out, size) == 0)
+		return 0;
+	return read_cwd(proc->shell_pid, out, size);
+}
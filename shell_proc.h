@@ -0,0 +1,46 @@
+/*
+ * What the monitored shell is currently doing.
+ *
+ * The analyzer only sees the shell's output, not the commands typed into it.
+ * monitor passes the shell's pid down in ERRORTRACKER_SHELL_PID, and from
+ * /proc the analyzer can tell which process group is in the foreground of the
+ * shell's terminal, what command line it was started with and which directory
+ * it is running in.
+ */
+
+#ifndef SHELL_PROC_H
+#define SHELL_PROC_H
+
+#include <sys/types.h>
+#include "error_event.h"
+
+#define SHELL_PID_ENV "ERRORTRACKER_SHELL_PID"
+
+struct shell_proc {
+	pid_t shell_pid;              /* 0 if unknown */
+	pid_t foreground;             /* foreground process group at the last update */
+	/* Command line of the most recent foreground job other than the shell
+	 * itself; an error is often printed just before its command exits
+	 */
+	char last_command[ERROR_EVENT_MAX_COMMAND];
+	/* When /proc was last read, and shell_proc_update last called, in ms */
+	long long last_read;
+	long long last_call;
+};
+
+/* Initializes <proc> from ERRORTRACKER_SHELL_PID */
+void shell_proc_init(struct shell_proc *proc);
+
+/* Re-reads the foreground process group, if output has just resumed after a
+ * pause or it hasn't been read for a while; called for every chunk of output,
+ * so a flood doesn't reopen /proc for each one. Returns 1 if a different job
+ * is in the foreground than at the previous update, 0 otherwise.
+ */
+int shell_proc_update(struct shell_proc *proc);
+
+/* Stores the current directory of the foreground job (or, once it has exited,
+ * of the shell) in <out>. Returns 0 on success and -1 if it is unknown.
+ */
+int shell_proc_cwd(const struct shell_proc *proc, char *out, size_t size);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Incremental construction of snapshot trees. See snapshot_tree.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot_tree.h"
+
+static int compare_tree_paths(const void *a, const void *b) {
+	/* Orders paths so that everything under a directory directly follows the
+	 * directory itself ("a", "a/b", "a-b"), by sorting '/' before every other
+	 * character
+	 */
+	const unsigned char *x = *(const unsigned char * const *) a;
+	const unsigned char *y = *(const unsigned char * const *) b;
+	int cx, cy;
+
+	while (*x != '\0' && *x == *y) {
+		x++;
+		y++;
+	}
+	cx = *x == '/' ? 1 : *x == '\0' ? 0 : *x + 1;
+	cy = *y == '/' ? 1 : *y == '\0' ? 0 : *y + 1;
+	return cx - cy;
+}
+
+static size_t index_lower_bound(git_index *index, const char *prefix) {
+	/* Position of the first index entry not sorting before <prefix> */
+	size_t lo = 0, hi = git_index_entrycount(index), mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(git_index_get_byindex(index, mid)->path, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int build_range(git_repository *repo, git_index *index, size_t lo, size_t hi, size_t skip, git_oid *out) {
+	/* Writes the tree of index entries <lo> to <hi>, which all lie in the same
+	 * directory whose path (with its trailing '/') is <skip> bytes long
+	 */
+	git_treebuilder *bld;
+	const git_index_entry *entry;
+	const char *name;
+	char component[4096];
+	size_t i = lo, end, len;
+	git_oid sub;
+	int result;
+
+	if ((result = git_treebuilder_new(&bld, repo, NULL)) != 0)
+		return result;
+	while (result == 0 && i < hi) {
+		entry = git_index_get_byindex(index, i);
+		name = entry->path + skip;
+		len = strcspn(name, "/");
+		if (name[len] == '\0') {
+			result = git_treebuilder_insert(NULL, bld, name, &entry->id, (git_filemode_t) entry->mode);
+			i++;
+			continue;
+		}
+		/* Entries under one subdirectory are contiguous in the index */
+		for (end = i + 1; end < hi; end++)
+			if (strncmp(git_index_get_byindex(index, end)->path + skip, name, len + 1) != 0)
+				break;
+		snprintf(component, sizeof(component), "%.*s", (int) len, name);
+		result = build_range(repo, index, i, end, skip + len + 1, &sub);
+		if (result == 0)
+			result = git_treebuilder_insert(NULL, bld, component, &sub, GIT_FILEMODE_TREE);
+		i = end;
+	}
+	if (result == 0)
+		result = git_treebuilder_write(out, bld);
+	git_treebuilder_free(bld);
+	return result;
+}
+
+static int recompute_entry(git_repository *repo, git_index *index, git_treebuilder *bld,
+	const char *path, const char *name) {
+	/* Sets entry <name> of <bld> to whatever the index now has at <path>: a
+	 * file, a directory built from the entries under it, or nothing
+	 */
+	const git_index_entry *entry = git_index_get_bypath(index, path, 0);
+	size_t lo, hi, len, count = git_index_entrycount(index);
+	char prefix[4096];
+	git_oid sub;
+	int result;
+
+	if (entry != NULL)
+		return git_treebuilder_insert(NULL, bld, name, &entry->id, (git_filemode_t) entry->mode);
+
+	len = (size_t) snprintf(prefix, sizeof(prefix), "%s/", path);
+	lo = index_lower_bound(index, prefix);
+	for (hi = lo; hi < count && strncmp(git_index_get_byindex(index, hi)->path, prefix, len) == 0; hi++)
+		;
+	if (hi == lo)
+		return git_treebuilder_get(bld, name) != NULL ? git_treebuilder_remove(bld, name) : 0;
+
+	result = build_range(repo, index, lo, hi, len, &sub);
+	if (result == 0)
+		result = git_treebuilder_insert(NULL, bld, name, &sub, GIT_FILEMODE_TREE);
+	return result;
+}
+
+static int update_dir(git_repository *repo, git_index *index, const git_tree *base,
+	char **paths, size_t count, size_t skip, git_oid *out, int *empty) {
+	/* Writes the new tree of the directory whose old tree is <base> (NULL if
+	 * it didn't exist) and whose path, with its trailing '/', is <skip> bytes
+	 * long. <paths> are the changed paths inside it, in compare_tree_paths
+	 * order. Sets <empty> instead of writing anything if a subdirectory ends
+	 * up empty, since git doesn't record empty trees.
+	 */
+	git_treebuilder *bld;
+	const git_tree_entry *existing;
+	git_tree *subtree;
+	const char *rel;
+	char name[4096], path[4096];
+	size_t i = 0, end, len;
+	int exact, sub_empty, result;
+	git_oid sub;
+
+	if ((result = git_treebuilder_new(&bld, repo, base)) != 0)
+		return result;
+	while (result == 0 && i < count) {
+		rel = paths[i] + skip;
+		len = strcspn(rel, "/");
+		if (len == 0) {
+			i++;
+			continue;
+		}
+		/* This entry and every changed path below it */
+		exact = rel[len] == '\0';
+		for (end = i + 1; end < count && strncmp(paths[end] + skip, rel, len) == 0 &&
+			(paths[end][skip + len] == '/' || paths[end][skip + len] == '\0'); end++)
+			exact |= paths[end][skip + len] == '\0';
+		snprintf(name, sizeof(name), "%.*s", (int) len, rel);
+
+		if (exact) {
+			/* The entry itself changed, so it is recomputed as a whole */
+			snprintf(path, sizeof(path), "%.*s", (int) (skip + len), paths[i]);
+			result = recompute_entry(repo, index, bld, path, name);
+		}
+		else {
+			/* Only things inside it changed: update the old subtree */
+			existing = git_treebuilder_get(bld, name);
+			subtree = NULL;
+			if (existing != NULL && git_tree_entry_type(existing) == GIT_OBJECT_TREE)
+				result = git_tree_lookup(&subtree, repo, git_tree_entry_id(existing));
+			if (result == 0)
+				result = update_dir(repo, index, subtree, paths + i, end - i, skip + len + 1, &sub, &sub_empty);
+			if (subtree != NULL)
+				git_tree_free(subtree);
+			if (result == 0 && sub_empty)
+				result = existing != NULL ? git_treebuilder_remove(bld, name) : 0;
+			else if (result == 0)
+				result = git_treebuilder_insert(NULL, bld, name, &sub, GIT_FILEMODE_TREE);
+		}
+		i = end;
+	}
+
+	/* The root is written even when empty */
+	*empty = skip > 0 && git_treebuilder_entrycount(bld) == 0;
+	if (result == 0 && !*empty)
+		result = git_treebuilder_write(out, bld);
+	git_treebuilder_free(bld);
+	return result;
+}
+
+static int add_file(git_repository *repo, const git_tree *base, const char *path,
+	const git_oid *blob, git_oid *out) {
+	/* Adds <blob> at <path> below the directory whose old tree is <base>
+	 * (NULL if it didn't exist) and writes the directory's new tree
+	 */
+	git_treebuilder *bld;
+	const git_tree_entry *existing;
+	git_tree *subtree = NULL;
+	char name[4096];
+	size_t len = strcspn(path, "/");
+	git_oid sub;
+	int result;
+
+	snprintf(name, sizeof(name), "%.*s", (int) len, path);
+	if ((result = git_treebuilder_new(&bld, repo, base)) != 0)
+		return result;
+	if (path[len] == '\0') {
+		result = git_treebuilder_insert(NULL, bld, name, blob, GIT_FILEMODE_BLOB);
+	}
+	else {
+		existing = base != NULL ? git_tree_entry_byname(base, name) : NULL;
+		if (existing != NULL && git_tree_entry_type(existing) == GIT_OBJECT_TREE)
+			result = git_tree_lookup(&subtree, repo, git_tree_entry_id(existing));
+		if (result == 0)
+			result = add_file(repo, subtree, path + len + 1, blob, &sub);
+		if (subtree != NULL)
+			git_tree_free(subtree);
+		if (result == 0)
+			result = git_treebuilder_insert(NULL, bld, name, &sub, GIT_FILEMODE_TREE);
+	}
+	if (result == 0)
+		result = git_treebuilder_write(out, bld);
+	git_treebuilder_free(bld);
+	return result;
+}
+
+int snapshot_tree_add_file(git_repository *repo, const git_oid *base, const char *path,
+	const git_oid *blob, git_oid *out) {
+	git_tree *base_tree;
+	int result;
+
+	if ((result = git_tree_lookup(&base_tree, repo, base)) != 0)
+		return result;
+	result = add_file(repo, base_tree, path, blob, out);
+	git_tree_free(base_tree);
+	return result;
+}
+
+int snapshot_tree_update(git_repository *repo, git_index *index, const git_oid *base,
+	char **paths, size_t count, git_oid *out) {
+	git_tree *base_tree;
+	int empty, result;
+
+	if ((result = git_tree_lookup(&base_tree, repo, base)) != 0)
+		return result;
+	qsort(paths, count, sizeof(char *), compare_tree_paths);
+	result = update_dir(repo, index, base_tree, paths, count, 0, out, &empty);
+	git_tree_free(base_tree);
+	return result;
+}
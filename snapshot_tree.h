@@ -0,0 +1,35 @@
+/*
+ * Incremental construction of snapshot trees.
+ *
+ * git_index_write_tree() builds every tree of the working directory from the
+ * whole index, so its cost grows with the number of files even when one file
+ * in one directory changed. Between two snapshots the change tracker knows
+ * exactly which paths changed, so the next tree can instead be derived from
+ * the previous snapshot's tree: only the trees of directories along a changed
+ * path are rewritten, and every other subtree is reused by id. That makes
+ * writing the tree O(depth x changes) rather than O(files).
+ */
+
+#ifndef SNAPSHOT_TREE_H
+#define SNAPSHOT_TREE_H
+
+#include <git2.h>
+
+/* Writes the tree of <index> to <out>, given that <base> is the tree the
+ * index had before the <count> paths in <paths> (relative to the working
+ * directory, in any order) were updated in it. Each changed path's entry is
+ * recomputed from the index: as a file, as a whole directory (rebuilt from
+ * the index entries under it) or as removed. <paths> is reordered. Returns 0
+ * or a libgit2 error code.
+ */
+int snapshot_tree_update(git_repository *repo, git_index *index, const git_oid *base,
+	char **paths, size_t count, git_oid *out);
+
+/* Writes to <out> the tree <base> with the blob <blob> added at <path>
+ * ("dir/name"), replacing whatever was there and creating the directories
+ * along it. Returns 0 or a libgit2 error code.
+ */
+int snapshot_tree_add_file(git_repository *repo, const git_oid *base, const char *path,
+	const git_oid *blob, git_oid *out);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Span tracing in the Chrome trace format. See trace.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+/* Spans a thread collects before appending them to the file */
+#define TRACE_BUFFER_SPANS 4096
+/* Longest line written for one span */
+#define TRACE_LINE_BYTES 160
+
+struct finished_span {
+	const char *name;
+	uint64_t start;
+	uint64_t duration;
+};
+
+struct trace_buffer {
+	pid_t tid;
+	const char *thread_name;
+	int named;                   /* whether the thread's name was written */
+	size_t count;
+	struct finished_span spans[TRACE_BUFFER_SPANS];
+};
+
+volatile int trace_enabled = 0;
+
+static char trace_path[4096];
+static const char *process_name = "errortracker";
+static pid_t pid = 0;
+/* The trace file, opened when something is first written to it */
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static int process_named = 0;
+/* Frees each thread's buffer, after writing it out, when the thread exits */
+static pthread_key_t buffer_key;
+static __thread struct trace_buffer *buffer = NULL;
+
+static void toggle(int signo) {
+	(void) signo;
+	trace_enabled = !trace_enabled;
+}
+
+static void flush_at_exit(void) {
+	trace_flush();
+}
+
+static void flush_thread(void *b) {
+	buffer = (struct trace_buffer *) b;
+	trace_flush();
+	free(b);
+	buffer = NULL;
+}
+
+void trace_init(const char *name) {
+	const char *path = getenv(TRACE_ENV);
+	struct sigaction sa;
+
+	process_name = name;
+	pid = getpid();
+	if (path != NULL && path[0] != '\0') {
+		snprintf(trace_path, sizeof(trace_path), "%s", path);
+		trace_enabled = 1;
+	}
+	else {
+		snprintf(trace_path, sizeof(trace_path), "/tmp/errortracker-trace-%d.json", (int) pid);
+	}
+	pthread_key_create(&buffer_key, flush_thread);
+	atexit(flush_at_exit);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = toggle;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+static struct trace_buffer* thread_buffer(void) {
+	if (buffer == NULL) {
+		buffer = (struct trace_buffer *) calloc(1, sizeof(struct trace_buffer));
+		if (buffer == NULL)
+			return NULL;
+		buffer->tid = (pid_t) syscall(SYS_gettid);
+		pthread_setspecific(buffer_key, buffer);
+	}
+	return buffer;
+}
+
+void trace_name_thread(const char *name) {
+	struct trace_buffer *b = thread_buffer();
+
+	if (b != NULL)
+		b->thread_name = name;
+}
+
+uint64_t trace_now(void) {
+	return probe_now();
+}
+
+void trace_begin(struct trace_span *span) {
+	span->start = trace_now();
+	PROBE1(span_start, span->name);
+}
+
+void trace_end(const struct trace_span *span) {
+	uint64_t duration = trace_now() - span->start;
+	struct trace_buffer *b;
+	struct finished_span *f;
+
+	PROBE3(span_end, span->name, span->start, duration);
+	if (!trace_enabled || (b = thread_buffer()) == NULL)
+		return;
+	if (b->count == TRACE_BUFFER_SPANS)
+		trace_flush();
+	f = &b->spans[b->count++];
+	f->name = span->name;
+	f->start = span->start;
+	f->duration = duration;
+}
+
+
+/*
+ **
+ **
+ ** Writing the file
+ **
+ **
+ */
+
+static int open_trace(void) {
+	/* Whoever creates the file starts the array. The closing bracket is
+	 * optional in the format, so the file is valid however the processes
+	 * writing to it end
+	 */
+	static const char start[] = "[\n";
+
+	if (trace_fd >= 0)
+		return 0;
+	trace_fd = open(trace_path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (trace_fd >= 0) {
+		if (write(trace_fd, start, sizeof(start) - 1) < 0)
+			perror("trace");
+	}
+	else if (errno == EEXIST) {
+		trace_fd = open(trace_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	}
+	return trace_fd >= 0 ? 0 : -1;
+}
+
+static size_t name_event(char *out, size_t size, const char *kind, pid_t tid, const char *name) {
+	return (size_t) snprintf(out, size,
+		"{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+		kind, (int) pid, (int) tid, name);
+}
+
+void trace_flush(void) {
+	/* All of a thread's spans go out in one write, which O_APPEND keeps from
+	 * interleaving with other threads' and processes'
+	 */
+	struct trace_buffer *b = buffer;
+	struct finished_span *f;
+	size_t size, used = 0, i;
+	char *out;
+	ssize_t w;
+
+	if (b == NULL || b->count == 0)
+		return;
+	size = (b->count + 2) * TRACE_LINE_BYTES;
+	out = (char *) malloc(size);
+	if (out == NULL) {
+		b->count = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&file_lock);
+	if (!process_named) {
+		used += name_event(out + used, size - used, "process_name", pid, process_name);
+		process_named = 1;
+	}
+	pthread_mutex_unlock(&file_lock);
+	if (!b->named && b->thread_name != NULL) {
+		used += name_event(out + used, size - used, "thread_name", b->tid, b->thread_name);
+		b->named = 1;
+	}
+	for (i = 0; i < b->count; i++) {
+		f = &b->spans[i];
+		used += (size_t) snprintf(out + used, size - used,
+			"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u},\n",
+			f->name, (int) pid, (int) b->tid,
+			(unsigned long long) (f->start / 1000), (unsigned int) (f->start % 1000),
+			(unsigned long long) (f->duration / 1000), (unsigned int) (f->duration % 1000));
+		if (used >= size)
+			used = size - 1;
+	}
+	b->count = 0;
+
+	pthread_mutex_lock(&file_lock);
+	if (open_trace() == 0) {
+		w = write(trace_fd, out, used);
+		if (w < 0)
+			perror("trace");
+	}
+	pthread_mutex_unlock(&file_lock);
+	free(out);
+}
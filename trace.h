@@ -0,0 +1,67 @@
+/*
+ * Span tracing in the Chrome trace format.
+ *
+ * A span is the time between TRACE_BEGIN and TRACE_END. Each thread collects
+ * its finished spans in a buffer of its own, without locking, and appends the
+ * buffer to the trace file in one write once it fills up, when the thread
+ * exits, when the commit worker runs out of work and when the process exits.
+ * The file is in the JSON array format that chrome://tracing and Perfetto
+ * (ui.perfetto.dev) open. Timestamps are taken from the monotonic clock, so
+ * monitor, the analyzer and errortracker can all write to one file and line
+ * up in it.
+ *
+ * Tracing starts on if ERRORTRACKER_TRACE names a file, and is switched on and
+ * off with SIGUSR2. Switched on without ERRORTRACKER_TRACE it writes to
+ * /tmp/errortracker-trace-<pid>.json. Spans also fire the span_start and
+ * span_end probes (see probes.h), whether tracing is on or not. While neither
+ * tracing nor a tracer attached to those probes is on, a span costs a few
+ * loads and a branch.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "probes.h"
+
+#define TRACE_ENV "ERRORTRACKER_TRACE"
+
+struct trace_span {
+	const char *name;   /* a string literal; only the pointer is kept */
+	uint64_t start;     /* nanoseconds, or 0 if neither tracing nor its probes were on */
+};
+
+/* Whether spans are being recorded; toggled by SIGUSR2 */
+extern volatile int trace_enabled;
+
+/* Starts and finishes <span>. A span started while tracing was off is not
+ * recorded even if tracing was switched on since.
+ */
+#define TRACE_BEGIN(span, span_name) \
+	do { \
+		(span)->name = (span_name); \
+		(span)->start = 0; \
+		if (trace_enabled || PROBE_ENABLED(span_start) || PROBE_ENABLED(span_end)) \
+			trace_begin(span); \
+	} while (0)
+#define TRACE_END(span) \
+	do { if ((span)->start != 0) trace_end(span); } while (0)
+
+/* Reads ERRORTRACKER_TRACE and installs the SIGUSR2 handler. <process_name>
+ * labels this process's spans in the trace. Called once, at startup, before
+ * any threads are started.
+ */
+void trace_init(const char *process_name);
+
+/* Labels the calling thread's spans in the trace */
+void trace_name_thread(const char *name);
+
+/* Writes out the calling thread's spans */
+void trace_flush(void);
+
+/* Used by the macros above */
+uint64_t trace_now(void);
+void trace_begin(struct trace_span *span);
+void trace_end(const struct trace_span *span);
+
+#endif